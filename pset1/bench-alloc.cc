@@ -0,0 +1,174 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <algorithm>
+// Allocator microbenchmarks, m61 versus the system allocator. Prints one
+// JSON object per measurement, in the style of pset4's io61_profiler.
+// Build with `make SAN=0 bench` for meaningful numbers.
+// Usage: bench-alloc [OPS]
+
+using bench_clock = std::chrono::steady_clock;
+
+static double since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct m61_api {
+    static constexpr const char* name = "m61";
+    static void* alloc(size_t sz) { return m61_malloc(sz, "bench", 0); }
+    static void release(void* ptr) { m61_free(ptr, "bench", 0); }
+};
+struct system_api {
+    static constexpr const char* name = "system";
+    static void* alloc(size_t sz) { return malloc(sz); }
+    static void release(void* ptr) { free(ptr); }
+};
+
+// Size distributions: uniform over a range, or log-uniform up to a limit
+struct distribution {
+    const char* name;
+    size_t lo, hi;
+    bool logscale;
+    size_t operator()(std::default_random_engine& randomness) const {
+        if (!logscale) {
+            return uniform_int(lo, hi, randomness);
+        }
+        int bits = uniform_int(0, 63 - __builtin_clzl(hi), randomness);
+        return std::max(lo, uniform_int(size_t(1) << bits, (size_t(2) << bits) - 1, randomness) & hi);
+    }
+};
+
+static const distribution distributions[] = {
+    {"small", 1, 128, false},
+    {"medium", 129, 4096, false},
+    {"mixed", 1, 65535, true},
+    {"large", 256 << 10, 1 << 20, false}
+};
+
+constexpr int nslots = 256;
+
+// Random replacement in a fixed set of slots: alloc/free throughput
+template <typename Api>
+static void throughput(const distribution& d, long nops) {
+    std::default_random_engine randomness(61);
+    void* ptrs[nslots] = {};
+    auto start = bench_clock::now();
+    for (long i = 0; i != nops; ++i) {
+        int slot = uniform_int(0, nslots - 1, randomness);
+        Api::release(ptrs[slot]);
+        ptrs[slot] = Api::alloc(d(randomness));
+    }
+    for (auto& ptr : ptrs) {
+        Api::release(ptr);
+    }
+    double t = since(start);
+    printf("{\"bench\":\"throughput\", \"allocator\":\"%s\", \"sizes\":\"%s\", \"ops\":%ld, \"time\":%.6f, \"mops_per_sec\":%.3f}\n",
+           Api::name, d.name, nops, t, nops / t / 1e6);
+}
+
+// Per-operation latency of malloc+free pairs, as percentiles
+template <typename Api>
+static void latency(const distribution& d, long nops) {
+    std::default_random_engine randomness(61);
+    void* ptrs[nslots] = {};
+    std::vector<double> samples;
+    samples.reserve(nops);
+    for (long i = 0; i != nops; ++i) {
+        int slot = uniform_int(0, nslots - 1, randomness);
+        size_t sz = d(randomness);
+        auto start = bench_clock::now();
+        Api::release(ptrs[slot]);
+        ptrs[slot] = Api::alloc(sz);
+        samples.push_back(since(start) * 1e9);
+    }
+    for (auto& ptr : ptrs) {
+        Api::release(ptr);
+    }
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&] (double p) {
+        return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+    };
+    printf("{\"bench\":\"latency\", \"allocator\":\"%s\", \"sizes\":\"%s\", \"ops\":%ld, \"p50_ns\":%.0f, \"p90_ns\":%.0f, \"p99_ns\":%.0f, \"p999_ns\":%.0f, \"max_ns\":%.0f}\n",
+           Api::name, d.name, nops, pct(0.5), pct(0.9), pct(0.99), pct(0.999),
+           samples.back());
+}
+
+// Fragmentation: after random churn with a varying number of live
+// blocks, compare the live bytes with the span of the heap they occupy
+static void fragmentation(const distribution& d, long nops) {
+    std::default_random_engine randomness(61);
+    std::vector<void*> ptrs;
+    for (long i = 0; i != nops; ++i) {
+        if (!ptrs.empty() && uniform_int(0, 2, randomness) == 0) {
+            size_t j = uniform_int(size_t(0), ptrs.size() - 1, randomness);
+            std::swap(ptrs[j], ptrs.back());
+            m61_free(ptrs.back());
+            ptrs.pop_back();
+        } else {
+            ptrs.push_back(m61_malloc(d(randomness)));
+        }
+    }
+    size_t live = m61_get_statistics().active_size;
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+    for (void* p : ptrs) {
+        lo = std::min(lo, reinterpret_cast<uintptr_t>(p));
+        hi = std::max(hi, reinterpret_cast<uintptr_t>(p));
+    }
+    double span = hi > lo ? double(hi - lo) : 1;
+    printf("{\"bench\":\"fragmentation\", \"allocator\":\"m61\", \"sizes\":\"%s\", \"ops\":%ld, \"live_blocks\":%zu, \"live_bytes\":%zu, \"span_bytes\":%.0f, \"utilization\":%.3f}\n",
+           d.name, nops, ptrs.size(), live, span, std::min(1.0, live / span));
+    for (void* p : ptrs) {
+        m61_free(p);
+    }
+}
+
+// Standard containers with m61_allocator versus std::allocator
+template <template <typename> class Alloc>
+static void containers(const char* name, long n) {
+    auto start = bench_clock::now();
+    {
+        std::vector<long, Alloc<long>> v;
+        for (long i = 0; i != n; ++i) {
+            v.push_back(i);
+        }
+    }
+    double vtime = since(start);
+
+    start = bench_clock::now();
+    {
+        using value = std::pair<const long, long>;
+        std::map<long, long, std::less<long>, Alloc<value>> m;
+        std::default_random_engine randomness(61);
+        for (long i = 0; i != n / 10; ++i) {
+            m[uniform_int(0L, n, randomness)] = i;
+        }
+        for (long i = 0; i != n / 10; ++i) {
+            m.erase(uniform_int(0L, n, randomness));
+        }
+    }
+    double mtime = since(start);
+    printf("{\"bench\":\"containers\", \"allocator\":\"%s\", \"n\":%ld, \"vector_time\":%.6f, \"map_time\":%.6f}\n",
+           name, n, vtime, mtime);
+}
+
+int main(int argc, char** argv) {
+    long nops = argc > 1 ? strtol(argv[1], nullptr, 0) : 1000000;
+    for (auto& d : distributions) {
+        long n = d.hi > (64 << 10) ? nops / 100 : nops;
+        throughput<m61_api>(d, n);
+        throughput<system_api>(d, n);
+    }
+    for (auto& d : distributions) {
+        long n = d.hi > (64 << 10) ? nops / 100 : nops;
+        latency<m61_api>(d, n);
+        latency<system_api>(d, n);
+    }
+    for (auto& d : distributions) {
+        fragmentation(d, d.hi > (64 << 10) ? nops / 1000 : nops / 10);
+    }
+    containers<m61_allocator>("m61", nops);
+    containers<std::allocator>("system", nops);
+}
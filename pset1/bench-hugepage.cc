@@ -0,0 +1,130 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+// Measure the effect of M61_HUGEPAGES on a TLB-bound workload: chase a
+// random cycle of pointers through objects spread over a large heap.
+// Each mode runs in a child process, since m61 reads its settings once.
+// Reports dTLB load misses when perf counters are available (else null),
+// and how much of the heap the kernel backed with huge pages.
+// Usage: bench-hugepage [OBJECTS [STEPS]]
+
+using bench_clock = std::chrono::steady_clock;
+
+struct node {
+    node* next;
+    char pad[56];
+};
+
+/// open_dtlb_counter()
+///     Returns a perf event counting this process's dTLB load misses, or
+///     -1 if perf events are unavailable.
+static int open_dtlb_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/// anon_huge_kb()
+///     Returns the kilobytes of this process's memory in transparent huge
+///     pages.
+static long anon_huge_kb() {
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kb;
+}
+
+static void run(const char* mode, long nobjects, long nsteps) {
+    if (mode) {
+        setenv("M61_HUGEPAGES", mode, 1);
+    }
+    node** nodes = new node*[nobjects];
+    for (long i = 0; i != nobjects; ++i) {
+        nodes[i] = reinterpret_cast<node*>(m61_malloc(sizeof(node)));
+    }
+    // Link the objects into one random cycle
+    std::default_random_engine randomness(61);
+    for (long i = nobjects - 1; i > 0; --i) {
+        std::swap(nodes[i], nodes[uniform_int(0L, i, randomness)]);
+    }
+    for (long i = 0; i != nobjects; ++i) {
+        nodes[i]->next = nodes[(i + 1) % nobjects];
+    }
+
+    int fd = open_dtlb_counter();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = bench_clock::now();
+    node* n = nodes[0];
+    for (long i = 0; i != nsteps; ++i) {
+        n = n->next;
+    }
+    std::chrono::duration<double> elapsed = bench_clock::now() - start;
+    long long misses = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+
+    char missbuf[32];
+    if (misses >= 0) {
+        snprintf(missbuf, sizeof(missbuf), "%lld", misses);
+    } else {
+        strcpy(missbuf, "null");
+    }
+    m61_heap_layout layout = m61_get_heap_layout();
+    printf("{\"hugepages\":\"%s\", \"objects\":%ld, \"steps\":%ld, \"time\":%.6f, "
+           "\"msteps_per_sec\":%.3f, \"dtlb_misses\":%s, \"heap_size\":%llu, "
+           "\"anon_huge_kb\":%ld, \"end\":\"%p\"}\n",
+           mode ? mode : "off", nobjects, nsteps, elapsed.count(),
+           nsteps / elapsed.count() / 1e6, missbuf, layout.heap_size,
+           anon_huge_kb(), static_cast<void*>(n));
+    fflush(stdout);
+
+    for (long i = 0; i != nobjects; ++i) {
+        m61_free(nodes[i]);
+    }
+    delete[] nodes;
+}
+
+int main(int argc, char** argv) {
+    long nobjects = argc > 1 ? strtol(argv[1], nullptr, 0) : 1 << 19;
+    long nsteps = argc > 2 ? strtol(argv[2], nullptr, 0) : 10000000;
+    const char* modes[] = {nullptr, "thp", "explicit"};
+    for (const char* mode : modes) {
+        pid_t p = fork();
+        if (p == 0) {
+            run(mode, nobjects, nsteps);
+            _exit(0);
+        }
+        int status;
+        waitpid(p, &status, 0);
+    }
+}
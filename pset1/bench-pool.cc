@@ -0,0 +1,48 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+// Compare m61_slab objects with plain m61_malloc on a test33-style
+// workload: random replacement of fixed-size objects in a pool of slots.
+// Usage: bench-pool [OPS [SLOTS]]
+
+using bench_clock = std::chrono::steady_clock;
+
+template <typename Alloc, typename Free>
+static double churn(long nops, int nslots, Alloc alloc, Free release) {
+    std::default_random_engine randomness(61);
+    void** ptrs = new void*[nslots]();
+    auto start = bench_clock::now();
+    for (long i = 0; i != nops; ++i) {
+        int slot = uniform_int(0, nslots - 1, randomness);
+        release(ptrs[slot]);
+        ptrs[slot] = alloc();
+    }
+    for (int slot = 0; slot != nslots; ++slot) {
+        release(ptrs[slot]);
+    }
+    std::chrono::duration<double> elapsed = bench_clock::now() - start;
+    delete[] ptrs;
+    return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+    long nops = argc > 1 ? strtol(argv[1], nullptr, 0) : 2000000;
+    int nslots = argc > 2 ? strtol(argv[2], nullptr, 0) : 200;
+    const size_t sz = 64;
+
+    double mtime = churn(nops, nslots,
+        [&] () { return m61_malloc(sz); },
+        [] (void* p) { m61_free(p); });
+
+    m61_slab* slab = m61_slab_create(sz);
+    double stime = churn(nops, nslots,
+        [&] () { return m61_slab_alloc(slab); },
+        [&] (void* p) { m61_slab_free(slab, p); });
+    m61_slab_destroy(slab);
+
+    printf("{\"allocator\":\"m61_malloc\", \"ops\":%ld, \"time\":%.6f, \"mops_per_sec\":%.3f}\n",
+           nops, mtime, nops / mtime / 1e6);
+    printf("{\"allocator\":\"m61_slab\", \"ops\":%ld, \"time\":%.6f, \"mops_per_sec\":%.3f, \"speedup\":%.2f}\n",
+           nops, stime, nops / stime / 1e6, mtime / stime);
+}
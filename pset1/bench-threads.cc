@@ -0,0 +1,46 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+// Measure m61 malloc/free throughput with 1 to N threads.
+// Usage: bench-threads [MAXTHREADS [OPS_PER_THREAD]]
+
+static void churn(unsigned seed, long nops) {
+    std::default_random_engine randomness(seed);
+    void* ptrs[64] = {};
+    for (long i = 0; i != nops; ++i) {
+        int slot = uniform_int(0, 63, randomness);
+        m61_free(ptrs[slot]);
+        ptrs[slot] = m61_malloc(uniform_int(1, 256, randomness));
+    }
+    for (int slot = 0; slot != 64; ++slot) {
+        m61_free(ptrs[slot]);
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned maxthreads = argc > 1 ? strtoul(argv[1], nullptr, 0)
+        : std::max(1U, std::thread::hardware_concurrency());
+    long nops = argc > 2 ? strtol(argv[2], nullptr, 0) : 1000000;
+
+    double base = 0;
+    for (unsigned n = 1; n <= maxthreads; n *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t != n; ++t) {
+            threads.emplace_back(churn, t, nops);
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double rate = n * nops / elapsed.count();
+        if (n == 1) {
+            base = rate;
+        }
+        printf("{\"threads\":%u, \"ops\":%ld, \"time\":%.6f, \"mops_per_sec\":%.3f, \"speedup\":%.2f}\n",
+               n, n * nops, elapsed.count(), rate / 1e6, rate / base);
+    }
+}
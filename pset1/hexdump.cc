@@ -1,7 +1,75 @@
 #include "hexdump.hh"
 #include <cassert>
+#include <cstring>
 
-static void fhexdump_ascii(FILE* f, const unsigned char* p, size_t pos);
+// Lines are formatted from lookup tables into a stack buffer, which is
+// written with one `fwrite` per chunk of lines; printf is never called.
+
+static const char hexdigits[] = "0123456789abcdef";
+
+// hexpairs[2*b], hexpairs[2*b+1]: the two hex digits of byte b
+// asciichars[b]: the ASCII report character for byte b
+struct hexdump_tables {
+    char hexpairs[512];
+    char asciichars[256];
+
+    constexpr hexdump_tables()
+        : hexpairs(), asciichars() {
+        for (int b = 0; b != 256; ++b) {
+            hexpairs[2 * b] = hexdigits[b >> 4];
+            hexpairs[2 * b + 1] = hexdigits[b & 15];
+            asciichars[b] = b >= 32 && b < 127 ? b : '.';
+        }
+    }
+};
+static constexpr hexdump_tables tables;
+
+// A line is at most 16 offset digits, 51 columns of bytes and padding,
+// 18 of ASCII report, and a newline
+constexpr size_t hexdump_line_max = 16 + 51 + 18 + 1;
+constexpr size_t hexdump_buffer_size = 4096;
+
+// format_line(buf, prefix, offset, p, n)
+//    Writes the hexdump line for the `n` (1 to 16) bytes at `p`, labeled
+//    `offset` and preceded by `prefix` (if not null), to `buf`. Returns
+//    the number of characters written.
+static size_t format_line(char* buf, const char* prefix, size_t offset,
+                          const unsigned char* p, size_t n) {
+    char* s = buf;
+    if (prefix) {
+        while (*prefix) {
+            *s++ = *prefix++;
+        }
+    }
+    // Offset: at least 8 hex digits, like "%08zx"
+    int ndigits = 8;
+    while (ndigits < 16 && (offset >> (4 * ndigits)) != 0) {
+        ++ndigits;
+    }
+    for (int d = ndigits - 1; d >= 0; --d) {
+        *s++ = hexdigits[(offset >> (4 * d)) & 15];
+    }
+    // Bytes, with an extra space before each group of 8
+    for (size_t i = 0; i != n; ++i) {
+        if (i % 8 == 0) {
+            *s++ = ' ';
+        }
+        *s++ = ' ';
+        *s++ = tables.hexpairs[2 * p[i]];
+        *s++ = tables.hexpairs[2 * p[i] + 1];
+    }
+    // ASCII report, starting at column 51 after the offset
+    size_t pad = 51 - (3 * n + (n > 8));
+    memset(s, ' ', pad);
+    s += pad;
+    *s++ = '|';
+    for (size_t i = 0; i != n; ++i) {
+        *s++ = tables.asciichars[p[i]];
+    }
+    *s++ = '|';
+    *s++ = '\n';
+    return s - buf;
+}
 
 void hexdump(const void* ptr, size_t size) {
     fhexdump_at(stdout, (size_t) ptr, ptr, size);
@@ -13,26 +81,39 @@ void fhexdump(FILE* f, const void* ptr, size_t size) {
 
 void fhexdump_at(FILE* f, size_t first_offset, const void* ptr, size_t size) {
     const unsigned char* p = (const unsigned char*) ptr;
-    for (size_t i = 0; i != size; ++i) {
-        if (i % 16 == 0) {
-            fprintf(f, "%08zx", first_offset + i);
-        }
-        fprintf(f, "%s%02x", (i % 8 == 0 ? "  " : " "), (unsigned) p[i]);
-        if (i % 16 == 15 || i == size - 1) {
-            fhexdump_ascii(f, p, i);
+    char buf[hexdump_buffer_size];
+    size_t len = 0;
+    for (size_t i = 0; i < size; i += 16) {
+        if (len + hexdump_line_max > sizeof(buf)) {
+            fwrite(buf, 1, len, f);
+            len = 0;
         }
+        size_t n = size - i < 16 ? size - i : 16;
+        len += format_line(buf + len, nullptr, first_offset + i, p + i, n);
     }
+    fwrite(buf, 1, len, f);
 }
 
-static void fhexdump_ascii(FILE* f, const unsigned char* p, size_t pos) {
-    // Print an ASCII report that ends with byte p[pos].
-    // The first byte printed is p[first], where first is the max multiple
-    // of 16 having `first < pos`. The report starts at column 51.
-    size_t first = pos - (pos % 16);  // first char to print
-    int n = pos + 1 - first;          // # chars to print
-    char buf[17];
-    for (size_t i = first; i != first + n; ++i) {
-        buf[i - first] = (p[i] >= 32 && p[i] < 127 ? p[i] : '.');
-    }
-    fprintf(f, "%*s|%.*s|\n", 51 - (3 * n + (n > 8)), "", n, buf);
+void hexdump_diff(const void* a, const void* b, size_t size) {
+    fhexdump_diff(stdout, a, b, size);
+}
+
+void fhexdump_diff(FILE* f, const void* a, const void* b, size_t size) {
+    const unsigned char* pa = (const unsigned char*) a;
+    const unsigned char* pb = (const unsigned char*) b;
+    char buf[hexdump_buffer_size];
+    size_t len = 0;
+    for (size_t i = 0; i < size; i += 16) {
+        size_t n = size - i < 16 ? size - i : 16;
+        if (memcmp(pa + i, pb + i, n) == 0) {
+            continue;
+        }
+        if (len + 2 * (hexdump_line_max + 2) > sizeof(buf)) {
+            fwrite(buf, 1, len, f);
+            len = 0;
+        }
+        len += format_line(buf + len, "- ", i, pa + i, n);
+        len += format_line(buf + len, "+ ", i, pb + i, n);
+    }
+    fwrite(buf, 1, len, f);
 }
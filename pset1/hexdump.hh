@@ -34,4 +34,16 @@ void fhexdump(FILE* f, const void* ptr, size_t size);
 //    address of `ptr`.
 void fhexdump_at(FILE* f, size_t first_offset, const void* ptr, size_t size);
 
+
+// hexdump_diff(a, b, size)
+//    Compare the `size` bytes at `a` and `b` and print, for each 16-byte
+//    line that differs, that line's hexdump from `a` (prefixed by `- `)
+//    and from `b` (prefixed by `+ `). Offsets count from the start of
+//    the data. Identical lines are not printed.
+void hexdump_diff(const void* a, const void* b, size_t size);
+
+// fhexdump_diff(f, a, b, size)
+//    Like `hexdump_diff(a, b, size)`, but print to file `f`.
+void fhexdump_diff(FILE* f, const void* a, const void* b, size_t size);
+
 #endif
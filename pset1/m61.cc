@@ -1,70 +1,384 @@
 #include "m61.hh"
+#include "m61shm.hh"
 #include <cstdlib>
 #include <cstddef>
 #include <cstring>
 #include <cstdio>
 #include <cinttypes>
 #include <cassert>
+#include <cerrno>
+#include <cstdarg>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
-#include <unordered_map>
-#include <vector>
+#include <sys/random.h>
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <iostream>
-#include <unordered_set>
 
+// The heap is a set of arenas. Each arena is one anonymous mapping that
+// starts with its `m61_memory_buffer` descriptor (the arena header),
+// followed by `size` bytes of blocks. The first arena is 8 MiB; each new
+// arena is twice as big as the last, so a growing heap needs only a few.
+// The mapping ends with the arena's shadow bitmaps (see `testShadow`).
 struct m61_memory_buffer {
-    char* buffer;
-    size_t pos = 0;
-    size_t size = 8 << 20; /* 8 MiB */
+    char* buffer;                // first byte available for blocks
+    size_t pos = 0;              // bytes in use (blocks end at buffer + pos)
+    size_t zeroed = 0;           // bytes from buffer + zeroed on were never
+                                 // written, so are still zero
+    size_t size;                 // bytes available for blocks
+    size_t mapsize;              // size of the whole mapping
+    std::atomic<uint64_t>* startBits;   // granules where a block starts
+    std::atomic<uint64_t>* allocBits;   // granules where an active block starts
 
-    m61_memory_buffer();
-    ~m61_memory_buffer();
+    static m61_memory_buffer* create(size_t size);
+    void destroy();
 };
 
-static m61_memory_buffer default_buffer;
+constexpr size_t defaultArenaSize = 8 << 20; /* 8 MiB */
+constexpr size_t maxArenaGrowth = size_t(1) << 30;
+constexpr size_t arenaHeaderSize = 64;
+constexpr int maxArenas = 64;
+static_assert(sizeof(m61_memory_buffer) <= arenaHeaderSize, "arena header too big");
 
+// Registered arenas. Slots are published and cleared atomically so m61_free
+// can look up arenas without taking `heapLock`.
+static std::atomic<m61_memory_buffer*> arenas[maxArenas];
+static std::atomic<int> narenas;        // high-water mark of used slots
 
-m61_memory_buffer::m61_memory_buffer() {
-    void* buf = mmap(nullptr,    // Place the buffer at a random address
-        this->size,              // Buffer should be 8 MiB big
-        PROT_WRITE,              // We want to read and write the buffer
-        MAP_ANON | MAP_PRIVATE, -1, 0);
-                                 // We want memory freshly allocated by the OS
-    assert(buf != MAP_FAILED);
-    this->buffer = (char*) buf;
+// The same arenas sorted by address, so findArena can binary search. They
+// change only under `heapLock`, and `arenaOrderSeq` is odd while they do;
+// a lock-free reader whose search overlapped a change sees the sequence
+// number move and searches again.
+static std::atomic<m61_memory_buffer*> arenaOrder[maxArenas];
+static std::atomic<int> narenaOrder;
+static std::atomic<unsigned> arenaOrderSeq;
+static size_t nextArenaSize = defaultArenaSize;
+
+
+// Huge pages: with `M61_HUGEPAGES` set to `thp`, arenas are aligned to
+// 2 MiB and marked MADV_HUGEPAGE so the kernel can back them with
+// transparent huge pages; with `explicit`, they are mapped MAP_HUGETLB
+// from the reserved huge page pool (falling back to `thp` when the pool
+// is empty). Either way, fewer TLB entries cover the heap.
+enum hugePageMode { hugePagesOff, hugePagesTransparent, hugePagesExplicit };
+static hugePageMode hugePages = hugePagesOff;
+constexpr size_t hugePageSize = 2 << 20;
+
+/// mapAligned(mapsize, align)
+///     Maps `mapsize` bytes of anonymous memory at a multiple of `align`
+///     by over-mapping and trimming. Returns MAP_FAILED on failure.
+static void* mapAligned(size_t mapsize, size_t align) {
+    void* buf = mmap(nullptr, mapsize + align, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (buf == MAP_FAILED) {
+        return buf;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(buf);
+    uintptr_t aligned = (start + align - 1) & ~(align - 1);
+    if (aligned != start) {
+        munmap(buf, aligned - start);
+    }
+    if (aligned + mapsize != start + mapsize + align) {
+        munmap(reinterpret_cast<void*>(aligned + mapsize), start + align - aligned);
+    }
+    return reinterpret_cast<void*>(aligned);
+}
+
+/// shadowWords(bytes)
+///     Returns the number of words in a shadow bitmap covering `bytes`
+///     bytes of blocks (one bit per 16-byte granule).
+static inline size_t shadowWords(size_t bytes) {
+    return (bytes + 1023) / 1024;
+}
+
+/// m61_memory_buffer::create(size)
+///     Maps a new arena with room for at least `size` bytes of blocks and
+///     returns its header, or returns nullptr if the OS refuses.
+m61_memory_buffer* m61_memory_buffer::create(size_t size) {
+    size_t pagesize = hugePages == hugePagesOff ? 4096 : hugePageSize;
+    if (size > SIZE_MAX / 2) {
+        return nullptr;
+    }
+    // The two bitmaps take 1/64 of the blocks' space; leave extra room
+    size_t mapsize = (size + size / 32 + 64 + arenaHeaderSize + pagesize - 1)
+        & ~(pagesize - 1);
+    void* buf = MAP_FAILED;
+    if (hugePages == hugePagesExplicit) {
+        buf = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                   MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    }
+    if (buf == MAP_FAILED && hugePages != hugePagesOff) {
+        buf = mapAligned(mapsize, hugePageSize);
+        if (buf != MAP_FAILED) {
+            madvise(buf, mapsize, MADV_HUGEPAGE);
+        }
+    } else if (buf == MAP_FAILED) {
+        buf = mmap(nullptr,          // Place the buffer at a random address
+            mapsize,                 // Room for the header and the blocks
+            PROT_READ | PROT_WRITE,  // We want to read and write the buffer
+            MAP_ANON | MAP_PRIVATE, -1, 0);
+                                     // We want memory freshly allocated by the OS
+    }
+    if (buf == MAP_FAILED) {
+        return nullptr;
+    }
+    auto a = new (buf) m61_memory_buffer;
+    a->buffer = reinterpret_cast<char*>(buf) + arenaHeaderSize;
+    size_t nwords = shadowWords(mapsize - arenaHeaderSize);
+    a->startBits = reinterpret_cast<std::atomic<uint64_t>*>(
+        reinterpret_cast<char*>(buf) + mapsize - 2 * nwords * sizeof(uint64_t));
+    a->allocBits = a->startBits + nwords;
+    a->size = (reinterpret_cast<char*>(a->startBits) - a->buffer) & ~size_t(15);
+    a->mapsize = mapsize;
+    return a;
 }
 
-m61_memory_buffer::~m61_memory_buffer() {
-    munmap(this->buffer, this->size);
+/// m61_memory_buffer::destroy()
+///     Returns this arena's memory to the OS.
+void m61_memory_buffer::destroy() {
+    munmap(this, this->mapsize);
 }
 
 static m61_statistics memory_stats = {
     .nactive = 0, .active_size = 0, .ntotal = 0,
     .total_size = 0, .nfail = 0, .fail_size = 0,
-    .heap_min = 0, .heap_max = 0
+    .heap_min = 0, .heap_max = 0, .ninplace = 0,
+    .committed_size = 0
 };
 
-// Struct for storing freed blocks
-struct freeBlock {
-    char* address;
-    size_t sz;
-};
-// Struct for storing active blocks
-struct activeBlock {
-    size_t sz;
-    const char* file;
+// Every block in the default buffer, from `buffer` up to `buffer + pos`,
+// starts with a `blockHeader` and ends with a `blockFooter` (boundary tags).
+// Active blocks look like this:
+//
+//     [blockHeader][payload: sz bytes][guard: >= guardSize bytes][blockFooter]
+//
+// Free blocks keep the header and footer, and store their free-index links
+// at the start of the payload. A block's total size is a multiple of 16, so
+// payloads stay 16-byte aligned.
+
+// Struct stored at the start of every block
+struct blockHeader {
+    size_t size;                 // total block size, including tags
+    size_t sz;                   // requested size (active blocks)
+    const char* file;            // allocation site (active blocks)
     int line;
+    uint32_t magic;              // blockMagic(this) ^ block state
+    uint64_t canary[2];          // leading guard (sampled active blocks)
+};
+// Struct stored at the end of every block (lets us find the previous block)
+struct blockFooter {
+    size_t size;                 // copy of blockHeader::size
 };
+// Free-index links, stored in the payload of free blocks
+struct freeLinks {
+    blockHeader* left;
+    blockHeader* right;
+};
+
+// Block states, stored xor'ed into blockHeader::magic
+constexpr uint32_t blockActive = 1;
+constexpr uint32_t blockFree = 2;
+constexpr uint32_t blockCached = 3;     // free, but held by a thread cache
+constexpr uint32_t blockActiveFast = 4; // active, but not sampled: no guard
+                                        // and no site statistics
+constexpr uint32_t blockQuarantined = 5; // freed, poisoned, awaiting reuse
+constexpr uint32_t blockSlab = 6;       // owned by an m61_slab
+constexpr uint32_t blockRegion = 7;     // owned by an m61_arena
+
+/// isActive(state)
+///     Returns true iff `state` is one of the active block states.
+static inline bool isActive(uint32_t state) {
+    return state == blockActive || state == blockActiveFast;
+}
 
 // Constant for trailing guard size (in case it needs changed)
 constexpr size_t guardSize = 16;
 constexpr unsigned char guardExpression = 0xDD;
 
-// Map for storing active allocations, vector for storing freed allocations, and vector for
-// storing start addresses of freed pointers that got merged with the tail
-static std::unordered_map<void*, activeBlock> activeAlloc;
-static std::vector<freeBlock> freedAlloc;
-static std::unordered_set<void*> trimmed;
+// Random key for the leading guard, chosen once per process, so a wild
+// write cannot forge a canary by copying a constant
+static uint64_t heapCanary;
+
+// Per-block metadata overhead, and the smallest block we ever create
+constexpr size_t tagSize = sizeof(blockHeader) + sizeof(blockFooter);
+constexpr size_t minBlockSize = (sizeof(blockHeader) + sizeof(freeLinks)
+                                 + sizeof(blockFooter) + 15) & ~size_t(15);
+static_assert(sizeof(blockHeader) % 16 == 0, "payloads must stay aligned");
+
+// Blocks at least this big bypass the arenas: each gets its own mapping,
+// which is unmapped as soon as the block is freed. A `largeLinks` node
+// precedes the header and links the block into `largeBlocks`.
+constexpr size_t largeBlockSize = 256 << 10;
+
+struct largeLinks {
+    blockHeader* prev;
+    blockHeader* next;
+    size_t mapsize;
+    size_t offset;              // bytes between mapping start and this node
+};
+static_assert(sizeof(largeLinks) % 16 == 0, "payloads must stay aligned");
+
+// Number of size classes in the free index. Class `c` holds free blocks
+// whose sizes are in [2^c, 2^(c+1)).
+constexpr int nSizeClasses = 64;
+
+// Free index: one treap per power-of-two size class, ordered by
+// (size, address), with nodes stored inside the free blocks themselves.
+// Bit `c` of `nonemptyClasses` is set iff `freeRoots[c]` is nonempty.
+static blockHeader* freeRoots[nSizeClasses];
+static uint64_t nonemptyClasses = 0;
+
+// Lock protecting the central heap: the arenas, the free index,
+// `largeBlocks`, `allSlabs`, `allRegions`, `memory_stats`, and the list of statistics
+// shards
+static std::mutex heapLock;
+
+// List of active large blocks
+static blockHeader* largeBlocks;
+
+// Statistics counters for one thread. Each thread updates only its own
+// shard, so counting needs no lock and no shared cache lines;
+// m61_get_statistics() sums every shard. Active counts are derived from
+// allocation and free counts, because a block may be freed by a different
+// thread than the one that allocated it.
+struct statShard {
+    std::atomic<unsigned long long> ntotal{0};
+    std::atomic<unsigned long long> total_size{0};
+    std::atomic<unsigned long long> nfreed{0};
+    std::atomic<unsigned long long> freed_size{0};
+    std::atomic<unsigned long long> nfail{0};
+    std::atomic<unsigned long long> fail_size{0};
+    std::atomic<unsigned long long> ninplace{0};
+    statShard* next = nullptr;
+};
+
+// Per-thread cache of small free blocks. `lists[c]` holds blocks of exactly
+// `cacheClassSize[c]` bytes, marked `blockCached` and linked through
+// freeLinks::left. Classes are 16 bytes apart up to 512 bytes, then four
+// per power of two up to `cacheMaxBlockSize`; allocations that fit are
+// rounded up to their class. Blocks move between a cache and the central
+// heap `cacheBatch` at a time. (Bigger blocks are not cached, so the
+// central heap can fit them best.)
+constexpr size_t cacheFineMaxBlockSize = 512;
+constexpr size_t cacheMaxBlockSize = 1024;
+constexpr size_t cacheMaxRequest = cacheMaxBlockSize - tagSize - guardSize;
+constexpr int nCacheFineClasses = cacheFineMaxBlockSize / 16 + 1;
+constexpr int nCacheClasses = nCacheFineClasses
+    + 4 * (__builtin_ctzl(cacheMaxBlockSize) - __builtin_ctzl(cacheFineMaxBlockSize));
+constexpr unsigned cacheBatch = 16;
+constexpr unsigned cacheLimit = 64;
+
+// Frees of bigger arena blocks are deferred too: each thread collects up
+// to `deferBatch` of them, marked `blockCached`, then coalesces the whole
+// batch in address order under one acquisition of `heapLock`. A batch is
+// also flushed when the free index cannot satisfy an allocation.
+constexpr unsigned deferBatch = 32;
+
+/// cacheClassForBlock(size)
+///     Returns the cache class of the smallest blocks that hold `size`
+///     bytes, for `0 < size <= cacheMaxBlockSize`. Both the 16-byte class
+///     and the geometric class (four per power of two, from the top bits
+///     of `size - 1`) are computed and one is selected, so there are no
+///     branches or loops.
+static constexpr inline int cacheClassForBlock(size_t size) {
+    constexpr int fineShift = __builtin_ctzl(cacheFineMaxBlockSize);
+    size_t n = size - 1;
+    int lg = 63 - __builtin_clzl(n | cacheFineMaxBlockSize);
+    int fine = int(n >> 4) + 1;
+    int coarse = nCacheFineClasses + 4 * (lg - fineShift) + int((n >> (lg - 2)) & 3);
+    return n < cacheFineMaxBlockSize ? fine : coarse;
+}
+
+/// cacheClass(sz)
+///     Returns the cache class for a `sz`-byte allocation, for
+///     `sz <= cacheMaxRequest`. Tags, guard, and alignment are folded into
+///     the class size.
+static constexpr inline int cacheClass(size_t sz) {
+    return cacheClassForBlock(sz + tagSize + guardSize);
+}
+
+// cacheClassSize[c]: the block size of cache class `c`
+static constexpr std::array<size_t, nCacheClasses> cacheClassSize = [] () {
+    std::array<size_t, nCacheClasses> size{};
+    for (int c = 1; c != nCacheFineClasses; ++c) {
+        size[c] = 16 * c;
+    }
+    for (int c = nCacheFineClasses; c != nCacheClasses; ++c) {
+        size_t base = cacheFineMaxBlockSize << ((c - nCacheFineClasses) / 4);
+        size[c] = base + base / 4 * ((c - nCacheFineClasses) % 4 + 1);
+    }
+    return size;
+} ();
+
+static_assert(cacheClassSize[nCacheClasses - 1] == cacheMaxBlockSize);
+static_assert(cacheClassSize[cacheClass(0)] >= minBlockSize,
+              "blockSize relies on classes covering minBlockSize");
+static_assert([] () {
+    // Every block size maps to the smallest class that holds it
+    for (size_t size = 1; size <= cacheMaxBlockSize; ++size) {
+        int c = cacheClassForBlock(size);
+        if (c <= 0 || c >= nCacheClasses || cacheClassSize[c] < size
+            || cacheClassSize[c - 1] >= size) {
+            return false;
+        }
+    }
+    return true;
+} (), "cacheClassForBlock must agree with cacheClassSize");
+
+struct threadCache {
+    blockHeader* lists[nCacheClasses];
+    unsigned counts[nCacheClasses];
+    blockHeader* deferred[deferBatch];
+    unsigned ndeferred;
+    unsigned sampleCountdown;           // allocations until the next sample
+    statShard stats;
+};
+
+// Sampling: only one in `sampleRate` allocations gets a guard and site
+// statistics, and is checked in full when freed. The rest only keep their
+// boundary tags. Set from the `M61_SAMPLE_RATE` environment variable;
+// the default, 1, samples every allocation.
+static unsigned sampleRate = 1;
+
+// Quarantine: freed sampled arena blocks wait in a FIFO before they can be
+// reused. Their payloads are filled with `poisonExpression` and their
+// `file`/`line` record where they were freed; the poison is verified on
+// eviction, so writes after free are caught. `quarantineBudget` bytes of
+// blocks may wait at once (set from `M61_QUARANTINE`; default 0, off).
+// Protected by `heapLock`.
+constexpr unsigned char poisonExpression = 0xFE;
+constexpr size_t quarantineSlots = 1 << 16;
+static size_t quarantineBudget = 0;
+static blockHeader* quarantine[quarantineSlots];
+static size_t quarantineHead = 0;       // index of oldest block
+static size_t quarantineCount = 0;
+static size_t quarantineBytes = 0;
+
+static thread_local threadCache* tcache;
+static statShard* allShards;            // shards of live threads
+static statShard retiredStats;          // totals from exited threads
+static pthread_key_t cacheKey;          // runs destroyCache at thread exit
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static threadCache* createCache();
+
+/// currentCache()
+///     Returns the calling thread's cache, creating it if necessary.
+static inline threadCache* currentCache() {
+    threadCache* tc = tcache;
+    return tc ? tc : createCache();
+}
+
+/// bump(counter, n)
+///     Adds `n` to a statistics counter owned by the calling thread.
+static inline void bump(std::atomic<unsigned long long>& counter, unsigned long long n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
 
 /// align(size_t sz)
 ///     Given a size, rounds up to the next multiple of 16
@@ -75,279 +389,2738 @@ size_t align(size_t sz) {
 /// fail(size_t sz)
 ///     Updates memory statistics for a failed allocation
 void fail(size_t sz) {
-    memory_stats.nfail++;
-    memory_stats.fail_size += sz;
+    statShard& stats = currentCache()->stats;
+    bump(stats.nfail, 1);
+    bump(stats.fail_size, sz);
 }
 
 /// success(size_t sz)
 ///     Updates memory statistics for a successful allocation
 void success(size_t sz) {
-    memory_stats.ntotal++;
-    memory_stats.nactive++;
-    memory_stats.active_size += sz;
-    memory_stats.total_size += sz;
-}
-
-/// insertFreedAlloc(freeBlock freed)
-///     Inserts a freed allocation into the freedAlloc vector, keeping
-///     the vector sorted by ptr memory address.
-static void insertFreedAlloc(const freeBlock& freed) {
-    // Variable to store index where freed is inserted
-    size_t i = 0;
-
-    // Handle case where freed is the first freed pointer
-    // or freed has a larger address than all other freed pointers
-    if (freedAlloc.empty()) {
-        freedAlloc.push_back(freed);
-    } else if (freedAlloc[freedAlloc.size() - 1].address < freed.address) {
-        freedAlloc.push_back(freed);
-        i = freedAlloc.size() - 1;
-    } else {
-        // Insert the freed block before the first pointer that has a larger address
-        for (size_t j = 0; j < freedAlloc.size(); ++j) {
-            if (freedAlloc[j].address > freed.address) {
-                freedAlloc.insert(freedAlloc.begin() + j, freed);
-                i = j;
-                break;
+    statShard& stats = currentCache()->stats;
+    bump(stats.ntotal, 1);
+    bump(stats.total_size, sz);
+}
+
+// Per-site statistics, one record per allocation site (`file`:`line`).
+// Records live in an open-addressed table keyed by the file pointer and
+// line; a site is interned the first time it allocates, and the record is
+// never moved or removed. `siteOrder` lists the interned records in the
+// order they were interned, so snapshots copy only those. Sites that do
+// not fit share `overflowSite`.
+struct siteStats {
+    std::atomic<const char*> file{nullptr};
+    int line = 0;
+    std::atomic<unsigned long long> count{0};     // # allocations
+    std::atomic<unsigned long long> bytes{0};     // # bytes allocated
+    std::atomic<unsigned long long> live{0};      // # bytes currently active
+    std::atomic<unsigned long long> peak{0};      // max of `live`
+    std::atomic<unsigned long long> nfreed{0};    // # frees
+    std::atomic<unsigned long long> free_ns{0};   // total time spent in free
+};
+
+constexpr size_t nSites = 1 << 16;
+constexpr size_t siteProbeLimit = 64;
+static siteStats sites[nSites];
+static siteStats overflowSite;
+static uint32_t siteOrder[nSites];      // indexes into `sites`
+static std::atomic<size_t> nInterned{0};        // # entries in `siteOrder`
+static std::mutex siteLock;             // serializes interning
+
+/// findSite(file, line)
+///     Returns the statistics record for allocation site `file`:`line`,
+///     interning it if necessary.
+static siteStats* findSite(const char* file, int line) {
+    uintptr_t key = reinterpret_cast<uintptr_t>(file) ^ (uintptr_t(line) << 40);
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 48;
+    for (size_t probe = 0; probe != siteProbeLimit; ++probe, i = (i + 1) % nSites) {
+        siteStats* st = &sites[i];
+        const char* f = st->file.load(std::memory_order_acquire);
+        if (f == nullptr) {
+            std::lock_guard<std::mutex> guard(siteLock);
+            f = st->file.load(std::memory_order_relaxed);
+            if (f == nullptr) {
+                st->line = line;
+                st->file.store(file, std::memory_order_release);
+                size_t n = nInterned.load(std::memory_order_relaxed);
+                siteOrder[n] = i;
+                nInterned.store(n + 1, std::memory_order_release);
+                return st;
             }
         }
+        if (f == file && st->line == line) {
+            return st;
+        }
     }
-    // Coalesce with next freed block (if possible)
-    if (i < freedAlloc.size() - 1 && freedAlloc[i].address + freedAlloc[i].sz == freedAlloc[i + 1].address) {
-        freedAlloc[i].sz += freedAlloc[i + 1].sz;
-        freedAlloc.erase(freedAlloc.begin() + i + 1);
-    }
-    // Coalesce with previous freed block (if possible)
-    if (i > 0 && freedAlloc[i - 1].address + freedAlloc[i - 1].sz == freedAlloc[i].address) {
-        freedAlloc[i - 1].sz += freedAlloc[i].sz;
-        freedAlloc.erase(freedAlloc.begin() + i);
-    }
-    // Coalesce with default buffer (if possible)
-    char* heap_end = default_buffer.buffer + default_buffer.pos;
-    freeBlock& last = freedAlloc.back();
+    return &overflowSite;
+}
 
-    if (last.address + last.sz == heap_end) {
-        default_buffer.pos -= last.sz;
-        freedAlloc.pop_back();
-    }
+// Heavy hitters: the sites that allocate the most bytes, found in bounded
+// memory however many sites there are. A Count-Min sketch estimates the
+// bytes allocated by every site, and `heavyHitters` remembers the
+// `nHeavyHitters` sites with the biggest estimates seen so far. A site is
+// only considered for the table once its estimate passes `heavyThreshold`,
+// the smallest estimate in the (full) table.
+constexpr int sketchDepth = 4;
+constexpr size_t sketchWidth = 4096;
+constexpr int nHeavyHitters = 32;
+
+struct heavyHitter {
+    std::atomic<uint64_t> key{0};       // siteKey(file, line), 0 if unused
+    const char* file = nullptr;
+    int line = 0;
+};
+
+static std::atomic<unsigned long long> sketch[sketchDepth][sketchWidth];
+static heavyHitter heavyHitters[nHeavyHitters];
+static std::atomic<unsigned long long> heavyThreshold{0};
+static std::mutex heavyLock;            // serializes table replacement
 
+/// siteKey(file, line)
+///     Returns a nonzero 64-bit hash of allocation site `file`:`line`.
+static inline uint64_t siteKey(const char* file, int line) {
+    uint64_t key = (reinterpret_cast<uintptr_t>(file) ^ (uint64_t(line) << 40))
+        * 0x9E3779B97F4A7C15ULL;
+    return (key ^ (key >> 29)) | 1;
 }
 
-/// findFreeSpace(size_t sz)
-///     Finds smallest free space in the vector of freedAlloc that is large
-///     enough to accomodate sz
-static void* findFreeSpace(size_t sz) {
-    // Handle case of empty freedAlloc
-    if (freedAlloc.size() == 0) {
-        return nullptr;
+/// sketchIndex(key, d)
+///     Returns row `d`'s counter index for site hash `key`.
+static inline size_t sketchIndex(uint64_t key, int d) {
+    static constexpr uint64_t seeds[sketchDepth] = {
+        0xFF51AFD7ED558CCDULL, 0xC4CEB9FE1A85EC53ULL,
+        0x9FB21C651E98DF25ULL, 0xD6E8FEB86659FD93ULL
+    };
+    return ((key * seeds[d]) >> 40) % sketchWidth;
+}
+
+/// sketchEstimate(key)
+///     Returns the sketch's estimate of the bytes allocated by site `key`.
+///     The estimate never undercounts.
+static unsigned long long sketchEstimate(uint64_t key) {
+    unsigned long long est = ~0ULL;
+    for (int d = 0; d != sketchDepth; ++d) {
+        est = std::min(est, sketch[d][sketchIndex(key, d)].load(std::memory_order_relaxed));
+    }
+    return est;
+}
+
+/// heavyHitterAllocated(file, line, sz)
+///     Adds a `sz`-byte allocation at site `file`:`line` to the sketch, and
+///     admits the site to `heavyHitters` if it has become big enough.
+static void heavyHitterAllocated(const char* file, int line, size_t sz) {
+    uint64_t key = siteKey(file, line);
+    unsigned long long est = ~0ULL;
+    for (int d = 0; d != sketchDepth; ++d) {
+        auto& counter = sketch[d][sketchIndex(key, d)];
+        est = std::min(est, counter.fetch_add(sz, std::memory_order_relaxed) + sz);
+    }
+    if (est <= heavyThreshold.load(std::memory_order_relaxed)) {
+        return;
     }
-    // Find the smallest free space that is large enough for sz
-    size_t bestIndex = (size_t)-1;
-    size_t bestSz = (size_t)-1;
-    for (size_t i = 0; i < freedAlloc.size(); ++i) {
-        if (freedAlloc[i].sz >= sz && freedAlloc[i].sz < bestSz) {
-            bestSz = freedAlloc[i].sz;
-            bestIndex = i;
-            // If perfect fit is found
-            if (bestSz == sz) break;
+    for (auto& hh : heavyHitters) {
+        if (hh.key.load(std::memory_order_acquire) == key) {
+            return;
         }
     }
-    // Handle case where no sufficient space was found
-    if (bestSz == (size_t)-1) {
-        return nullptr;
+
+    std::lock_guard<std::mutex> guard(heavyLock);
+    // Replace an unused entry or the one with the smallest estimate
+    heavyHitter* victim = nullptr;
+    unsigned long long victimEst = ~0ULL, nextMin = ~0ULL;
+    for (auto& hh : heavyHitters) {
+        uint64_t k = hh.key.load(std::memory_order_relaxed);
+        if (k == key) {
+            return;
+        }
+        unsigned long long e = k ? sketchEstimate(k) : 0;
+        if (e < victimEst) {
+            nextMin = victimEst;
+            victim = &hh;
+            victimEst = e;
+        } else if (e < nextMin) {
+            nextMin = e;
+        }
     }
-    void* ptr = freedAlloc[bestIndex].address;
-    // Handle case where perfect match was found
-    if (bestSz == sz) {
-        freedAlloc.erase(freedAlloc.begin() + bestIndex);
+    if (victimEst < est) {
+        victim->key.store(0, std::memory_order_relaxed);
+        victim->file = file;
+        victim->line = line;
+        victim->key.store(key, std::memory_order_release);
+        heavyThreshold.store(std::min(est, nextMin), std::memory_order_relaxed);
     }
-    else {
-        freedAlloc[bestIndex].address += sz;
-        freedAlloc[bestIndex].sz -= sz;
+}
+
+/// siteAllocated(file, line, sz)
+///     Records a `sz`-byte allocation at site `file`:`line`.
+static void siteAllocated(const char* file, int line, size_t sz) {
+    heavyHitterAllocated(file, line, sz);
+    siteStats* st = findSite(file, line);
+    st->count.fetch_add(1, std::memory_order_relaxed);
+    st->bytes.fetch_add(sz, std::memory_order_relaxed);
+    unsigned long long live = st->live.fetch_add(sz, std::memory_order_relaxed) + sz;
+    unsigned long long peak = st->peak.load(std::memory_order_relaxed);
+    while (live > peak
+           && !st->peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
     }
-    return ptr;
 }
 
-/// m61_malloc(sz, file, line)
-///    Returns a pointer to `sz` bytes of freshly-allocated dynamic memory.
-///    The memory is not initialized. If `sz == 0`, then m61_malloc may
-///    return either `nullptr` or a pointer to a unique allocation.
-///    The allocation request was made at source code location `file`:`line`.
+/// siteFreed(file, line, sz, ns)
+///     Records that a `sz`-byte allocation from site `file`:`line` was
+///     freed, taking `ns` nanoseconds.
+static void siteFreed(const char* file, int line, size_t sz, unsigned long long ns) {
+    siteStats* st = findSite(file, line);
+    st->live.fetch_sub(sz, std::memory_order_relaxed);
+    st->nfreed.fetch_add(1, std::memory_order_relaxed);
+    st->free_ns.fetch_add(ns, std::memory_order_relaxed);
+}
 
-void* m61_malloc(size_t sz, const char* file, int line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    // Guard against overflow when finding aligned_sz
-    if (sz > SIZE_MAX - 15) {
-        fail(sz);
-        return nullptr;
-    }
-    // Find padding needed for 16-byte alignment, then combine with guard
-    size_t total = sz + guardSize;
-    size_t aligned_total = align(total);
-    // Try to fit the allocation into previously freed space
-    void* ptr = findFreeSpace(aligned_total);
-    // If that fails, try new space
-    if (!ptr) {
-        // Check if space is available for padded allocation, guarding against
-        // overflow when calculating available space
-        if (aligned_total <= default_buffer.size - default_buffer.pos) {
-            // Space is available, allocate memory
-            ptr = &default_buffer.buffer[default_buffer.pos];
-            default_buffer.pos += aligned_total;
-        }
-        else {
-            // Not enough space left in default buffer for allocation
-            ptr = nullptr;
-        }
-    }
-    if (ptr) {
-        // Update guard space
-        std::memset(reinterpret_cast<unsigned char*>(ptr) + sz, guardExpression, guardSize);
-        // Update set of tail trims
-        if (trimmed.contains(static_cast<char*>(ptr))) {
-            trimmed.erase(static_cast<char*>(ptr));
-        }
-        // Handle successful allocation
-        success(sz);
-        activeAlloc[ptr] = { sz, file, line };
-        
-        auto addr = reinterpret_cast<uintptr_t>(ptr);
-        auto endAddr = addr + aligned_total;
-        // Adjust heap_min for intial case or new smallest address
-        if (memory_stats.heap_min == 0 || addr < memory_stats.heap_min) {
-            memory_stats.heap_min = addr;
-        }
-        // Adjust heap_max for new largest address
-        if (endAddr > memory_stats.heap_max) {
-            memory_stats.heap_max = endAddr;
-        }
-    }
-    else {
-        // Handle failed allocation
-        fail(sz);
+// Tracing: if `M61_TRACE` names a file, every public allocation call
+// appends an `m61_trace_record` to `traceBuffer`, which is written to
+// `traceFd` when full and at exit. `traceFd` is -1 when tracing is off,
+// so untraced programs pay one predictable branch per call.
+constexpr size_t traceBufferRecords = 4096;
+static int traceFd = -1;
+static m61_trace_record traceBuffer[traceBufferRecords];
+static size_t traceCount = 0;
+static std::mutex traceLock;            // protects traceBuffer, traceCount
+
+/// writeAll(fd, data, n)
+///     Writes `n` bytes to `fd`, retrying short writes. Gives up (turning
+///     tracing off) on error.
+static void writeAll(int fd, const void* data, size_t n) {
+    const char* p = reinterpret_cast<const char*>(data);
+    while (n != 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            traceFd = -1;
+            return;
+        }
+        p += w;
+        n -= w;
     }
-    return ptr;
 }
 
-/// m61_free(ptr, file, line)
-///    Frees the memory allocation pointed to by `ptr`. If `ptr == nullptr`,
-///    does nothing. Otherwise, `ptr` must point to a currently active
-///    allocation returned by `m61_malloc`. The free was called at location
-///    `file`:`line`.
+/// flushTraceLocked()
+///     Writes out buffered trace records. Requires `traceLock`.
+static void flushTraceLocked() {
+    if (traceCount != 0 && traceFd >= 0) {
+        writeAll(traceFd, traceBuffer, traceCount * sizeof(m61_trace_record));
+    }
+    traceCount = 0;
+}
 
-void m61_free(void* ptr, const char* file, int line) {
-    // avoid uninitialized variable warnings
-    (void) ptr, (void) file, (void) line;
-    // Handle nullptr case
-    if (ptr == nullptr) {
+/// openTrace(path)
+///     Starts tracing to file `path`.
+static void openTrace(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
         return;
     }
-    // Handle cases where ptr does not point to an active allocation
-    // Three cases: not in heap, double free, invalid free
-    char* p = reinterpret_cast<char*>(ptr);
-    // Handle not in heap case
-    if (p < default_buffer.buffer || p >= default_buffer.buffer + default_buffer.size) {
-        std::cerr << "MEMORY BUG: " << file << ":" << line
-            << ": invalid free of pointer " << ptr << ", not in heap" << std::endl;
-        abort();
+    traceFd = fd;
+    writeAll(fd, &m61_trace_magic, sizeof(m61_trace_magic));
+    atexit(m61_trace_flush);
+}
+
+/// traceEvent(op, file, line, ptr, size, arg)
+///     Appends a trace record.
+static void traceEvent(m61_trace_op op, const char* file, int line,
+                       const void* ptr, size_t size, uint64_t arg = 0) {
+    std::lock_guard<std::mutex> guard(traceLock);
+    if (traceCount == traceBufferRecords) {
+        flushTraceLocked();
     }
-    auto it = activeAlloc.find(ptr);
-    if (it == activeAlloc.end()) {
-        // Handle double frees (ptr was already freed)
-        if (trimmed.contains(ptr)) {
-            std::cerr << "MEMORY BUG: " << file << ":" << line
-                << ": invalid free of pointer " << ptr << ", double free" << std::endl;
+    m61_trace_record& r = traceBuffer[traceCount];
+    r.op = op;
+    r.site = siteKey(file, line) >> 32;
+    r.ptr = reinterpret_cast<uintptr_t>(ptr);
+    r.size = size;
+    r.arg = arg;
+    ++traceCount;
+}
+
+/// m61_trace_flush()
+///     Writes out any buffered trace records.
+void m61_trace_flush() {
+    std::lock_guard<std::mutex> guard(traceLock);
+    flushTraceLocked();
+}
+
+/// nanotime()
+///     Returns a monotonic timestamp in nanoseconds.
+static inline unsigned long long nanotime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// blockMagic(h)
+///     Returns the magic number for a header at address `h`. Tying the magic
+///     to the address means a header copied elsewhere is not mistaken for
+///     a real one.
+static inline uint32_t blockMagic(const blockHeader* h) {
+    uintptr_t a = reinterpret_cast<uintptr_t>(h);
+    return uint32_t((a >> 4) * 0x9E3779B1U) ^ 0x6D36316BU;
+}
+
+/// blockState(h)
+///     Returns the state of the block with header `h`, or 0 if `h` does not
+///     look like a valid block header.
+static inline uint32_t blockState(const blockHeader* h) {
+    return h->magic ^ blockMagic(h);
+}
+
+/// payload(h), headerOf(ptr), footerOf(h), nextBlock(h)
+///     Pointer arithmetic helpers for the block layout.
+static inline char* payload(blockHeader* h) {
+    return reinterpret_cast<char*>(h + 1);
+}
+static inline blockHeader* headerOf(void* ptr) {
+    return reinterpret_cast<blockHeader*>(ptr) - 1;
+}
+static inline blockFooter* footerOf(blockHeader* h) {
+    return reinterpret_cast<blockFooter*>(reinterpret_cast<char*>(h) + h->size) - 1;
+}
+static inline blockHeader* nextBlock(blockHeader* h) {
+    return reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) + h->size);
+}
+static inline freeLinks* links(blockHeader* h) {
+    return reinterpret_cast<freeLinks*>(payload(h));
+}
+static inline largeLinks* largeLinksOf(blockHeader* h) {
+    return reinterpret_cast<largeLinks*>(h) - 1;
+}
+
+/// heapEnd(a)
+///     Returns the first address past the last block in arena `a`.
+static inline char* heapEnd(const m61_memory_buffer* a) {
+    return a->buffer + a->pos;
+}
+
+/// findArena(p)
+///     Returns the arena whose block area contains address `p`, or nullptr
+///     if `p` is not in the heap. Takes time logarithmic in the number of
+///     arenas.
+static m61_memory_buffer* findArena(const void* p) {
+    auto cp = reinterpret_cast<const char*>(p);
+    while (true) {
+        unsigned seq = arenaOrderSeq.load(std::memory_order_acquire);
+        m61_memory_buffer* a = nullptr;
+        if (seq % 2 == 0) {
+            // Find the last arena that starts at or before `p`
+            int lo = 0, hi = narenaOrder.load(std::memory_order_relaxed);
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                auto m = arenaOrder[mid].load(std::memory_order_relaxed);
+                if (reinterpret_cast<uintptr_t>(m) <= reinterpret_cast<uintptr_t>(cp)) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo != 0) {
+                a = arenaOrder[lo - 1].load(std::memory_order_relaxed);
+            }
         }
-        else { // Handle invalid frees (ptr was never allocated)
-            std::cerr << "MEMORY BUG: " << file << ":" << line
-                << ": invalid free of pointer " << ptr << ", not allocated" << std::endl;
-            // Handle case where ptr is inside an active block
-            auto insideActive = std::find_if(activeAlloc.begin(), activeAlloc.end(),
-                [p](const auto& pair) {
-                    char* start = static_cast<char*>(pair.first);
-                    return p > start && p < start + pair.second.sz;
-                });
-            char* start = static_cast<char*>(insideActive->first);
-            size_t offset = static_cast<size_t>(p - start);
-            if (insideActive != activeAlloc.end()) {
-                std::cerr << "  " << insideActive->second.file << ":"<< insideActive->second.line 
-                    << ": " << ptr << " is " << offset << " bytes inside a " 
-                    << insideActive->second.sz << " byte region allocated here" << std::endl;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq % 2 == 0
+            && arenaOrderSeq.load(std::memory_order_relaxed) == seq) {
+            if (a && cp >= a->buffer && cp < a->buffer + a->size) {
+                return a;
             }
+            return nullptr;
         }
-        abort();
     }
-    // Check trailing guard
-    const size_t activeSz = it->second.sz;
-    unsigned char* pUnsigned = reinterpret_cast<unsigned char*>(ptr);
-    for (size_t i = 0; i < guardSize; ++i) {
-        if (pUnsigned[activeSz + i] != guardExpression) {
-            std::cerr << "MEMORY BUG: " << file << ":" << line
-                << ": detected wild write during free of pointer " << ptr
-                << std::endl;
-            abort();
+}
+
+/// orderArena(a, present)
+///     Inserts arena `a` into `arenaOrder` if `present`, or removes it
+///     otherwise. The caller must hold `heapLock`.
+static void orderArena(m61_memory_buffer* a, bool present) {
+    unsigned seq = arenaOrderSeq.load(std::memory_order_relaxed);
+    arenaOrderSeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    int n = narenaOrder.load(std::memory_order_relaxed);
+    int i = 0;
+    while (i != n
+           && reinterpret_cast<uintptr_t>(arenaOrder[i].load(std::memory_order_relaxed))
+              < reinterpret_cast<uintptr_t>(a)) {
+        ++i;
+    }
+    if (present) {
+        for (int j = n; j != i; --j) {
+            arenaOrder[j].store(arenaOrder[j - 1].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
         }
+        arenaOrder[i].store(a, std::memory_order_relaxed);
+        ++n;
+    } else if (i != n && arenaOrder[i].load(std::memory_order_relaxed) == a) {
+        for (int j = i; j + 1 != n; ++j) {
+            arenaOrder[j].store(arenaOrder[j + 1].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+        }
+        --n;
     }
-    // Handle successful case
-    --memory_stats.nactive;
-    memory_stats.active_size -= activeSz;
-    insertFreedAlloc({ p, align(activeSz + guardSize) });
-    trimmed.insert(it->first);
-    activeAlloc.erase(it);
+    narenaOrder.store(n, std::memory_order_relaxed);
+    arenaOrderSeq.store(seq + 2, std::memory_order_release);
 }
 
-/// m61_calloc(count, sz, file, line)
-///    Returns a pointer a fresh dynamic memory allocation big enough to
-///    hold an array of `count` elements of `sz` bytes each. Returned
-///    memory is initialized to zero. The allocation request was at
-///    location `file`:`line`. Returns `nullptr` if out of memory; may
-///    also return `nullptr` if `count == 0` or `size == 0`.
+// Shadow bitmaps: each arena has one bit per 16-byte granule saying
+// whether a block header starts there (`startBits`) and one saying whether
+// an active block's header starts there (`allocBits`). `startBits` change
+// only under `heapLock`, as blocks are split and coalesced; `allocBits`
+// change as blocks are allocated and freed, often from thread caches
+// without the lock, so they are updated with atomic operations. Checking
+// a pointer passed to m61_free takes a bit test or two, and the active
+// block containing an address is found by scanning `allocBits` backwards
+// a word at a time. The bitmaps cost 1/64 of the arena's space.
 
-void* m61_calloc(size_t count, size_t sz, const char* file, int line) {
-    // Guard against multiplication overflow
-    if (count != 0 && sz > SIZE_MAX / count) {
-        memory_stats.nfail++;
-        memory_stats.fail_size += static_cast<unsigned long long>(count) * static_cast<unsigned long long>(sz);
+/// granuleOf(a, p)
+///     Returns the index of the granule holding `p` in arena `a`.
+static inline size_t granuleOf(const m61_memory_buffer* a, const void* p) {
+    return size_t(reinterpret_cast<const char*>(p) - a->buffer) / 16;
+}
+
+/// testShadow(bits, g)
+///     Returns true iff granule `g`'s bit in `bits` is set.
+static inline bool testShadow(const std::atomic<uint64_t>* bits, size_t g) {
+    return (bits[g / 64].load(std::memory_order_relaxed) >> (g % 64)) & 1;
+}
+
+/// setStartBit(a, h, on), setAllocBit(a, h, on)
+///     Set or clear block `h`'s bit in arena `a`'s shadow bitmaps. The
+///     caller of setStartBit must hold `heapLock`.
+static inline void setStartBit(m61_memory_buffer* a, const blockHeader* h, bool on) {
+    size_t g = granuleOf(a, h);
+    uint64_t mask = uint64_t(1) << (g % 64);
+    uint64_t w = a->startBits[g / 64].load(std::memory_order_relaxed);
+    a->startBits[g / 64].store(on ? w | mask : w & ~mask, std::memory_order_relaxed);
+}
+static inline void setAllocBit(m61_memory_buffer* a, const blockHeader* h, bool on) {
+    size_t g = granuleOf(a, h);
+    uint64_t mask = uint64_t(1) << (g % 64);
+    if (on) {
+        a->allocBits[g / 64].fetch_or(mask, std::memory_order_relaxed);
+    } else {
+        a->allocBits[g / 64].fetch_and(~mask, std::memory_order_relaxed);
+    }
+}
+
+/// addArena(size)
+///     Maps a new arena with room for a `size`-byte block and registers it.
+///     Returns nullptr on failure. The caller must hold `heapLock`.
+static m61_memory_buffer* addArena(size_t size) {
+    int slot = 0;
+    while (slot != maxArenas && arenas[slot].load(std::memory_order_relaxed)) {
+        ++slot;
+    }
+    if (slot == maxArenas) {
         return nullptr;
     }
-    void* ptr = m61_malloc(count * sz, file, line);
-    if (ptr) {
-        memset(ptr, 0, count * sz);
+    m61_memory_buffer* a = m61_memory_buffer::create(std::max(size, nextArenaSize));
+    if (!a) {
+        return nullptr;
     }
-    return ptr;
+    arenas[slot].store(a, std::memory_order_release);
+    orderArena(a, true);
+    if (slot >= narenas.load(std::memory_order_relaxed)) {
+        narenas.store(slot + 1, std::memory_order_release);
+    }
+    nextArenaSize = std::min(nextArenaSize * 2, maxArenaGrowth);
+    return a;
 }
 
+/// removeArena(a)
+///     Unregisters arena `a`, which must contain no blocks, and returns its
+///     memory to the OS. The first arena is always kept. The caller must
+///     hold `heapLock`.
+static void removeArena(m61_memory_buffer* a) {
+    if (a == arenas[0].load(std::memory_order_relaxed)) {
+        return;
+    }
+    for (int i = 1; i != narenas.load(std::memory_order_relaxed); ++i) {
+        if (arenas[i].load(std::memory_order_relaxed) == a) {
+            arenas[i].store(nullptr, std::memory_order_release);
+            break;
+        }
+    }
+    orderArena(a, false);
+    a->destroy();
+}
 
-/// m61_get_statistics()
-///    Return the current memory statistics.
+// Purging: free space is returned to the OS with MADV_DONTNEED once a
+// free block (or an arena's unused tail) reaches `purgeThreshold` bytes
+// (set from `M61_PURGE`; 0 turns purging off). Only whole pages strictly
+// inside a free block are purged, so its tags and free-index links stay
+// resident. The OS refills purged pages with zeros, so a free block whose
+// `sz` field is `purgedMark` has an all-zero interior: m61_calloc need not
+// clear memory allocated from it. (MADV_FREE would be cheaper, but does
+// not promise zeros.)
+constexpr size_t defaultPurgeThreshold = 1 << 20;
+constexpr size_t purgePageSize = 4096;
+constexpr size_t purgedMark = 1;
+static size_t purgeThreshold = defaultPurgeThreshold;
 
-m61_statistics m61_get_statistics() {
-    return memory_stats;
+/// pageUp(p), pageDown(p)
+///     Round `p` up or down to a page boundary.
+static inline char* pageUp(char* p) {
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + purgePageSize - 1)
+                                   & ~(purgePageSize - 1));
+}
+static inline char* pageDown(char* p) {
+    return reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(p) & ~(purgePageSize - 1));
 }
 
+/// purgeRange(start, end)
+///     Returns the pages in [`start`, `end`) to the OS. Both must be
+///     page-aligned.
+static void purgeRange(char* start, char* end) {
+    if (start < end) {
+        madvise(start, end - start, MADV_DONTNEED);
+    }
+}
 
-/// m61_print_statistics()
-///    Prints the current memory statistics.
+/// setBlock(h, size, state)
+///     Writes the boundary tags for a block of `size` bytes at `h`, and
+///     marks its start in its arena's shadow.
+static inline void setBlock(blockHeader* h, size_t size, uint32_t state) {
+    h->size = size;
+    h->magic = blockMagic(h) ^ state;
+    footerOf(h)->size = size;
+    if (m61_memory_buffer* a = findArena(h)) {
+        setStartBit(a, h, true);
+    }
+}
 
-void m61_print_statistics() {
-    m61_statistics stats = m61_get_statistics();
-    printf("alloc count: active %10llu   total %10llu   fail %10llu\n",
-           stats.nactive, stats.ntotal, stats.nfail);
-    printf("alloc size:  active %10llu   total %10llu   fail %10llu\n",
-           stats.active_size, stats.total_size, stats.fail_size);
+/// sizeClass(size_t sz)
+///     Returns the free-index size class for a block of `sz` bytes (`sz > 0`).
+static inline int sizeClass(size_t sz) {
+    return 63 - __builtin_clzl(sz);
 }
 
+/// treapPriority(h)
+///     Returns the heap priority of free block `h` in its treap.
+static inline uint32_t treapPriority(const blockHeader* h) {
+    uintptr_t a = reinterpret_cast<uintptr_t>(h);
+    return uint32_t(((a >> 4) * 0x2545F4914F6CDD1DULL) >> 32);
+}
 
-/// m61_print_leak_report()
-///    Prints a report of all currently-active allocated blocks of dynamic
-///    memory.
+/// treapLess(a, b)
+///     Returns true iff free block `a` sorts before `b` by (size, address).
+static inline bool treapLess(const blockHeader* a, const blockHeader* b) {
+    return a->size < b->size || (a->size == b->size && a < b);
+}
 
-void m61_print_leak_report() {
-    for (const auto& pair : activeAlloc) {
-        std::cout << "LEAK CHECK: " << pair.second.file << ":" 
-            << pair.second.line << ": allocated object " << pair.first
-            << " with size " << pair.second.sz << std::endl;
+/// treapInsert(root, h)
+///     Inserts free block `h` into the treap rooted at `root`; returns the
+///     new root.
+static blockHeader* treapInsert(blockHeader* root, blockHeader* h) {
+    if (!root) {
+        links(h)->left = links(h)->right = nullptr;
+        return h;
+    }
+    if (treapLess(h, root)) {
+        links(root)->left = treapInsert(links(root)->left, h);
+        if (treapPriority(links(root)->left) > treapPriority(root)) {
+            // rotate right
+            blockHeader* l = links(root)->left;
+            links(root)->left = links(l)->right;
+            links(l)->right = root;
+            return l;
+        }
+    } else {
+        links(root)->right = treapInsert(links(root)->right, h);
+        if (treapPriority(links(root)->right) > treapPriority(root)) {
+            // rotate left
+            blockHeader* r = links(root)->right;
+            links(root)->right = links(r)->left;
+            links(r)->left = root;
+            return r;
+        }
+    }
+    return root;
+}
+
+/// treapMerge(a, b)
+///     Merges treaps `a` and `b`, where every node in `a` sorts before every
+///     node in `b`; returns the new root.
+static blockHeader* treapMerge(blockHeader* a, blockHeader* b) {
+    if (!a || !b) {
+        return a ? a : b;
+    }
+    if (treapPriority(a) > treapPriority(b)) {
+        links(a)->right = treapMerge(links(a)->right, b);
+        return a;
+    } else {
+        links(b)->left = treapMerge(a, links(b)->left);
+        return b;
+    }
+}
+
+/// treapErase(root, h)
+///     Removes free block `h` from the treap rooted at `root`; returns the
+///     new root.
+static blockHeader* treapErase(blockHeader* root, blockHeader* h) {
+    if (root == h) {
+        return treapMerge(links(h)->left, links(h)->right);
+    } else if (treapLess(h, root)) {
+        links(root)->left = treapErase(links(root)->left, h);
+    } else {
+        links(root)->right = treapErase(links(root)->right, h);
+    }
+    return root;
+}
+
+/// addFreeBlock(h, size, purged)
+///     Marks the `size`-byte block at `h` as free and adds it to the free
+///     index. The block must not touch any other free block. `purged`
+///     says whether its interior (see `interiorStart`) is all zeros.
+static void addFreeBlock(blockHeader* h, size_t size, bool purged = false) {
+    setBlock(h, size, blockFree);
+    h->sz = purged ? purgedMark : 0;
+    int c = sizeClass(size);
+    freeRoots[c] = treapInsert(freeRoots[c], h);
+    nonemptyClasses |= uint64_t(1) << c;
+}
+
+/// interiorStart(h), interiorEnd(h, size)
+///     Return the bounds of the pages lying wholly inside free block `h`
+///     (of `size` bytes) past its free-index links. These are the pages
+///     purging releases.
+static inline char* interiorStart(blockHeader* h) {
+    return pageUp(payload(h) + sizeof(freeLinks));
+}
+static inline char* interiorEnd(blockHeader* h, size_t size) {
+    return pageDown(reinterpret_cast<char*>(h) + size - sizeof(blockFooter));
+}
+
+/// isPurged(h)
+///     Returns true iff free block `h`'s interior is all zeros.
+static inline bool isPurged(const blockHeader* h) {
+    return h->sz == purgedMark;
+}
+
+/// removeFreeBlock(h)
+///     Removes free block `h` from the free index.
+static void removeFreeBlock(blockHeader* h) {
+    int c = sizeClass(h->size);
+    freeRoots[c] = treapErase(freeRoots[c], h);
+    if (!freeRoots[c]) {
+        nonemptyClasses &= ~(uint64_t(1) << c);
+    }
+}
+
+/// prevFreeBlock(a, h)
+///     Returns the free block immediately before block `h` in arena `a`, or
+///     nullptr if that block is not free (or `h` is the first block).
+static blockHeader* prevFreeBlock(m61_memory_buffer* a, blockHeader* h) {
+    if (reinterpret_cast<char*>(h) == a->buffer) {
+        return nullptr;
+    }
+    size_t prevSize = (reinterpret_cast<blockFooter*>(h) - 1)->size;
+    if (prevSize < minBlockSize
+        || prevSize > size_t(reinterpret_cast<char*>(h) - a->buffer)) {
+        return nullptr;
+    }
+    auto prev = reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) - prevSize);
+    if (blockState(prev) != blockFree || prev->size != prevSize) {
+        return nullptr;
+    }
+    return prev;
+}
+
+/// insertFreedAlloc(h)
+///     Returns block `h` to the free index, coalescing it with free
+///     neighbors and with the unallocated tail of its arena. Arenas that
+///     become empty are returned to the OS; big enough free space is
+///     purged.
+static void insertFreedAlloc(blockHeader* h) {
+    m61_memory_buffer* a = findArena(h);
+    size_t size = h->size;
+    char* freed = reinterpret_cast<char*>(h);
+    blockHeader* purgedNext = nullptr;
+    bool prevPurged = false;
+
+    // Coalesce with next freed block (if possible)
+    blockHeader* next = nextBlock(h);
+    if (reinterpret_cast<char*>(next) < heapEnd(a) && blockState(next) == blockFree) {
+        removeFreeBlock(next);
+        setStartBit(a, next, false);
+        size += next->size;
+        purgedNext = isPurged(next) ? next : nullptr;
+    }
+    // Coalesce with previous freed block (if possible)
+    if (blockHeader* prev = prevFreeBlock(a, h)) {
+        removeFreeBlock(prev);
+        size += prev->size;
+        prevPurged = isPurged(prev);
+        // Leave `h` marked free so a later double free is still recognized
+        h->magic = blockMagic(h) ^ blockFree;
+        setStartBit(a, h, false);
+        h = prev;
+    }
+    // Coalesce with the arena's unallocated tail (if possible)
+    if (reinterpret_cast<char*>(h) + size == heapEnd(a)) {
+        a->pos -= size;
+        h->size = size;
+        h->magic = blockMagic(h) ^ blockFree;
+        setStartBit(a, h, false);
+        if (a->pos == 0 && a != arenas[0].load(std::memory_order_relaxed)) {
+            removeArena(a);
+        } else if (purgeThreshold != 0 && a->zeroed - a->pos >= purgeThreshold) {
+            // Everything past the tail's header becomes never-written space
+            char* start = pageUp(heapEnd(a) + sizeof(blockHeader));
+            purgeRange(start, pageUp(a->buffer + a->zeroed));
+            a->zeroed = start - a->buffer;
+        }
+        return;
+    }
+    // Purge a big enough block, skipping the parts of its neighbors that
+    // are already purged
+    bool purged = purgeThreshold != 0 && size >= purgeThreshold;
+    if (purged) {
+        char* start = interiorStart(h);
+        char* end = interiorEnd(h, size);
+        if (prevPurged) {
+            start = std::max(start, pageDown(freed - sizeof(blockFooter)));
+        }
+        if (purgedNext) {
+            end = std::min(end, interiorStart(purgedNext));
+        }
+        purgeRange(start, end);
+    }
+    addFreeBlock(h, size, purged);
+}
+
+/// findFreeSpace(size_t size)
+///     Finds smallest free block in the free index that is large enough to
+///     accomodate a `size`-byte block, removes it from the index, and
+///     returns it. The caller must split off any leftover space.
+static blockHeader* findFreeSpace(size_t size) {
+    // Look for the best fit in `size`'s own class first; every block in a
+    // higher class is larger than every block in this one
+    int c = sizeClass(size);
+    blockHeader* best = nullptr;
+    for (blockHeader* n = freeRoots[c]; n; ) {
+        if (n->size >= size) {
+            best = n;
+            n = links(n)->left;
+        } else {
+            n = links(n)->right;
+        }
     }
+    if (!best) {
+        // Otherwise the best fit is the smallest block in the next
+        // nonempty class (if any)
+        uint64_t higher = c + 1 < nSizeClasses ? nonemptyClasses >> (c + 1) << (c + 1) : 0;
+        if (higher == 0) {
+            return nullptr;
+        }
+        c = __builtin_ctzll(higher);
+        best = freeRoots[c];
+        while (links(best)->left) {
+            best = links(best)->left;
+        }
+    }
+    removeFreeBlock(best);
+    return best;
 }
 
+/// extendHeapRange(h)
+///     Widens `memory_stats.heap_min` and `heap_max` to cover the payload
+///     of block `h`. The caller must hold `heapLock`.
+static void extendHeapRange(blockHeader* h) {
+    auto addr = reinterpret_cast<uintptr_t>(payload(h));
+    auto endAddr = addr + h->size - tagSize;
+    // Adjust heap_min for intial case or new smallest address
+    if (memory_stats.heap_min == 0 || addr < memory_stats.heap_min) {
+        memory_stats.heap_min = addr;
+    }
+    // Adjust heap_max for new largest address
+    if (endAddr > memory_stats.heap_max) {
+        memory_stats.heap_max = endAddr;
+    }
+}
 
+/// flushDeferred(tc)
+///     Coalesces `tc`'s deferred frees into the central heap. The caller
+///     must hold `heapLock`.
+static void flushDeferred(threadCache* tc) {
+    std::sort(tc->deferred, tc->deferred + tc->ndeferred);
+    for (unsigned i = 0; i != tc->ndeferred; ++i) {
+        insertFreedAlloc(tc->deferred[i]);
+    }
+    tc->ndeferred = 0;
+}
+
+// The part of a newly allocated block known to hold only zeros (empty if
+// `start >= end`)
+struct zeroRange {
+    char* start = nullptr;
+    char* end = nullptr;
+};
+
+/// centralAllocate(size, zero)
+///     Removes a block of at least `size` bytes from the central heap,
+///     marks it `blockCached`, and returns it. Returns nullptr if there is
+///     no room. If `zero` is not null, sets it to a range of the block
+///     that has never been written since it was mapped or purged (and so
+///     is zero). The caller must hold `heapLock`.
+static blockHeader* centralAllocate(size_t size, zeroRange* zero = nullptr) {
+    // Try to fit the allocation into previously freed space
+    blockHeader* h = findFreeSpace(size);
+    if (!h && tcache && tcache->ndeferred != 0) {
+        // Maybe this thread's deferred frees would fit
+        flushDeferred(tcache);
+        h = findFreeSpace(size);
+    }
+    if (h) {
+        bool purged = isPurged(h);
+        if (zero && purged) {
+            zero->start = interiorStart(h);
+            zero->end = std::min(interiorEnd(h, h->size), reinterpret_cast<char*>(h) + size);
+        }
+        // Split off leftover space if it can form a block of its own (its
+        // interior lies within this block's, so stays purged)
+        size_t leftover = h->size - size;
+        if (leftover >= minBlockSize) {
+            addFreeBlock(reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) + size),
+                         leftover, purged);
+        } else {
+            size = h->size;
+        }
+    } else {
+        // If that fails, try new space at the end of an arena, mapping a new
+        // arena if none has room
+        m61_memory_buffer* a = nullptr;
+        for (int i = 0; !a && i != narenas.load(std::memory_order_relaxed); ++i) {
+            a = arenas[i].load(std::memory_order_relaxed);
+            if (a && size > a->size - a->pos) {
+                a = nullptr;
+            }
+        }
+        if (!a && !(a = addArena(size))) {
+            // Not enough space left in the heap for allocation
+            return nullptr;
+        }
+        h = reinterpret_cast<blockHeader*>(heapEnd(a));
+        if (zero) {
+            zero->start = std::max(heapEnd(a), a->buffer + a->zeroed);
+            zero->end = heapEnd(a) + size;
+        }
+        a->pos += size;
+        a->zeroed = std::max(a->zeroed, a->pos);
+    }
+    setBlock(h, size, blockCached);
+    extendHeapRange(h);
+    return h;
+}
+
+/// largeAllocate(size, alignment)
+///     Maps a large block of `size` bytes whose payload is aligned to
+///     `alignment` (a power of two), links it into `largeBlocks`, and
+///     returns it. Returns nullptr if the OS refuses.
+static blockHeader* largeAllocate(size_t size, size_t alignment = 16) {
+    constexpr size_t prefix = sizeof(largeLinks) + sizeof(blockHeader);
+    size_t extra = alignment > prefix ? alignment - prefix : 0;
+    if (size > SIZE_MAX - sizeof(largeLinks) - extra - 4095) {
+        return nullptr;
+    }
+    size_t mapsize = (size + sizeof(largeLinks) + extra + 4095) & ~size_t(4095);
+    void* buf = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (buf == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(buf);
+    uintptr_t ptr = (base + prefix + alignment - 1) & ~(alignment - 1);
+    auto h = headerOf(reinterpret_cast<void*>(ptr));
+    auto l = largeLinksOf(h);
+    setBlock(h, size, blockCached);
+    l->mapsize = mapsize;
+    l->offset = reinterpret_cast<uintptr_t>(l) - base;
+    l->prev = nullptr;
+
+    std::lock_guard<std::mutex> guard(heapLock);
+    l->next = largeBlocks;
+    if (largeBlocks) {
+        largeLinksOf(largeBlocks)->prev = h;
+    }
+    largeBlocks = h;
+    extendHeapRange(h);
+    return h;
+}
+
+/// largeFree(h)
+///     Unlinks large block `h` and returns its memory to the OS.
+static void largeFree(blockHeader* h) {
+    largeLinks* l = largeLinksOf(h);
+    {
+        std::lock_guard<std::mutex> guard(heapLock);
+        if (l->prev) {
+            largeLinksOf(l->prev)->next = l->next;
+        } else {
+            largeBlocks = l->next;
+        }
+        if (l->next) {
+            largeLinksOf(l->next)->prev = l->prev;
+        }
+    }
+    munmap(reinterpret_cast<char*>(l) - l->offset, l->mapsize);
+}
+
+/// findLargeBlock(p)
+///     Returns the large block whose memory contains `p`, or nullptr if
+///     there is none. The caller must hold `heapLock`.
+static blockHeader* findLargeBlock(const char* p) {
+    for (blockHeader* h = largeBlocks; h; h = largeLinksOf(h)->next) {
+        if (p >= reinterpret_cast<char*>(h) && p < reinterpret_cast<char*>(h) + h->size) {
+            return h;
+        }
+    }
+    return nullptr;
+}
+
+/// centralAllocateAligned(size, alignment)
+///     Like centralAllocate(), but the block's payload is aligned to
+///     `alignment` (a power of two greater than 16). The caller must hold
+///     `heapLock`.
+static blockHeader* centralAllocateAligned(size_t size, size_t alignment) {
+    // Over-allocate, then free the space before and after the aligned block
+    blockHeader* h = centralAllocate(size + alignment + minBlockSize);
+    if (!h) {
+        return nullptr;
+    }
+    auto addr = reinterpret_cast<uintptr_t>(payload(h));
+    if (addr % alignment != 0) {
+        size_t lead = ((addr + minBlockSize + alignment - 1) & ~(alignment - 1)) - addr;
+        auto ah = reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) + lead);
+        setBlock(ah, h->size - lead, blockCached);
+        setBlock(h, lead, blockCached);
+        insertFreedAlloc(h);
+        h = ah;
+    }
+    if (h->size - size >= minBlockSize) {
+        auto rest = reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) + size);
+        setBlock(rest, h->size - size, blockCached);
+        setBlock(h, size, blockCached);
+        insertFreedAlloc(rest);
+    }
+    return h;
+}
+
+/// returnCachedBlocks(tc, c, n)
+///     Moves up to `n` blocks from `tc`'s class-`c` list back to the central
+///     heap. The caller must hold `heapLock`.
+static void returnCachedBlocks(threadCache* tc, int c, unsigned n) {
+    while (n != 0 && tc->lists[c]) {
+        blockHeader* h = tc->lists[c];
+        tc->lists[c] = links(h)->left;
+        --tc->counts[c];
+        --n;
+        insertFreedAlloc(h);
+    }
+}
+
+/// flushCache(tc)
+///     Moves every block in `tc` back to the central heap, so it can be
+///     coalesced. The caller must hold `heapLock`.
+static void flushCache(threadCache* tc) {
+    flushDeferred(tc);
+    for (int c = 0; c != nCacheClasses; ++c) {
+        returnCachedBlocks(tc, c, tc->counts[c]);
+    }
+}
+
+/// refillCache(tc, c)
+///     Fetches a batch of class-`c` blocks from the central heap into
+///     `tc`, and returns one more for immediate use (or nullptr if the heap
+///     is full).
+static blockHeader* refillCache(threadCache* tc, int c) {
+    size_t size = cacheClassSize[c];
+    std::lock_guard<std::mutex> guard(heapLock);
+    blockHeader* first = centralAllocate(size);
+    if (!first) {
+        // Coalesce this thread's cached blocks and try again
+        flushCache(tc);
+        first = centralAllocate(size);
+        if (!first) {
+            return nullptr;
+        }
+    }
+    for (unsigned i = 1; i < cacheBatch; ++i) {
+        blockHeader* h = centralAllocate(size);
+        if (!h) {
+            break;
+        } else if (h->size != size) {
+            // Cache lists hold exact sizes only
+            insertFreedAlloc(h);
+            break;
+        }
+        links(h)->left = tc->lists[c];
+        tc->lists[c] = h;
+        ++tc->counts[c];
+    }
+    return first;
+}
+
+/// createCache()
+///     Creates and registers the calling thread's cache. Caches live in
+///     their own mapping, not in the heap they are caching.
+static void destroyCache(void* arg);
+static void openShm(const char* name);
+static void startShmPublisher();
+static threadCache* createCache() {
+    pthread_once(&cacheKeyOnce, [] () {
+        pthread_key_create(&cacheKey, destroyCache);
+        if (getrandom(&heapCanary, sizeof(heapCanary), GRND_NONBLOCK) != sizeof(heapCanary)) {
+            heapCanary = nanotime() * 0x9E3779B97F4A7C15ULL;
+        }
+        if (const char* rate = getenv("M61_SAMPLE_RATE")) {
+            sampleRate = std::max(strtoul(rate, nullptr, 0), 1UL);
+        }
+        if (const char* budget = getenv("M61_QUARANTINE")) {
+            quarantineBudget = strtoull(budget, nullptr, 0);
+        }
+        if (const char* purge = getenv("M61_PURGE")) {
+            purgeThreshold = strtoull(purge, nullptr, 0);
+        }
+        if (const char* mode = getenv("M61_HUGEPAGES")) {
+            if (strcmp(mode, "explicit") == 0) {
+                hugePages = hugePagesExplicit;
+            } else if (strcmp(mode, "thp") == 0 || strcmp(mode, "1") == 0) {
+                hugePages = hugePagesTransparent;
+            }
+        }
+        if (const char* path = getenv("M61_TRACE")) {
+            openTrace(path);
+        }
+        if (const char* name = getenv("M61_SHM")) {
+            openShm(name);
+        }
+    });
+    void* mem = mmap(nullptr, sizeof(threadCache), PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    assert(mem != MAP_FAILED);
+    threadCache* tc = new (mem) threadCache();
+    tc->sampleCountdown = sampleRate;
+    {
+        std::lock_guard<std::mutex> guard(heapLock);
+        tc->stats.next = allShards;
+        allShards = &tc->stats;
+    }
+    pthread_setspecific(cacheKey, tc);
+    tcache = tc;
+    // Started here, not in the pthread_once, so that allocations made by
+    // pthread_create find this cache
+    startShmPublisher();
+    return tc;
+}
+
+/// destroyCache(arg)
+///     Called when a thread exits: returns its cached blocks to the central
+///     heap and folds its statistics into `retiredStats`.
+static void destroyCache(void* arg) {
+    threadCache* tc = static_cast<threadCache*>(arg);
+    {
+        std::lock_guard<std::mutex> guard(heapLock);
+        flushCache(tc);
+        bump(retiredStats.ntotal, tc->stats.ntotal);
+        bump(retiredStats.total_size, tc->stats.total_size);
+        bump(retiredStats.nfreed, tc->stats.nfreed);
+        bump(retiredStats.freed_size, tc->stats.freed_size);
+        bump(retiredStats.nfail, tc->stats.nfail);
+        bump(retiredStats.fail_size, tc->stats.fail_size);
+        bump(retiredStats.ninplace, tc->stats.ninplace);
+        statShard** pp = &allShards;
+        while (*pp != &tc->stats) {
+            pp = &(*pp)->next;
+        }
+        *pp = tc->stats.next;
+    }
+    tc->~threadCache();
+    munmap(tc, sizeof(threadCache));
+    tcache = nullptr;
+}
+
+// Live statistics: if `M61_SHM` names a POSIX shared-memory segment
+// (`1` means `/m61.<pid>`), a background thread publishes the statistics
+// counters and the per-site table into it every `shmIntervalMs`, in the
+// layout of m61shm.hh, for `m61top` to watch. The thread sums the
+// per-thread shards like m61_get_statistics, but holds `heapLock` only
+// to walk the shard and large-block lists, so the program is never
+// paused for long. The segment is unlinked at exit.
+constexpr unsigned shmIntervalMs = 250;
+static m61_shm_segment* shmSegment;
+static char shmName[64];
+static std::atomic<bool> shmPublisherStarted{false};
+
+/// unlinkShm()
+///     Removes the statistics segment's name at exit.
+static void unlinkShm() {
+    shm_unlink(shmName);
+}
+
+/// openShm(name)
+///     Creates and maps the statistics segment `name`.
+static void openShm(const char* name) {
+    if (strcmp(name, "1") == 0) {
+        snprintf(shmName, sizeof(shmName), "/m61.%d", int(getpid()));
+    } else {
+        snprintf(shmName, sizeof(shmName), "%s%s", name[0] == '/' ? "" : "/", name);
+    }
+    int fd = shm_open(shmName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    void* mem = MAP_FAILED;
+    if (ftruncate(fd, sizeof(m61_shm_segment)) == 0) {
+        mem = mmap(nullptr, sizeof(m61_shm_segment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(shmName);
+        return;
+    }
+    shmSegment = new (mem) m61_shm_segment;
+    shmSegment->pid = getpid();
+    shmSegment->interval_ms = shmIntervalMs;
+    atexit(unlinkShm);
+}
+
+/// publishSiteName(dst, file)
+///     Copies site file name `file` into `dst`, keeping its end if it is
+///     too long.
+static void publishSiteName(m61_shm_site& dst, const char* file) {
+    file = file ? file : "?";
+    size_t len = strlen(file);
+    if (len >= m61_shm_filelen) {
+        file += len - (m61_shm_filelen - 1);
+    }
+    strncpy(dst.file, file, m61_shm_filelen - 1);
+}
+
+/// publishShm(nnamed)
+///     Updates the statistics segment. The first `nnamed` sites already
+///     have their names; returns the new number of named sites.
+static size_t publishShm(size_t nnamed) {
+    m61_shm_segment* seg = shmSegment;
+    unsigned long long totals[7] = {};
+    unsigned long long committed = 0;
+    {
+        std::lock_guard<std::mutex> guard(heapLock);
+        for (statShard* s = &retiredStats; s; s = (s == &retiredStats ? allShards : s->next)) {
+            totals[0] += s->ntotal.load(std::memory_order_relaxed);
+            totals[1] += s->total_size.load(std::memory_order_relaxed);
+            totals[2] += s->nfreed.load(std::memory_order_relaxed);
+            totals[3] += s->freed_size.load(std::memory_order_relaxed);
+            totals[4] += s->nfail.load(std::memory_order_relaxed);
+            totals[5] += s->fail_size.load(std::memory_order_relaxed);
+            totals[6] += s->ninplace.load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i != narenas.load(std::memory_order_relaxed); ++i) {
+            if (m61_memory_buffer* a = arenas[i].load(std::memory_order_relaxed)) {
+                committed += a->mapsize;
+            }
+        }
+        for (blockHeader* h = largeBlocks; h; h = largeLinksOf(h)->next) {
+            committed += largeLinksOf(h)->mapsize;
+        }
+    }
+
+    uint64_t seq = seg->seq.load(std::memory_order_relaxed);
+    seg->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->timestamp_ns.store(nanotime(), std::memory_order_relaxed);
+    seg->ntotal.store(totals[0], std::memory_order_relaxed);
+    seg->total_size.store(totals[1], std::memory_order_relaxed);
+    seg->nactive.store(totals[0] - totals[2], std::memory_order_relaxed);
+    seg->active_size.store(totals[1] - totals[3], std::memory_order_relaxed);
+    seg->nfail.store(totals[4], std::memory_order_relaxed);
+    seg->fail_size.store(totals[5], std::memory_order_relaxed);
+    seg->ninplace.store(totals[6], std::memory_order_relaxed);
+    seg->committed_size.store(committed, std::memory_order_relaxed);
+    size_t n = std::min(nInterned.load(std::memory_order_acquire), m61_shm_nsites);
+    for (size_t i = 0; i != n; ++i) {
+        const siteStats& st = sites[siteOrder[i]];
+        m61_shm_site& dst = seg->sites[i];
+        if (i >= nnamed) {
+            publishSiteName(dst, st.file.load(std::memory_order_relaxed));
+            dst.line.store(st.line, std::memory_order_relaxed);
+        }
+        dst.count.store(st.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        dst.bytes.store(st.bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        dst.live.store(st.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        dst.nfreed.store(st.nfreed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    seg->nsites.store(n, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->seq.store(seq + 2, std::memory_order_relaxed);
+    if (seq == 0) {
+        // First update: mark the segment ready
+        seg->magic.store(m61_shm_magic, std::memory_order_release);
+    }
+    return n;
+}
+
+/// startShmPublisher()
+///     Starts the thread that publishes statistics, if `M61_SHM` asked
+///     for one and it is not already running.
+static void startShmPublisher() {
+    if (!shmSegment || shmPublisherStarted.exchange(true)) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, [] (void*) -> void* {
+            size_t nnamed = 0;
+            while (true) {
+                nnamed = publishShm(nnamed);
+                usleep(shmIntervalMs * 1000);
+            }
+            return nullptr;
+        }, nullptr) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+/// canaryFor(h)
+///     Returns the leading guard word for the block with header `h`.
+static inline uint64_t canaryFor(const blockHeader* h) {
+    return heapCanary ^ (reinterpret_cast<uintptr_t>(h) * 0x9E3779B97F4A7C15ULL);
+}
+
+/// writeGuards(h)
+///     Writes the leading and trailing guards of active block `h`.
+static inline void writeGuards(blockHeader* h) {
+    h->canary[0] = h->canary[1] = canaryFor(h);
+    char* ptr = payload(h);
+    std::memset(ptr + h->sz, guardExpression, reinterpret_cast<char*>(footerOf(h)) - (ptr + h->sz));
+}
+
+/// sampleNext(tc)
+///     Returns true iff the calling thread's next allocation is sampled.
+static inline bool sampleNext(threadCache* tc) {
+    if (--tc->sampleCountdown != 0) {
+        return false;
+    }
+    tc->sampleCountdown = sampleRate;
+    return true;
+}
+
+/// activateBlock(h, sz, file, line, sampled)
+///     Marks block `h` as an active `sz`-byte allocation made at
+///     `file`:`line`, counts it, and returns its payload. Sampled blocks
+///     also get a guard and site statistics.
+static void* activateBlock(blockHeader* h, size_t sz, const char* file, int line,
+                           bool sampled) {
+    // Fill in the block's tags and guard
+    h->magic = blockMagic(h) ^ (sampled ? blockActive : blockActiveFast);
+    if (m61_memory_buffer* a = findArena(h)) {
+        setAllocBit(a, h, true);
+    }
+    h->sz = sz;
+    h->file = file;
+    h->line = line;
+    if (sampled) {
+        writeGuards(h);
+    }
+
+    // Handle successful allocation
+    success(sz);
+    if (sampled) {
+        siteAllocated(file, line, sz);
+    }
+    return payload(h);
+}
+
+/// blockSize(sz)
+///     Returns the size of the block that holds a `sz`-byte allocation:
+///     the payload padded for 16-byte alignment, plus tags and guard,
+///     rounded up to its cache class if it has one.
+static inline size_t blockSize(size_t sz) {
+    if (sz <= cacheMaxRequest) {
+        return cacheClassSize[cacheClass(sz)];
+    }
+    return align(sz + tagSize + guardSize);
+}
+
+static void* allocate(size_t sz, const char* file, int line, bool zero);
+static void* allocateAligned(size_t alignment, size_t sz, const char* file, int line);
+static void freePointer(void* ptr, const char* file, int line);
+static void* reallocate(void* ptr, size_t sz, const char* file, int line);
+
+/// m61_malloc(sz, file, line)
+///    Returns a pointer to `sz` bytes of freshly-allocated dynamic memory.
+///    The memory is not initialized. If `sz == 0`, then m61_malloc may
+///    return either `nullptr` or a pointer to a unique allocation.
+///    The allocation request was made at source code location `file`:`line`.
+
+void* m61_malloc(size_t sz, const char* file, int line) {
+    void* ptr = allocate(sz, file, line, false);
+    if (traceFd >= 0) {
+        traceEvent(m61_trace_malloc, file, line, ptr, sz);
+    }
+    return ptr;
+}
+
+/// allocate(sz, file, line, zero)
+///     Implements m61_malloc, and m61_calloc if `zero` is true. Memory
+///     known to be zero already (never-used or purged arena space, or a
+///     new large mapping) is not cleared again, so its pages are not
+///     touched.
+static void* allocate(size_t sz, const char* file, int line, bool zero) {
+    // Guard against overflow when finding the block size
+    if (sz > SIZE_MAX - tagSize - guardSize - 15) {
+        fail(sz);
+        return nullptr;
+    }
+    zeroRange known;
+    threadCache* tc = currentCache();
+    blockHeader* h;
+    int c = cacheClass(std::min(sz, cacheMaxRequest));
+    size_t size = sz <= cacheMaxRequest ? cacheClassSize[c] : blockSize(sz);
+    if (sz <= cacheMaxRequest) {
+        // Small blocks come from this thread's cache when possible
+        h = tc->lists[c];
+        if (h) {
+            tc->lists[c] = links(h)->left;
+            --tc->counts[c];
+        } else {
+            h = refillCache(tc, c);
+        }
+    } else if (size >= largeBlockSize) {
+        // Large blocks get their own mapping
+        h = largeAllocate(size);
+        if (h) {
+            known.start = reinterpret_cast<char*>(h);
+            known.end = known.start + size;
+        }
+    } else {
+        std::lock_guard<std::mutex> guard(heapLock);
+        h = centralAllocate(size, &known);
+        if (!h) {
+            flushCache(tc);
+            h = centralAllocate(size, &known);
+        }
+    }
+    if (!h) {
+        fail(sz);
+        return nullptr;
+    }
+
+    void* ptr = activateBlock(h, sz, file, line, sampleNext(tc));
+    if (zero) {
+        // Clear the parts of the payload not known to be zero
+        char* p = static_cast<char*>(ptr);
+        char* end = p + sz;
+        char* zstart = std::max(known.start, p);
+        char* zend = std::min(known.end, end);
+        if (zstart >= zend) {
+            memset(p, 0, sz);
+        } else {
+            memset(p, 0, zstart - p);
+            memset(zend, 0, end - zend);
+        }
+    }
+    return ptr;
+}
+
+/// m61_aligned_alloc(alignment, sz, file, line)
+///    Like `m61_malloc`, but the returned pointer is a multiple of
+///    `alignment`, which must be a power of two. Returns `nullptr` if
+///    `alignment` is invalid or memory is short.
+
+void* m61_aligned_alloc(size_t alignment, size_t sz, const char* file, int line) {
+    void* ptr = allocateAligned(alignment, sz, file, line);
+    if (traceFd >= 0) {
+        traceEvent(m61_trace_aligned_alloc, file, line, ptr, sz, alignment);
+    }
+    return ptr;
+}
+
+/// allocateAligned(alignment, sz, file, line)
+///     Implements m61_aligned_alloc.
+static void* allocateAligned(size_t alignment, size_t sz, const char* file, int line) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0
+        || alignment > (SIZE_MAX >> 2)
+        || sz > SIZE_MAX - tagSize - guardSize - 15 - alignment - minBlockSize) {
+        fail(sz);
+        return nullptr;
+    } else if (alignment <= 16) {
+        // Every payload is 16-byte aligned
+        return allocate(sz, file, line, false);
+    }
+    size_t size = blockSize(sz);
+    blockHeader* h;
+    if (size + alignment + minBlockSize >= largeBlockSize) {
+        h = largeAllocate(size, alignment);
+    } else {
+        std::lock_guard<std::mutex> guard(heapLock);
+        h = centralAllocateAligned(size, alignment);
+        if (!h) {
+            flushCache(currentCache());
+            h = centralAllocateAligned(size, alignment);
+        }
+    }
+    if (!h) {
+        fail(sz);
+        return nullptr;
+    }
+    return activateBlock(h, sz, file, line, sampleNext(currentCache()));
+}
+
+/// findContainingBlock(p)
+///     Returns the active block whose payload contains `p`, or nullptr if
+///     there is none.
+static blockHeader* findContainingBlock(char* p) {
+    if (blockHeader* h = findLargeBlock(p)) {
+        return isActive(blockState(h)) && p > payload(h)
+            && p < payload(h) + h->sz ? h : nullptr;
+    }
+    m61_memory_buffer* a = findArena(p);
+    if (!a || p >= heapEnd(a) || p <= a->buffer + sizeof(blockHeader)) {
+        return nullptr;
+    }
+    // Active blocks do not overlap, so only the nearest active header
+    // before `p` can contain it. Active arena blocks are smaller than
+    // `largeBlockSize + minBlockSize`, which bounds the scan.
+    size_t g = granuleOf(a, p - sizeof(blockHeader) - 1);
+    size_t lo = g > (largeBlockSize + minBlockSize) / 16
+        ? g - (largeBlockSize + minBlockSize) / 16 : 0;
+    size_t w = g / 64;
+    uint64_t bits = a->allocBits[w].load(std::memory_order_relaxed)
+        & (~uint64_t(0) >> (63 - g % 64));
+    while (bits == 0 && w > lo / 64) {
+        --w;
+        bits = a->allocBits[w].load(std::memory_order_relaxed);
+    }
+    if (bits == 0) {
+        return nullptr;
+    }
+    auto h = reinterpret_cast<blockHeader*>(a->buffer + (w * 64 + 63 - __builtin_clzll(bits)) * 16);
+    return isActive(blockState(h)) && p < payload(h) + h->sz ? h : nullptr;
+}
+
+/// checkActive(ptr, op, file, line, arena)
+///     Checks that `ptr` points to an active allocation, and returns its
+///     header; sets `arena` to its arena (nullptr for a large block).
+///     Otherwise reports the bug for operation `op` (e.g., "free") at
+///     location `file`:`line` and aborts.
+static blockHeader* checkActive(void* ptr, const char* op, const char* file, int line,
+                                m61_memory_buffer*& arena) {
+    // Handle cases where ptr does not point to an active allocation
+    // Three cases: not in heap, double free, invalid free
+    char* p = reinterpret_cast<char*>(ptr);
+    // Handle not in heap case (no payload starts before the first header ends)
+    m61_memory_buffer* a = findArena(p);
+    bool inLarge = false;
+    if (!a) {
+        std::lock_guard<std::mutex> guard(heapLock);
+        inLarge = findLargeBlock(p) != nullptr;
+    }
+    if (a ? p < a->buffer + sizeof(blockHeader) : !inLarge) {
+        std::cerr << "MEMORY BUG: " << file << ":" << line
+            << ": invalid " << op << " of pointer " << ptr << ", not in heap" << std::endl;
+        abort();
+    }
+    blockHeader* h = headerOf(ptr);
+    bool aligned = reinterpret_cast<uintptr_t>(p) % 16 == 0;
+    if (a && aligned && testShadow(a->allocBits, granuleOf(a, h))) {
+        arena = a;
+        return h;
+    }
+    // An inactive block that starts here was freed, unless a slab or
+    // region owns it. A header coalesced away is no longer a start, but it
+    // keeps its free magic.
+    bool start = a && aligned && testShadow(a->startBits, granuleOf(a, h));
+    uint32_t state = aligned ? blockState(h) : 0;
+    bool freed = start ? state != blockSlab && state != blockRegion
+        : state == blockFree || state == blockCached || state == blockQuarantined;
+    if (a || !isActive(state)) {
+        // Handle double frees (ptr was already freed)
+        if (freed) {
+            std::cerr << "MEMORY BUG: " << file << ":" << line
+                << ": invalid " << op << " of pointer " << ptr << ", double free" << std::endl;
+        }
+        else { // Handle invalid frees (ptr was never allocated)
+            std::cerr << "MEMORY BUG: " << file << ":" << line
+                << ": invalid " << op << " of pointer " << ptr << ", not allocated" << std::endl;
+            // Handle case where ptr is inside an active block
+            std::lock_guard<std::mutex> guard(heapLock);
+            if (blockHeader* inside = findContainingBlock(p)) {
+                size_t offset = static_cast<size_t>(p - payload(inside));
+                std::cerr << "  " << inside->file << ":" << inside->line
+                    << ": " << ptr << " is " << offset << " bytes inside a "
+                    << inside->sz << " byte region allocated here" << std::endl;
+            }
+        }
+        abort();
+    }
+    arena = a;
+    return h;
+}
+
+/// filledWith(g, end, byte)
+///     Returns true iff every byte in [g, end) equals `byte`. Compares a
+///     word at a time.
+static inline bool filledWith(const unsigned char* g, const unsigned char* end,
+                              unsigned char byte) {
+    for (; g != end && reinterpret_cast<uintptr_t>(g) % 8 != 0; ++g) {
+        if (*g != byte) {
+            return false;
+        }
+    }
+    uint64_t word = byte * 0x0101010101010101ULL;
+    uint64_t diff = 0;
+    for (; end - g >= 8; g += 8) {
+        uint64_t w;
+        memcpy(&w, g, 8);
+        diff |= w ^ word;
+    }
+    for (; g != end; ++g) {
+        diff |= *g ^ byte;
+    }
+    return diff == 0;
+}
+
+/// checkGuard(h, op, file, line)
+///     Checks the leading and trailing guards of sampled block `h`. If
+///     either was overwritten, reports the bug for operation `op` at
+///     location `file`:`line` and aborts.
+static void checkGuard(blockHeader* h, const char* op, const char* file, int line) {
+    unsigned char* pUnsigned = reinterpret_cast<unsigned char*>(payload(h));
+    unsigned char* guardEnd = reinterpret_cast<unsigned char*>(footerOf(h));
+    uint64_t canary = canaryFor(h);
+    if (((h->canary[0] ^ canary) | (h->canary[1] ^ canary)) != 0
+        || !filledWith(pUnsigned + h->sz, guardEnd, guardExpression)) {
+        std::cerr << "MEMORY BUG: " << file << ":" << line
+            << ": detected wild write during " << op << " of pointer "
+            << static_cast<void*>(pUnsigned) << std::endl;
+        abort();
+    }
+}
+
+static void releaseBlock(m61_memory_buffer* a, blockHeader* h, unsigned long long start,
+                         const char* file, int line);
+
+/// m61_free(ptr, file, line)
+///    Frees the memory allocation pointed to by `ptr`. If `ptr == nullptr`,
+///    does nothing. Otherwise, `ptr` must point to a currently active
+///    allocation returned by `m61_malloc`. The free was called at location
+///    `file`:`line`.
+
+void m61_free(void* ptr, const char* file, int line) {
+    if (traceFd >= 0 && ptr) {
+        traceEvent(m61_trace_free, file, line, ptr, 0);
+    }
+    freePointer(ptr, file, line);
+}
+
+/// freePointer(ptr, file, line)
+///     Implements m61_free.
+static void freePointer(void* ptr, const char* file, int line) {
+    // Handle nullptr case
+    if (ptr == nullptr) {
+        return;
+    }
+    m61_memory_buffer* a;
+    blockHeader* h = checkActive(ptr, "free", file, line, a);
+    unsigned long long start = 0;
+    if (blockState(h) == blockActive) {
+        start = nanotime();
+        checkGuard(h, "free", file, line);
+    }
+    releaseBlock(a, h, start, file, line);
+}
+
+/// evictQuarantine()
+///     Removes the oldest block from the quarantine, checks that it is
+///     still poisoned, and returns it to the central heap. The caller must
+///     hold `heapLock`.
+static void evictQuarantine() {
+    blockHeader* h = quarantine[quarantineHead];
+    quarantineHead = (quarantineHead + 1) % quarantineSlots;
+    --quarantineCount;
+    quarantineBytes -= h->size;
+    auto p = reinterpret_cast<unsigned char*>(payload(h));
+    if (!filledWith(p, reinterpret_cast<unsigned char*>(footerOf(h)), poisonExpression)) {
+        std::cerr << "MEMORY BUG: " << h->file << ":" << h->line
+            << ": detected write to pointer " << static_cast<void*>(p)
+            << " after it was freed here" << std::endl;
+        abort();
+    }
+    setBlock(h, h->size, blockCached);
+    insertFreedAlloc(h);
+}
+
+/// quarantineBlock(h, file, line)
+///     Poisons block `h`, freed at `file`:`line`, and adds it to the
+///     quarantine, evicting old blocks to stay within budget.
+static void quarantineBlock(blockHeader* h, const char* file, int line) {
+    h->magic = blockMagic(h) ^ blockQuarantined;
+    h->file = file;
+    h->line = line;
+    std::memset(payload(h), poisonExpression, reinterpret_cast<char*>(footerOf(h)) - payload(h));
+    std::lock_guard<std::mutex> guard(heapLock);
+    while (quarantineCount != 0
+           && (quarantineCount == quarantineSlots
+               || quarantineBytes + h->size > quarantineBudget)) {
+        evictQuarantine();
+    }
+    if (h->size > quarantineBudget) {
+        setBlock(h, h->size, blockCached);
+        insertFreedAlloc(h);
+        return;
+    }
+    quarantine[(quarantineHead + quarantineCount) % quarantineSlots] = h;
+    ++quarantineCount;
+    quarantineBytes += h->size;
+}
+
+/// releaseBlock(a, h, start, file, line)
+///     Frees active block `h` from arena `a` (nullptr for a large block),
+///     which has already been checked. The free was called at location
+///     `file`:`line`; the free of a sampled block started at time `start`.
+static void releaseBlock(m61_memory_buffer* a, blockHeader* h, unsigned long long start,
+                         const char* file, int line) {
+    threadCache* tc = currentCache();
+    bool sampled = blockState(h) == blockActive;
+    const char* siteFile = h->file;
+    int siteLine = h->line;
+    size_t sz = h->sz;
+    bump(tc->stats.nfreed, 1);
+    bump(tc->stats.freed_size, sz);
+    if (a) {
+        setAllocBit(a, h, false);
+    }
+    if (!a) {
+        largeFree(h);
+    } else if (sampled && quarantineBudget != 0) {
+        quarantineBlock(h, file, line);
+    } else if (h->size <= cacheMaxBlockSize
+               && cacheClassSize[cacheClassForBlock(h->size)] == h->size) {
+        // Small blocks go to this thread's cache
+        int c = cacheClassForBlock(h->size);
+        h->magic = blockMagic(h) ^ blockCached;
+        links(h)->left = tc->lists[c];
+        tc->lists[c] = h;
+        if (++tc->counts[c] > cacheLimit) {
+            std::lock_guard<std::mutex> guard(heapLock);
+            returnCachedBlocks(tc, c, cacheBatch);
+        }
+    } else {
+        // Bigger blocks, and small ones not of a class size, are coalesced
+        // in batches
+        h->magic = blockMagic(h) ^ blockCached;
+        tc->deferred[tc->ndeferred] = h;
+        if (++tc->ndeferred == deferBatch) {
+            std::lock_guard<std::mutex> guard(heapLock);
+            flushDeferred(tc);
+        }
+    }
+    if (sampled) {
+        siteFreed(siteFile, siteLine, sz, nanotime() - start);
+    }
+}
+
+/// m61_free_sized(ptr, sz, file, line)
+///    Like `m61_free`, but the caller also passes the allocation's size
+///    `sz`, which must match the size it was allocated with.
+
+void m61_free_sized(void* ptr, size_t sz, const char* file, int line) {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (traceFd >= 0) {
+        traceEvent(m61_trace_free, file, line, ptr, 0);
+    }
+    m61_memory_buffer* a;
+    blockHeader* h = checkActive(ptr, "free", file, line, a);
+    unsigned long long start = 0;
+    if (blockState(h) == blockActive) {
+        start = nanotime();
+        checkGuard(h, "free", file, line);
+    }
+    if (h->sz != sz) {
+        std::cerr << "MEMORY BUG: " << file << ":" << line
+            << ": invalid free of pointer " << ptr << ", freed with size " << sz
+            << " but allocated with size " << h->sz << std::endl;
+        abort();
+    }
+    releaseBlock(a, h, start, file, line);
+}
+
+/// resizeInPlace(a, h, size)
+///     Tries to change the size of active block `h` in arena `a` to `size`
+///     bytes without moving it, by splitting off its tail or by absorbing
+///     a free block or unallocated space after it. Returns true on success.
+///     The caller must hold `heapLock`.
+static bool resizeInPlace(m61_memory_buffer* a, blockHeader* h, size_t size) {
+    char* end = reinterpret_cast<char*>(h) + h->size;
+    size_t avail = h->size;
+    if (size > avail) {
+        blockHeader* next = reinterpret_cast<blockHeader*>(end);
+        if (end == heapEnd(a) && size - avail <= a->size - a->pos) {
+            // Grow into the arena's unallocated tail
+            a->pos += size - avail;
+            a->zeroed = std::max(a->zeroed, a->pos);
+            avail = size;
+        } else if (end < heapEnd(a) && blockState(next) == blockFree
+                   && size - avail <= next->size) {
+            // Grow into the next block
+            removeFreeBlock(next);
+            setStartBit(a, next, false);
+            avail += next->size;
+        } else {
+            return false;
+        }
+    }
+    // Split off leftover space if it can form a block of its own
+    size_t leftover = avail - size;
+    if (leftover < minBlockSize) {
+        size = avail;
+    }
+    setBlock(h, size, blockActive);
+    if (leftover >= minBlockSize) {
+        auto rest = reinterpret_cast<blockHeader*>(reinterpret_cast<char*>(h) + size);
+        setBlock(rest, leftover, blockCached);
+        insertFreedAlloc(rest);
+    }
+    extendHeapRange(h);
+    return true;
+}
+
+/// resizeLarge(h, size)
+///     Changes the size of large block `h` to `size` bytes, remapping it if
+///     necessary, and returns its (possibly moved) header. Returns nullptr
+///     if the OS refuses.
+static blockHeader* resizeLarge(blockHeader* h, size_t size) {
+    largeLinks* l = largeLinksOf(h);
+    if (l->offset != 0 || size > SIZE_MAX - sizeof(largeLinks) - 4095) {
+        // (mremap would not preserve an over-aligned block's alignment)
+        return nullptr;
+    }
+    size_t mapsize = (size + sizeof(largeLinks) + 4095) & ~size_t(4095);
+    std::lock_guard<std::mutex> guard(heapLock);
+    if (mapsize != l->mapsize) {
+        void* buf = mremap(l, l->mapsize, mapsize, MREMAP_MAYMOVE);
+        if (buf == MAP_FAILED) {
+            return nullptr;
+        }
+        l = reinterpret_cast<largeLinks*>(buf);
+        l->mapsize = mapsize;
+        h = reinterpret_cast<blockHeader*>(l + 1);
+        if (l->prev) {
+            largeLinksOf(l->prev)->next = h;
+        } else {
+            largeBlocks = h;
+        }
+        if (l->next) {
+            largeLinksOf(l->next)->prev = h;
+        }
+    }
+    setBlock(h, size, blockActive);
+    extendHeapRange(h);
+    return h;
+}
+
+/// m61_realloc(ptr, sz, file, line)
+///    Changes the size of the allocation pointed to by `ptr` to `sz` bytes
+///    and returns a pointer to it, preserving its contents up to the
+///    smaller of the old and new sizes. The block is resized in place when
+///    possible and moved otherwise. Behaves like `m61_malloc` if
+///    `ptr == nullptr`, and like `m61_free` (returning `nullptr`) if
+///    `sz == 0`. If out of memory, returns `nullptr` and leaves `ptr`
+///    alone. The request was made at location `file`:`line`.
+
+void* m61_realloc(void* ptr, size_t sz, const char* file, int line) {
+    void* newptr = reallocate(ptr, sz, file, line);
+    if (traceFd >= 0) {
+        traceEvent(m61_trace_realloc, file, line, ptr, sz,
+                   reinterpret_cast<uintptr_t>(newptr));
+    }
+    return newptr;
+}
+
+/// reallocate(ptr, sz, file, line)
+///     Implements m61_realloc.
+static void* reallocate(void* ptr, size_t sz, const char* file, int line) {
+    if (ptr == nullptr) {
+        return allocate(sz, file, line, false);
+    } else if (sz == 0) {
+        freePointer(ptr, file, line);
+        return nullptr;
+    }
+    m61_memory_buffer* a;
+    blockHeader* h = checkActive(ptr, "realloc", file, line, a);
+    bool wasSampled = blockState(h) == blockActive;
+    if (wasSampled) {
+        checkGuard(h, "realloc", file, line);
+    }
+    size_t oldSz = h->sz;
+    size_t size = sz <= SIZE_MAX - tagSize - guardSize - 15 ? blockSize(sz) : 0;
+
+    // Large blocks stay large; others try to grow or shrink in place
+    blockHeader* nh = nullptr;
+    if (size == 0) {
+        // request is too big; fall through to m61_malloc to fail
+    } else if (!a) {
+        if (size >= largeBlockSize) {
+            nh = resizeLarge(h, size);
+        }
+    } else if (size <= h->size && h->size - size < minBlockSize) {
+        // Block is already the right size
+        nh = h;
+    } else if (size > cacheMaxBlockSize || h->size > cacheMaxBlockSize) {
+        // (Small blocks are recycled through exact-size thread caches, so
+        // their neighbors are rarely free; just move them.)
+        std::lock_guard<std::mutex> guard(heapLock);
+        if (size < largeBlockSize && resizeInPlace(a, h, size)) {
+            nh = h;
+        }
+    }
+
+    if (!nh) {
+        // Fall back to allocate, copy, and free
+        void* newptr = allocate(sz, file, line, false);
+        if (newptr) {
+            memcpy(newptr, ptr, std::min(oldSz, sz));
+            freePointer(ptr, file, line);
+        }
+        return newptr;
+    }
+
+    // Resized in place: count a free of the old size and an allocation of
+    // the new size, like a move would. The resized block is sampled.
+    if (wasSampled) {
+        siteFreed(nh->file, nh->line, oldSz, 0);
+    }
+    nh->magic = blockMagic(nh) ^ blockActive;
+    nh->sz = sz;
+    nh->file = file;
+    nh->line = line;
+    writeGuards(nh);
+    statShard& stats = currentCache()->stats;
+    bump(stats.nfreed, 1);
+    bump(stats.freed_size, oldSz);
+    bump(stats.ninplace, 1);
+    success(sz);
+    siteAllocated(file, line, sz);
+    return payload(nh);
+}
+
+/// m61_calloc(count, sz, file, line)
+///    Returns a pointer a fresh dynamic memory allocation big enough to
+///    hold an array of `count` elements of `sz` bytes each. Returned
+///    memory is initialized to zero. The allocation request was at
+///    location `file`:`line`. Returns `nullptr` if out of memory; may
+///    also return `nullptr` if `count == 0` or `size == 0`.
+
+void* m61_calloc(size_t count, size_t sz, const char* file, int line) {
+    // Guard against multiplication overflow
+    if (count != 0 && sz > SIZE_MAX / count) {
+        fail(count * sz);
+        return nullptr;
+    }
+    void* ptr = allocate(count * sz, file, line, true);
+    if (traceFd >= 0) {
+        traceEvent(m61_trace_calloc, file, line, ptr, count * sz);
+    }
+    return ptr;
+}
+
+
+/// m61_usable_size(ptr, file, line)
+///    Returns the size `ptr`'s allocation was requested with. `ptr` must
+///    point to an active allocation. The query was made at `file`:`line`.
+
+size_t m61_usable_size(void* ptr, const char* file, int line) {
+    m61_memory_buffer* a;
+    return checkActive(ptr, "size query", file, line, a)->sz;
+}
+
+
+/// residentBytes(start, size)
+///     Returns how many bytes of the mapping [`start`, `start + size`) are
+///     resident in memory. `start` must be page-aligned.
+static unsigned long long residentBytes(void* start, size_t size) {
+    unsigned char vec[1024];
+    unsigned long long resident = 0;
+    char* p = static_cast<char*>(start);
+    for (size_t off = 0; off < size; off += sizeof(vec) * purgePageSize) {
+        size_t n = std::min(size - off, sizeof(vec) * purgePageSize);
+        if (mincore(p + off, n, vec) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i != (n + purgePageSize - 1) / purgePageSize; ++i) {
+            resident += (vec[i] & 1) * purgePageSize;
+        }
+    }
+    return std::min<unsigned long long>(resident, size);
+}
+
+/// m61_get_statistics()
+///    Return the current memory statistics.
+
+m61_statistics m61_get_statistics() {
+    std::lock_guard<std::mutex> guard(heapLock);
+    m61_statistics stats = memory_stats;
+    unsigned long long nfreed = 0, freed_size = 0;
+    for (statShard* s = &retiredStats; s; s = (s == &retiredStats ? allShards : s->next)) {
+        stats.ntotal += s->ntotal.load(std::memory_order_relaxed);
+        stats.total_size += s->total_size.load(std::memory_order_relaxed);
+        stats.nfail += s->nfail.load(std::memory_order_relaxed);
+        stats.fail_size += s->fail_size.load(std::memory_order_relaxed);
+        stats.ninplace += s->ninplace.load(std::memory_order_relaxed);
+        nfreed += s->nfreed.load(std::memory_order_relaxed);
+        freed_size += s->freed_size.load(std::memory_order_relaxed);
+    }
+    stats.nactive = stats.ntotal - nfreed;
+    stats.active_size = stats.total_size - freed_size;
+    for (int i = 0; i != narenas.load(std::memory_order_relaxed); ++i) {
+        if (m61_memory_buffer* a = arenas[i].load(std::memory_order_relaxed)) {
+            stats.committed_size += a->mapsize;
+        }
+    }
+    for (blockHeader* h = largeBlocks; h; h = largeLinksOf(h)->next) {
+        stats.committed_size += largeLinksOf(h)->mapsize;
+    }
+    return stats;
+}
+
+
+/// m61_get_resident_bytes()
+///    Returns how many heap bytes are resident in memory. `heapLock` is
+///    held only to list a batch of mappings, never while `mincore` measures
+///    them, so allocation proceeds meanwhile; the result is an estimate if
+///    the heap changes during the call.
+
+unsigned long long m61_get_resident_bytes() {
+    struct mapping {
+        void* start;
+        size_t size;
+    };
+    mapping maps[maxArenas];
+    unsigned long long resident = 0;
+    // Batch 0 holds the arenas; later batches hold large blocks, skipping
+    // those measured already
+    size_t skip = 0;
+    for (bool first = true; true; first = false) {
+        size_t n = 0;
+        {
+            std::lock_guard<std::mutex> guard(heapLock);
+            if (first) {
+                for (int i = 0; i != narenas.load(std::memory_order_relaxed); ++i) {
+                    if (m61_memory_buffer* a = arenas[i].load(std::memory_order_relaxed)) {
+                        maps[n++] = {a, a->mapsize};
+                    }
+                }
+            } else {
+                size_t i = 0;
+                for (blockHeader* h = largeBlocks; h && n != maxArenas;
+                     h = largeLinksOf(h)->next, ++i) {
+                    if (i >= skip) {
+                        largeLinks* ll = largeLinksOf(h);
+                        maps[n++] = {reinterpret_cast<char*>(ll) - ll->offset, ll->mapsize};
+                    }
+                }
+            }
+        }
+        // A mapping unmapped since the lock was released fails `mincore`
+        // and counts as nonresident
+        for (size_t i = 0; i != n; ++i) {
+            resident += residentBytes(maps[i].start, maps[i].size);
+        }
+        if (!first) {
+            if (n != maxArenas) {
+                return resident;
+            }
+            skip += n;
+        }
+    }
+}
+
+
+/// m61_print_statistics()
+///    Prints the current memory statistics.
+
+void m61_print_statistics() {
+    m61_statistics stats = m61_get_statistics();
+    printf("alloc count: active %10llu   total %10llu   fail %10llu\n",
+           stats.nactive, stats.ntotal, stats.nfail);
+    printf("alloc size:  active %10llu   total %10llu   fail %10llu\n",
+           stats.active_size, stats.total_size, stats.fail_size);
+}
+
+
+
+/// m61_get_heap_layout()
+///    Returns a snapshot of the heap's layout: where its bytes are and how
+///    fragmented its free space is. Walks every block, so takes time
+///    proportional to the number of blocks.
+
+m61_heap_layout m61_get_heap_layout() {
+    m61_heap_layout layout = {};
+    std::lock_guard<std::mutex> guard(heapLock);
+    for (int i = 0; i != narenas.load(std::memory_order_relaxed); ++i) {
+        m61_memory_buffer* a = arenas[i].load(std::memory_order_relaxed);
+        if (!a) {
+            continue;
+        }
+        ++layout.narenas;
+        layout.heap_size += a->size;
+        layout.heap_used += a->pos;
+        for (char* b = a->buffer; b < heapEnd(a); ) {
+            auto h = reinterpret_cast<blockHeader*>(b);
+            uint32_t state = blockState(h);
+            if (isActive(state)) {
+                layout.active_bytes += h->size;
+            } else if (state == blockFree) {
+                int c = sizeClass(h->size);
+                ++layout.free_count[c];
+                layout.free_bytes[c] += h->size;
+                layout.free_size += h->size;
+                layout.largest_free = std::max<unsigned long long>(layout.largest_free, h->size);
+            } else if (state == blockSlab || state == blockRegion) {
+                layout.pool_bytes += h->size;
+            } else {
+                layout.cached_bytes += h->size;
+            }
+            b += h->size;
+        }
+    }
+    for (blockHeader* h = largeBlocks; h; h = largeLinksOf(h)->next) {
+        ++layout.nlarge;
+        layout.large_bytes += largeLinksOf(h)->mapsize;
+    }
+    if (layout.free_size != 0) {
+        layout.fragmentation = 1.0 - double(layout.largest_free) / layout.free_size;
+    }
+    if (layout.heap_size != 0) {
+        layout.bump_utilization = double(layout.heap_used) / layout.heap_size;
+    }
+    return layout;
+}
+
+
+/// m61_print_heap_layout()
+///    Prints the heap layout, including a histogram of free blocks by
+///    size class.
+
+void m61_print_heap_layout() {
+    m61_heap_layout layout = m61_get_heap_layout();
+    printf("heap: %llu arenas, %llu bytes, %llu used (%.1f%%)\n",
+           layout.narenas, layout.heap_size, layout.heap_used,
+           100 * layout.bump_utilization);
+    printf("heap: active %llu   free %llu   cached %llu   pools %llu   large %llu in %llu\n",
+           layout.active_bytes, layout.free_size, layout.cached_bytes,
+           layout.pool_bytes, layout.large_bytes, layout.nlarge);
+    printf("free: largest %llu   fragmentation %.3f\n",
+           layout.largest_free, layout.fragmentation);
+    for (int c = 0; c != 64; ++c) {
+        if (layout.free_count[c] != 0) {
+            printf("free: [%llu, %llu): %llu blocks, %llu bytes\n",
+                   1ULL << c, c == 63 ? ~0ULL : 2ULL << c,
+                   layout.free_count[c], layout.free_bytes[c]);
+        }
+    }
+}
+
+// Slabs. An m61_slab hands out objects of one size, carved from 64 KiB
+// chunks that it takes from the central heap (as `blockSlab` blocks, so
+// the chunks themselves are neither allocations nor free space). Free
+// objects form an intrusive list: word 0 links to the next free object and
+// word 1 holds `slabFreeMark(obj)`, which is how leak reports and double
+// free checks tell free objects from live ones.
+struct m61_slab {
+    size_t objsize;              // object size, rounded for alignment
+    size_t sz;                   // requested object size
+    const char* file;            // where the slab was created
+    int line;
+    void** freelist;             // free objects
+    char* bump;                  // never-used part of the newest chunk
+    char* bumpEnd;
+    blockHeader* chunks;         // chunk list, linked through payload word 0
+    size_t nlive;                // # live objects
+    m61_slab* prev;              // links in `allSlabs`
+    m61_slab* next;
+};
+
+constexpr size_t slabChunkSize = 64 << 10;
+static m61_slab* allSlabs;
+
+/// slabFreeMark(obj)
+///     Returns the word stored in free slab object `obj`'s second word.
+static inline uintptr_t slabFreeMark(const void* obj) {
+    return (reinterpret_cast<uintptr_t>(obj) * 0x9E3779B97F4A7C15ULL) ^ 0x736C6162ULL;
+}
+
+/// takeBlock(size, state)
+///     Takes a `size`-byte block from the central heap for use by a slab
+///     or region, and marks it with `state`. Returns nullptr if there is
+///     no room.
+static blockHeader* takeBlock(size_t size, uint32_t state) {
+    std::lock_guard<std::mutex> guard(heapLock);
+    blockHeader* h = centralAllocate(size);
+    if (!h) {
+        flushCache(currentCache());
+        h = centralAllocate(size);
+    }
+    if (h) {
+        h->magic = blockMagic(h) ^ state;
+    }
+    return h;
+}
+
+/// slabChunkObjects(slab, chunk, end)
+///     Sets `end` to the end of the carved objects in `chunk` and returns
+///     the first object.
+static char* slabChunkObjects(m61_slab* slab, blockHeader* chunk, char*& end) {
+    char* first = payload(chunk) + 16;
+    if (slab->bump >= first && slab->bump <= reinterpret_cast<char*>(footerOf(chunk))) {
+        end = slab->bump;
+    } else {
+        end = first + (reinterpret_cast<char*>(footerOf(chunk)) - first)
+            / slab->objsize * slab->objsize;
+    }
+    return first;
+}
+
+
+/// m61_slab_create(sz, file, line)
+///    Returns a new slab of `sz`-byte objects, created at `file`:`line`,
+///    or `nullptr` if out of memory or `sz` is too big for a slab (more
+///    than 16 KiB). A slab must be used by one thread at a time.
+
+m61_slab* m61_slab_create(size_t sz, const char* file, int line) {
+    if (sz > slabChunkSize / 4) {
+        return nullptr;
+    }
+    blockHeader* h = takeBlock(blockSize(sizeof(m61_slab)), blockSlab);
+    if (!h) {
+        return nullptr;
+    }
+    m61_slab* slab = new (payload(h)) m61_slab;
+    slab->objsize = std::max(align(sz), size_t(16));
+    slab->sz = sz;
+    slab->file = file;
+    slab->line = line;
+    slab->freelist = nullptr;
+    slab->bump = slab->bumpEnd = nullptr;
+    slab->chunks = nullptr;
+    slab->nlive = 0;
+    std::lock_guard<std::mutex> guard(heapLock);
+    slab->prev = nullptr;
+    slab->next = allSlabs;
+    if (allSlabs) {
+        allSlabs->prev = slab;
+    }
+    allSlabs = slab;
+    return slab;
+}
+
+
+/// m61_slab_alloc(slab)
+///    Returns a new object from `slab`, or `nullptr` if out of memory.
+
+void* m61_slab_alloc(m61_slab* slab) {
+    void** obj = slab->freelist;
+    if (obj) {
+        slab->freelist = static_cast<void**>(obj[0]);
+    } else if (slab->bump != slab->bumpEnd) {
+        obj = reinterpret_cast<void**>(slab->bump);
+        slab->bump += slab->objsize;
+    } else if (blockHeader* chunk = takeBlock(slabChunkSize, blockSlab)) {
+        *reinterpret_cast<blockHeader**>(payload(chunk)) = slab->chunks;
+        slab->chunks = chunk;
+        char* end;
+        obj = reinterpret_cast<void**>(slabChunkObjects(slab, chunk, end));
+        slab->bump = reinterpret_cast<char*>(obj) + slab->objsize;
+        slab->bumpEnd = end;
+    } else {
+        fail(slab->sz);
+        return nullptr;
+    }
+    obj[1] = nullptr;
+    ++slab->nlive;
+    success(slab->sz);
+    return obj;
+}
+
+
+/// m61_slab_free(slab, ptr, file, line)
+///    Returns object `ptr` to `slab`. Does nothing if `ptr == nullptr`.
+///    The free was called at location `file`:`line`.
+
+void m61_slab_free(m61_slab* slab, void* ptr, const char* file, int line) {
+    if (ptr == nullptr) {
+        return;
+    }
+    void** obj = static_cast<void**>(ptr);
+    if (reinterpret_cast<uintptr_t>(obj[1]) == slabFreeMark(obj)) {
+        std::cerr << "MEMORY BUG: " << file << ":" << line
+            << ": invalid free of pointer " << ptr << ", double free" << std::endl;
+        abort();
+    }
+    obj[0] = slab->freelist;
+    obj[1] = reinterpret_cast<void*>(slabFreeMark(obj));
+    slab->freelist = obj;
+    --slab->nlive;
+    statShard& stats = currentCache()->stats;
+    bump(stats.nfreed, 1);
+    bump(stats.freed_size, slab->sz);
+}
+
+
+/// m61_slab_destroy(slab)
+///    Frees `slab`, every object in it, and its memory. Does nothing if
+///    `slab == nullptr`.
+
+void m61_slab_destroy(m61_slab* slab) {
+    if (slab == nullptr) {
+        return;
+    }
+    statShard& stats = currentCache()->stats;
+    bump(stats.nfreed, slab->nlive);
+    bump(stats.freed_size, slab->nlive * slab->sz);
+
+    std::lock_guard<std::mutex> guard(heapLock);
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        allSlabs = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    blockHeader* chunk = slab->chunks;
+    while (chunk) {
+        blockHeader* next = *reinterpret_cast<blockHeader**>(payload(chunk));
+        insertFreedAlloc(chunk);
+        chunk = next;
+    }
+    insertFreedAlloc(headerOf(slab));
+}
+
+
+// Regions. An m61_arena bump-allocates objects of any size from chunks it
+// takes from the central heap (as `blockRegion` blocks), and frees them
+// all at once. Chunks are linked through payload word 0; objects start 16
+// bytes into the payload. Requests too big for a standard chunk get a
+// chunk of their own.
+struct m61_arena {
+    const char* file;            // where the region was begun
+    int line;
+    char* bump;                  // free part of the newest chunk
+    char* bumpEnd;
+    blockHeader* chunks;
+    size_t nlive;                // # objects allocated since reset
+    size_t live_size;            // # bytes in those objects
+    m61_arena* prev;             // links in `allRegions`
+    m61_arena* next;
+};
+
+constexpr size_t regionChunkSize = 64 << 10;
+static m61_arena* allRegions;
+
+
+/// m61_arena_begin(file, line)
+///    Returns a new, empty region begun at `file`:`line`, or `nullptr` if
+///    out of memory. A region must be used by one thread at a time.
+
+m61_arena* m61_arena_begin(const char* file, int line) {
+    blockHeader* h = takeBlock(blockSize(sizeof(m61_arena)), blockRegion);
+    if (!h) {
+        return nullptr;
+    }
+    m61_arena* region = new (payload(h)) m61_arena;
+    region->file = file;
+    region->line = line;
+    region->bump = region->bumpEnd = nullptr;
+    region->chunks = nullptr;
+    region->nlive = region->live_size = 0;
+    std::lock_guard<std::mutex> guard(heapLock);
+    region->prev = nullptr;
+    region->next = allRegions;
+    if (allRegions) {
+        allRegions->prev = region;
+    }
+    allRegions = region;
+    return region;
+}
+
+
+/// m61_arena_alloc(region, sz)
+///    Returns `sz` bytes of uninitialized memory from `region`, aligned to
+///    16 bytes. The memory lasts until the region is reset or destroyed.
+///    Returns `nullptr` if out of memory.
+
+void* m61_arena_alloc(m61_arena* region, size_t sz) {
+    if (sz > SIZE_MAX - tagSize - guardSize - 32 - 15) {
+        fail(sz);
+        return nullptr;
+    }
+    size_t asz = align(sz);
+    if (asz > size_t(region->bumpEnd - region->bump)) {
+        size_t size = std::max(regionChunkSize, blockSize(asz + 16));
+        blockHeader* chunk = takeBlock(size, blockRegion);
+        if (!chunk) {
+            fail(sz);
+            return nullptr;
+        }
+        *reinterpret_cast<blockHeader**>(payload(chunk)) = region->chunks;
+        region->chunks = chunk;
+        region->bump = payload(chunk) + 16;
+        region->bumpEnd = reinterpret_cast<char*>(footerOf(chunk)) - guardSize;
+    }
+    void* ptr = region->bump;
+    region->bump += asz;
+    ++region->nlive;
+    region->live_size += sz;
+    success(sz);
+    return ptr;
+}
+
+
+/// m61_arena_reset(region)
+///    Frees every object allocated from `region`, keeping one chunk for
+///    reuse. Costs O(1) per chunk, not per object.
+
+void m61_arena_reset(m61_arena* region) {
+    statShard& stats = currentCache()->stats;
+    bump(stats.nfreed, region->nlive);
+    bump(stats.freed_size, region->live_size);
+    region->nlive = region->live_size = 0;
+
+    blockHeader* keep = region->chunks;
+    if (keep && keep->size != regionChunkSize) {
+        keep = nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> guard(heapLock);
+        blockHeader* chunk = region->chunks;
+        while (chunk) {
+            blockHeader* next = *reinterpret_cast<blockHeader**>(payload(chunk));
+            if (chunk != keep) {
+                insertFreedAlloc(chunk);
+            }
+            chunk = next;
+        }
+    }
+    region->chunks = keep;
+    if (keep) {
+        *reinterpret_cast<blockHeader**>(payload(keep)) = nullptr;
+        region->bump = payload(keep) + 16;
+        region->bumpEnd = reinterpret_cast<char*>(footerOf(keep)) - guardSize;
+    } else {
+        region->bump = region->bumpEnd = nullptr;
+    }
+}
+
+
+/// m61_arena_destroy(region)
+///    Frees `region` and everything allocated from it. Does nothing if
+///    `region == nullptr`.
+
+void m61_arena_destroy(m61_arena* region) {
+    if (region == nullptr) {
+        return;
+    }
+    m61_arena_reset(region);
+    std::lock_guard<std::mutex> guard(heapLock);
+    if (region->prev) {
+        region->prev->next = region->next;
+    } else {
+        allRegions = region->next;
+    }
+    if (region->next) {
+        region->next->prev = region->prev;
+    }
+    if (region->chunks) {
+        insertFreedAlloc(region->chunks);
+    }
+    insertFreedAlloc(headerOf(region));
+}
+
+
+// Reports with one line per block are written through `reportOut`, a
+// static buffer written to standard output in large pieces (after
+// flushing stdio), so they neither allocate nor flush per line.
+// Protected by `heapLock`.
+struct reportWriter {
+    char buf[1 << 16];
+    size_t len = 0;
+
+    void print(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    void flush();
+};
+static reportWriter reportOut;
+
+/// reportWriter::print(format, ...)
+///     Appends a formatted line to the buffer, flushing first if it does
+///     not fit.
+void reportWriter::print(const char* format, ...) {
+    for (int tries = 0; tries != 2; ++tries) {
+        va_list val;
+        va_start(val, format);
+        size_t room = sizeof(this->buf) - this->len;
+        int n = vsnprintf(this->buf + this->len, room, format, val);
+        va_end(val);
+        if (n >= 0 && size_t(n) < room) {
+            this->len += n;
+            return;
+        }
+        this->flush();
+    }
+}
+
+/// reportWriter::flush()
+///     Writes out the buffer. Uses write(2), not stdio, which might
+///     allocate memory (possibly from this heap) while `heapLock` is held.
+void reportWriter::flush() {
+    for (size_t pos = 0; pos < this->len; ) {
+        ssize_t w = write(STDOUT_FILENO, this->buf + pos, this->len - pos);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            break;
+        }
+        pos += w;
+    }
+    this->len = 0;
+}
+
+/// forEachLeak(visit)
+///     Calls `visit(file, line, ptr, sz)` for every active allocation:
+///     arena blocks in address order, then large blocks, then slab
+///     objects (reported at their slab's creation site), then regions with
+///     live objects (reported as one object holding all of them, since
+///     regions do not track their objects). Requires `heapLock`.
+template <typename F>
+static void forEachLeak(F visit) {
+    for (int i = 0; i != narenas.load(std::memory_order_relaxed); ++i) {
+        m61_memory_buffer* a = arenas[i].load(std::memory_order_relaxed);
+        for (char* b = a ? a->buffer : nullptr; a && b < heapEnd(a); ) {
+            auto h = reinterpret_cast<blockHeader*>(b);
+            if (isActive(blockState(h))) {
+                visit(h->file, h->line, static_cast<void*>(payload(h)), h->sz);
+            }
+            b += h->size;
+        }
+    }
+    for (blockHeader* h = largeBlocks; h; h = largeLinksOf(h)->next) {
+        if (isActive(blockState(h))) {
+            visit(h->file, h->line, static_cast<void*>(payload(h)), h->sz);
+        }
+    }
+    for (m61_slab* slab = allSlabs; slab; slab = slab->next) {
+        for (blockHeader* chunk = slab->chunks; chunk && slab->nlive != 0;
+             chunk = *reinterpret_cast<blockHeader**>(payload(chunk))) {
+            char* end;
+            for (char* obj = slabChunkObjects(slab, chunk, end); obj != end; obj += slab->objsize) {
+                if (reinterpret_cast<uintptr_t*>(obj)[1] != slabFreeMark(obj)) {
+                    visit(slab->file, slab->line, static_cast<void*>(obj), slab->sz);
+                }
+            }
+        }
+    }
+    for (m61_arena* region = allRegions; region; region = region->next) {
+        if (region->nlive != 0) {
+            visit(region->file, region->line, static_cast<void*>(region),
+                  region->live_size);
+        }
+    }
+}
+
+
+/// m61_print_leak_report()
+///    Prints a report of all currently-active allocated blocks of dynamic
+///    memory.
+
+void m61_print_leak_report() {
+    std::lock_guard<std::mutex> guard(heapLock);
+    fflush(stdout);
+    forEachLeak([] (const char* file, int line, void* ptr, size_t sz) {
+        reportOut.print("LEAK CHECK: %s:%d: allocated object %p with size %zu\n",
+                        file, line, ptr, sz);
+    });
+    reportOut.flush();
+}
+
+
+/// m61_print_leak_summary(order)
+///    Prints one line per allocation site with active allocations, giving
+///    their count and total size. Sites are sorted by bytes (biggest
+///    first) or by the address of their lowest allocation. The sites are
+///    tallied in a scratch mapping, not the heap being reported on.
+
+void m61_print_leak_summary(m61_leak_order order) {
+    struct leakSite {
+        const char* file;
+        int line;
+        unsigned long long count;       // 0 if slot unused
+        unsigned long long bytes;
+        uintptr_t first;                // lowest address
+    };
+
+    std::lock_guard<std::mutex> guard(heapLock);
+    size_t nleaks = 0;
+    forEachLeak([&] (const char*, int, void*, size_t) {
+        ++nleaks;
+    });
+    size_t capacity = 16;
+    while (capacity < 2 * nleaks) {
+        capacity *= 2;
+    }
+    size_t nbytes = capacity * sizeof(leakSite);
+    void* mem = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+
+    // Tally leaks by site in an open-addressed table
+    leakSite* table = static_cast<leakSite*>(mem);
+    forEachLeak([&] (const char* file, int line, void* ptr, size_t sz) {
+        size_t i = siteKey(file, line) & (capacity - 1);
+        while (table[i].count != 0
+               && (table[i].file != file || table[i].line != line)) {
+            i = (i + 1) & (capacity - 1);
+        }
+        leakSite& ls = table[i];
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (ls.count == 0) {
+            ls.file = file;
+            ls.line = line;
+            ls.first = addr;
+        }
+        ++ls.count;
+        ls.bytes += sz;
+        ls.first = std::min(ls.first, addr);
+    });
+
+    size_t n = 0;
+    for (size_t i = 0; i != capacity; ++i) {
+        if (table[i].count != 0) {
+            table[n++] = table[i];
+        }
+    }
+    if (order == m61_leak_by_address) {
+        std::sort(table, table + n, [] (const leakSite& a, const leakSite& b) {
+            return a.first < b.first;
+        });
+    } else {
+        std::sort(table, table + n, [] (const leakSite& a, const leakSite& b) {
+            return a.bytes > b.bytes || (a.bytes == b.bytes && a.first < b.first);
+        });
+    }
+
+    fflush(stdout);
+    for (size_t i = 0; i != n; ++i) {
+        reportOut.print("LEAK SUMMARY: %s:%d: %llu objects, %llu bytes, first %p\n",
+                        table[i].file, table[i].line, table[i].count, table[i].bytes,
+                        reinterpret_cast<void*>(table[i].first));
+    }
+    reportOut.flush();
+    munmap(mem, nbytes);
+}
+
+
+/// m61_print_site_report(top_n)
+///    Prints statistics for the `top_n` allocation sites that allocated
+///    the most bytes.
+
+void m61_print_site_report(size_t top_n) {
+    // Collect the interned sites into a scratch mapping (not the heap
+    // being reported on) and pick the biggest
+    size_t nbytes = (nSites + 1) * sizeof(siteStats*);
+    void* mem = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+    siteStats** order = static_cast<siteStats**>(mem);
+    size_t n = 0;
+    for (size_t i = 0; i != nSites; ++i) {
+        if (sites[i].file.load(std::memory_order_acquire)) {
+            order[n++] = &sites[i];
+        }
+    }
+    if (overflowSite.count.load(std::memory_order_relaxed) != 0) {
+        order[n++] = &overflowSite;
+    }
+    top_n = std::min(top_n, n);
+    std::partial_sort(order, order + top_n, order + n, [] (siteStats* a, siteStats* b) {
+        return a->bytes.load(std::memory_order_relaxed) > b->bytes.load(std::memory_order_relaxed);
+    });
+    for (size_t i = 0; i != top_n; ++i) {
+        siteStats* st = order[i];
+        const char* file = st->file.load(std::memory_order_relaxed);
+        unsigned long long nfreed = st->nfreed.load(std::memory_order_relaxed);
+        printf("SITE: %s:%d: %llu allocations, %llu bytes, %llu bytes peak, %llu ns/free\n",
+               file ? file : "?", st->line,
+               st->count.load(std::memory_order_relaxed),
+               st->bytes.load(std::memory_order_relaxed),
+               st->peak.load(std::memory_order_relaxed),
+               nfreed ? st->free_ns.load(std::memory_order_relaxed) / nfreed : 0);
+    }
+    munmap(mem, nbytes);
+}
+
+
+/// m61_print_heavy_hitter_report()
+///    Prints the allocation sites estimated to have allocated the most
+///    bytes, biggest first. Estimates may overcount, never undercount.
+
+void m61_print_heavy_hitter_report() {
+    struct entry {
+        const char* file;
+        int line;
+        unsigned long long bytes;
+    } entries[nHeavyHitters];
+    int n = 0;
+    {
+        std::lock_guard<std::mutex> guard(heavyLock);
+        for (auto& hh : heavyHitters) {
+            if (uint64_t k = hh.key.load(std::memory_order_relaxed)) {
+                entries[n++] = {hh.file, hh.line, sketchEstimate(k)};
+            }
+        }
+    }
+    std::sort(entries, entries + n, [] (const entry& a, const entry& b) {
+        return a.bytes > b.bytes;
+    });
+    for (int i = 0; i != n; ++i) {
+        printf("HEAVY HITTER: %s:%d: ~%llu bytes\n",
+               entries[i].file, entries[i].line, entries[i].bytes);
+    }
+}
+
+
+
+// Snapshots: `m61_snapshot` copies each interned site's live count and
+// bytes, in `siteOrder` order, into a scratch mapping (not the heap being
+// watched). Entry `i` of every snapshot is site `siteOrder[i]`, and later
+// snapshots only add entries, so two snapshots are compared entry by
+// entry. No lock is taken; counters are read one at a time, so a snapshot
+// taken during allocation is only approximately consistent.
+struct m61_heap_snapshot {
+    struct entry {
+        unsigned long long count;       // live allocations
+        unsigned long long bytes;       // live bytes
+    };
+    size_t mapsize;
+    size_t n;                           // # interned sites
+    entry overflow;                     // `overflowSite`
+    entry entries[];
+};
+
+/// snapshotEntry(st)
+///     Returns site `st`'s live count and bytes.
+static m61_heap_snapshot::entry snapshotEntry(const siteStats& st) {
+    // Read frees before allocations so the difference cannot go negative
+    unsigned long long nfreed = st.nfreed.load(std::memory_order_relaxed);
+    unsigned long long count = st.count.load(std::memory_order_relaxed);
+    return {count - std::min(count, nfreed), st.live.load(std::memory_order_relaxed)};
+}
+
+
+/// m61_snapshot()
+///    Captures the live count and bytes of every allocation site.
+
+m61_heap_snapshot* m61_snapshot() {
+    size_t n = nInterned.load(std::memory_order_acquire);
+    size_t mapsize = (sizeof(m61_heap_snapshot) + n * sizeof(m61_heap_snapshot::entry)
+                      + 4095) & ~size_t(4095);
+    void* mem = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    auto snap = new (mem) m61_heap_snapshot;
+    snap->mapsize = mapsize;
+    snap->n = n;
+    for (size_t i = 0; i != n; ++i) {
+        snap->entries[i] = snapshotEntry(sites[siteOrder[i]]);
+    }
+    snap->overflow = snapshotEntry(overflowSite);
+    return snap;
+}
+
+
+/// m61_snapshot_free(snap)
+///    Releases a snapshot.
+
+void m61_snapshot_free(m61_heap_snapshot* snap) {
+    if (snap) {
+        munmap(snap, snap->mapsize);
+    }
+}
+
+
+/// m61_snapshot_diff(a, b, out, n)
+///    Stores the `n` sites that grew the most from snapshot `a` to snapshot
+///    `b` in `out`, and returns the number of sites that changed.
+
+size_t m61_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b,
+                         m61_site_growth* out, size_t n) {
+    static const m61_heap_snapshot empty = {};
+    a = a ? a : &empty;
+    b = b ? b : &empty;
+    size_t nsites = std::max(a->n, b->n);
+    size_t nbytes = (nsites + 1) * sizeof(m61_site_growth);
+    void* mem = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return 0;
+    }
+    auto changed = static_cast<m61_site_growth*>(mem);
+    size_t nchanged = 0;
+    auto compare = [&] (const m61_heap_snapshot::entry* ea,
+                        const m61_heap_snapshot::entry* eb, const siteStats& st) {
+        long long count = (eb ? eb->count : 0) - (ea ? ea->count : 0);
+        long long bytes = (eb ? eb->bytes : 0) - (ea ? ea->bytes : 0);
+        if (count != 0 || bytes != 0) {
+            const char* file = st.file.load(std::memory_order_relaxed);
+            changed[nchanged++] = {file ? file : "?", st.line, count, bytes};
+        }
+    };
+    for (size_t i = 0; i != nsites; ++i) {
+        compare(i < a->n ? &a->entries[i] : nullptr,
+                i < b->n ? &b->entries[i] : nullptr, sites[siteOrder[i]]);
+    }
+    compare(&a->overflow, &b->overflow, overflowSite);
+
+    n = std::min(n, nchanged);
+    std::partial_sort(changed, changed + n, changed + nchanged,
+                      [] (const m61_site_growth& x, const m61_site_growth& y) {
+        return x.bytes > y.bytes || (x.bytes == y.bytes && x.count > y.count);
+    });
+    std::copy(changed, changed + n, out);
+    munmap(mem, nbytes);
+    return nchanged;
+}
+
+
+/// m61_print_snapshot_diff(a, b, top_n)
+///    Prints the `top_n` sites whose live bytes grew the most from `a` to
+///    `b`.
+
+void m61_print_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b,
+                             size_t top_n) {
+    size_t nbytes = std::max(top_n, size_t(1)) * sizeof(m61_site_growth);
+    void* mem = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+    auto growth = static_cast<m61_site_growth*>(mem);
+    size_t n = std::min(top_n, m61_snapshot_diff(a, b, growth, top_n));
+    for (size_t i = 0; i != n; ++i) {
+        printf("GROWTH: %s:%d: %+lld objects, %+lld bytes\n",
+               growth[i].file, growth[i].line, growth[i].count, growth[i].bytes);
+    }
+    munmap(mem, nbytes);
+}
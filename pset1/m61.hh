@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <new>
 #include <random>
+#include <utility>
 
 /// align(size_t sz)
 ///     Rounds up a memory size to the next multiple of 16
@@ -27,12 +28,72 @@ void* m61_malloc(size_t sz, const char* file = __builtin_FILE(), int line = __bu
 ///    Free the memory space pointed to by `ptr`.
 void m61_free(void* ptr, const char* file = __builtin_FILE(), int line = __builtin_LINE());
 
+/// m61_free_sized(ptr, sz, file, line)
+///    Free the memory space pointed to by `ptr`, which holds `sz` bytes.
+void m61_free_sized(void* ptr, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_aligned_alloc(alignment, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory,
+///    aligned to a multiple of `alignment` (a power of two).
+void* m61_aligned_alloc(size_t alignment, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
 /// m61_calloc(count, sz, file, line)
 ///    Return a pointer to newly-allocated dynamic memory big enough to
 ///    hold an array of `count` elements of `sz` bytes each. The memory
 ///    is initialized to zero.
 void* m61_calloc(size_t count, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
 
+/// m61_realloc(ptr, sz, file, line)
+///    Change the size of the allocation pointed to by `ptr` to `sz` bytes,
+///    preserving its contents, and return its (possibly new) address.
+void* m61_realloc(void* ptr, size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_usable_size(ptr, file, line)
+///    Return the size that active allocation `ptr` was requested with.
+size_t m61_usable_size(void* ptr, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+
+/// m61_slab
+///    A pool of same-sized objects carved from the m61 heap.
+struct m61_slab;
+
+/// m61_slab_create(sz, file, line)
+///    Return a new slab of `sz`-byte objects.
+m61_slab* m61_slab_create(size_t sz, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_slab_alloc(slab)
+///    Return a new object from `slab`.
+void* m61_slab_alloc(m61_slab* slab);
+
+/// m61_slab_free(slab, ptr, file, line)
+///    Return object `ptr` to `slab`.
+void m61_slab_free(m61_slab* slab, void* ptr, const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_slab_destroy(slab)
+///    Free `slab` and every object in it.
+void m61_slab_destroy(m61_slab* slab);
+
+
+/// m61_arena
+///    A region of the m61 heap whose objects are freed all at once.
+struct m61_arena;
+
+/// m61_arena_begin(file, line)
+///    Return a new, empty region.
+m61_arena* m61_arena_begin(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+/// m61_arena_alloc(region, sz)
+///    Return `sz` bytes of memory from `region`.
+void* m61_arena_alloc(m61_arena* region, size_t sz);
+
+/// m61_arena_reset(region)
+///    Free every object allocated from `region`.
+void m61_arena_reset(m61_arena* region);
+
+/// m61_arena_destroy(region)
+///    Free `region` and every object in it.
+void m61_arena_destroy(m61_arena* region);
+
 
 /// m61_statistics
 ///    Structure tracking memory statistics.
@@ -45,6 +106,8 @@ struct m61_statistics {
     unsigned long long fail_size;       // # bytes in failed alloc attempts
     uintptr_t heap_min;                 // smallest allocated addr
     uintptr_t heap_max;                 // largest allocated addr
+    unsigned long long ninplace;        // # reallocs resized in place
+    unsigned long long committed_size;  // # bytes mapped for the heap
 };
 
 /// m61_get_statistics()
@@ -55,11 +118,128 @@ m61_statistics m61_get_statistics();
 ///    Print the current memory statistics.
 void m61_print_statistics();
 
+/// m61_get_resident_bytes()
+///    Return the number of heap bytes resident in memory. Much slower than
+///    m61_get_statistics: it asks the OS about every heap page.
+unsigned long long m61_get_resident_bytes();
+
+/// m61_heap_layout
+///    Structure describing where the heap's bytes are.
+struct m61_heap_layout {
+    unsigned long long narenas;         // # arenas
+    unsigned long long heap_size;       // # bytes in arenas
+    unsigned long long heap_used;       // # arena bytes below bump pointers
+    double bump_utilization;            // heap_used / heap_size
+    unsigned long long active_bytes;    // # bytes in active blocks
+    unsigned long long free_size;       // # bytes in free blocks
+    unsigned long long cached_bytes;    // # free bytes held by threads
+                                        // (caches, deferred frees, quarantine)
+    unsigned long long pool_bytes;      // # bytes owned by slabs and regions
+    unsigned long long nlarge;          // # large (separately mapped) blocks
+    unsigned long long large_bytes;     // # bytes mapped for large blocks
+    unsigned long long largest_free;    // size of largest free block
+    double fragmentation;               // 1 - largest_free / free_size
+    unsigned long long free_count[64];  // # free blocks with sizes in
+                                        // [2^c, 2^(c+1)), by class c
+    unsigned long long free_bytes[64];  // # bytes in those blocks
+};
+
+/// m61_get_heap_layout()
+///    Return a snapshot of the heap layout.
+m61_heap_layout m61_get_heap_layout();
+
+/// m61_print_heap_layout()
+///    Print the heap layout.
+void m61_print_heap_layout();
+
 /// m61_print_leak_report()
 ///    Print a report of all currently-active allocated blocks of dynamic
 ///    memory.
 void m61_print_leak_report();
 
+/// m61_print_leak_summary(order)
+///    Print one line per allocation site with active allocations, giving
+///    their count and total size, sorted by `order`.
+enum m61_leak_order {
+    m61_leak_by_bytes,                  // most bytes first
+    m61_leak_by_address                 // lowest allocation first
+};
+void m61_print_leak_summary(m61_leak_order order = m61_leak_by_bytes);
+
+/// m61_print_site_report(top_n)
+///    Print statistics for the `top_n` allocation sites that allocated the
+///    most bytes.
+void m61_print_site_report(size_t top_n = 10);
+
+/// m61_print_heavy_hitter_report()
+///    Print the allocation sites estimated to allocate the most bytes,
+///    using bounded memory however many sites there are.
+void m61_print_heavy_hitter_report();
+
+/// m61_heap_snapshot
+///    The live allocation count and bytes of every allocation site at one
+///    moment, made by `m61_snapshot`. Only sampled allocations (see
+///    `M61_SAMPLE_RATE`) are counted.
+struct m61_heap_snapshot;
+
+/// m61_snapshot()
+///    Capture the live count and bytes of every allocation site, without
+///    walking the heap or stopping other threads. Returns nullptr if
+///    memory is short. Release the result with `m61_snapshot_free`.
+m61_heap_snapshot* m61_snapshot();
+
+/// m61_snapshot_free(snap)
+///    Release a snapshot returned by `m61_snapshot`.
+void m61_snapshot_free(m61_heap_snapshot* snap);
+
+/// m61_site_growth
+///    How one allocation site's live allocations changed between two
+///    snapshots.
+struct m61_site_growth {
+    const char* file;
+    int line;
+    long long count;                    // change in live allocations
+    long long bytes;                    // change in live bytes
+};
+
+/// m61_snapshot_diff(a, b, out, n)
+///    Compare snapshot `a` with later snapshot `b` (`a == nullptr` means
+///    the empty heap at startup). Store the up to `n` changed sites that
+///    grew the most in `out`, biggest growth first, and return the number
+///    of sites that changed, which may be more than `n`.
+size_t m61_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b,
+                         m61_site_growth* out, size_t n);
+
+/// m61_print_snapshot_diff(a, b, top_n)
+///    Print the `top_n` sites whose live bytes grew the most from snapshot
+///    `a` to snapshot `b`.
+void m61_print_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b,
+                             size_t top_n = 10);
+
+
+/// m61_trace_record
+///    One event in an allocation trace. If the `M61_TRACE` environment
+///    variable names a file, every m61_malloc, m61_calloc,
+///    m61_aligned_alloc, m61_realloc, and m61_free call appends a record
+///    to it; the file starts with `m61_trace_magic`. Pointers serve as
+///    allocation IDs, so an ID is reused once its allocation is freed.
+struct m61_trace_record {
+    uint32_t op;                        // m61_trace_op
+    uint32_t site;                      // hash of the call's file:line
+    uint64_t ptr;                       // allocated ptr, or ptr freed/moved
+    uint64_t size;                      // requested bytes (0 for free)
+    uint64_t arg;                       // alignment, or realloc result
+};
+enum m61_trace_op : uint32_t {
+    m61_trace_malloc = 1, m61_trace_calloc, m61_trace_aligned_alloc,
+    m61_trace_free, m61_trace_realloc
+};
+constexpr uint64_t m61_trace_magic = 0x3130656361725436ULL;   // "6Trace01"
+
+/// m61_trace_flush()
+///    Write out any buffered trace records. Called automatically at exit.
+void m61_trace_flush();
+
 
 /// This magic class lets standard C++ containers use your allocator
 /// instead of the system allocator.
@@ -74,8 +254,8 @@ public:
     T* allocate(size_t n) {
         return reinterpret_cast<T*>(m61_malloc(n * sizeof(T), "?", 0));
     }
-    void deallocate(T* ptr, size_t) {
-        m61_free(ptr, "?", 0);
+    void deallocate(T* ptr, size_t n) {
+        m61_free_sized(ptr, n * sizeof(T), "?", 0);
     }
 };
 template <typename T, typename U>
@@ -83,6 +263,78 @@ inline constexpr bool operator==(const m61_allocator<T>&, const m61_allocator<U>
     return true;
 }
 
+/// m61_arena_allocator<T>
+///    Lets standard C++ containers allocate from an m61 region. Memory is
+///    released when the region is reset or destroyed, not by the container.
+template <typename T>
+class m61_arena_allocator {
+public:
+    using value_type = T;
+    m61_arena_allocator(m61_arena* region) noexcept
+        : region_(region) {
+    }
+    template <typename U> m61_arena_allocator(const m61_arena_allocator<U>& x) noexcept
+        : region_(x.region()) {
+    }
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= 16, "m61_arena objects must fit 16-byte alignment");
+        T* ptr = reinterpret_cast<T*>(m61_arena_alloc(region_, n * sizeof(T)));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    void deallocate(T*, size_t) {
+    }
+    m61_arena* region() const noexcept {
+        return region_;
+    }
+
+private:
+    m61_arena* region_;
+};
+template <typename T, typename U>
+inline constexpr bool operator==(const m61_arena_allocator<T>& a, const m61_arena_allocator<U>& b) {
+    return a.region() == b.region();
+}
+template <typename T, typename U>
+inline constexpr bool operator!=(const m61_arena_allocator<T>& a, const m61_arena_allocator<U>& b) {
+    return a.region() != b.region();
+}
+
+/// m61_pool<T>
+///    Creates and destroys `T` objects using an m61 slab.
+template <typename T>
+class m61_pool {
+public:
+    static_assert(alignof(T) <= 16, "m61_pool objects must fit 16-byte alignment");
+
+    m61_pool(const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : slab_(m61_slab_create(sizeof(T), file, line)) {
+    }
+    m61_pool(const m61_pool<T>&) = delete;
+    m61_pool<T>& operator=(const m61_pool<T>&) = delete;
+    ~m61_pool() {
+        m61_slab_destroy(slab_);
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        void* ptr = m61_slab_alloc(slab_);
+        return ptr ? new (ptr) T(std::forward<Args>(args)...) : nullptr;
+    }
+    void destroy(T* ptr) {
+        if (ptr) {
+            ptr->~T();
+            m61_slab_free(slab_, ptr, "?", 0);
+        }
+    }
+
+private:
+    m61_slab* slab_;
+};
+
 /// Returns a random integer between `min` and `max`, using randomness from
 /// `randomness`.
 template <typename Engine, typename T>
@@ -0,0 +1,246 @@
+#include "m61.hh"
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unistd.h>
+// Interpose the C and C++ allocation functions onto m61, so that
+// unmodified programs can run on it:
+//
+//     make libm61.so
+//     LD_PRELOAD=./libm61.so M61_STATS=1 PROGRAM ARGS...
+//
+// Allocation sites are named by their callers' return addresses (as
+// "0x...", line 0), which `addr2line` can turn back into source lines.
+// With `M61_STATS` set, statistics and the heap layout are printed to
+// standard error at exit.
+
+// Site names, interned in a fixed table so naming a site never allocates.
+// Lookups are lock-free; the rare insertion takes `siteNameLock`. When
+// the table fills, new sites share the name "?".
+constexpr size_t nSiteNames = 1 << 16;
+constexpr size_t siteProbeLimit = 64;
+
+struct siteName {
+    std::atomic<uintptr_t> addr{0};
+    char name[24];
+};
+static siteName siteNames[nSiteNames];
+static std::mutex siteNameLock;
+
+/// callerSite(ra)
+///     Returns a stable name for return address `ra`.
+static const char* callerSite(void* ra) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ra);
+    size_t i = ((addr * 0x9E3779B97F4A7C15ULL) >> 48) % nSiteNames;
+    for (size_t probe = 0; probe != siteProbeLimit; ++probe, i = (i + 1) % nSiteNames) {
+        siteName* sn = &siteNames[i];
+        uintptr_t a = sn->addr.load(std::memory_order_acquire);
+        if (a == 0) {
+            std::lock_guard<std::mutex> guard(siteNameLock);
+            a = sn->addr.load(std::memory_order_relaxed);
+            if (a == 0) {
+                snprintf(sn->name, sizeof(sn->name), "%p", ra);
+                sn->addr.store(addr, std::memory_order_release);
+                return sn->name;
+            }
+        }
+        if (a == addr) {
+            return sn->name;
+        }
+    }
+    return "?";
+}
+
+#define M61_SITE callerSite(__builtin_return_address(0)), 0
+
+/// checkResult(ptr)
+///     Sets `errno` to ENOMEM if an allocation failed.
+static inline void* checkResult(void* ptr) {
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+extern "C" {
+
+void* malloc(size_t sz) {
+    return checkResult(m61_malloc(sz, M61_SITE));
+}
+
+void free(void* ptr) {
+    m61_free(ptr, M61_SITE);
+}
+
+void* calloc(size_t count, size_t sz) {
+    return checkResult(m61_calloc(count, sz, M61_SITE));
+}
+
+void* realloc(void* ptr, size_t sz) {
+    void* newptr = m61_realloc(ptr, sz, M61_SITE);
+    return sz == 0 ? newptr : checkResult(newptr);
+}
+
+void* reallocarray(void* ptr, size_t count, size_t sz) {
+    if (count != 0 && sz > SIZE_MAX / count) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return checkResult(m61_realloc(ptr, count * sz, M61_SITE));
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t sz) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* p = m61_aligned_alloc(alignment, sz, M61_SITE);
+    if (!p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t sz) {
+    return checkResult(m61_aligned_alloc(alignment, sz, M61_SITE));
+}
+
+void* memalign(size_t alignment, size_t sz) {
+    return checkResult(m61_aligned_alloc(alignment, sz, M61_SITE));
+}
+
+void* valloc(size_t sz) {
+    return checkResult(m61_aligned_alloc(sysconf(_SC_PAGESIZE), sz, M61_SITE));
+}
+
+void* pvalloc(size_t sz) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    return checkResult(m61_aligned_alloc(pagesize, (sz + pagesize - 1) & ~(pagesize - 1),
+                                         M61_SITE));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return ptr ? m61_usable_size(ptr, M61_SITE) : 0;
+}
+
+}
+
+
+// C++ allocation functions. Sized deletes use plain m61_free: objects
+// allocated by C code or through another operator may legitimately be
+// deleted with a different size.
+
+/// newMemory(sz, file, alignment)
+///     Allocates memory for operator new, calling the new handler and
+///     retrying until it succeeds. Throws std::bad_alloc if there is no
+///     new handler.
+static void* newMemory(size_t sz, const char* file, size_t alignment = 0) {
+    while (true) {
+        void* ptr = alignment ? m61_aligned_alloc(alignment, sz, file, 0)
+            : m61_malloc(sz, file, 0);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+/// newMemoryNothrow(sz, file, alignment)
+///     Like `newMemory`, but returns nullptr instead of throwing.
+static void* newMemoryNothrow(size_t sz, const char* file, size_t alignment = 0) noexcept {
+    try {
+        return newMemory(sz, file, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+#define M61_FILE callerSite(__builtin_return_address(0))
+
+void* operator new(size_t sz) {
+    return newMemory(sz, M61_FILE);
+}
+void* operator new[](size_t sz) {
+    return newMemory(sz, M61_FILE);
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept {
+    return newMemoryNothrow(sz, M61_FILE);
+}
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
+    return newMemoryNothrow(sz, M61_FILE);
+}
+void* operator new(size_t sz, std::align_val_t al) {
+    return newMemory(sz, M61_FILE, size_t(al));
+}
+void* operator new[](size_t sz, std::align_val_t al) {
+    return newMemory(sz, M61_FILE, size_t(al));
+}
+void* operator new(size_t sz, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return newMemoryNothrow(sz, M61_FILE, size_t(al));
+}
+void* operator new[](size_t sz, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return newMemoryNothrow(sz, M61_FILE, size_t(al));
+}
+
+void operator delete(void* ptr) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete[](void* ptr) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    m61_free(ptr, M61_SITE);
+}
+
+
+/// printStatistics()
+///     Prints statistics and the heap layout to standard error at exit if
+///     `M61_STATS` is set. (Standard output may be closed by then.)
+__attribute__((destructor)) static void printStatistics() {
+    if (!getenv("M61_STATS")) {
+        return;
+    }
+    m61_statistics stats = m61_get_statistics();
+    m61_heap_layout layout = m61_get_heap_layout();
+    fprintf(stderr, "m61: alloc count: active %10llu   total %10llu   fail %10llu\n",
+            stats.nactive, stats.ntotal, stats.nfail);
+    fprintf(stderr, "m61: alloc size:  active %10llu   total %10llu   fail %10llu\n",
+            stats.active_size, stats.total_size, stats.fail_size);
+    fprintf(stderr, "m61: heap: %llu arenas, %llu bytes, %llu used (%.1f%%)\n",
+            layout.narenas, layout.heap_size, layout.heap_used,
+            100 * layout.bump_utilization);
+    fprintf(stderr, "m61: heap: active %llu   free %llu   cached %llu   large %llu in %llu\n",
+            layout.active_bytes, layout.free_size, layout.cached_bytes,
+            layout.large_bytes, layout.nlarge);
+    fprintf(stderr, "m61: free: largest %llu   fragmentation %.3f\n",
+            layout.largest_free, layout.fragmentation);
+    fprintf(stderr, "m61: memory: committed %llu   resident %llu\n",
+            stats.committed_size, m61_get_resident_bytes());
+}
@@ -0,0 +1,201 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+// Replay an allocation trace recorded with `M61_TRACE=FILE` against m61
+// or against the system allocator, and report throughput and footprint.
+// Run once per allocator: peak RSS is per process.
+// Usage: m61replay [-s] TRACE
+
+using bench_clock = std::chrono::steady_clock;
+
+struct m61_api {
+    static constexpr const char* name = "m61";
+    static void* malloc(size_t sz, int site) {
+        return m61_malloc(sz, "replay", site);
+    }
+    static void* calloc(size_t sz, int site) {
+        return m61_calloc(1, sz, "replay", site);
+    }
+    static void* aligned_alloc(size_t alignment, size_t sz, int site) {
+        return m61_aligned_alloc(alignment, sz, "replay", site);
+    }
+    static void* realloc(void* ptr, size_t sz, int site) {
+        return m61_realloc(ptr, sz, "replay", site);
+    }
+    static void free(void* ptr, int site) {
+        m61_free(ptr, "replay", site);
+    }
+};
+
+struct system_api {
+    static constexpr const char* name = "system";
+    static void* malloc(size_t sz, int) {
+        return ::malloc(sz);
+    }
+    static void* calloc(size_t sz, int) {
+        return ::calloc(1, sz);
+    }
+    static void* aligned_alloc(size_t alignment, size_t sz, int) {
+        void* ptr;
+        return posix_memalign(&ptr, alignment, sz) == 0 ? ptr : nullptr;
+    }
+    static void* realloc(void* ptr, size_t sz, int) {
+        return ::realloc(ptr, sz);
+    }
+    static void free(void* ptr, int) {
+        ::free(ptr);
+    }
+};
+
+struct live_allocation {
+    void* ptr;
+    size_t sz;
+};
+
+struct replay_result {
+    size_t nops = 0;
+    size_t nskipped = 0;             // frees of IDs the trace never allocated
+    size_t peak_live = 0;            // most requested bytes live at once
+    double time = 0;
+};
+
+static bool read_trace(const char* filename, std::vector<m61_trace_record>& trace) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    uint64_t magic;
+    if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != m61_trace_magic) {
+        fprintf(stderr, "%s: not an m61 trace\n", filename);
+        fclose(f);
+        return false;
+    }
+    m61_trace_record buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(m61_trace_record), 4096, f)) != 0) {
+        trace.insert(trace.end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+}
+
+template <typename A>
+static replay_result replay(const std::vector<m61_trace_record>& trace) {
+    replay_result res;
+    std::unordered_map<uint64_t, live_allocation> live;
+    live.reserve(trace.size() / 2 + 1);
+    size_t live_bytes = 0;
+
+    auto add = [&] (uint64_t id, void* ptr, size_t sz) {
+        if (id != 0 && ptr) {
+            live[id] = {ptr, sz};
+            live_bytes += sz;
+            res.peak_live = std::max(res.peak_live, live_bytes);
+        }
+    };
+    auto find = [&] (uint64_t id) -> live_allocation* {
+        auto it = live.find(id);
+        return it == live.end() ? nullptr : &it->second;
+    };
+
+    auto start = bench_clock::now();
+    for (auto& r : trace) {
+        int site = r.site & 0x7FFFFFFF;
+        switch (r.op) {
+        case m61_trace_malloc:
+            add(r.ptr, A::malloc(r.size, site), r.size);
+            break;
+        case m61_trace_calloc:
+            add(r.ptr, A::calloc(r.size, site), r.size);
+            break;
+        case m61_trace_aligned_alloc:
+            add(r.ptr, A::aligned_alloc(r.arg, r.size, site), r.size);
+            break;
+        case m61_trace_free:
+            if (live_allocation* la = find(r.ptr)) {
+                A::free(la->ptr, site);
+                live_bytes -= la->sz;
+                live.erase(r.ptr);
+            } else {
+                ++res.nskipped;
+            }
+            break;
+        case m61_trace_realloc: {
+            if (r.ptr != 0 && r.size != 0 && r.arg == 0) {
+                // The recorded realloc failed and left its block alone
+                break;
+            }
+            live_allocation* la = r.ptr ? find(r.ptr) : nullptr;
+            if (r.ptr && !la) {
+                ++res.nskipped;
+                break;
+            }
+            void* old = la ? la->ptr : nullptr;
+            if (la) {
+                live_bytes -= la->sz;
+                live.erase(r.ptr);
+            }
+            add(r.arg, A::realloc(old, r.size, site), r.size);
+            break;
+        }
+        default:
+            fprintf(stderr, "bad trace op %u\n", r.op);
+            exit(1);
+        }
+        ++res.nops;
+    }
+    // Free what the traced program leaked so every run ends empty
+    for (auto& it : live) {
+        A::free(it.second.ptr, 0);
+    }
+    std::chrono::duration<double> elapsed = bench_clock::now() - start;
+    res.time = elapsed.count();
+    return res;
+}
+
+template <typename A>
+static void report(const std::vector<m61_trace_record>& trace) {
+    replay_result res = replay<A>(trace);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("{\"allocator\":\"%s\", \"ops\":%zu, \"skipped\":%zu, \"time\":%.6f, "
+           "\"mops_per_sec\":%.3f, \"peak_live_bytes\":%zu, \"peak_rss_kb\":%ld}\n",
+           A::name, res.nops, res.nskipped, res.time,
+           res.nops / res.time / 1e6, res.peak_live, ru.ru_maxrss);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: m61replay [-s] TRACE\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    bool use_system = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            use_system = true;
+        } else {
+            usage();
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+    }
+
+    std::vector<m61_trace_record> trace;
+    if (!read_trace(argv[optind], trace)) {
+        exit(1);
+    }
+    if (use_system) {
+        report<system_api>(trace);
+    } else {
+        report<m61_api>(trace);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef M61SHM_HH
+#define M61SHM_HH 1
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+
+// m61shm.hh
+//    Layout of the POSIX shared-memory segment in which m61 publishes its
+//    live statistics when `M61_SHM` is set, for `m61top` to read. The
+//    publisher increments `seq` before and after each update, so readers
+//    retry while it is odd or changes under them. Every field is read and
+//    written with relaxed atomics.
+
+constexpr uint64_t m61_shm_magic = 0x31306D6873313636ULL;     // "661shm01"
+constexpr size_t m61_shm_nsites = 1 << 16;
+constexpr size_t m61_shm_filelen = 48;
+
+struct m61_shm_site {
+    char file[m61_shm_filelen];         // site file, NUL-terminated; long
+                                        // names keep their last characters
+    std::atomic<int> line;
+    std::atomic<unsigned long long> count;      // # allocations
+    std::atomic<unsigned long long> bytes;      // # bytes allocated
+    std::atomic<unsigned long long> live;       // # bytes currently active
+    std::atomic<unsigned long long> nfreed;     // # frees
+};
+
+struct m61_shm_segment {
+    std::atomic<uint64_t> magic;        // m61_shm_magic once published
+    int32_t pid;                        // publishing process
+    uint32_t interval_ms;               // time between updates
+    std::atomic<uint64_t> seq;          // odd while an update is under way
+    std::atomic<unsigned long long> timestamp_ns;       // CLOCK_MONOTONIC
+    std::atomic<unsigned long long> nactive;
+    std::atomic<unsigned long long> active_size;
+    std::atomic<unsigned long long> ntotal;
+    std::atomic<unsigned long long> total_size;
+    std::atomic<unsigned long long> nfail;
+    std::atomic<unsigned long long> fail_size;
+    std::atomic<unsigned long long> ninplace;
+    std::atomic<unsigned long long> committed_size;
+    std::atomic<size_t> nsites;         // # valid entries in `sites`
+    m61_shm_site sites[m61_shm_nsites];
+};
+
+#endif
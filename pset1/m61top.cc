@@ -0,0 +1,171 @@
+#include "m61shm.hh"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+// Watch the live statistics of a process running with `M61_SHM` set:
+// allocation and free rates, active memory, and the allocation sites
+// whose live bytes are largest, refreshed every INTERVAL seconds. The
+// process is not paused or otherwise disturbed.
+// Usage: m61top [-i INTERVAL] [-n COUNT] [-t TOP] NAME|PID
+//   NAME is the `M61_SHM` segment name; PID means `M61_SHM=1`.
+//   -n COUNT stops after COUNT reports (default: run until interrupted).
+
+struct top_site {
+    const char* file;
+    int line;
+    unsigned long long count;
+    unsigned long long live;
+    unsigned long long nfreed;
+};
+
+struct top_sample {
+    unsigned long long timestamp_ns;
+    unsigned long long nactive, active_size, ntotal, total_size;
+    unsigned long long nfail, committed_size;
+    std::vector<top_site> sites;
+};
+
+/// read_sample(seg, s)
+///    Copies a consistent update of `seg` into `s`, retrying while the
+///    publisher is writing.
+static void read_sample(const m61_shm_segment* seg, top_sample& s) {
+    constexpr auto relaxed = std::memory_order_relaxed;
+    while (true) {
+        uint64_t seq = seg->seq.load(std::memory_order_acquire);
+        if (seq % 2 != 0) {
+            usleep(1000);
+            continue;
+        }
+        s.timestamp_ns = seg->timestamp_ns.load(relaxed);
+        s.nactive = seg->nactive.load(relaxed);
+        s.active_size = seg->active_size.load(relaxed);
+        s.ntotal = seg->ntotal.load(relaxed);
+        s.total_size = seg->total_size.load(relaxed);
+        s.nfail = seg->nfail.load(relaxed);
+        s.committed_size = seg->committed_size.load(relaxed);
+        size_t n = std::min(seg->nsites.load(relaxed), m61_shm_nsites);
+        s.sites.resize(n);
+        for (size_t i = 0; i != n; ++i) {
+            const m61_shm_site& src = seg->sites[i];
+            s.sites[i] = {src.file, src.line.load(relaxed), src.count.load(relaxed),
+                          src.live.load(relaxed), src.nfreed.load(relaxed)};
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seg->seq.load(relaxed) == seq) {
+            return;
+        }
+    }
+}
+
+/// attach(arg)
+///    Maps the segment named by `arg` (a name or a process ID) read-only.
+static const m61_shm_segment* attach(const char* arg) {
+    char name[80];
+    bool is_pid = *arg != '\0';
+    for (const char* s = arg; *s; ++s) {
+        is_pid = is_pid && isdigit((unsigned char) *s);
+    }
+    if (is_pid) {
+        snprintf(name, sizeof(name), "/m61.%s", arg);
+    } else {
+        snprintf(name, sizeof(name), "%s%s", arg[0] == '/' ? "" : "/", arg);
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "m61top: %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    void* mem = mmap(nullptr, sizeof(m61_shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "m61top: %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    auto seg = static_cast<const m61_shm_segment*>(mem);
+    for (int tries = 0; seg->magic.load(std::memory_order_acquire) != m61_shm_magic; ++tries) {
+        if (tries == 50) {
+            fprintf(stderr, "m61top: %s: not an m61 statistics segment\n", name);
+            exit(1);
+        }
+        usleep(100000);
+    }
+    return seg;
+}
+
+/// report(seg, prev, cur, top)
+///    Prints the rates between samples `prev` and `cur` and the `top`
+///    sites with the most live bytes.
+static void report(const m61_shm_segment* seg, const top_sample& prev,
+                   const top_sample& cur, size_t top) {
+    double dt = (cur.timestamp_ns - prev.timestamp_ns) / 1e9;
+    if (dt <= 0) {
+        dt = 1e-9;
+    }
+    unsigned long long nfreed = cur.ntotal - cur.nactive;
+    unsigned long long prev_nfreed = prev.ntotal - prev.nactive;
+    printf("pid %d: %llu active (%llu bytes), %llu bytes committed, %llu failed\n",
+           seg->pid, cur.nactive, cur.active_size, cur.committed_size, cur.nfail);
+    printf("  %.0f allocs/s  %.0f frees/s  %.0f bytes/s allocated\n",
+           (cur.ntotal - prev.ntotal) / dt, (nfreed - prev_nfreed) / dt,
+           (cur.total_size - prev.total_size) / dt);
+
+    std::vector<size_t> order(cur.sites.size());
+    for (size_t i = 0; i != order.size(); ++i) {
+        order[i] = i;
+    }
+    top = std::min(top, order.size());
+    std::partial_sort(order.begin(), order.begin() + top, order.end(),
+                      [&] (size_t a, size_t b) {
+        return cur.sites[a].live > cur.sites[b].live;
+    });
+    printf("  %14s %14s %12s  %s\n", "live bytes", "growth/s", "allocs/s", "site");
+    for (size_t k = 0; k != top; ++k) {
+        const top_site& st = cur.sites[order[k]];
+        // Sites only ever get added, so entry `i` is the same in `prev`
+        const top_site* old = order[k] < prev.sites.size() ? &prev.sites[order[k]] : nullptr;
+        double growth = ((double) st.live - (old ? (double) old->live : 0)) / dt;
+        double allocs = (st.count - (old ? old->count : 0)) / dt;
+        printf("  %14llu %+14.0f %12.0f  %s:%d\n",
+               st.live, growth, allocs, st.file, st.line);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    double interval = 1;
+    long count = -1;
+    size_t top = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:t:")) != -1) {
+        if (opt == 'i') {
+            interval = strtod(optarg, nullptr);
+        } else if (opt == 'n') {
+            count = strtol(optarg, nullptr, 0);
+        } else if (opt == 't') {
+            top = strtoul(optarg, nullptr, 0);
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || interval <= 0) {
+        fprintf(stderr, "Usage: m61top [-i INTERVAL] [-n COUNT] [-t TOP] NAME|PID\n");
+        exit(1);
+    }
+
+    const m61_shm_segment* seg = attach(argv[optind]);
+    top_sample prev, cur;
+    read_sample(seg, prev);
+    for (long n = 0; count < 0 || n != count; ++n) {
+        usleep((useconds_t) (interval * 1e6));
+        read_sample(seg, cur);
+        report(seg, prev, cur, top);
+        std::swap(prev, cur);
+    }
+}
@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that freed blocks are reused in best-fit order.
+
+int main() {
+    // Create three holes of different sizes, separated by active blocks
+    // so they cannot coalesce.
+    void* a = m61_malloc(3000);
+    void* sep1 = m61_malloc(1100);
+    void* b = m61_malloc(2000);
+    void* sep2 = m61_malloc(1100);
+    void* c = m61_malloc(5000);
+    void* sep3 = m61_malloc(1100);
+    m61_free(a);
+    m61_free(c);
+    m61_free(b);
+
+    // Each allocation should land in the smallest hole that fits it.
+    void* p1 = m61_malloc(1900);
+    void* p2 = m61_malloc(2900);
+    void* p3 = m61_malloc(4500);
+    printf("reuse %s %s %s\n", p1 == b ? "yes" : "no",
+           p2 == a ? "yes" : "no", p3 == c ? "yes" : "no");
+
+    m61_free(p1);
+    m61_free(p2);
+    m61_free(p3);
+    m61_free(sep1);
+    m61_free(sep2);
+    m61_free(sep3);
+    m61_print_statistics();
+}
+
+//! reuse yes yes yes
+//! alloc count: active          0   total          9   fail          0
+//! alloc size:  active          0   total      22600   fail          0
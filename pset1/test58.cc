@@ -0,0 +1,41 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <vector>
+// Check that m61 can be used from several threads at once.
+
+static void churn(unsigned seed) {
+    std::default_random_engine randomness(seed);
+    std::vector<int, m61_allocator<int>> v;
+    void* ptrs[32] = {};
+    for (int i = 0; i != 100000; ++i) {
+        int slot = uniform_int(0, 31, randomness);
+        m61_free(ptrs[slot]);
+        size_t sz = uniform_int(1, 2000, randomness);
+        ptrs[slot] = m61_malloc(sz);
+        assert(ptrs[slot]);
+        memset(ptrs[slot], slot, sz);
+        if (i % 1000 == 0) {
+            v.push_back(i);
+        }
+    }
+    for (int slot = 0; slot != 32; ++slot) {
+        m61_free(ptrs[slot]);
+    }
+}
+
+int main() {
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t != 4; ++t) {
+        threads.emplace_back(churn, t);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total ??>=400000??   fail          0
+//! alloc size:  active          0   total        ???   fail          0
@@ -0,0 +1,24 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that the heap grows past its first 8 MiB and shrinks again.
+
+int main() {
+    const size_t nmax = 256;
+    void* ptrs[nmax];
+    for (size_t i = 0; i != nmax; ++i) {
+        ptrs[i] = m61_malloc(64 << 10);
+        assert(ptrs[i]);
+        memset(ptrs[i], int(i), 64 << 10);
+    }
+    for (size_t i = 0; i != nmax; ++i) {
+        assert(reinterpret_cast<unsigned char*>(ptrs[i])[(64 << 10) - 1] == i);
+        m61_free(ptrs[i]);
+    }
+
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total        256   fail          0
+//! alloc size:  active          0   total   16777216   fail          0
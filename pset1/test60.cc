@@ -0,0 +1,24 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that large blocks are reported as leaks and checked on free.
+
+int main() {
+    char* ptr1 = (char*) m61_malloc(100 << 20);
+    char* ptr2 = (char*) m61_malloc(1 << 20);
+    memset(ptr1, 'A', 100 << 20);
+    memset(ptr2, 'B', 1 << 20);
+    m61_free(ptr1);
+    m61_print_statistics();
+    m61_print_leak_report();
+    m61_free(ptr2 + 4096);
+}
+
+//! alloc count: active          1   total          2   fail          0
+//! alloc size:  active    1048576   total  105906176   fail          0
+//! LEAK CHECK: test???.cc:9: allocated object ??? with size 1048576
+//! MEMORY BUG: test???.cc:15: invalid free of pointer ???, not allocated
+//!   test???.cc:9: ??? is 4096 bytes inside a 1048576 byte region allocated here
+//! ???
+//!!ABORT
@@ -0,0 +1,50 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61_realloc: contents survive, and blocks resize in place when
+// the space after them is free.
+
+int main() {
+    // Grow into never-allocated space
+    char* p = (char*) m61_malloc(2000);
+    memset(p, 'A', 2000);
+    char* q = (char*) m61_realloc(p, 5000);
+    assert(q == p);
+    for (int i = 0; i != 2000; ++i) {
+        assert(q[i] == 'A');
+    }
+    memset(q, 'B', 5000);
+
+    // Shrink in place, then grow back into the split-off space
+    char* sep = (char*) m61_malloc(1100);
+    q = (char*) m61_realloc(q, 1500);
+    assert(q == p);
+    q = (char*) m61_realloc(q, 4000);
+    assert(q == p);
+    for (int i = 0; i != 1500; ++i) {
+        assert(q[i] == 'B');
+    }
+
+    // Growing past the separator must move the block
+    char* r = (char*) m61_realloc(q, 20000);
+    assert(r && r != p);
+    for (int i = 0; i != 1500; ++i) {
+        assert(r[i] == 'B');
+    }
+
+    // Null and zero-size cases
+    char* s = (char*) m61_realloc(nullptr, 10);
+    assert(s);
+    assert(m61_realloc(s, 0) == nullptr);
+
+    m61_statistics stat = m61_get_statistics();
+    printf("inplace %llu\n", stat.ninplace);
+    m61_free(r);
+    m61_free(sep);
+    m61_print_statistics();
+}
+
+//! inplace 3
+//! alloc count: active          0   total          7   fail          0
+//! alloc size:  active          0   total      33610   fail          0
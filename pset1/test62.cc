@@ -0,0 +1,40 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <vector>
+// Check m61_aligned_alloc and m61_free_sized.
+
+int main() {
+    void* ptrs[27];
+    int n = 0;
+    for (size_t alignment = 1; alignment <= (1 << 16); alignment <<= 2) {
+        for (size_t sz : {size_t(1), size_t(1000), size_t(300000)}) {
+            char* p = (char*) m61_aligned_alloc(alignment, sz);
+            assert(p);
+            assert(reinterpret_cast<uintptr_t>(p) % alignment == 0);
+            memset(p, 'A', sz);
+            ptrs[n++] = p;
+        }
+    }
+    for (int i = 0; i != n; ++i) {
+        m61_free_sized(ptrs[i], i % 3 == 0 ? 1 : (i % 3 == 1 ? 1000 : 300000));
+    }
+
+    // bad alignments fail
+    assert(m61_aligned_alloc(24, 100) == nullptr);
+    assert(m61_aligned_alloc(0, 100) == nullptr);
+
+    // containers free with sizes
+    {
+        std::vector<int, m61_allocator<int>> v;
+        for (int i = 0; i != 1000; ++i) {
+            v.push_back(i);
+        }
+    }
+
+    m61_statistics stat = m61_get_statistics();
+    printf("active %llu fail %llu\n", stat.nactive, stat.nfail);
+}
+
+//! active 0 fail 2
@@ -0,0 +1,15 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that m61_free_sized detects a size mismatch.
+
+int main() {
+    void* ptr = m61_malloc(2001);
+    m61_free_sized(ptr, 2000);
+    m61_print_statistics();
+}
+
+//! MEMORY BUG: test???.cc:9: invalid free of pointer ???, freed with size 2000 but allocated with size 2001
+//! ???
+//!!ABORT
@@ -0,0 +1,27 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check the per-site statistics report.
+
+int main() {
+    void* ptrs[10];
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = m61_malloc(100, "alpha.cc", 1);
+    }
+    for (int i = 0; i != 10; ++i) {
+        m61_free(ptrs[i]);
+    }
+    for (int i = 0; i != 3; ++i) {
+        ptrs[i] = m61_malloc(1000, "beta.cc", 2);
+    }
+    m61_free(ptrs[0]);
+    void* ptr = m61_malloc(50, "gamma.cc", 3);
+    m61_print_site_report(2);
+    m61_free(ptrs[1]);
+    m61_free(ptrs[2]);
+    m61_free(ptr);
+}
+
+//! SITE: beta.cc:2: 3 allocations, 3000 bytes, 3000 bytes peak, ??? ns/free
+//! SITE: alpha.cc:1: 10 allocations, 1000 bytes, 1000 bytes peak, ??? ns/free
@@ -0,0 +1,23 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that heavy hitters are found among a million allocation sites.
+
+int main() {
+    for (int i = 0; i != 1000000; ++i) {
+        m61_free(m61_malloc(1, "many.cc", i));
+        if (i % 1000 == 0) {
+            m61_free(m61_malloc(1000, "big.cc", 1));
+            m61_free(m61_malloc(500, "big.cc", 2));
+        }
+    }
+    m61_print_heavy_hitter_report();
+    printf("done\n");
+}
+
+//!!TIME
+//! HEAVY HITTER: big.cc:1: ~??{10\d\d\d\d\d}?? bytes
+//! HEAVY HITTER: big.cc:2: ~??{5\d\d\d\d\d}?? bytes
+//! ???
+//! done
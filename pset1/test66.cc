@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check sampling mode: only sampled blocks are guarded and tracked by
+// site, but statistics stay exact.
+
+int main() {
+    setenv("M61_SAMPLE_RATE", "4", 1);
+    char* ptrs[8];
+    for (int i = 0; i != 8; ++i) {
+        ptrs[i] = (char*) m61_malloc(100, "sampled.cc", 1);
+    }
+    // unsampled blocks are not checked
+    for (int i = 0; i != 3; ++i) {
+        ptrs[i][100] = 0;
+        m61_free(ptrs[i]);
+    }
+    m61_print_statistics();
+    m61_print_site_report(1);
+    // sampled blocks are
+    ptrs[3][100] = 0;
+    m61_free(ptrs[3]);
+}
+
+//! alloc count: active          5   total          8   fail          0
+//! alloc size:  active        500   total        800   fail          0
+//! SITE: sampled.cc:1: 2 allocations, 200 bytes, 200 bytes peak, 0 ns/free
+//! MEMORY BUG: test???.cc:23: detected wild write during free of pointer ???
+//!!ABORT
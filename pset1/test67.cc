@@ -0,0 +1,20 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check detection of boundary write errors before the start of a block.
+
+int main() {
+    int* ptr = (int*) m61_malloc(sizeof(int) * 10);
+    fprintf(stderr, "Will free %p\n", ptr);
+    for (int i = 9; i >= -1 /* Whoops! Should be >= 0 */; --i) {
+        ptr[i] = i;
+    }
+    m61_free(ptr);
+    m61_print_statistics();
+}
+
+//! Will free ??{0x\w+}=ptr??
+//! MEMORY BUG???: detected wild write during free of pointer ??ptr??
+//! ???
+//!!ABORT
@@ -0,0 +1,24 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that invalid free inside an allocated block is diagnosed quickly
+// even when there are many active blocks.
+
+int main() {
+    const int n = 500000;
+    static char* ptrs[n];
+    for (int i = 0; i != n; ++i) {
+        ptrs[i] = (char*) m61_malloc(32 + i % 100);
+    }
+    ptrs[n - 1] = (char*) m61_malloc(2308);
+    for (int i = 0; i != 1000; ++i) {
+        m61_free(ptrs[i * 3]);
+    }
+    m61_free(ptrs[n - 1] + 64);
+}
+
+//!!TIME
+//! MEMORY BUG: test???.cc:18: invalid free of pointer ???, not allocated
+//!   test???.cc:14: ??? is 64 bytes inside a 2308 byte region allocated here
+//!!ABORT
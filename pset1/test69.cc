@@ -0,0 +1,22 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that the quarantine delays reuse and detects writes after free.
+
+int main() {
+    setenv("M61_QUARANTINE", "8192", 1);
+    char* ptr = (char*) m61_malloc(100);
+    m61_free(ptr);
+    char* ptr2 = (char*) m61_malloc(100);
+    assert(ptr2 != ptr);
+    m61_free(ptr2);
+    ptr[10] = 'X';              // use after free
+    for (int i = 0; i != 100; ++i) {
+        m61_free(m61_malloc(100));
+    }
+    m61_print_statistics();
+}
+
+//! MEMORY BUG: test???.cc:10: detected write to pointer ??? after it was freed here
+//!!ABORT
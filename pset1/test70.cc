@@ -0,0 +1,49 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61 slabs: objects are distinct, reused, counted in statistics,
+// and reported as leaks.
+
+struct node {
+    node* next;
+    int value;
+    node(int v) : next(nullptr), value(v) {}
+};
+
+int main() {
+    m61_pool<node> pool;
+    node* head = nullptr;
+    for (int i = 0; i != 10000; ++i) {
+        node* n = pool.create(i);
+        assert(n);
+        n->next = head;
+        head = n;
+    }
+    int expected = 9999;
+    while (head->value != 0) {
+        assert(head->value == expected);
+        --expected;
+        node* next = head->next;
+        pool.destroy(head);
+        head = next;
+    }
+    // freed objects are reused
+    node* again = pool.create(1);
+    assert(again);
+    pool.destroy(again);
+
+    m61_slab* slab = m61_slab_create(100);
+    char* leak = (char*) m61_slab_alloc(slab);
+    memset(leak, 0, 100);
+    m61_print_statistics();
+    m61_print_leak_report();
+    m61_slab_destroy(slab);
+    pool.destroy(head);
+}
+
+//! alloc count: active          2   total      10002   fail          0
+//! alloc size:  active        116   total     160116   fail          0
+//! LEAK CHECK: test???.cc:15: allocated object ??? with size 16
+//! LEAK CHECK: test???.cc:36: allocated object ??? with size 100
+//!!UNORDERED
@@ -0,0 +1,41 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <vector>
+// Check m61 regions: bump allocation, bulk reset, and container use.
+
+int main() {
+    m61_arena* region = m61_arena_begin();
+    char* ptrs[1000];
+    for (int i = 0; i != 1000; ++i) {
+        ptrs[i] = (char*) m61_arena_alloc(region, 1 + i);
+        assert(ptrs[i]);
+        assert(reinterpret_cast<uintptr_t>(ptrs[i]) % 16 == 0);
+        memset(ptrs[i], i, 1 + i);
+    }
+    for (int i = 0; i != 1000; ++i) {
+        assert(ptrs[i][i] == char(i));
+    }
+    void* big = m61_arena_alloc(region, 1 << 20);
+    assert(big);
+    memset(big, 0, 1 << 20);
+    m61_arena_reset(region);
+    m61_print_statistics();
+
+    {
+        std::vector<int, m61_arena_allocator<int>> v{m61_arena_allocator<int>(region)};
+        for (int i = 0; i != 1000; ++i) {
+            v.push_back(i);
+        }
+    }
+    m61_print_leak_report();
+    m61_arena_destroy(region);
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total       1001   fail          0
+//! alloc size:  active          0   total    1549076   fail          0
+//! LEAK CHECK: test???.cc:9: allocated object ??? with size 8188
+//! alloc count: active          0   total       1012   fail          0
+//! alloc size:  active          0   total    1557264   fail          0
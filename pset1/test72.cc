@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that m61_calloc zeroes reused memory as well as fresh memory.
+
+static bool all_zero(const char* p, size_t n) {
+    for (size_t i = 0; i != n; ++i) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    for (size_t sz : {size_t(100), size_t(5000), size_t(100000), size_t(1 << 20)}) {
+        char* p = (char*) m61_calloc(sz, 1);
+        assert(p && all_zero(p, sz));
+        memset(p, 'X', sz);
+        m61_free(p);
+        char* q = (char*) m61_calloc(1, sz);
+        assert(q && all_zero(q, sz));
+        m61_free(q);
+    }
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total          8   fail          0
+//! alloc size:  active          0   total    2307352   fail          0
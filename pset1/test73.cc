@@ -0,0 +1,35 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+// Check that deferred frees of medium blocks still coalesce.
+
+int main() {
+    const int n = 100;
+    void* ptrs[n];
+    for (int i = 0; i != n; ++i) {
+        ptrs[i] = m61_malloc(2000);
+        assert(ptrs[i]);
+    }
+    void* sep = m61_malloc(2000);
+    std::sort(ptrs, ptrs + n);
+    void* lowest = ptrs[0];
+
+    std::default_random_engine randomness(61);
+    std::shuffle(ptrs, ptrs + n, randomness);
+    for (int i = 0; i != n; ++i) {
+        m61_free(ptrs[i]);
+    }
+
+    // the freed blocks form one region big enough for this
+    void* big = m61_malloc(190000);
+    printf("coalesced %s\n", big == lowest ? "yes" : "no");
+    m61_free(big);
+    m61_free(sep);
+    m61_print_statistics();
+}
+
+//! coalesced yes
+//! alloc count: active          0   total        102   fail          0
+//! alloc size:  active          0   total     392000   fail          0
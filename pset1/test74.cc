@@ -0,0 +1,29 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check m61_get_heap_layout after freeing every other block.
+
+int main() {
+    void* ptrs[20];
+    for (int i = 0; i != 20; ++i) {
+        ptrs[i] = m61_malloc(4000);
+    }
+    for (int i = 0; i < 20; i += 2) {
+        m61_free(ptrs[i]);
+    }
+    void* flush = m61_malloc(100000);   // misses, so deferred frees land
+    m61_heap_layout layout = m61_get_heap_layout();
+    printf("free blocks %llu, largest %llu, free bytes %llu\n",
+           layout.free_count[11], layout.largest_free, layout.free_size);
+    printf("fragmentation %.2f\n", layout.fragmentation);
+    assert(layout.heap_used <= layout.heap_size);
+    assert(layout.active_bytes >= 10 * 4000 + 100000);
+    for (int i = 1; i < 20; i += 2) {
+        m61_free(ptrs[i]);
+    }
+    m61_free(flush);
+}
+
+//! free blocks 10, largest 4080, free bytes 40800
+//! fragmentation 0.90
@@ -0,0 +1,49 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+// Check allocation tracing: each public call appends one record, and
+// internal work (realloc moving a block) adds none.
+
+int main() {
+    char path[] = "/tmp/m61trace.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    setenv("M61_TRACE", path, 1);
+
+    void* a = m61_malloc(100);
+    void* b = m61_calloc(4, 25);
+    void* c = m61_aligned_alloc(4096, 10);
+    a = m61_realloc(a, 5000);
+    m61_free(b);
+    m61_free_sized(c, 10);
+    m61_free(nullptr);
+    m61_free(a);
+    m61_trace_flush();
+
+    FILE* f = fopen(path, "rb");
+    assert(f);
+    uint64_t magic;
+    assert(fread(&magic, sizeof(magic), 1, f) == 1 && magic == m61_trace_magic);
+    m61_trace_record r;
+    int n = 0;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        printf("%d: op %u size %" PRIu64 " arg %s\n", n, r.op, r.size,
+               r.op == m61_trace_aligned_alloc ? std::to_string(r.arg).c_str()
+               : r.arg ? "ptr" : "0");
+        ++n;
+    }
+    fclose(f);
+    unlink(path);
+}
+
+//! 0: op 1 size 100 arg 0
+//! 1: op 2 size 100 arg 0
+//! 2: op 3 size 10 arg 4096
+//! 3: op 5 size 5000 arg ptr
+//! 4: op 4 size 0 arg 0
+//! 5: op 4 size 0 arg 0
+//! 6: op 4 size 0 arg 0
@@ -0,0 +1,23 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check the leak summary: leaks are grouped by site and sorted.
+
+int main() {
+    for (int i = 0; i != 1000; ++i) {
+        m61_malloc(10, "small.cc", 1);
+    }
+    for (int i = 0; i != 3; ++i) {
+        m61_malloc(5000, "big.cc", 2);
+    }
+    void* p = m61_malloc(100, "freed.cc", 3);
+    m61_free(p);
+    m61_print_leak_summary();
+    m61_print_leak_summary(m61_leak_by_address);
+}
+
+//! LEAK SUMMARY: big.cc:2: 3 objects, 15000 bytes, first ??{0x\w+}=big??
+//! LEAK SUMMARY: small.cc:1: 1000 objects, 10000 bytes, first ??{0x\w+}=small??
+//! LEAK SUMMARY: small.cc:1: 1000 objects, 10000 bytes, first ??small??
+//! LEAK SUMMARY: big.cc:2: 3 objects, 15000 bytes, first ??big??
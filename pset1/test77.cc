@@ -0,0 +1,44 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check purging: big free ranges are returned to the OS, and calloc
+// does not touch (or need to clear) purged memory.
+
+int main() {
+    const int n = 60;
+    char* ptrs[n + 1];
+    for (int i = 0; i != n + 1; ++i) {
+        ptrs[i] = (char*) m61_malloc(100000);
+        memset(ptrs[i], 'A', 100000);
+    }
+    unsigned long long before = m61_get_resident_bytes();
+    assert(m61_get_statistics().committed_size >= before);
+    // Free all but the last block. Frees are deferred and coalesced in
+    // batches; the first batch forms a free block of over 3 MB that is
+    // not at the end of the heap
+    for (int i = 0; i != n; ++i) {
+        m61_free(ptrs[i]);
+    }
+    unsigned long long after = m61_get_resident_bytes();
+    printf("purged at least 3 MB: %s\n",
+           before - after >= (3 << 20) ? "yes" : "no");
+
+    // Memory carved from the purged block is zero and stays unbacked
+    char* p = (char*) m61_calloc(1, 200000);
+    unsigned long long zeroed = m61_get_resident_bytes();
+    bool allzero = true;
+    for (int i = 0; i != 200000; ++i) {
+        allzero = allzero && p[i] == 0;
+    }
+    printf("calloc zero: %s\n", allzero ? "yes" : "no");
+    printf("calloc left some pages untouched: %s\n",
+           zeroed - after < 100000 ? "yes" : "no");
+
+    m61_free(p);
+    m61_free(ptrs[n]);
+}
+
+//! purged at least 3 MB: yes
+//! calloc zero: yes
+//! calloc left some pages untouched: yes
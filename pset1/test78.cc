@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include "hexdump.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check hexdump formatting and hexdump_diff.
+
+int main() {
+    char* a = (char*) m61_malloc(100);
+    char* b = (char*) m61_malloc(100);
+    for (int i = 0; i != 100; ++i) {
+        a[i] = b[i] = 'A' + i % 26;
+    }
+    a[10] = 0;
+    b[40] = '\n';
+    b[99] = '!';
+    fhexdump_at(stdout, 0x1000, a, 20);
+    hexdump_diff(a, b, 100);
+    m61_free(a);
+    m61_free(b);
+}
+
+//! 00001000  41 42 43 44 45 46 47 48  49 4a 00 4c 4d 4e 4f 50  |ABCDEFGHIJ.LMNOP|
+//! 00001010  51 52 53 54                                       |QRST|
+//! - 00000000  41 42 43 44 45 46 47 48  49 4a 00 4c 4d 4e 4f 50  |ABCDEFGHIJ.LMNOP|
+//! + 00000000  41 42 43 44 45 46 47 48  49 4a 4b 4c 4d 4e 4f 50  |ABCDEFGHIJKLMNOP|
+//! - 00000020  47 48 49 4a 4b 4c 4d 4e  4f 50 51 52 53 54 55 56  |GHIJKLMNOPQRSTUV|
+//! + 00000020  47 48 49 4a 4b 4c 4d 4e  0a 50 51 52 53 54 55 56  |GHIJKLMN.PQRSTUV|
+//! - 00000060  53 54 55 56                                       |STUV|
+//! + 00000060  53 54 55 21                                       |STU!|
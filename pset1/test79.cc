@@ -0,0 +1,45 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check heap snapshots: a diff reports the sites whose live memory changed.
+
+int main() {
+    void* keep[100];
+    for (int i = 0; i != 100; ++i) {
+        keep[i] = m61_malloc(10, "steady.cc", 1);
+    }
+    m61_heap_snapshot* before = m61_snapshot();
+    assert(before);
+
+    void* leaks[50];
+    for (int i = 0; i != 50; ++i) {
+        leaks[i] = m61_malloc(100, "leaky.cc", 2);
+    }
+    for (int i = 0; i != 20; ++i) {
+        m61_free(keep[i]);
+    }
+    void* p = m61_malloc(7, "transient.cc", 3);
+    m61_free(p);
+    m61_heap_snapshot* after = m61_snapshot();
+
+    m61_site_growth growth[4];
+    size_t n = m61_snapshot_diff(before, after, growth, 4);
+    printf("%zu changed\n", n);
+    m61_print_snapshot_diff(before, after);
+    m61_print_snapshot_diff(nullptr, before, 1);
+
+    m61_snapshot_free(before);
+    m61_snapshot_free(after);
+    for (int i = 20; i != 100; ++i) {
+        m61_free(keep[i]);
+    }
+    for (int i = 0; i != 50; ++i) {
+        m61_free(leaks[i]);
+    }
+}
+
+//! 2 changed
+//! GROWTH: leaky.cc:2: +50 objects, +5000 bytes
+//! GROWTH: steady.cc:1: -20 objects, -200 bytes
+//! GROWTH: steady.cc:1: +100 objects, +1000 bytes
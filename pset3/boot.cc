@@ -28,7 +28,7 @@
 
 extern "C" {
 [[noreturn]] void boot();
-static void boot_readsect(uintptr_t dst, uint32_t src_sect);
+static void boot_readsect(uintptr_t dst, uint32_t src_sect, uint32_t nsect);
 static void boot_readseg(uintptr_t dst, uint32_t src_sect,
                          size_t filesz, size_t memsz);
 }
@@ -76,9 +76,7 @@ static void boot_readseg(uintptr_t ptr, uint32_t src_sect,
     ptr &= ~(SECTORSIZE - 1);
 
     // read sectors
-    for (; ptr < end_ptr; ptr += SECTORSIZE, ++src_sect) {
-        boot_readsect(ptr, src_sect);
-    }
+    boot_readsect(ptr, src_sect, (end_ptr - ptr + SECTORSIZE - 1) / SECTORSIZE);
 
     // clear bss segment
     for (; end_ptr < memsz; ++end_ptr) {
@@ -98,20 +96,37 @@ static void boot_waitdisk() {
 }
 
 
-// boot_readsect(dst, src_sect)
-//    Read disk sector number `src_sect` into address `dst`.
-static void boot_readsect(uintptr_t dst, uint32_t src_sect) {
-    // programmed I/O for "read sector"
+// boot_readcmd(src_sect, nsect)
+//    Start reading `nsect % 256` disk sectors (256 if 0) at number
+//    `src_sect`. A separate function keeps the compiler from holding every
+//    port number in a register around `boot_readsect`'s loops, which would
+//    not fit in the boot sector.
+__noinline static void boot_readcmd(uint32_t src_sect, uint32_t nsect) {
+    // programmed I/O for "read sectors"
     boot_waitdisk();
-    outb(0x1F2, 1);             // send `count = 1` as an ATA argument
+    outb(0x1F2, nsect);         // send `count = nsect` as an ATA argument
     outb(0x1F3, src_sect);      // send `src_sect`, the sector number
     outb(0x1F4, src_sect >> 8);
     outb(0x1F5, src_sect >> 16);
     outb(0x1F6, (src_sect >> 24) | 0xE0);
     outb(0x1F7, 0x20);          // send the command: 0x20 = read sectors
+}
 
-    // then move the data into memory
-    boot_waitdisk();
-    // read 128 words from the disk
-    insl(0x1F0, reinterpret_cast<void*>(dst), SECTORSIZE/4);
+
+// boot_readsect(dst, src_sect, nsect)
+//    Read `nsect` disk sectors, starting at number `src_sect`, into
+//    address `dst`. Each command reads up to 256 sectors, rather than
+//    one, so the kernel arrives with a few commands, not one per sector.
+static void boot_readsect(uintptr_t dst, uint32_t src_sect, uint32_t nsect) {
+    while (nsect != 0) {
+        boot_readcmd(src_sect, nsect);
+        // then move the data into memory, a sector at a time
+        do {
+            boot_waitdisk();
+            // read 128 words from the disk
+            insl(0x1F0, reinterpret_cast<void*>(dst), SECTORSIZE/4);
+            dst += SECTORSIZE;
+            ++src_sect;
+        } while (--nsect % 256 != 0);
+    }
 }
@@ -1,6 +1,7 @@
 #define _LARGEFILE_SOURCE 1
 #define _FILE_OFFSET_BITS 64
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <inttypes.h>
 #include <fcntl.h>
 #include "elf.h"
@@ -23,11 +24,29 @@
  * two bytes in the sector equal 0x55 and 0xAA.
  * This code makes sure the code intended for the boot sector is at most
  * 512 - 2 = 510 bytes long, then appends the 0x55-0xAA signature.
+ *
+ * Output is collected in a large buffer and written with `pwrite` when
+ * the output is seekable. Zero-filled regions are not written where the
+ * output already reads as zero (past its end, or in a hole found with
+ * SEEK_DATA), so padding becomes holes; a regular output file is then
+ * `ftruncate`d to the image size. With `-u IMAGE`, the image is updated
+ * in place: each buffered range is compared with the existing image,
+ * and only the sectors that changed are written.
  */
 
+#define SECTORSIZE              512
+#define DISKBUFSIZE             (1 << 20)
+
 int diskfd;
 off_t maxoff = 0;
 off_t curoff = 0;
+off_t baseoff = 0;              // file offset of `curoff` 0
+int diskseekable = 0;           // use `pwrite` at `baseoff + curoff`
+int diskregular = 0;            // output is a regular file (may have holes)
+int diskupdate = 0;             // only write sectors that changed
+static unsigned char diskbuf[DISKBUFSIZE];
+static unsigned char diskcmpbuf[DISKBUFSIZE];
+static size_t diskbuflen = 0;   // buffered bytes, ending at `curoff`
 
 int find_partition(off_t partition_sect, off_t extended_sect, int partoff);
 void do_multiboot(const char *filename);
@@ -35,6 +54,7 @@ void do_multiboot(const char *filename);
 
 void usage(void) {
     fprintf(stderr, "Usage: mkbootdisk BOOTSECTORFILE [FILE | @SECNUM]...\n");
+    fprintf(stderr, "   or: mkbootdisk -u IMAGE BOOTSECTORFILE [FILE | @SECNUM]...\n");
     fprintf(stderr, "   or: mkbootdisk -p DISK [FILE | @SECNUM]...\n");
     fprintf(stderr, "   or: mkbootdisk -m KERNELFILE\n");
     exit(1);
@@ -49,14 +69,21 @@ FILE *fopencheck(const char *name) {
     return f;
 }
 
-void diskwrite(const void *data, size_t amt) {
-    if (maxoff && curoff + amt > size_t(maxoff)) {
-        fprintf(stderr, "more data than allowed in partition!\n");
-        usage();
+void diskinit(int fd) {
+    struct stat st;
+    diskfd = fd;
+    baseoff = lseek(fd, 0, SEEK_CUR);
+    diskseekable = baseoff != (off_t) -1;
+    if (!diskseekable) {
+        baseoff = 0;
     }
+    diskregular = diskseekable && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
 
+static void diskpwrite(const unsigned char *data, size_t amt, off_t off) {
     while (amt > 0) {
-        ssize_t w = write(diskfd, data, amt);
+        ssize_t w = diskseekable ? pwrite(diskfd, data, amt, off)
+            : write(diskfd, data, amt);
         if (w == -1 && errno != EINTR) {
             perror("write");
             usage();
@@ -65,15 +92,135 @@ void diskwrite(const void *data, size_t amt) {
             usage();
         } else if (w > 0) {
             amt -= w;
-            curoff += w;
-            data = (const unsigned char *) data + w;
+            off += w;
+            data += w;
+        }
+    }
+}
+
+// Write out the buffer. In update mode, compare it with the image and
+// write only runs of changed sectors.
+void diskflush(void) {
+    size_t amt = diskbuflen;
+    off_t off = baseoff + curoff - amt;
+    diskbuflen = 0;
+    if (!diskupdate || !diskseekable) {
+        diskpwrite(diskbuf, amt, off);
+        return;
+    }
+
+    ssize_t r;
+    do {
+        r = pread(diskfd, diskcmpbuf, amt, off);
+    } while (r == -1 && errno == EINTR);
+    if (r == -1) {
+        perror("read");
+        usage();
+    }
+    size_t same = r;            // bytes of `diskcmpbuf` that exist
+    size_t pos = 0;
+    while (pos < amt) {
+        // Skip an unchanged sector, or write a run of changed ones
+        size_t end = pos;
+        while (end < amt) {
+            size_t n = amt - end < SECTORSIZE ? amt - end : SECTORSIZE;
+            if (end + n <= same
+                && memcmp(diskbuf + end, diskcmpbuf + end, n) == 0) {
+                break;
+            }
+            end += n;
+        }
+        if (end == pos) {
+            pos += amt - pos < SECTORSIZE ? amt - pos : SECTORSIZE;
+        } else {
+            diskpwrite(diskbuf + pos, end - pos, off + pos);
+            pos = end;
+        }
+    }
+}
+
+void diskwrite(const void *data, size_t amt) {
+    if (maxoff && curoff + amt > size_t(maxoff)) {
+        fprintf(stderr, "more data than allowed in partition!\n");
+        usage();
+    }
+
+    while (amt > 0) {
+        size_t n = DISKBUFSIZE - diskbuflen;
+        if (n > amt) {
+            n = amt;
+        }
+        memcpy(diskbuf + diskbuflen, data, n);
+        diskbuflen += n;
+        curoff += n;
+        amt -= n;
+        data = (const unsigned char *) data + n;
+        if (diskbuflen == DISKBUFSIZE) {
+            diskflush();
+        }
+    }
+}
+
+// Return the first offset in [off, end) that might not read as zero:
+// `end` if the output has a hole there (or ends before it).
+static off_t disknonzero(off_t off, off_t end) {
+    if (!diskregular) {
+        return off;
+    }
+    off_t data = lseek(diskfd, off, SEEK_DATA);
+    if (data == (off_t) -1) {
+        // ENXIO: no data at or after `off`; otherwise SEEK_DATA is
+        // unsupported, so assume data
+        return errno == ENXIO ? end : off;
+    }
+    return data < end ? data : end;
+}
+
+// Write `amt` zero bytes, skipping the parts that already read as zero.
+void diskzero(size_t amt) {
+    static const unsigned char zerobuf[SECTORSIZE] = {0};
+    if (maxoff && curoff + amt > size_t(maxoff)) {
+        fprintf(stderr, "more data than allowed in partition!\n");
+        usage();
+    }
+
+    diskflush();
+    off_t end = baseoff + curoff + amt;
+    while (baseoff + curoff < end) {
+        off_t off = baseoff + curoff;
+        off_t data = disknonzero(off, end);
+        if (data != off) {
+            curoff += data - off;
+            continue;
+        }
+        off_t hole = diskregular ? lseek(diskfd, off, SEEK_HOLE) : (off_t) -1;
+        if (hole <= off || hole > end) {
+            hole = end;
         }
+        while (baseoff + curoff < hole) {
+            off_t n = hole - (baseoff + curoff);
+            diskwrite(zerobuf, n < SECTORSIZE ? n : SECTORSIZE);
+        }
+        diskflush();
+    }
+}
+
+// Flush the buffer and set a regular output file's size to the image
+// size, which fills any trailing zeros as a hole.
+void diskfinish(void) {
+    struct stat st;
+    diskflush();
+    off_t end = baseoff + curoff;
+    if (diskregular
+        && (!maxoff || (fstat(diskfd, &st) == 0 && st.st_size < end))
+        && ftruncate(diskfd, end) != 0) {
+        perror("ftruncate");
+        usage();
     }
 }
 
 int main(int argc, char *argv[]) {
     char buf[4096];
-    char zerobuf[512];
     FILE *f;
     size_t n;
     size_t nsectors;
@@ -82,21 +229,39 @@ int main(int argc, char *argv[]) {
 
 #if defined(_MSDOS) || defined(_WIN32)
     // As our output file is binary, we must set its file mode to binary.
-    diskfd = _fileno(stdout);
+    diskinit(_fileno(stdout));
     _setmode(diskfd, _O_BINARY);
 #else
-    diskfd = fileno(stdout);
+    diskinit(fileno(stdout));
 #endif
 
+    // Check for in-place update
+    if (argc >= 2 && strcmp(argv[1], "-u") == 0) {
+        int fd;
+        if (argc < 3) {
+            usage();
+        }
+        if ((fd = open(argv[2], O_RDWR | O_CREAT, 0666)) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+            usage();
+        }
+        diskinit(fd);
+        diskupdate = 1;
+        argc -= 2;
+        argv += 2;
+    }
+
     // Check for a partition
     if (argc >= 2 && strcmp(argv[1], "-p") == 0) {
         if (argc < 3) {
             usage();
         }
-        if ((diskfd = open(argv[2], O_RDWR)) < 0) {
+        int fd;
+        if ((fd = open(argv[2], O_RDWR)) < 0) {
             fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
             usage();
         }
+        diskinit(fd);
         if (find_partition(0, 0, 0) <= 0) {
             fprintf(stderr, "%s: no JOS partition (type 0x27) found!\n", argv[2]);
             usage();
@@ -143,7 +308,6 @@ int main(int argc, char *argv[]) {
     }
 
     // Read any succeeding files, then write them out
-    memset(zerobuf, 0, 512);
     for (i = 1; i < argc; i++) {
         size_t pos;
         char *str;
@@ -156,10 +320,8 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "mkbootdisk: can't skip to sector %u, already at sector %u\n", (unsigned) skipto_sector, (unsigned) nsectors);
                 usage();
             }
-            while (nsectors < skipto_sector) {
-                diskwrite(zerobuf, 512);
-                nsectors++;
-            }
+            diskzero((skipto_sector - nsectors) * 512);
+            nsectors = skipto_sector;
             continue;
         }
 
@@ -171,7 +333,7 @@ int main(int argc, char *argv[]) {
             pos += n;
         }
         if (pos % 512 != 0) {
-            diskwrite(zerobuf, 512 - (pos % 512));
+            diskzero(512 - (pos % 512));
             pos += 512 - (pos % 512);
         }
         nsectors += pos / 512;
@@ -179,17 +341,15 @@ int main(int argc, char *argv[]) {
     }
 
     // Fill out to 1024 sectors with 0 blocks
-    while (nsectors < 1024) {
-        diskwrite(zerobuf, 512);
-        nsectors++;
+    if (nsectors < 1024) {
+        diskzero((1024 - nsectors) * 512);
     }
 
+    diskfinish();
     return 0;
 }
 
 
-#define SECTORSIZE              512
-
 static void readsect(void *buf, uint32_t sectno) {
     ssize_t s;
     off_t o = lseek(diskfd, (off_t) sectno * (off_t) SECTORSIZE, SEEK_SET);
@@ -238,7 +398,6 @@ struct Partitiondesc {
 int find_partition(off_t partition_sect, off_t extended_sect, int partoff) {
     int i, r;
     uint8_t buf[SECTORSIZE];
-    off_t o;
     struct Partitiondesc *ptable;
 
     // read the partition sector: initially sector 0
@@ -259,11 +418,7 @@ int find_partition(off_t partition_sect, off_t extended_sect, int partoff) {
             // use this partition
             partition_sect += (off_t) ptable[i].lba_start;
             fprintf(stderr, "Using partition %d (start sector %ld, sector length %ld)\n", partoff + i + 1, (long) partition_sect, (long) ptable[i].lba_length);
-            o = lseek(diskfd, partition_sect * SECTORSIZE, SEEK_SET);
-            if (o != partition_sect * SECTORSIZE) {
-                fprintf(stderr, "cannot seek to partition start: %s\n", strerror(errno));
-                usage();
-            }
+            baseoff = partition_sect * SECTORSIZE;
             maxoff = (off_t) ptable[i].lba_length * SECTORSIZE;
             return 1;
         } else if (ptable[i].type == PTYPE_DOS_EXTENDED
@@ -290,11 +445,14 @@ void do_multiboot(const char *filename) {
     uint8_t buf[SECTORSIZE];
     elf_header *elfh = (elf_header *) buf;
     off_t o;
+    int fd;
 
-    if ((diskfd = open(filename, O_RDWR)) < 0) {
+    if ((fd = open(filename, O_RDWR)) < 0) {
         fprintf(stderr, "%s: %s\n", filename, strerror(errno));
         usage();
     }
+    diskinit(fd);
+    diskregular = 0;            // don't truncate the kernel
 
     readsect(buf, 0);
 
@@ -307,11 +465,10 @@ void do_multiboot(const char *filename) {
     if (size_t(o) >= 4096 - sizeof(multiboot_header)) {
         fprintf(stderr, "%s: ELF header too large to accommodate multiboot header\n", filename);
         usage();
-    } else if (lseek(diskfd, o, SEEK_SET) != o) {
-        perror("lseek");
-        usage();
     }
 
+    baseoff = o;
     diskwrite(multiboot_header, sizeof(multiboot_header));
+    diskflush();
     exit(0);
 }
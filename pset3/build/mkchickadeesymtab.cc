@@ -17,6 +17,8 @@
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <string>
+#include <unordered_map>
 #if defined(_MSDOS) || defined(_WIN32)
 # include <fcntl.h>
 # include <io.h>
@@ -279,7 +281,10 @@ elf_symbol* elf_info::find_symbol(const char* name,
 }
 
 void elf_info::shift_sections(size_t offset, ptrdiff_t diff) {
-    assert(offset < size_ && diff > 0);
+    // A negative `diff` moves data at `offset` and up down over
+    // `[offset + diff, offset)`, which must be unused.
+    assert(offset <= size_ && diff != 0
+           && (diff > 0 || size_t(-diff) <= offset));
 
     // update program headers
     if (eh_->e_phoff + eh_->e_phnum * sizeof(*pht_) >= offset) {
@@ -290,7 +295,7 @@ void elf_info::shift_sections(size_t offset, ptrdiff_t diff) {
         auto& ph = pht_[i];
         if (ph.p_offset >= offset) {
             ph.p_offset += diff;
-        } else if (ph.p_offset + ph.p_filesz > offset) {
+        } else if (ph.p_offset + ph.p_filesz > offset + std::min(diff, ptrdiff_t(0))) {
             fprintf(stderr, "%s: program %u spans alignment boundary\n", filename_, i);
             fprintf(stderr, "  shifting %zu+%zu, program %" PRIu64 "+%" PRIu64 "\n",
                     offset, diff, ph.p_offset, ph.p_filesz);
@@ -305,7 +310,7 @@ void elf_info::shift_sections(size_t offset, ptrdiff_t diff) {
             sh.sh_offset += diff;
         } else if (sh.sh_type != ELF_SHT_NULL
                    && sh.sh_type != ELF_SHT_NOBITS
-                   && sh.sh_offset + sh.sh_size > offset) {
+                   && sh.sh_offset + sh.sh_size > offset + std::min(diff, ptrdiff_t(0))) {
             fprintf(stderr, "%s: section <%s> spans alignment boundary\n", filename_, section_display_name(i));
             fprintf(stderr, "  shifting %zu+%zu, section %" PRIu64 "+%" PRIu64 "\n",
                     offset, diff, sh.sh_offset, sh.sh_size);
@@ -314,9 +319,13 @@ void elf_info::shift_sections(size_t offset, ptrdiff_t diff) {
     }
 
     // move data
-    grow(size_ + diff);
+    if (diff > 0) {
+        grow(size_ + diff);
+    }
     memmove(&data_[offset + diff], &data_[offset], size_ - offset);
-    memset(&data_[offset], 0, diff);
+    if (diff > 0) {
+        memset(&data_[offset], 0, diff);
+    }
     size_ += diff;
     changed_ = true;
 
@@ -333,9 +342,99 @@ static void usage() {
     exit(1);
 }
 
+// ksymtab
+//    The compact symbol table that replaces <.symtab> and <.strtab> in
+//    the image; see `elf_symtabref` in elf.h. `data` holds the sorted
+//    32-bit address offsets, then the name offsets, then the string pool.
+
+struct ksymtab {
+    uint64_t base = 0;
+    size_t nsym = 0;
+    std::vector<char> data;
+};
+
+static ksymtab build_ksymtab(const elf_info& ei) {
+    // collect named function and object symbols, sorted by address
+    ei.symtab();
+    std::vector<const elf_symbol*> syms;
+    for (unsigned i = 1; i < ei.nsymtab_; ++i) {
+        auto& sym = ei.symtab_[i];
+        if ((sym.st_info & ELF_STT_MASK) <= ELF_STT_FUNC
+            && sym.st_value != 0
+            && sym.st_shndx != 0
+            && sym.st_shndx < ei.eh_->e_shnum       // not absolute
+            && ei.symstrtab_[sym.st_name] != 0) {
+            syms.push_back(&sym);
+        }
+    }
+    std::stable_sort(syms.begin(), syms.end(),
+                     [] (const elf_symbol* a, const elf_symbol* b) {
+                         return symbol_less(*a, *b);
+                     });
+
+    std::vector<uint32_t> addrs, names;
+    std::vector<char> pool;
+    std::unordered_map<std::string, uint32_t> pool_offsets;
+    ksymtab kt;
+    kt.base = syms.empty() ? 0 : syms[0]->st_value;
+    auto add = [&] (uint64_t addr, uint32_t name) {
+        if (addr - kt.base > 0xFFFFFFFFU) {
+            fprintf(stderr, "%s: symbols span more than 4 GiB\n", ei.filename_);
+            exit(1);
+        }
+        addrs.push_back(addr - kt.base);
+        names.push_back(name);
+    };
+
+    for (size_t i = 0; i != syms.size(); ) {
+        // of the symbols at one address, prefer functions, then the
+        // largest
+        const elf_symbol* sym = syms[i];
+        size_t j = i + 1;
+        for (; j != syms.size() && syms[j]->st_value == sym->st_value; ++j) {
+            bool func = (syms[j]->st_info & ELF_STT_MASK) == ELF_STT_FUNC;
+            bool symfunc = (sym->st_info & ELF_STT_MASK) == ELF_STT_FUNC;
+            if (func > symfunc
+                || (func == symfunc && syms[j]->st_size >= sym->st_size)) {
+                sym = syms[j];
+            }
+        }
+
+        std::string name = ei.symstrtab_ + sym->st_name;
+        auto it = pool_offsets.find(name);
+        if (it == pool_offsets.end()) {
+            it = pool_offsets.emplace(name, pool.size()).first;
+            pool.insert(pool.end(), name.begin(), name.end() + 1);
+        }
+        add(sym->st_value, it->second);
+
+        // a sized symbol covers addresses through `st_value + st_size`
+        // (a return address after a final call); the last symbol
+        // otherwise covers a page
+        uint64_t end = 0;
+        if (sym->st_size != 0) {
+            end = sym->st_value + sym->st_size + 1;
+        } else if (j == syms.size()) {
+            end = sym->st_value + 0x1000;
+        }
+        if (end != 0 && (j == syms.size() || end < syms[j]->st_value)) {
+            add(end, ELF_SYMTABREF_GAP);
+        }
+        i = j;
+    }
+
+    kt.nsym = addrs.size();
+    kt.data.resize(kt.nsym * 2 * sizeof(uint32_t) + pool.size());
+    char* d = kt.data.data();
+    memcpy(d, addrs.data(), kt.nsym * sizeof(uint32_t));
+    memcpy(d + kt.nsym * sizeof(uint32_t), names.data(),
+           kt.nsym * sizeof(uint32_t));
+    memcpy(d + kt.nsym * 2 * sizeof(uint32_t), pool.data(), pool.size());
+    return kt;
+}
+
 static unsigned rewrite_symtabref(elf_info& ei, const char* name,
-                                  uint64_t& loadaddr, size_t strtab_off,
-                                  size_t size) {
+                                  uint64_t& loadaddr, const ksymtab& kt) {
     auto sym = ei.find_symbol(name);
     unsigned nfound = 0;
     while (sym) {
@@ -364,14 +463,15 @@ static unsigned rewrite_symtabref(elf_info& ei, const char* name,
             if (!loadaddr) {
                 memcpy(&loadaddr, ei.data_ + stref_off, sizeof(loadaddr));
             }
-            elf_symtabref stref;
-            memcpy(&stref, ei.data_ + stref_off, sizeof(stref));
 
+            size_t names_off = kt.nsym * sizeof(uint32_t);
             elf_symtabref xstref = {
-                reinterpret_cast<elf_symbol*>(loadaddr),
-                ei.nsymtab_,
-                reinterpret_cast<char*>(loadaddr + strtab_off),
-                size
+                reinterpret_cast<uint32_t*>(loadaddr),
+                reinterpret_cast<uint32_t*>(loadaddr + names_off),
+                kt.nsym,
+                reinterpret_cast<char*>(loadaddr + 2 * names_off),
+                kt.data.size(),
+                kt.base
             };
             if (memcmp(ei.data_ + stref_off, &xstref, sizeof(xstref)) != 0) {
                 memcpy(ei.data_ + stref_off, &xstref, sizeof(xstref));
@@ -494,40 +594,44 @@ int main(int argc, char** argv) {
         }
     }
 
-    // figure out allocation range
-    uint64_t first_offset = ei.sht_[symtabndx].sh_offset;
-    uint64_t strtab_offset = ei.sht_[symtabndx + 1].sh_offset;
-    uint64_t last_offset = ei.sht_[symtabndx + 1].sh_offset
-        + ei.sht_[symtabndx + 1].sh_size;
+    // sort symbol table by address and build the compact table
+    ei.sort_symtab();
+    ksymtab kt = build_ksymtab(ei);
 
     // find `lsymtab_name`
-    if (!rewrite_symtabref(ei, lsymtab_name, loadaddr,
-                           strtab_offset - first_offset,
-                           last_offset - first_offset)
+    if (!rewrite_symtabref(ei, lsymtab_name, loadaddr, kt)
         && lsymtab_set) {
         fprintf(stderr, "%s: no `%s` symbol found\n", ei.filename_, lsymtab_name);
         exit(1);
     }
 
-    // sort symbol table by address
-    ei.sort_symtab();
-
-    // mark symbol table as allocated
-    if (loadaddr && !(ei.sht_[symtabndx].sh_flags & ELF_SHF_ALLOC)) {
-        ei.sht_[symtabndx].sh_flags |= ELF_SHF_ALLOC;
-        ei.sht_[symtabndx].sh_addr = loadaddr;
-        ei.changed_ = true;
-        if (verbose) {
-            fprintf(stderr, "%s: marking <.symtab> as allocated\n", ei.filename_);
+    // replace <.symtab> and <.strtab> with the compact table, which is
+    // always smaller (8 bytes per symbol, not 24, and no repeated names),
+    // then close up the space they used
+    uint64_t first_offset = ei.sht_[symtabndx].sh_offset;
+    uint64_t last_offset = first_offset + kt.data.size();
+    {
+        auto& symtab = ei.sht_[symtabndx];
+        auto& strtab = ei.sht_[symtabndx + 1];
+        uint64_t old_end = strtab.sh_offset + strtab.sh_size;
+        assert(strtab.sh_offset >= symtab.sh_offset + symtab.sh_size
+               && last_offset <= old_end);
+        memcpy(ei.data_ + first_offset, kt.data.data(), kt.data.size());
+        symtab.sh_type = ELF_SHT_PROGBITS;
+        symtab.sh_flags = loadaddr ? ELF_SHF_ALLOC : 0;
+        symtab.sh_addr = loadaddr;
+        symtab.sh_size = kt.data.size();
+        symtab.sh_link = symtab.sh_info = 0;
+        symtab.sh_entsize = 0;
+        memset(&strtab, 0, sizeof(strtab));
+        uint64_t new_end = (last_offset + 7) & ~uint64_t(7);
+        if (new_end < old_end) {
+            ei.shift_sections(old_end, -ptrdiff_t(old_end - new_end));
         }
-    }
-    if (loadaddr && !(ei.sht_[symtabndx + 1].sh_flags & ELF_SHF_ALLOC)) {
-        ei.sht_[symtabndx + 1].sh_flags |= ELF_SHF_ALLOC;
-        ei.sht_[symtabndx + 1].sh_addr = loadaddr
-            + strtab_offset - first_offset;
         ei.changed_ = true;
         if (verbose) {
-            fprintf(stderr, "%s: marking <.symstrtab> as allocated\n", ei.filename_);
+            fprintf(stderr, "%s: compact symbol table: %zu symbols from 0x%" PRIx64 ", %zu bytes\n",
+                    ei.filename_, kt.nsym, kt.base, kt.data.size());
         }
     }
 
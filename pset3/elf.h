@@ -70,13 +70,20 @@ struct elf_symbol {
     uint64_t st_size;
 };
 
-// in-memory reference to debug symbol table + string table
+// in-memory reference to the compact debug symbol table that
+// `mkchickadeesymtab` builds: `nsym` sorted symbol start addresses, as
+// 32-bit offsets from `base`, then `nsym` offsets of their names in
+// `strtab`, a pool of deduplicated strings. A name offset of
+// `ELF_SYMTABREF_GAP` marks the end of the previous symbol.
 struct elf_symtabref {
-    elf_symbol* sym;
+    uint32_t* addr;
+    uint32_t* name;
     size_t nsym;
     char* strtab;
-    size_t size;
+    size_t size;                // bytes in the whole table
+    uint64_t base;
 };
+#define ELF_SYMTABREF_GAP       0xFFFFFFFFU
 
 // Values for elf_header::e_type
 #define ELF_ET_EXEC             2   // executable file
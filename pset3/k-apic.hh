@@ -75,6 +75,8 @@ struct lapicstate {
 
     // send an IPI to all other processes
     inline void ipi_others(ipi_type_t ipi_type, int vector = 0);
+    // send interrupt `vector` to the CPU whose APIC ID is `apic_id`
+    inline void ipi(uint32_t apic_id, int vector);
     // return if the previous IPI has not completed
     inline bool ipi_pending() const;
 
@@ -157,6 +159,10 @@ inline void lapicstate::ack() {
 inline void lapicstate::ipi_others(ipi_type_t t, int vector) {
     write(reg_icr_low, ipi_all_excluding_self | ipi_level_assert | t | vector);
 }
+inline void lapicstate::ipi(uint32_t apic_id, int vector) {
+    write(reg_icr_high, apic_id << 24);
+    write(reg_icr_low, ipi_given | ipi_level_assert | vector);
+}
 inline bool lapicstate::ipi_pending() const {
     return (read(reg_icr_low) & ipi_delivery_status) != 0;
 }
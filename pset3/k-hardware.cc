@@ -21,7 +21,7 @@ pcistate pcistate::state;
 static void init_kernel_memory();
 static void init_interrupts();
 static void init_constructors();
-static void init_cpu_hardware();
+static void init_cpu_hardware(cpustate& c);
 static void stash_kernel_data(bool restore);
 
 void init_hardware() {
@@ -39,7 +39,7 @@ void init_hardware() {
     init_constructors();
 
     // initialize this CPU
-    init_cpu_hardware();
+    init_cpu(0);
 }
 
 
@@ -128,13 +128,8 @@ void init_kernel_memory() {
 
     // user-accessible mappings for physical memory,
     // except that (for debuggability) nullptr is totally inaccessible
-    for (vmiter it(kernel_pagetable, 0);
-         it.va() < MEMSIZE_PHYSICAL;
-         it += PAGESIZE) {
-        if (it.va() != 0) {
-            it.map(it.va(), PTE_P | PTE_W | PTE_U);
-        }
-    }
+    vmiter(kernel_pagetable, PAGESIZE)
+        .map_range(PAGESIZE, MEMSIZE_PHYSICAL - PAGESIZE, PTE_P | PTE_W | PTE_U);
 
     wrcr3(kptr2pa(kernel_pagetable));
 
@@ -172,6 +167,10 @@ void init_interrupts() {
     assert((ioapic_ver & 0xFF) == 0x11 || (ioapic_ver & 0xFF) == 0x20);
     assert((ioapic_ver >> 16) >= 0x17);
 
+    // deliver keyboard interrupts, so the kernel need not poll for keys
+    ioapic.enable_irq(IRQ_KEYBOARD, INT_IRQ + IRQ_KEYBOARD,
+                      lapicstate::get().id());
+
     // disable the old programmable interrupt controller
 #define IO_PIC1         0x20    // Master (IRQs 0-7)
 #define IO_PIC2         0xA0    // Slave (IRQs 8-15)
@@ -190,30 +189,63 @@ void init_constructors() {
 }
 
 
-static x86_64_taskstate taskstate;
+// Per-CPU state. The boot CPU keeps the boot kernel stack, below
+// KERNEL_STACK_TOP; the others get a page each from `ap_stacks`, which
+// `init_other_cpus` allocates.
+cpustate cpus[MAXNCPU];
+int ncpu = 1;
+uint8_t* ap_stacks;                 // MAXNCPU - 1 pages
+std::atomic<int> ap_next_index;     // next index for `ap_trampoline`
+
+static_assert(offsetof(cpustate, syscall_rsp) == CPUSTATE_SYSCALL_RSP, "");
+static_assert(offsetof(cpustate, stack_top) == CPUSTATE_STACK_TOP, "");
+static_assert(offsetof(cpustate, current) == CPUSTATE_CURRENT, "");
+static_assert(offsetof(cpustate, kernel_cr3) == CPUSTATE_KERNEL_CR3, "");
+static_assert(offsetof(cpustate, user_cr3) == CPUSTATE_USER_CR3, "");
+
+bool pcid_enabled;
+
+// init_cpu(index)
+//    Initialize the running CPU as `cpus[index]`.
+
+void init_cpu(int index) {
+    cpustate& c = cpus[index];
+    c.self = &c;
+    c.index = index;
+    if (index == 0) {
+        c.stack_top = KERNEL_STACK_TOP;
+    } else {
+        // top of page `index - 1` of `ap_stacks`
+        c.stack_top = reinterpret_cast<uintptr_t>(ap_stacks + index * PAGESIZE);
+    }
+    init_cpu_hardware(c);
+}
+
+void init_cpu_hardware(cpustate& c) {
+    uint64_t* segments = c.gdt_segments;
+    x86_64_taskstate& taskstate = c.taskstate;
 
-void init_cpu_hardware() {
     // initialize per-CPU segments
-    gdt_segments[0] = 0;
-    set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
+    segments[0] = 0;
+    set_app_segment(&segments[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
-    set_app_segment(&gdt_segments[SEGSEL_KERN_DATA >> 3],
+    set_app_segment(&segments[SEGSEL_KERN_DATA >> 3],
                     X86SEG_W, 0);
-    set_app_segment(&gdt_segments[SEGSEL_APP_CODE >> 3],
+    set_app_segment(&segments[SEGSEL_APP_CODE >> 3],
                     X86SEG_X | X86SEG_L, 3);
-    set_app_segment(&gdt_segments[SEGSEL_APP_DATA >> 3],
+    set_app_segment(&segments[SEGSEL_APP_DATA >> 3],
                     X86SEG_W, 3);
-    set_sys_segment(&gdt_segments[SEGSEL_TASKSTATE >> 3],
+    set_sys_segment(&segments[SEGSEL_TASKSTATE >> 3],
                     reinterpret_cast<uintptr_t>(&taskstate), sizeof(taskstate),
                     X86SEG_TSS, 0);
 
     // taskstate lets the kernel receive interrupts
     memset(&taskstate, 0, sizeof(taskstate));
-    taskstate.ts_rsp[0] = KERNEL_STACK_TOP;
+    taskstate.ts_rsp[0] = c.stack_top;
 
     x86_64_pseudodescriptor gdt, idt;
-    gdt.limit = sizeof(gdt_segments) - 1;
-    gdt.base = reinterpret_cast<uint64_t>(gdt_segments);
+    gdt.limit = sizeof(c.gdt_segments) - 1;
+    gdt.base = reinterpret_cast<uint64_t>(segments);
     idt.limit = sizeof(interrupt_descriptors) - 1;
     idt.base = reinterpret_cast<uint64_t>(interrupt_descriptors);
 
@@ -228,6 +260,9 @@ void init_cpu_hardware() {
     // initialize segments
     asm volatile("movw %%ax, %%fs; movw %%ax, %%gs"
                  : : "a" (uint16_t(SEGSEL_KERN_DATA)));
+    // `%gs` addresses this CPU's state in the kernel (see `this_cpu`)
+    wrmsr(MSR_IA32_GS_BASE, reinterpret_cast<uint64_t>(&c));
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
 
 
     // set up control registers
@@ -235,6 +270,15 @@ void init_cpu_hardware() {
     cr0 |= CR0_PE | CR0_PG | CR0_WP | CR0_AM | CR0_MP | CR0_NE;
     wrcr0(cr0);
 
+    // tag TLB entries with process-context identifiers if supported
+    // (the kernel page table, loaded now, has PCID 0)
+    c.kernel_cr3 = kptr2pa(kernel_pagetable);
+    pcid_enabled = cpuid(1).ecx & (1 << 17);
+    if (pcid_enabled) {
+        wrcr4(rdcr4() | CR4_PCIDE);
+        c.kernel_cr3 |= CR3_NOFLUSH;
+    }
+
 
     // set up syscall/sysret
     wrmsr(MSR_IA32_STAR, (uintptr_t(SEGSEL_KERN_CODE) << 32)
@@ -248,11 +292,12 @@ void init_cpu_hardware() {
     auto& lapic = lapicstate::get();
     lapic.enable_lapic(INT_IRQ + IRQ_SPURIOUS);
 
-    // timer is in periodic mode
+    // timer is in one-shot mode, disarmed until `set_timer`
     lapic.write(lapic.reg_timer_divide, lapic.timer_divide_1);
-    lapic.write(lapic.reg_lvt_timer,
-                lapic.timer_periodic | (INT_IRQ + IRQ_TIMER));
+    lapic.write(lapic.reg_lvt_timer, INT_IRQ + IRQ_TIMER);
     lapic.write(lapic.reg_timer_initial_count, 0);
+    c.lapic_id = lapic.id();
+    c.timer_deadline = 0;
 
     // disable logical interrupt lines
     lapic.write(lapic.reg_lvt_lint0, lapic.lvt_masked);
@@ -268,16 +313,80 @@ void init_cpu_hardware() {
 }
 
 
-// init_timer(rate)
-//    Set the timer interrupt to fire `rate` times a second. Disables the
-//    timer interrupt if `rate <= 0`.
+// set_timer(usec)
+//    Arm this CPU's one-shot timer. With divide-by-1, the timer counts the
+//    APIC bus clock, which runs at 1 GHz under QEMU.
 
-void init_timer(int rate) {
+void set_timer(uint64_t usec) {
     auto& lapic = lapicstate::get();
-    if (rate > 0) {
-        lapic.write(lapic.reg_timer_initial_count, 1000000000 / rate);
-    } else {
-        lapic.write(lapic.reg_timer_initial_count, 0);
+    lapic.write(lapic.reg_timer_initial_count,
+                min(usec * 1000, uint64_t(0xFFFFFFFF)));
+}
+
+
+// pit_delay(usec)
+//    Busy-wait for `usec` microseconds (at most 54000) on PIT channel 2,
+//    which needs no interrupts.
+static void pit_delay(unsigned usec) {
+    unsigned count = usec * 1193182ULL / 1000000;
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);     // gate on, speaker off
+    outb(0x43, 0xB0);                           // channel 2, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+    uint8_t gate = inb(0x61) & ~0x01;           // restart the count
+    outb(0x61, gate);
+    outb(0x61, gate | 0x01);
+    while (!(inb(0x61) & 0x20)) {
+        pause();
+    }
+}
+
+
+// init_timer()
+//    Measure the TSC over 10 milliseconds of the PIT.
+
+uint64_t tsc_per_usec;
+
+void init_timer() {
+    uint64_t start = rdtsc();
+    pit_delay(10000);
+    tsc_per_usec = max((rdtsc() - start) / 10000, uint64_t(1));
+    set_timer(0);
+}
+
+
+// init_other_cpus()
+//    Start the other CPUs (the standard INIT, startup, startup sequence)
+//    and count those that arrive.
+
+void init_other_cpus() {
+    ap_stacks = reinterpret_cast<uint8_t*>(kalloc((MAXNCPU - 1) * PAGESIZE));
+    assert(ap_stacks);
+
+    extern uint8_t ap_trampoline[], ap_trampoline_end[];
+    memcpy(reinterpret_cast<void*>(AP_TRAMPOLINE_ADDR), ap_trampoline,
+           ap_trampoline_end - ap_trampoline);
+    ap_next_index = 1;
+
+    auto& lapic = lapicstate::get();
+    lapic.ipi_others(lapic.ipi_init);
+    while (lapic.ipi_pending()) {
+        pause();
+    }
+    pit_delay(10000);
+    for (int i = 0; i != 2; ++i) {
+        lapic.ipi_others(lapic.ipi_startup, AP_TRAMPOLINE_ADDR >> PAGEOFFBITS);
+        while (lapic.ipi_pending()) {
+            pause();
+        }
+        pit_delay(200);
+    }
+
+    // give the other CPUs time to reach `ap_trampoline`'s count
+    pit_delay(50000);
+    ncpu = ap_next_index.load();
+    if (ncpu > MAXNCPU) {
+        ncpu = MAXNCPU;
     }
 }
 
@@ -286,11 +395,11 @@ void init_timer(int rate) {
 //    Allocate and return a new, empty page table.
 
 x86_64_pagetable* kalloc_pagetable() {
-    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
-    if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pagetable));
+    void* kpage = kalloc_zeroed_page();
+    if (kpage) {
+        physpages[kptr2pa(kpage) / PAGESIZE].flags |= PPI_PAGETABLE;
     }
-    return pt;
+    return reinterpret_cast<x86_64_pagetable*>(kpage);
 }
 
 
@@ -343,11 +452,14 @@ bool reserved_physical_address(uintptr_t pa) {
 
 // allocatable_physical_address(pa)
 //    Returns true iff `pa` is an allocatable physical address, i.e.,
-//    not reserved or holding kernel data.
+//    not reserved or holding kernel data. The page at AP_TRAMPOLINE_ADDR
+//    is kept for `init_other_cpus`.
 
 bool allocatable_physical_address(uintptr_t pa) {
     extern uint8_t _kernel_end[];
     return !reserved_physical_address(pa)
+        && (pa < AP_TRAMPOLINE_ADDR
+            || pa >= AP_TRAMPOLINE_ADDR + PAGESIZE)
         && (pa < KERNEL_START_ADDR
             || pa >= round_up(reinterpret_cast<uintptr_t>(_kernel_end), PAGESIZE))
         && (pa < KERNEL_STACK_TOP - PAGESIZE
@@ -389,6 +501,7 @@ void pcistate::enable(int addr) {
 //    that speaks ACPI.
 
 void poweroff() {
+    log_flush();
     auto& pci = pcistate::get();
     int addr = pci.find([&] (int a) {
             uint32_t vd = pci.readl(a + pci.config_vendor);
@@ -412,12 +525,90 @@ void poweroff() {
 //    Reboot the virtual machine.
 
 void reboot() {
+    log_flush();
     outb(0x92, 3); // does not return
     while (true) {
     }
 }
 
 
+// Boot disk
+//    `disk_read` and `disk_write` drive the first disk on the IDE
+//    controller, where the boot loader found the kernel, with programmed
+//    I/O: they poll the status register rather than take interrupts, so
+//    they return when the transfer is done. The controller's ports come
+//    from its PCI configuration (the legacy ports, unless the primary
+//    channel is in native mode).
+
+static int ide_cmd_port = -1;   // command block registers
+static int ide_ctl_port;        // device control register
+
+static void ide_init() {
+    auto& pci = pcistate::get();
+    int addr = pci.find([&] (int a) {
+            return (pci.readl(a + pci.config_rpsc) >> 16) == 0x0101;
+        });
+    ide_cmd_port = 0x1F0;
+    ide_ctl_port = 0x3F6;
+    if (addr >= 0 && (pci.readb(addr + pci.config_rpsc + 1) & 0x01)) {
+        ide_cmd_port = pci.readl(addr + pci.config_bar0) & 0xFFFC;
+        ide_ctl_port = (pci.readl(addr + pci.config_bar1) & 0xFFFC) + 2;
+    }
+    outb(ide_ctl_port, 0x02);           // no interrupts (nIEN)
+}
+
+// ide_wait(drq)
+//    Wait while the disk is busy. Returns false if it reports an error,
+//    or if `drq` and it is not ready to transfer data.
+static bool ide_wait(bool drq) {
+    uint8_t status;
+    while ((status = inb(ide_cmd_port + 7)) & 0x80) {
+        pause();
+    }
+    return !(status & 0x21) && (!drq || (status & 0x08));
+}
+
+static int ide_transfer(void* buf, uint32_t sector, unsigned nsectors,
+                        bool write) {
+    assert(nsectors > 0 && nsectors <= 256 && sector < (1U << 28));
+    if (ide_cmd_port < 0) {
+        ide_init();
+    }
+    if (!ide_wait(false)) {
+        return -1;
+    }
+    outb(ide_cmd_port + 2, nsectors & 0xFF);
+    outb(ide_cmd_port + 3, sector);
+    outb(ide_cmd_port + 4, sector >> 8);
+    outb(ide_cmd_port + 5, sector >> 16);
+    outb(ide_cmd_port + 6, (sector >> 24) | 0xE0);      // LBA, disk 0
+    outb(ide_cmd_port + 7, write ? 0x30 : 0x20);        // write/read sectors
+    char* p = reinterpret_cast<char*>(buf);
+    for (unsigned i = 0; i != nsectors; ++i, p += SECTORSIZE) {
+        if (!ide_wait(true)) {
+            return -1;
+        }
+        if (write) {
+            outsl(ide_cmd_port, p, SECTORSIZE / 4);
+        } else {
+            insl(ide_cmd_port, p, SECTORSIZE / 4);
+        }
+    }
+    if (write) {
+        outb(ide_cmd_port + 7, 0xE7);                   // flush cache
+    }
+    return ide_wait(false) ? 0 : -1;
+}
+
+int disk_read(void* buf, uint32_t sector, unsigned nsectors) {
+    return ide_transfer(buf, sector, nsectors, false);
+}
+
+int disk_write(const void* buf, uint32_t sector, unsigned nsectors) {
+    return ide_transfer(const_cast<void*>(buf), sector, nsectors, true);
+}
+
+
 // init_process(p, flags)
 //    Initialize special-purpose registers for process `p`.
 
@@ -569,6 +760,18 @@ int keyboard_readc() {
 // log_printf, log_vprintf
 //    Print debugging messages to the host's `log.txt` file. We run QEMU
 //    so that messages written to the QEMU "parallel port" end up in `log.txt`.
+//
+//    The parallel port takes several slow I/O operations per byte, so
+//    messages go first to `log_ring`, an in-memory ring, and reach the
+//    port in bulk when `log_flush` drains the ring: a batch each time a
+//    CPU goes idle, and everything on panic or power-off. Writers never
+//    wait for the port. Each message chunk reserves its bytes by
+//    advancing `log_head` with compare-and-swap, copies them in, and then
+//    publishes them by advancing `log_committed` in reservation order. A
+//    chunk that does not fit in the ring is dropped and counted, and the
+//    next drain reports the loss. The ring lives in pages from `kalloc`
+//    (`init_log_ring`), not in the kernel image, which has no room for
+//    it; until it exists, messages go straight to the port.
 
 #define IO_PARALLEL1_DATA       0x378
 #define IO_PARALLEL1_STATUS     0x379
@@ -604,12 +807,82 @@ static void parallel_port_putc(unsigned char c) {
          | IO_PARALLEL_CONTROL_INIT);
 }
 
+#define LOG_RING_SIZE   (1UL << 15)
+static char* log_ring;
+static std::atomic<uint64_t> log_head;        // end of reserved bytes
+static std::atomic<uint64_t> log_committed;   // end of published bytes
+static std::atomic<uint64_t> log_tail;        // end of drained bytes
+static std::atomic<uint64_t> log_dropped;     // bytes lost to overflow
+static std::atomic<bool> log_draining;
+
+void init_log_ring() {
+    log_ring = reinterpret_cast<char*>(kalloc(LOG_RING_SIZE));
+}
+
+static void log_ring_write(const char* s, size_t n) {
+    if (!log_ring) {
+        for (size_t i = 0; i != n; ++i) {
+            parallel_port_putc(s[i]);
+        }
+        return;
+    }
+    uint64_t pos = log_head.load(std::memory_order_relaxed);
+    do {
+        if (pos + n - log_tail.load(std::memory_order_acquire) > LOG_RING_SIZE) {
+            log_dropped.fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+    } while (!log_head.compare_exchange_weak(pos, pos + n,
+                                             std::memory_order_relaxed));
+    for (size_t i = 0; i != n; ++i) {
+        log_ring[(pos + i) % LOG_RING_SIZE] = s[i];
+    }
+    // Publish after every earlier reservation is published
+    while (log_committed.load(std::memory_order_relaxed) != pos) {
+        pause();
+    }
+    log_committed.store(pos + n, std::memory_order_release);
+}
+
+void log_flush(size_t max) {
+    if (!log_ring || log_draining.exchange(true, std::memory_order_acquire)) {
+        return;                 // another CPU is draining
+    }
+    if (uint64_t dropped = log_dropped.exchange(0)) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "\n[log: %lu bytes dropped]\n", dropped);
+        for (const char* s = buf; *s; ++s) {
+            parallel_port_putc(*s);
+        }
+    }
+    uint64_t tail = log_tail.load(std::memory_order_relaxed);
+    uint64_t end = log_committed.load(std::memory_order_acquire);
+    if (end - tail > max) {
+        end = tail + max;
+    }
+    for (; tail != end; ++tail) {
+        parallel_port_putc(log_ring[tail % LOG_RING_SIZE]);
+    }
+    log_tail.store(tail, std::memory_order_release);
+    log_draining.store(false, std::memory_order_release);
+}
+
 namespace {
 struct log_printer : public printer {
     ansi_escape_buffer ebuf_;
+    char buf_[128];
+    size_t len_ = 0;
+    ~log_printer() {
+        log_ring_write(buf_, len_);
+    }
     void putc(unsigned char c) override {
         if (!ebuf_.putc(c, *this)) {
-            parallel_port_putc(c);
+            if (len_ == sizeof(buf_)) {
+                log_ring_write(buf_, len_);
+                len_ = 0;
+            }
+            buf_[len_] = c;
+            ++len_;
         }
     }
 };
@@ -647,13 +920,14 @@ void log_printf(const char* format, ...) {
 // The `mkchickadeesymtab` program fills this structure in.
 #define SYMTAB_ADDR 0x1000000
 elf_symtabref symtab = {
-    reinterpret_cast<elf_symbol*>(SYMTAB_ADDR), 0, nullptr, 0
+    reinterpret_cast<uint32_t*>(SYMTAB_ADDR), nullptr, 0, nullptr, 0, 0
 };
 
 // lookup_symbol(addr, name, start)
 //    Use the debugging symbol table to look up `addr`. Return the
 //    corresponding symbol name (usually a function name) in `*name`
-//    and the first address in that symbol in `*start`.
+//    and the first address in that symbol in `*start`. The binary search
+//    touches only the 32-bit address array, 16 entries per cache line.
 
 __no_asan
 bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
@@ -662,34 +936,32 @@ bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
         kernel_pagetable[2].entry[SYMTAB_ADDR / 0x200000] =
             SYMTAB_ADDR | PTE_P | PTE_W | PTE_PS;
     }
+    if (addr < symtab.base || addr - symtab.base > 0xFFFFFFFFU) {
+        return false;
+    }
+    uint32_t off = addr - symtab.base;
 
+    // find the last symbol starting at or before `off`
     size_t l = 0;
     size_t r = symtab.nsym;
     while (l < r) {
         size_t m = l + ((r - l) >> 1);
-        auto& sym = symtab.sym[m];
-        if (sym.st_value <= addr
-            && (m + 1 == symtab.nsym
-                ? addr < sym.st_value + 0x1000
-                : addr < (&sym)[1].st_value)
-            && (sym.st_size == 0 || addr <= sym.st_value + sym.st_size)) {
-            if (!sym.st_value) {
-                return false;
-            }
-            if (name) {
-                *name = symtab.strtab + sym.st_name;
-            }
-            if (start) {
-                *start = sym.st_value;
-            }
-            return true;
-        } else if (sym.st_value < addr) {
+        if (symtab.addr[m] <= off) {
             l = m + 1;
         } else {
             r = m;
         }
     }
-    return false;
+    if (l == 0 || symtab.name[l - 1] == ELF_SYMTABREF_GAP) {
+        return false;
+    }
+    if (name) {
+        *name = symtab.strtab + symtab.name[l - 1];
+    }
+    if (start) {
+        *start = symtab.base + symtab.addr[l - 1];
+    }
+    return true;
 }
 
 
@@ -877,8 +1149,17 @@ void error_vprintf(const char* format, va_list val) {
 int check_keyboard() {
     int c = keyboard_readc();
     if (c == 'a' || c == 'f' || c == 'e') {
-        // Turn off the timer interrupt.
-        init_timer(-1);
+        log_flush();
+        // Turn off the timer interrupt, and stop the other CPUs, which
+        // may be running on stacks in the memory about to be cleared.
+        set_timer(0);
+        if (ncpu > 1) {
+            auto& lapic = lapicstate::get();
+            lapic.ipi_others(lapic.ipi_init);
+            while (lapic.ipi_pending()) {
+                pause();
+            }
+        }
         // Install a temporary page table to carry us through the
         // process of reinitializing memory. This replicates work the
         // bootloader does.
@@ -923,22 +1204,66 @@ int check_keyboard() {
 //    Loop until user presses Control-C, then poweroff.
 
 [[noreturn]] void fail() {
+    log_flush();
     while (true) {
         check_keyboard();
     }
 }
 
 
+// copy_from_user(dst, it, sz), copy_to_user(it, src, sz)
+//    Copy `sz` bytes between kernel memory and user memory starting at
+//    `it`. Each mapping range is checked once and copied with `memcpy`.
+//    Stop at the first absent or non-user-accessible page (for
+//    `copy_to_user`, also non-writable, such as copy-on-write). Return
+//    the number of bytes copied.
+
+size_t copy_from_user(void* dst, vmiter it, size_t sz) {
+    char* d = reinterpret_cast<char*>(dst);
+    size_t i = 0;
+    while (i < sz && it.user()) {
+        size_t n = min(sz - i, it.range_size());
+        memcpy(d + i, it.kptr<const char*>(), n);
+        i += n;
+        it += n;
+    }
+    return i;
+}
+
+size_t copy_to_user(vmiter it, const void* src, size_t sz) {
+    const char* s = reinterpret_cast<const char*>(src);
+    size_t i = 0;
+    while (i < sz && it.perm(PTE_P | PTE_W | PTE_U)) {
+        size_t n = min(sz - i, it.range_size());
+        memcpy(it.kptr<char*>(), s + i, n);
+        i += n;
+        it += n;
+    }
+    return i;
+}
+
+
 // strlcpy_from_user(buf, it, maxlen)
 //    Copy a C string from `it` into `buf`. Copies at most `maxlen-1`
 //    characters, then null-terminates the string. Stops at first
-//    absent or non-user-accessible byte.
+//    absent or non-user-accessible byte. Searches each mapping range for
+//    the terminator with `memchr`.
 
 void strlcpy_from_user(char* buf, vmiter it, size_t maxlen) {
     size_t i = 0;
     while (i + 1 < maxlen && it.user()) {
-        buf[i] = *it.kptr<const char*>();
-        ++i, ++it;
+        size_t n = min(maxlen - 1 - i, it.range_size());
+        const char* src = it.kptr<const char*>();
+        const void* nul = memchr(src, '\0', n);
+        if (nul) {
+            n = reinterpret_cast<const char*>(nul) - src;
+        }
+        memcpy(buf + i, src, n);
+        i += n;
+        if (nul) {
+            break;
+        }
+        it += n;
     }
     if (i < maxlen) {
         buf[i] = '\0';
@@ -979,6 +1304,15 @@ void print_backtrace(printer& pr, const backtrace_regs& regs,
     }
 }
 
+int backtrace_collect(const regstate& regs, x86_64_pagetable* pt,
+                      uintptr_t* frames, int max) {
+    int n = 0;
+    for (backtracer bt(regs, pt); bt.ok() && n != max; bt.step(), ++n) {
+        frames[n] = bt.ret_rip();
+    }
+    return n;
+}
+
 void log_print_backtrace() {
     log_printer pr;
     print_backtrace(pr, backtrace_current_regs(), backtrace_current_pagetable(),
@@ -1255,4 +1589,9 @@ static void stash_kernel_data(bool reboot) {
 // `proc` members have fixed offsets
 static_assert(offsetof(proc, pagetable) == 0, "proc::pagetable has bad offset");
 static_assert(offsetof(proc, state) == 12, "proc::state has bad offset");
-static_assert(offsetof(proc, regs) == 16, "proc::refs has bad offset");
+static_assert(offsetof(proc, regs) == PROC_REGS, "proc::refs has bad offset");
+static_assert(PROC_REGS + sizeof(regstate) == PROC_REGS_END, "");
+static_assert(offsetof(regstate, reg_cs) == REGSTATE_CS, "");
+static_assert(offsetof(regstate, reg_rip) == REGSTATE_RIP, "");
+static_assert(PROC_REGS_END % 16 == 0 && alignof(proc) % 16 == 0,
+              "exception frames in proc::regs must be 16-byte aligned");
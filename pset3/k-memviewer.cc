@@ -5,6 +5,12 @@
 //
 //    The `memusage` class tracks memory usage by walking page tables,
 //    looks for errors, and prints the memory map to the console.
+//
+//    Walking every page table on every redraw costs time proportional to
+//    the total number of mappings. Instead, `memusage` remembers each
+//    process's contribution to the map and rewalks only processes whose
+//    page tables changed (reported by `memviewer_mark_pagetable`), then
+//    redraws only pages whose flags or allocation state changed.
 
 
 class memusage {
@@ -15,6 +21,7 @@ class memusage {
     static constexpr uintptr_t max_view_pa = 512 * PAGESIZE;
     // shows virtual addresses in the range [0, max_view_va)
     static constexpr uintptr_t max_view_va = 768 * PAGESIZE;
+    static constexpr unsigned npages = maxpa / PAGESIZE;
 
     memusage() = default;
 
@@ -38,6 +45,24 @@ class memusage {
 
     // Refresh the memory map from current state
     void refresh();
+    // Forget what is on the console, so the next refresh redraws it all
+    void invalidate() {
+        invalid_ = true;
+    }
+
+    // Return true if the last refresh may have changed the symbol for
+    // physical page `pn`
+    bool changed(unsigned pn) const {
+        return pn >= npages || (changed_[pn / 64] & (1UL << (pn % 64)));
+    }
+    // Return true if the last refresh changed any page's symbol
+    bool any_changed() const {
+        return any_changed_;
+    }
+    // Return true if the last refresh rewalked process `pid`
+    bool walked(int pid) const {
+        return walked_[pid];
+    }
 
     // Return the symbol (character & color) associated with `pa`
     uint16_t symbol_at(uintptr_t pa) const;
@@ -53,6 +78,16 @@ class memusage {
 
   private:
     unsigned* v_ = nullptr;
+    // Flags each process contributes, `npages` per pid (pid 0 is the
+    // kernel page table). Low bits are the current flags; `walk` collects
+    // new flags in the high bits.
+    uint8_t* rows_ = nullptr;
+    // Page tables as of the last refresh
+    x86_64_pagetable* pagetables_[MAXNPROC] = {};
+    bool walked_[MAXNPROC] = {};
+    uint64_t changed_[npages / 64] = {};
+    bool any_changed_ = false;
+    bool invalid_ = true;
     mutable unsigned nerrors_ = 0;
     bool separate_tables_ = false;
     int error_sympos_ = -1;
@@ -68,74 +103,198 @@ class memusage {
     static int marked_pid(unsigned v) {
         return lsb(v >> 3);
     }
+    void set_changed(unsigned pn) {
+        changed_[pn / 64] |= 1UL << (pn % 64);
+    }
+    // recalculate `v_` for every page when processes share the kernel
+    // page table
+    void refresh_all();
+    // recalculate `pid`'s row of `rows_`
+    void walk(int pid);
     // print an error about a page table
     void page_error(uintptr_t pa, const char* desc, int pid) const;
 };
 
 
+// Changes since the last refresh, reported by the `memviewer_mark`
+// functions. Entry 0 of `dirty_procs` is the kernel page table.
+static bool dirty_procs[MAXNPROC];
+static uint64_t dirty_pages[memusage::npages / 64];
+
+void memviewer_mark_pagetable(x86_64_pagetable* pt) {
+    if (pt == kernel_pagetable) {
+        dirty_procs[0] = true;
+        return;
+    }
+    for (int pid = 1; pid < MAXNPROC; ++pid) {
+        if (ptable[pid].pagetable == pt) {
+            dirty_procs[pid] = true;
+            return;
+        }
+    }
+}
+
+void memviewer_mark_page(uintptr_t pa) {
+    if (pa < memusage::maxpa) {
+        dirty_pages[pa / PAGESIZE / 64] |= 1UL << (pa / PAGESIZE % 64);
+    }
+}
+
+
 // memusage::refresh()
 //    Calculate the current physical usage map, using the current process
-//    table.
+//    table. Afterwards `changed(pn)` is true for every page whose symbol
+//    may differ from the last refresh.
 
 void memusage::refresh() {
     if (!v_) {
         v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE));
-        assert(v_ != nullptr);
+        rows_ = reinterpret_cast<uint8_t*>(kalloc(MAXNPROC * npages));
+        assert(v_ != nullptr && rows_ != nullptr);
+        memset(v_, 0, npages * sizeof(*v_));
+        memset(rows_, 0, MAXNPROC * npages);
     }
 
-    memset(v_, 0, (maxpa / PAGESIZE) * sizeof(*v_));
+    memcpy(changed_, dirty_pages, sizeof(changed_));
+    memset(dirty_pages, 0, sizeof(dirty_pages));
 
-    // mark kernel page tables
-    for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
-        mark(it.pa(), f_kernel);
-    }
-    mark(kptr2pa(kernel_pagetable), f_kernel);
-    mark(kptr2pa(v_), f_kernel);
-
-    // mark pages accessible from each process's page table
-    separate_tables_ = false;
+    // a process whose page table appeared, was replaced, or was freed
+    // must be rewalked too
+    bool separate_tables = false;
     for (int pid = 1; pid < MAXNPROC; ++pid) {
-        unsigned pidflag = f_process(pid);
         proc* p = &ptable[pid];
-        if (p->state != P_FREE
-            && p->pagetable
-            && p->pagetable != kernel_pagetable) {
-            separate_tables_ = true;
+        x86_64_pagetable* pt = nullptr;
+        if (p->state != P_FREE && p->pagetable != kernel_pagetable) {
+            pt = p->pagetable;
+        }
+        if (pt != pagetables_[pid]) {
+            pagetables_[pid] = pt;
+            dirty_procs[pid] = true;
+        }
+        separate_tables = separate_tables || pt;
+    }
 
-            for (ptiter it(p); it.va() < VA_LOWEND; it.next()) {
-                mark(it.pa(), f_kernel | pidflag);
-            }
-            mark(kptr2pa(p->pagetable), f_kernel | pidflag);
-
-            for (vmiter it(p, 0); it.va() < VA_LOWEND; ) {
-                if (it.user()) {
-                    if (it.va() == it.pa()) {
-                        mark(it.pa(), f_user | pidflag);
-                    } else {
-                        mark(it.pa(), f_user | f_nonidentity | pidflag);
-                    }
-                    it.next();
-                } else {
-                    it.next_range();
+    if (!separate_tables) {
+        // processes share the kernel page table, so the map depends on
+        // more than page tables: recalculate it all
+        separate_tables_ = false;
+        refresh_all();
+        for (int pid = 0; pid < MAXNPROC; ++pid) {
+            walked_[pid] = true;
+        }
+        memset(changed_, 0xFF, sizeof(changed_));
+        any_changed_ = true;
+        return;
+    }
+    if (invalid_ || !separate_tables_) {
+        separate_tables_ = true;
+        memset(rows_, 0, MAXNPROC * npages);
+        for (int pid = 0; pid < MAXNPROC; ++pid) {
+            dirty_procs[pid] = true;
+        }
+        memset(changed_, 0xFF, sizeof(changed_));
+        invalid_ = false;
+    }
+
+    for (int pid = 0; pid < MAXNPROC; ++pid) {
+        walked_[pid] = dirty_procs[pid];
+        if (dirty_procs[pid]) {
+            walk(pid);
+            dirty_procs[pid] = false;
+        }
+    }
+
+    // recalculate the flags of changed pages from the rows
+    any_changed_ = false;
+    for (unsigned w = 0; w != npages / 64; ++w) {
+        for (uint64_t bits = changed_[w]; bits; bits &= bits - 1) {
+            unsigned pn = w * 64 + lsb(bits) - 1;
+            unsigned v = 0;
+            for (int pid = 0; pid < MAXNPROC; ++pid) {
+                if (unsigned f = rows_[pid * npages + pn]) {
+                    v |= f | f_process(pid);
                 }
             }
+            v_[pn] = v;
+            any_changed_ = true;
         }
     }
+}
+
+void memusage::walk(int pid) {
+    uint8_t* row = &rows_[pid * npages];
+    auto mark = [&] (uintptr_t pa, unsigned flags) {
+        if (pa < maxpa) {
+            row[pa / PAGESIZE] |= flags << 4;
+        }
+    };
 
-    // if no different process page tables, use physical address instead
-    if (!separate_tables_) {
-        for (vmiter it(kernel_pagetable, 0); it.va() < VA_LOWEND; ) {
-            if (it.user()
-                && it.pa() < MEMSIZE_PHYSICAL
-                && physpages[it.pa() / PAGESIZE].used()) {
-                unsigned owner = (it.pa() - PROC_START_ADDR) / 0x40000;
-                mark(it.pa(), f_user | f_process(owner + 1));
+    if (pid == 0) {
+        // mark kernel page tables and the viewer's own memory
+        for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
+            mark(it.pa(), f_kernel);
+        }
+        mark(kptr2pa(kernel_pagetable), f_kernel);
+        mark(kptr2pa(v_), f_kernel);
+        for (size_t off = 0; off < MAXNPROC * npages; off += PAGESIZE) {
+            mark(kptr2pa(rows_) + off, f_kernel);
+        }
+    } else if (pagetables_[pid]) {
+        // mark pages accessible from the process's page table
+        for (ptiter it(pagetables_[pid]); it.va() < VA_LOWEND; it.next()) {
+            mark(it.pa(), f_kernel);
+        }
+        mark(kptr2pa(pagetables_[pid]), f_kernel);
+
+        for (vmiter it(pagetables_[pid], 0); it.va() < VA_LOWEND; ) {
+            if (it.user()) {
+                if (it.va() == it.pa()) {
+                    mark(it.pa(), f_user);
+                } else {
+                    mark(it.pa(), f_user | f_nonidentity);
+                }
                 it.next();
             } else {
                 it.next_range();
             }
         }
     }
+
+    // install the new flags, noting which pages changed
+    for (unsigned pn = 0; pn != npages; ++pn) {
+        unsigned f = row[pn] >> 4;
+        if (f != (row[pn] & 0xFU)) {
+            set_changed(pn);
+        }
+        row[pn] = f;
+    }
+}
+
+void memusage::refresh_all() {
+    memset(v_, 0, npages * sizeof(*v_));
+
+    // mark kernel page tables
+    for (ptiter it(kernel_pagetable); !it.done(); it.next()) {
+        mark(it.pa(), f_kernel);
+    }
+    mark(kptr2pa(kernel_pagetable), f_kernel);
+    mark(kptr2pa(v_), f_kernel);
+    for (size_t off = 0; off < MAXNPROC * npages; off += PAGESIZE) {
+        mark(kptr2pa(rows_) + off, f_kernel);
+    }
+
+    // no process has its own page table, so use physical address instead
+    for (vmiter it(kernel_pagetable, 0); it.va() < VA_LOWEND; ) {
+        if (it.user()
+            && it.pa() < MEMSIZE_PHYSICAL
+            && physpages[it.pa() / PAGESIZE].used()) {
+            unsigned owner = (it.pa() - PROC_START_ADDR) / 0x40000;
+            mark(it.pa(), f_user | f_process(owner + 1));
+            it.next();
+        } else {
+            it.next_range();
+        }
+    }
 }
 
 void memusage::page_error(uintptr_t pa, const char* desc, int pid) const {
@@ -196,7 +355,9 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
     } else {
         auto vx = v & ~f_nonidentity;
         if (vx == 0) {
-            if (physpages[pn].used()) {
+            if (physpages[pn].flags & PPI_SLAB) {
+                return 's' | 0x0D00;
+            } else if (physpages[pn].used()) {
                 // Leaked page: used but not referenced by anything we know
                 return 'L' | 0x0300;
             } else {
@@ -228,9 +389,13 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
                 // shared page
                 ch = 'S' | 0x0F00;
             } else {
-                // non-shared page
+                // non-shared page, dimmed if outside the working set
                 static const char names[] = "K123456789ABCDEFGHIJKLMNOPQRST??";
                 ch |= names[pid];
+                if (!(v & f_kernel) && pn < NPAGES
+                    && physpages[pn].age >= WS_WINDOW) {
+                    ch &= ~0x0800;
+                }
             }
             return ch;
         }
@@ -241,10 +406,32 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
 static void console_memviewer_virtual(memusage& mu, proc* vmp) {
     assert(vmp->pagetable != nullptr);
 
-    const char* statemsg = vmp->state == P_FAULTED ? " (faulted)" : "";
+    // redraw only if the process, its mappings, its state, or the
+    // symbols for physical pages changed
+    static proc* last_vmp;
+    static x86_64_pagetable* last_pagetable;
+    static int last_state;
+    if (vmp == last_vmp
+        && vmp->pagetable == last_pagetable
+        && vmp->state == last_state
+        && !mu.walked(vmp->pid)
+        && !mu.any_changed()) {
+        return;
+    }
+    last_vmp = vmp;
+    last_pagetable = vmp->pagetable;
+    last_state = vmp->state;
+
+    const char* statemsg = vmp->state == P_FAULTED ? " (faulted)"
+        : vmp->state == P_ZOMBIE ? " (exiting)" : "";
     console_printf(CPOS(10, 26),
                    CS_WHITE "VIRTUAL ADDRESS SPACE FOR %d" CS_NORMAL "%s\n",
                    vmp->pid, statemsg);
+    // working set, user, shared, and page table pages, from the
+    // process's counters
+    console_printf(CPOS(10, 0), CS_NORMAL "ws %3u/%-3u sh %3u pt %2u",
+                   vmp->mem.working_set, vmp->mem.resident,
+                   vmp->mem.shared, vmp->mem.pagetable);
 
     for (vmiter it(vmp, 0);
          it.va() < memusage::max_view_va;
@@ -278,11 +465,21 @@ void console_memviewer(proc* vmp) {
 
     // track physical memory
     static memusage mu;
+    static proc* last_vmp;
+    // redraw everything if something else overwrote the viewer
+    bool redraw = (console[CPOS(0, 32)] & 0xFF) != 'P' || (vmp && !last_vmp);
+    if (redraw) {
+        mu.invalidate();
+    }
+    last_vmp = vmp;
     mu.refresh();
 
     // print physical memory
     console_printf(CPOS(0, 32), CS_WHITE "PHYSICAL MEMORY\n");
     for (int pn = 0; pn * PAGESIZE < memusage::max_view_pa; ++pn) {
+        if (!mu.changed(pn)) {
+            continue;
+        }
         if (pn % 64 == 0) {
             console_printf(mu.sympos(1, pn) - 9, CS_WHITE "0x%06X ", pn << 12);
         }
@@ -291,6 +488,25 @@ void console_memviewer(proc* vmp) {
     }
     mu.set_error_sympos(-1);
 
+    // print `kmalloc` objects in use per size class, below the map
+    static unsigned last_nused[KMALLOC_NCLASSES];
+    unsigned nused[KMALLOC_NCLASSES], npages, total_pages = 0;
+    for (int cls = 0; cls != KMALLOC_NCLASSES; ++cls) {
+        kmalloc_usage(cls, &nused[cls], &npages);
+        total_pages += npages;
+        redraw = redraw || nused[cls] != last_nused[cls];
+    }
+    if (redraw) {
+        memcpy(last_nused, nused, sizeof(nused));
+        int cpos = console_printf(CPOS(9, 0), CS_WHITE "kmalloc" CS_NORMAL);
+        for (int cls = 0; cls != KMALLOC_NCLASSES; ++cls) {
+            unsigned size = 16U << cls;
+            cpos = console_printf(cpos, size < 1024 ? " %u:%-3u" : " %uK:%-3u",
+                                  size < 1024 ? size : size / 1024, nused[cls]);
+        }
+        console_printf(cpos, " %3u pages", total_pages);
+    }
+
     // print virtual memory
     if (vmp) {
         console_memviewer_virtual(mu, vmp);
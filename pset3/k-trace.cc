@@ -0,0 +1,318 @@
+#include "kernel.hh"
+
+// k-trace.cc
+//
+//    Kernel tracepoints. `trace` stamps an event with the TSC and appends
+//    it to this CPU's ring, which keeps the last TRACE_RING_SIZE events;
+//    writing one costs a `rdtsc` and a few stores, so the tracepoints
+//    stay on. Each ring is a page from `kalloc`, allocated at boot for
+//    each running CPU; the kernel image has no room for them. System
+//    calls are also timed from entry until the kernel returns to user
+//    mode or idles, whichever path they leave by, and the latencies are
+//    counted in log2 histograms per system call number.
+//    `trace_dump` (`sys_trace_dump`, or Control-T) writes both to
+//    `log.txt`, along with the profile below.
+//
+//    The sampling profiler counts, on every timer interrupt, the
+//    interrupted call stack: the process's %rip and up to PROFILE_DEPTH-1
+//    return addresses from `backtrace_collect`, or just the %rip if the
+//    CPU was idle. Identical stacks share an entry in `profile_table`, an
+//    open-addressed hash table in pages from `kalloc`. `profile_report`
+//    (also Control-P) prints a flat profile by function and the most
+//    common stacks. Kernel functions are named with `lookup_symbol`; user
+//    addresses are printed raw, for `obj/p-*.sym`. The kernel runs with
+//    interrupts disabled except in `idle`, so kernel samples only show
+//    idle time. The timer is one-shot, so a busy CPU is sampled at least
+//    once per time slice, and an idle CPU rarely.
+
+struct trace_event {
+    uint64_t tsc;
+    uint64_t arg;
+    uint16_t type;
+    int16_t pid;                        // `current` when recorded, or -1
+};
+
+#define TRACE_RING_SIZE         128
+struct trace_ring {
+    trace_event ev[TRACE_RING_SIZE];
+    unsigned long n;                    // events ever recorded
+    bool in_syscall;                    // is a system call running?
+    int syscall_no;                     // its number
+    uint64_t syscall_tsc;               // its start
+};
+static_assert(sizeof(trace_ring) <= PAGESIZE, "trace_ring too big");
+static trace_ring* trace_rings[MAXNCPU];
+
+#define PROFILE_DEPTH           4
+#define PROFILE_PAGES           4
+struct profile_entry {
+    uintptr_t frames[PROFILE_DEPTH];    // %rip, then return addresses
+    int16_t pid;                        // -1 for idle
+    uint16_t depth;                     // number of `frames`
+    uint32_t count;                     // samples; 0 if unused
+};
+#define PROFILE_NENTRIES  (PROFILE_PAGES * PAGESIZE / sizeof(profile_entry))
+#define PROFILE_MAXPROBES       16
+static profile_entry* profile_table;
+static unsigned long profile_nsamples;
+static unsigned long profile_lost;      // samples that found no entry
+
+void init_trace() {
+    for (int cpu = 0; cpu != ncpu; ++cpu) {
+        trace_rings[cpu] = reinterpret_cast<trace_ring*>(kalloc(PAGESIZE));
+        assert(trace_rings[cpu]);
+        memset(trace_rings[cpu], 0, sizeof(trace_ring));
+    }
+    profile_table = reinterpret_cast<profile_entry*>(kalloc(PROFILE_PAGES * PAGESIZE));
+    assert(profile_table);
+    memset(profile_table, 0, PROFILE_PAGES * PAGESIZE);
+}
+
+// Histogram bucket `b` counts latencies of [2^(b-1), 2^b) cycles
+#define TRACE_NSYSCALLS         19
+#define TRACE_NBUCKETS          40
+static unsigned long syscall_hist[TRACE_NSYSCALLS][TRACE_NBUCKETS];
+
+static const char* const syscall_names[TRACE_NSYSCALLS] = {
+    nullptr, "getpid", "yield", "panic", "page_alloc", "fork", "exit",
+    "page_alloc_range", "sleep", "waitpid", "trace_dump", "set_quantum",
+    "shm_create", "shm_map", "getc", "log", "spawn", "meminfo",
+    "write_console"
+};
+static const char* const trace_type_names[] = {
+    "syscall", "sysret", "pagefault", "switch", "kalloc", "kfree",
+    "swapout", "swapin"
+};
+
+
+void trace(int type, uint64_t arg) {
+    cpustate* c = this_cpu();
+    if (!trace_rings[c->index]) {
+        return;
+    }
+    trace_ring& r = *trace_rings[c->index];
+    trace_event& e = r.ev[r.n % TRACE_RING_SIZE];
+    e.tsc = rdtsc();
+    e.arg = arg;
+    e.type = type;
+    e.pid = c->current ? c->current->pid : -1;
+    ++r.n;
+}
+
+void trace_syscall_enter(int sysno) {
+    trace(TRACE_SYSCALL, sysno);
+    trace_ring* rp = trace_rings[this_cpu()->index];
+    if (!rp) {
+        return;
+    }
+    trace_ring& r = *rp;
+    r.in_syscall = true;
+    r.syscall_no = sysno;
+    r.syscall_tsc = r.ev[(r.n - 1) % TRACE_RING_SIZE].tsc;
+}
+
+void trace_syscall_exit() {
+    trace_ring* rp = trace_rings[this_cpu()->index];
+    if (!rp || !rp->in_syscall) {
+        return;
+    }
+    trace_ring& r = *rp;
+    trace(TRACE_SYSRET, r.syscall_no);
+    uint64_t cycles = r.ev[(r.n - 1) % TRACE_RING_SIZE].tsc - r.syscall_tsc;
+    if (unsigned(r.syscall_no) < TRACE_NSYSCALLS) {
+        int bucket = min(msb(cycles), TRACE_NBUCKETS - 1);
+        ++syscall_hist[r.syscall_no][bucket];
+    }
+    r.in_syscall = false;
+}
+
+
+// trace_dump()
+//    Log the system call histograms and each CPU's most recent events.
+
+#define TRACE_DUMP_EVENTS       32
+
+void trace_dump() {
+    log_printf("trace: syscall latency (cycles)\n");
+    for (int sysno = 0; sysno != TRACE_NSYSCALLS; ++sysno) {
+        unsigned long count = 0;
+        for (int b = 0; b != TRACE_NBUCKETS; ++b) {
+            count += syscall_hist[sysno][b];
+        }
+        if (count == 0) {
+            continue;
+        }
+        log_printf("  %s (%d): %lu calls\n",
+                   syscall_names[sysno] ? syscall_names[sysno] : "?",
+                   sysno, count);
+        for (int b = 0; b != TRACE_NBUCKETS; ++b) {
+            if (syscall_hist[sysno][b]) {
+                log_printf("    < %13lu: %lu\n", 1UL << b,
+                           syscall_hist[sysno][b]);
+            }
+        }
+    }
+
+    for (int cpu = 0; cpu != ncpu; ++cpu) {
+        if (!trace_rings[cpu]) {
+            continue;
+        }
+        trace_ring& r = *trace_rings[cpu];
+        unsigned long first = r.n > TRACE_DUMP_EVENTS ? r.n - TRACE_DUMP_EVENTS : 0;
+        log_printf("trace: cpu %d, last %lu of %lu events\n",
+                   cpu, r.n - first, r.n);
+        for (unsigned long i = first; i != r.n; ++i) {
+            const trace_event& e = r.ev[i % TRACE_RING_SIZE];
+            log_printf("  %lu %s pid %d %#lx\n", e.tsc,
+                       trace_type_names[e.type], e.pid, e.arg);
+        }
+    }
+
+    profile_report();
+}
+
+
+// profile_sample(regs, p)
+//    Count one sample of `p`'s (or the idle CPU's) call stack.
+
+void profile_sample(const regstate& regs, const proc* p) {
+    if (!profile_table) {
+        return;
+    }
+    ++profile_nsamples;
+    profile_entry key = {};
+    key.frames[0] = regs.reg_rip;
+    key.pid = p ? p->pid : -1;
+    key.depth = 1;
+    if (p) {
+        key.depth += backtrace_collect(regs, p->pagetable, key.frames + 1,
+                                       PROFILE_DEPTH - 1);
+    }
+
+    uint64_t h = key.pid;
+    for (int i = 0; i != key.depth; ++i) {
+        h = (h ^ key.frames[i]) * 0x9E3779B97F4A7C15UL;
+    }
+    for (int probe = 0; probe != PROFILE_MAXPROBES; ++probe) {
+        profile_entry& e = profile_table[(h + probe) % PROFILE_NENTRIES];
+        if (e.count == 0) {
+            e = key;
+            e.count = 1;
+            return;
+        } else if (e.pid == key.pid && e.depth == key.depth
+                   && memcmp(e.frames, key.frames,
+                             key.depth * sizeof(uintptr_t)) == 0) {
+            ++e.count;
+            return;
+        }
+    }
+    ++profile_lost;
+}
+
+
+// profile_function(e, name)
+//    Return the function containing `e`'s %rip, for grouping: the symbol's
+//    start for kernel code, setting `*name`, and otherwise the %rip itself.
+
+static uintptr_t profile_function(const profile_entry& e, const char** name) {
+    uintptr_t start;
+    *name = nullptr;
+    if (e.pid < 0 && lookup_symbol(e.frames[0], name, &start)) {
+        return start;
+    }
+    return e.frames[0];
+}
+
+static void profile_print_frame(uintptr_t rip, bool kernel) {
+    const char* name;
+    if (kernel && lookup_symbol(rip, &name, nullptr)) {
+        log_printf(" %p <%s>", rip, name);
+    } else {
+        log_printf(" %p", rip);
+    }
+}
+
+
+// profile_report()
+//    Log the PROFILE_REPORT_TOP functions and call stacks with the most
+//    samples.
+
+#define PROFILE_REPORT_TOP      20
+
+void profile_report() {
+    if (!profile_table) {
+        return;
+    }
+    log_printf("profile: %lu samples, %lu lost\n",
+               profile_nsamples, profile_lost);
+
+    // Flat profile: add each function's entries into its first entry
+    static_assert(PROFILE_NENTRIES * sizeof(uint32_t) <= PAGESIZE,
+                  "profile totals too big");
+    uint32_t* totals = reinterpret_cast<uint32_t*>(kalloc(PAGESIZE));
+    if (!totals) {
+        log_printf("  (out of memory)\n");
+        return;
+    }
+    for (size_t i = 0; i != PROFILE_NENTRIES; ++i) {
+        totals[i] = profile_table[i].count;
+    }
+    for (size_t i = 0; i != PROFILE_NENTRIES; ++i) {
+        const char* name;
+        if (!totals[i]) {
+            continue;
+        }
+        uintptr_t fn = profile_function(profile_table[i], &name);
+        for (size_t j = i + 1; j != PROFILE_NENTRIES; ++j) {
+            if (totals[j] && profile_table[j].pid == profile_table[i].pid
+                && profile_function(profile_table[j], &name) == fn) {
+                totals[i] += totals[j];
+                totals[j] = 0;
+            }
+        }
+    }
+    log_printf("  flat:\n");
+    for (int n = 0; n != PROFILE_REPORT_TOP; ++n) {
+        size_t best = 0;
+        for (size_t i = 1; i != PROFILE_NENTRIES; ++i) {
+            if (totals[i] > totals[best]) {
+                best = i;
+            }
+        }
+        if (!totals[best]) {
+            break;
+        }
+        const profile_entry& e = profile_table[best];
+        const char* name;
+        uintptr_t fn = profile_function(e, &name);
+        log_printf("  %8u  %3lu%%  pid %2d  %p <%s>\n", totals[best],
+                   totals[best] * 100 / max(profile_nsamples, 1UL), e.pid,
+                   fn, name ? name : "user");
+        totals[best] = 0;
+    }
+
+    // Call stacks, innermost frame first
+    for (size_t i = 0; i != PROFILE_NENTRIES; ++i) {
+        totals[i] = profile_table[i].count;
+    }
+    log_printf("  stacks:\n");
+    for (int n = 0; n != PROFILE_REPORT_TOP; ++n) {
+        size_t best = 0;
+        for (size_t i = 1; i != PROFILE_NENTRIES; ++i) {
+            if (totals[i] > totals[best]) {
+                best = i;
+            }
+        }
+        if (!totals[best]) {
+            break;
+        }
+        const profile_entry& e = profile_table[best];
+        log_printf("  %8u  pid %2d ", e.count, e.pid);
+        for (int f = 0; f != e.depth; ++f) {
+            profile_print_frame(e.frames[f], e.pid < 0);
+        }
+        log_printf("\n");
+        totals[best] = 0;
+    }
+    kfree(totals);
+}
@@ -68,23 +68,63 @@ int vmiter::try_map(uintptr_t pa, int perm) {
 
     while (lbits_ > PAGEOFFBITS && perm) {
         assert(!(*pep_ & PTE_P));
-        x86_64_pagetable* pt = static_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
+        x86_64_pagetable* pt = kalloc_pagetable();
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = reinterpret_cast<uintptr_t>(pt) | PTE_P | PTE_W | PTE_U;
+        meminfo_add_pagetable(pt_);
         down();
     }
 
     if (lbits_ == PAGEOFFBITS) {
+        meminfo_account(pt_, va_, *pep_, pa | perm);
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = pa | perm;
     }
+    memviewer_mark_pagetable(pt_);
+    tlb_mark_pagetable(pt_);
     return 0;
 }
 
+int vmiter::try_map_range(uintptr_t pa, size_t sz, int perm) {
+    assert((va_ % PAGESIZE) == 0 && (sz % PAGESIZE) == 0,
+           "vmiter::try_map_range range not aligned");
+    assert(perm & PTE_P ? (pa & PTE_PAMASK) == pa : (pa & PTE_P) == 0,
+           "vmiter::try_map_range invalid pa");
+    uintptr_t pa_step = perm & PTE_P ? PAGESIZE : 0;
+    uintptr_t end = va_ + sz;
+    int r = 0;
+    while (va_ != end) {
+        if (lbits_ > PAGEOFFBITS && !perm) {
+            // nothing to unmap down this missing subtree
+            find_impl(va_ + min(range_size(), end - va_), true);
+        } else if (lbits_ > PAGEOFFBITS) {
+            // `try_map` allocates the page table pages
+            if ((r = try_map(pa, perm)) != 0) {
+                break;
+            }
+            pa += pa_step;
+            find_impl(va_ + PAGESIZE, true);
+        } else {
+            // fill the rest of this level-1 page table page
+            assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
+            size_t n = min((end - va_) / PAGESIZE,
+                           size_t(512 - ((va_ >> PAGEOFFBITS) & 0x1FF)));
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i != n; ++i, pa += pa_step) {
+                meminfo_account(pt_, va_ + i * PAGESIZE, pep_[i], pa | perm);
+                pep_[i] = pa | perm;
+            }
+            find_impl(va_ + n * PAGESIZE, true);
+        }
+    }
+    memviewer_mark_pagetable(pt_);
+    tlb_mark_pagetable(pt_);
+    return r;
+}
+
 
 uint64_t vmiter::range_perm(size_t sz) const {
     uint64_t p = sz > 0 ? perm() : uint64_t(-1);
@@ -38,6 +38,9 @@ class vmiter {
     // or `nullptr` if `this->va()` is unmapped
     template <typename T = void*>
     inline T kptr() const;
+    // Return the raw level-1 page table entry for `this->va()`, present or
+    // not, or 0 if `this->va()` has no level-1 entry
+    inline x86_64_pageentry_t pte() const;
 
     // PERMISSIONS
     // Return permissions at `this->va()` (or 0 if `PTE_P` is not set)
@@ -100,6 +103,26 @@ class vmiter {
     [[gnu::warn_unused_result]] inline int try_map(void* kptr, int perm);
     [[gnu::warn_unused_result]] inline int try_map(volatile void* kptr, int perm);
 
+    // Map the `sz` bytes from `this->va()` to the physical range starting
+    // at `pa` with permissions `perm` (or, if `perm == 0`, unmap them), and
+    // advance to `this->va() + sz`. `this->va()`, `pa`, and `sz` must be
+    // page-aligned. Fills each level-1 page table page's entries in one
+    // loop, allocating missing page table pages once each, and marks the
+    // page table changed once. Returns 0, or a negative error code if
+    // `kalloc` fails; then the range is mapped up to `this->va()`.
+    [[gnu::warn_unused_result]] int try_map_range(uintptr_t pa, size_t sz, int perm);
+    // Same, but panics if `kalloc` fails
+    inline void map_range(uintptr_t pa, size_t sz, int perm);
+    // Unmap the `sz` bytes from `this->va()` and advance past them. Never
+    // allocates; skips ranges with no page table pages.
+    inline void unmap_range(size_t sz);
+
+    // Clear `bits` (such as `PTE_A | PTE_D`) in the level-1 entry for
+    // `this->va()`, atomically, since the CPU may be setting them, and
+    // return those that were set. Unlike `map`, does not mark the page
+    // table changed: the caller must make TLBs forget the entry.
+    inline uint64_t take_bits(uint64_t bits);
+
     // Invalidate TLB entry for `va()`
     inline void invalidate();
     // Invalidate whole TLB: if this page table is installed, reload it
@@ -228,6 +251,9 @@ inline T vmiter::kptr() const {
         return nullptr;
     }
 }
+inline x86_64_pageentry_t vmiter::pte() const {
+    return lbits_ == PAGEOFFBITS ? *pep_ : 0;
+}
 inline uint64_t vmiter::perm() const {
     // Returns 0-0xFFF. (XXX Does not track PTE_XD.)
     // Returns 0 unless `(*pep_ & perm_ & PTE_P) != 0`.
@@ -302,11 +328,27 @@ inline int vmiter::try_map(volatile void* kp, int perm) {
     assert(kp != nullptr);
     return try_map(reinterpret_cast<uintptr_t>(kp), perm);
 }
+inline uint64_t vmiter::take_bits(uint64_t bits) {
+    if (lbits_ != PAGEOFFBITS) {
+        return 0;
+    }
+    return __atomic_fetch_and(pep_, ~bits, __ATOMIC_RELAXED) & bits;
+}
+inline void vmiter::map_range(uintptr_t pa, size_t sz, int perm) {
+    int r = try_map_range(pa, sz, perm);
+    assert(r == 0, "vmiter::map_range failed");
+}
+inline void vmiter::unmap_range(size_t sz) {
+    int r = try_map_range(0, sz, 0);
+    assert(r == 0);
+}
 inline void vmiter::invalidate() {
     invlpg(va());
 }
 inline void vmiter::invalidate_all() {
-    if (rdcr3() == reinterpret_cast<uintptr_t>(pt_)) {
+    // (`%cr3` may hold a PCID, and reloading it without CR3_NOFLUSH
+    // flushes that PCID's entries)
+    if ((rdcr3() & PTE_PAMASK) == reinterpret_cast<uintptr_t>(pt_)) {
         wrcr3(reinterpret_cast<uintptr_t>(pt_));
     }
 }
@@ -26,18 +26,69 @@
 
 proc ptable[MAXNPROC];          // array of process descriptors
                                 // Note that `ptable[0]` is never used.
-proc* current;                  // pointer to currently executing proc
-
-#define HZ 100                  // timer interrupt frequency (interrupts/sec)
-[[maybe_unused]] static std::atomic<unsigned long> ticks; // # timer interrupts so far
+#define current (this_cpu()->current) // process running on this CPU
+spinlock kernel_lock;
+#define SCHED_LEVELS 3          // run queue levels for `mlfq` scheduling
+#define SCHED_BOOST_TICKS 100   // ticks between `mlfq` priority boosts
+#define SCHED_QUANTUM 10000     // default time slice (usec; doubles per level)
+#define SCHED_MIN_QUANTUM 100   // bounds for `sys_set_quantum`
+#define SCHED_MAX_QUANTUM 1000000
+static proc* runq[SCHED_LEVELS]; // next process on each run queue level
+static int sched_levels = 1;    // levels in use: 1 unless `mlfq` (see `runq_insert`)
+static unsigned idle_cpus;      // CPUs halted in `idle`
+static unsigned woken_cpus;     // idle CPUs already sent IRQ_WAKEUP
+static unsigned check_interval = 1; // `run` checks every Nth run; 0 never
+static unsigned long run_count; // calls to `run`
+
+#define HZ 100                  // clock ticks per second
+#define MEMSHOW_TICKS 5         // clock ticks between memviewer refreshes
+#define WS_SCAN_TICKS 50        // clock ticks between working-set scans
+static std::atomic<unsigned long> ticks; // clock ticks so far (see `update_clock`)
+static uint64_t clock_start_tsc; // TSC at tick 0
+static uint64_t tsc_per_tick;
+static uint64_t idle_cycles;    // TSC cycles CPUs have spent in `idle`
+
+#define TIMER_WHEEL_SIZE 64     // sleeping processes, by `wake_tick` mod size
+static proc* timer_wheel[TIMER_WHEEL_SIZE];
+static unsigned long next_wake_tick = -1; // earliest `wake_tick` on the wheel
 
 
 // Memory state - see `kernel.hh`
 physpageinfo physpages[NPAGES];
+static void* zero_page;         // shared all-zero page (see `kalloc`)
+#define REAP_BATCH 32           // user pages freed per `reap_some` call
+
+// Kernel region mappings
+//    Every process page table maps the kernel region below
+//    PROC_START_ADDR like `kernel_pagetable` does, but kernel-only except
+//    for the console. That region shares its level-1 page table page with
+//    the first user addresses, so the page cannot be shared between
+//    processes. Instead `kernel_start` computes the region's level-1
+//    entries once, and `map_kernel_region` copies them into each new page
+//    table.
+static_assert(PROC_START_ADDR <= (PAGESIZE << PAGEINDEXBITS),
+              "kernel region must fit in one level-1 page table page");
+static x86_64_pageentry_t kernel_region_ptes[PROC_START_ADDR / PAGESIZE];
+static int map_kernel_region(x86_64_pagetable* pt);
 
 
 [[noreturn]] void schedule();
 [[noreturn]] void run(proc* p);
+[[noreturn]] void idle();
+static void set_state(proc* p, int state);
+static bool sched_timer(proc* p);
+static bool sched_preempted(proc* p);
+static void sched_boost();
+static void log_accounting(proc* p);
+static void update_clock();
+static void wss_scan();
+static void arm_timer(proc* p);
+static void wake_idle_cpu(proc* p);
+static bool reclaim_page();
+static bool reap_some(unsigned batch);
+static bool can_commit(size_t npages);
+static void wake_waiters(proc* p, int result);
+static void free_pagetable_and_pages(proc* p);
 void exception(regstate* regs);
 uintptr_t syscall(regstate* regs);
 void memshow();
@@ -47,63 +98,408 @@ void memshow();
 //    Initialize the hardware and processes and start running. The `command`
 //    string is an optional string passed from the boot loader.
 
-static void process_setup(pid_t pid, const char* program_name);
+static int process_setup(pid_t pid, const char* program_name);
+static void memory_benchmark();
 
 void kernel_start(const char* command) {
+    // The TSC counts from power-on, so this includes the BIOS and the boot
+    // loader's disk reads (a soft reboot counts from the first boot)
+    uint64_t boot_tsc = rdtsc();
+
     // initialize hardware
     init_hardware();
     log_printf("Starting WeensyOS\n");
 
+    // the kernel runs under `kernel_lock`; `run` and `idle` release it
+    kernel_lock.lock();
+    current = nullptr;
+
+    init_timer();
+    tsc_per_tick = tsc_per_usec * (1000000 / HZ);
+    log_printf("boot: kernel_start %lu usec after power-on\n",
+               boot_tsc / tsc_per_usec);
+    clock_start_tsc = rdtsc() - tsc_per_tick;
     ticks = 1;
-    init_timer(HZ);
+    idle_cpus = woken_cpus = 0;
 
     // clear screen
     console_clear();
 
-    // (re-)initialize kernel page table
-    for (uintptr_t addr = 0; addr < MEMSIZE_PHYSICAL; addr += PAGESIZE) {
-        int perm = PTE_P | PTE_W; // Default to kernel only access
-        if (addr == 0) {
-            // nullptr is inaccessible even to the kernel
-            perm = 0;
-        }
-        else if (addr == CONSOLE_ADDR) {
-            // CGA console page is accessible to user
-            perm = PTE_P | PTE_W | PTE_U;
-        }
-        else if (addr >= PROC_START_ADDR) {
-            // User region is accessible to user
-            perm = PTE_P | PTE_W | PTE_U;
+    // (re-)initialize kernel page table with identity mappings: kernel-
+    // only, except that nullptr is inaccessible even to the kernel and the
+    // CGA console and the user region are accessible to user. (Mappings
+    // during kernel_start MUST NOT fail; later mappings might fail!!)
+    {
+        vmiter it(kernel_pagetable, 0);
+        it.unmap_range(PAGESIZE);
+        it.map_range(PAGESIZE, CONSOLE_ADDR - PAGESIZE, PTE_P | PTE_W);
+        it.map_range(CONSOLE_ADDR, PAGESIZE, PTE_P | PTE_W | PTE_U);
+        it.map_range(CONSOLE_ADDR + PAGESIZE,
+                     PROC_START_ADDR - CONSOLE_ADDR - PAGESIZE, PTE_P | PTE_W);
+        it.map_range(PROC_START_ADDR, MEMSIZE_PHYSICAL - PROC_START_ADDR,
+                     PTE_P | PTE_W | PTE_U);
+    }
+
+    // compute the kernel region mappings for process page tables
+    for (vmiter kit(kernel_pagetable, 0); kit.va() < PROC_START_ADDR; kit.next()) {
+        int perm = kit.perm();
+        if (kit.va() != CONSOLE_ADDR) {
+            perm &= ~PTE_U;
         }
-        // install identity mapping
-        int r = vmiter(kernel_pagetable, addr).try_map(addr, perm);
-        assert(r == 0); // mappings during kernel_start MUST NOT fail
-                        // (Note that later mappings might fail!!)
+        kernel_region_ptes[kit.va() / PAGESIZE] = perm ? kit.pa() | perm : 0;
     }
 
+    // start the other CPUs
+    init_other_cpus();
+    log_printf("%d CPUs\n", ncpu);
+
+
+    // set up the shared zero page
+    zero_page = kalloc(PAGESIZE);
+    assert(zero_page);
+    clear_page(zero_page);
+
+    // move the log and trace rings out of the kernel image
+    init_log_ring();
+    init_trace();
+
+    memory_benchmark();
 
     // set up process descriptors
     for (pid_t i = 0; i < MAXNPROC; i++) {
         ptable[i].pid = i;
         ptable[i].state = P_FREE;
+        ptable[i].runq_next = ptable[i].runq_prev = nullptr;
+        ptable[i].wait_next = ptable[i].waiters = nullptr;
+        ptable[i].cpu = -1;
+        ptable[i].tlb_cpus = 0;
     }
+    memset(runq, 0, sizeof(runq));
+    memset(timer_wheel, 0, sizeof(timer_wheel));
+    next_wake_tick = -1;
     if (!command) {
         command = WEENSYOS_FIRST_PROCESS;
     }
+
+    // `PROGRAM:OPTION...` also sets options. The scheduler is `rr`
+    // (round-robin, the default) or `mlfq` (multilevel feedback; see
+    // `runq_insert`). `run` checks a process's registers and page table
+    // every time (`check`, the default), every Nth run (`check=N`), or
+    // never (`nocheck`).
+    char program[32];
+    strlcpy(program, command, sizeof(program));
+    sched_levels = 1;
+    check_interval = 1;
+    char* option = strchr(program, ':');
+    while (option) {
+        *option = '\0';
+        ++option;
+        char* next = strchr(option, ':');
+        if (next) {
+            *next = '\0';
+        }
+        if (strcmp(option, "mlfq") == 0) {
+            sched_levels = SCHED_LEVELS;
+        } else if (strcmp(option, "rr") == 0) {
+            sched_levels = 1;
+        } else if (strcmp(option, "check") == 0) {
+            check_interval = 1;
+        } else if (strncmp(option, "check=", 6) == 0) {
+            check_interval = strtol(option + 6, nullptr, 10);
+        } else if (strcmp(option, "nocheck") == 0) {
+            check_interval = 0;
+        } else {
+            log_printf("unknown option `%s`\n", option);
+        }
+        option = next;
+    }
+    command = program;
+
+    int r;
     if (!program_image(command).empty()) {
-        process_setup(1, command);
+        r = process_setup(1, command);
     } else {
-        process_setup(1, "allocator");
-        process_setup(2, "allocator2");
-        process_setup(3, "allocator3");
-        process_setup(4, "allocator4");
+        r = process_setup(1, "allocator")
+            | process_setup(2, "allocator2")
+            | process_setup(3, "allocator3")
+            | process_setup(4, "allocator4");
     }
+    assert(r == 0);
 
     // switch to first process using run()
     run(&ptable[1]);
 }
 
 
+// memory_benchmark()
+//    Logs the speed of the memory routines on whole pages, in bytes per
+//    TSC cycle, to `log.txt`. Runs once at boot and takes well under a
+//    millisecond.
+
+static void memory_benchmark() {
+    void* a = kalloc(PAGESIZE);
+    void* b = kalloc(PAGESIZE);
+    assert(a && b);
+    memset(b, 0x61, PAGESIZE);
+    volatile int sink = 0;
+
+    auto measure = [] (const char* name, auto fn) {
+        constexpr unsigned rounds = 64;
+        fn();                   // warm the caches
+        uint64_t start = rdtsc();
+        for (unsigned i = 0; i != rounds; ++i) {
+            fn();
+        }
+        uint64_t cycles = max(rdtsc() - start, uint64_t(1));
+        uint64_t centibytes = PAGESIZE * rounds * 100 / cycles;
+        log_printf("%-10s %lu.%02lu bytes/cycle\n", name,
+                   centibytes / 100, centibytes % 100);
+    };
+    measure("memcpy", [&] { memcpy(a, b, PAGESIZE); });
+    measure("copy_page", [&] { copy_page(a, b); });
+    measure("memmove", [&] { memmove(a, b, PAGESIZE); });
+    measure("memcmp", [&] { sink = memcmp(a, b, PAGESIZE); });
+    measure("memset", [&] { memset(a, 0xCC, PAGESIZE); });
+    measure("clear_page", [&] { clear_page(a); });
+    (void) sink;
+
+    kfree(a);
+    kfree(b);
+}
+
+
+// ap_start(index)
+//    The other CPUs come here from `ap_trampoline`, on their own kernel
+//    stacks, and start scheduling.
+
+void ap_start(int index) {
+    init_cpu(index);
+    kernel_lock.lock();
+    current = nullptr;
+    schedule();
+}
+
+
+// Buddy allocator
+//    Free physical memory is kept as blocks of 2^order pages, each aligned
+//    to its size, on one doubly-linked list per order. The links are page
+//    numbers in side arrays, so free memory itself is never touched.
+//    `kalloc` takes the smallest free block that fits and splits it,
+//    returning the unused halves to the lists; `kfree` merges a freed
+//    block with its buddy (the block whose page number differs only in
+//    bit `order`) for as long as the buddy is free too. Single pages take
+//    at most KALLOC_MAXORDER list operations either way.
+//
+//    Every page of an allocated block has refcount 1, so the memviewer's
+//    `used()` and `valid()` checks see it; the block's order is recorded
+//    at its first page. The first `kalloc` builds the lists from
+//    `allocatable_physical_address` and the refcounts.
+
+static constexpr int KALLOC_MAXORDER = msb(NPAGES) - 1;
+
+static int free_head[KALLOC_MAXORDER + 1];  // First free block of each order
+static int free_next[NPAGES];               // Links between free blocks
+static int free_prev[NPAGES];
+static int8_t free_order[NPAGES];   // Order of the free block starting here, or -1
+static int8_t block_order[NPAGES];  // Order of the block `kalloc` returned here, or -1
+static bool kalloc_ready = false;
+static size_t nfree_pages = 0;      // # free pages, including `zeroed_pages`
+
+// Pre-zeroed pages
+//    While no process can run, `schedule` moves free pages off the free
+//    lists into `zeroed_pages`, clearing them, so `kalloc_zeroed_page`
+//    (used for page tables and demand-zero faults) usually need not
+//    clear a page on the critical path. The pool is small, so it keeps
+//    little memory out of buddy merging; `kalloc` falls back on it only
+//    when the free lists are empty.
+static constexpr int ZEROED_POOL_SIZE = 16;
+static int zeroed_pages[ZEROED_POOL_SIZE];
+static int nzeroed_pages = 0;
+
+// Demand-zero pages
+//    `syscall_page_alloc` maps new pages to the shared, read-only
+//    `zero_page`, tagged PTE_COW, and allocates a real page only on the
+//    first write fault. Each such mapping holds a reservation, so that
+//    fault cannot run out of memory: `kalloc` keeps `nreserved_pages`
+//    free pages back for them, and `kfree(zero_page)`, called when a
+//    mapping goes away, releases one.
+static size_t nreserved_pages = 0;
+
+// Per-CPU page caches
+//    Single pages a CPU frees go to its `page_cache`, and its single-page
+//    allocations take from there first, so a page is usually reused on
+//    the CPU that last touched it, and most single-page `kalloc` and
+//    `kfree` calls skip the free lists. A cache refills from and drains
+//    to the free lists PAGE_CACHE_BATCH pages at a time. Cached pages are
+//    free (refcount 0, counted in `nfree_pages`) but cannot merge, so
+//    when the free lists cannot satisfy a request, `kalloc` empties
+//    every CPU's cache into them and tries again.
+static constexpr int PAGE_CACHE_SIZE = 16;
+static constexpr int PAGE_CACHE_BATCH = 8;
+struct page_cache {
+    int pages[PAGE_CACHE_SIZE];         // Most recently freed last
+    int n = 0;
+};
+static page_cache page_caches[MAXNCPU];
+
+static void free_list_push(int pageno, int order) {
+    free_order[pageno] = order;
+    free_prev[pageno] = -1;
+    free_next[pageno] = free_head[order];
+    if (free_head[order] >= 0) {
+        free_prev[free_head[order]] = pageno;
+    }
+    free_head[order] = pageno;
+}
+
+static void free_list_remove(int pageno) {
+    int order = free_order[pageno];
+    if (free_prev[pageno] >= 0) {
+        free_next[free_prev[pageno]] = free_next[pageno];
+    } else {
+        free_head[order] = free_next[pageno];
+    }
+    if (free_next[pageno] >= 0) {
+        free_prev[free_next[pageno]] = free_prev[pageno];
+    }
+    free_order[pageno] = -1;
+}
+
+// buddy_free(pageno, order)
+//    Returns the block of 2^`order` pages at `pageno` to the free lists,
+//    merging it with free buddies.
+
+static void buddy_free(int pageno, int order) {
+    nfree_pages += size_t(1) << order;
+    while (order < KALLOC_MAXORDER) {
+        int buddy = pageno ^ (1 << order);
+        if (size_t(buddy) >= NPAGES || free_order[buddy] != order) {
+            break;
+        }
+        free_list_remove(buddy);
+        pageno = min(pageno, buddy);
+        ++order;
+    }
+    free_list_push(pageno, order);
+}
+
+// take_free_block(order)
+//    Removes a free block of 2^`order` pages from the free lists,
+//    splitting the smallest larger block if needed. Returns its first
+//    page number, or -1 if there is none.
+
+static int take_free_block(int order) {
+    int k = order;
+    while (k <= KALLOC_MAXORDER && free_head[k] < 0) {
+        ++k;
+    }
+    if (k > KALLOC_MAXORDER) {
+        return -1;
+    }
+    int pageno = free_head[k];
+    free_list_remove(pageno);
+    while (k > order) {
+        --k;
+        free_list_push(pageno + (1 << k), k);
+    }
+    return pageno;
+}
+
+// claim_block(pageno, order)
+//    Marks the 2^`order` pages at `pageno` allocated and returns them.
+
+static void* claim_block(int pageno, int order) {
+    nfree_pages -= size_t(1) << order;
+    block_order[pageno] = order;
+    for (int i = 0; i != (1 << order); ++i) {
+        physpageinfo& pi = physpages[pageno + i];
+        assert(pi.refcount == 0);
+        pi.refcount = 1;
+        pi.flags = PPI_PINNED;
+        pi.owner = 0;
+        pi.age = 0;
+        memviewer_mark_page((pageno + i) * PAGESIZE);
+    }
+    return reinterpret_cast<void*>(pageno * PAGESIZE);
+}
+
+// page_cache_take()
+//    Removes a page from this CPU's cache, refilling it from the free
+//    lists if it is empty. Returns its page number, or -1 if there is
+//    none.
+
+static int page_cache_take() {
+    page_cache& pc = page_caches[this_cpu()->index];
+    while (pc.n < PAGE_CACHE_BATCH) {
+        int pageno = take_free_block(0);
+        if (pageno < 0) {
+            break;
+        }
+        pc.pages[pc.n] = pageno;
+        ++pc.n;
+    }
+    if (pc.n == 0) {
+        return -1;
+    }
+    --pc.n;
+    return pc.pages[pc.n];
+}
+
+// page_cache_put(pageno)
+//    Frees page `pageno` into this CPU's cache, first returning the
+//    cache's oldest pages to the free lists if it is full.
+
+static void page_cache_put(int pageno) {
+    page_cache& pc = page_caches[this_cpu()->index];
+    if (pc.n == PAGE_CACHE_SIZE) {
+        for (int i = 0; i != PAGE_CACHE_BATCH; ++i) {
+            --nfree_pages;              // `buddy_free` counts it again
+            buddy_free(pc.pages[i], 0);
+        }
+        pc.n -= PAGE_CACHE_BATCH;
+        memmove(pc.pages, pc.pages + PAGE_CACHE_BATCH, pc.n * sizeof(int));
+    }
+    ++nfree_pages;
+    pc.pages[pc.n] = pageno;
+    ++pc.n;
+}
+
+// drain_page_caches()
+//    Returns every CPU's cached pages to the free lists. Returns true if
+//    there were any.
+
+static bool drain_page_caches() {
+    bool any = false;
+    for (auto& pc : page_caches) {
+        for (int i = 0; i != pc.n; ++i) {
+            --nfree_pages;
+            buddy_free(pc.pages[i], 0);
+        }
+        any = any || pc.n != 0;
+        pc.n = 0;
+    }
+    return any;
+}
+
+static void init_buddy() {
+    for (auto& pc : page_caches) {
+        pc.n = 0;
+    }
+    for (int order = 0; order <= KALLOC_MAXORDER; ++order) {
+        free_head[order] = -1;
+    }
+    for (size_t pageno = 0; pageno != NPAGES; ++pageno) {
+        free_order[pageno] = block_order[pageno] = -1;
+    }
+    for (size_t pageno = 0; pageno != NPAGES; ++pageno) {
+        if (allocatable_physical_address(pageno * PAGESIZE)
+            && physpages[pageno].refcount == 0) {
+            buddy_free(pageno, 0);
+        }
+    }
+    kalloc_ready = true;
+}
+
 // kalloc(sz)
 //    Kernel physical memory allocator. Allocates at least `sz` contiguous bytes
 //    and returns a pointer to the allocated memory, or `nullptr` on failure.
@@ -115,45 +511,91 @@ void kernel_start(const char* command) {
 //    process use (so not reserved pages or kernel data), and from physical
 //    pages that are currently unused (`physpages[N].refcount == 0`).
 //
-//    On WeensyOS, `kalloc` is a page-based allocator: if `sz > PAGESIZE`
-//    the allocation fails; if `sz < PAGESIZE` it allocates a whole page
-//    anyway.
+//    On WeensyOS, `kalloc` is a page-based buddy allocator: it allocates
+//    the smallest power-of-two number of whole pages that holds `sz`
+//    bytes, aligned to its size, and fails if that exceeds
+//    `PAGESIZE << KALLOC_MAXORDER` or no such free block exists.
 //
 //    The returned memory is initially filled with 0xCC, which corresponds to
 //    the `int3` instruction. Executing that instruction will cause a `PANIC:
 //    Unhandled exception 3!` This may help you debug.
 
 void* kalloc(size_t sz) {
-    if (sz > PAGESIZE) {
+    if (!kalloc_ready) {
+        init_buddy();
+    }
+    int order = 0;
+    while ((size_t(PAGESIZE) << order) < sz) {
+        ++order;
+        if (order > KALLOC_MAXORDER) {
+            return nullptr;
+        }
+    }
+
+    while (nfree_pages - nreserved_pages < (size_t(1) << order)) {
+        // Out of memory: finish freeing exited processes, or else evict
+        // user pages to swap to make room
+        if (!reap_some(REAP_BATCH) && (order != 0 || !reclaim_page())) {
+            return nullptr;
+        }
+    }
+    int pageno = order == 0 ? page_cache_take() : take_free_block(order);
+    if (pageno < 0 && drain_page_caches()) {
+        pageno = take_free_block(order);
+    }
+    if (pageno < 0 && order == 0 && nzeroed_pages > 0) {
+        // Only pre-zeroed pages are left
+        --nzeroed_pages;
+        pageno = zeroed_pages[nzeroed_pages];
+    }
+    if (pageno < 0) {
         return nullptr;
     }
 
-    int pageno = 0;
-    int page_increment = 1;
-    // In the handout code, `kalloc` returns the first free page.
-    // Alternate search strategies can be faster and/or expose bugs elsewhere.
-    // This initialization returns a random free page:
-    //     int pageno = rand(0, NPAGES - 1);
-    // This initialization remembers the most-recently-allocated page and
-    // starts the search from there:
-    //     static int pageno = 0;
-    // In Phase 4, you must change the allocation to use non-sequential pages.
-    // The easiest way to do this is to set page_increment to 3, but you can
-    // also set `pageno` randomly.
-
-    for (int tries = 0; tries != NPAGES; ++tries) {
-        uintptr_t pa = pageno * PAGESIZE;
-        if (allocatable_physical_address(pa)
-            && physpages[pageno].refcount == 0) {
-            ++physpages[pageno].refcount;
-            void* ptr = reinterpret_cast<void*>(pa);
-            memset(ptr, 0xCC, PAGESIZE);
-            return ptr;
+    void* ptr = claim_block(pageno, order);
+    trace(TRACE_KALLOC, kptr2pa(ptr) | order);
+    memset(ptr, 0xCC, size_t(PAGESIZE) << order);
+    return ptr;
+}
+
+
+// kalloc_zeroed_page()
+//    Allocates a page filled with zeros, or returns `nullptr` on failure.
+//    Takes a page from `zeroed_pages` if there is one.
+
+void* kalloc_zeroed_page() {
+    if (nzeroed_pages == 0 || nfree_pages <= nreserved_pages) {
+        void* ptr = kalloc(PAGESIZE);
+        if (ptr) {
+            clear_page(ptr);
         }
-        pageno = (pageno + page_increment) % NPAGES;
+        return ptr;
     }
+    --nzeroed_pages;
+    void* ptr = claim_block(zeroed_pages[nzeroed_pages], 0);
+    trace(TRACE_KALLOC, kptr2pa(ptr));
+    return ptr;
+}
 
-    return nullptr;
+
+// prezero_page()
+//    Clears one free page into `zeroed_pages`, unless the pool is full or
+//    no page is free. Returns true if it cleared a page. `schedule` calls
+//    this while it waits.
+
+static bool prezero_page() {
+    if (!kalloc_ready || nzeroed_pages == ZEROED_POOL_SIZE) {
+        return false;
+    }
+    int pageno = take_free_block(0);
+    if (pageno < 0) {
+        return false;
+    }
+    clear_page(reinterpret_cast<void*>(pageno * PAGESIZE));
+    physpages[pageno].flags = PPI_ZEROED;
+    zeroed_pages[nzeroed_pages] = pageno;
+    ++nzeroed_pages;
+    return true;
 }
 
 
@@ -174,100 +616,707 @@ void kfree(void* kptr) {
         return;
     }
 
+    // A mapping of the zero page releases its reservation
+    if (kptr == zero_page) {
+        assert(nreserved_pages > 0);
+        --nreserved_pages;
+        return;
+    }
+
     int pageno = pa / PAGESIZE;
     // Guard against double frees
     if (physpages[pageno].refcount == 0) {
         return; 
     }
 
-    // Decrement reference count for the physical page
-    if(physpages[pageno].refcount > 0) {
-        --physpages[pageno].refcount;
+    // Decrement reference count for the physical page. When the last
+    // reference to a block `kalloc` returned goes, free all its pages and
+    // merge it back into the buddy lists. Shared pages that `kalloc`
+    // never hands out (like the console) only lose the reference.
+    --physpages[pageno].refcount;
+    if (physpages[pageno].refcount == 0) {
+        physpages[pageno].flags = 0;
+        physpages[pageno].owner = 0;
+        physpages[pageno].age = 0;
+        memviewer_mark_page(pa);
+    }
+    if (physpages[pageno].refcount == 0 && kalloc_ready
+        && block_order[pageno] >= 0) {
+        int order = block_order[pageno];
+        block_order[pageno] = -1;
+        trace(TRACE_KFREE, pa | order);
+        for (int i = 1; i != (1 << order); ++i) {
+            physpages[pageno + i] = physpageinfo();
+            memviewer_mark_page((pageno + i) * PAGESIZE);
+        }
+        if (order == 0) {
+            page_cache_put(pageno);
+        } else {
+            buddy_free(pageno, order);
+        }
     }
 }
 
 
-// process_setup(pid, program_name)
-//    Load application program `program_name` as process number `pid`.
-//    This loads the application's code and data into memory, sets its
-//    %rip and %rsp, gives it a stack page, and marks it as runnable.
+// reserve_zero_page()
+//    Takes a reservation for a new mapping of `zero_page`. Returns false
+//    if every free page is already reserved and none can be reclaimed.
 
-void process_setup(pid_t pid, const char* program_name) {
-    proc* p = &ptable[pid];
-    init_process(p, 0);
+static bool reserve_zero_page() {
+    while (nfree_pages <= nreserved_pages) {
+        if (!reap_some(REAP_BATCH) && !reclaim_page()) {
+            return false;
+        }
+    }
+    ++nreserved_pages;
+    return true;
+}
 
-    // initialize process page table
-    p->pagetable = kalloc_pagetable();
-    assert(p->pagetable != nullptr);
 
-    // Copy kernel region mappings
-    for (vmiter kit(kernel_pagetable, 0); kit.va() < PROC_START_ADDR; kit.next()) {
-        if (!kit.present()) {
+// Slab allocator
+//    `kmalloc` serves kernel objects of up to KMALLOC_MAXSIZE bytes from
+//    slabs: blocks from `kalloc` carved into equal objects, with a `slab`
+//    header in the first cache line and a free list threaded through the
+//    free objects. Each power-of-2 size class from 16 bytes has a cache of
+//    slabs; the two largest classes use 2- and 4-page slabs, so no more
+//    than an eighth of a slab goes unused. Every page of a slab is flagged
+//    PPI_SLAB, and `kmfree` finds the slab from `block_order`, which marks
+//    the start of each block `kalloc` returned.
+//
+//    Slabs are cache-colored: the objects start a multiple of 64 bytes
+//    past the header, chosen round-robin among the offsets the slab's
+//    leftover space allows, so that same-index objects in different slabs
+//    map to different cache sets. (Classes below 128 bytes have no room
+//    for colors.) A cache keeps its slabs with free objects on a list; a
+//    slab whose objects are all free is given back to `kalloc`, unless it
+//    is the cache's last.
+
+static constexpr int SLAB_HEADER = 64;
+static constexpr int slab_order[KMALLOC_NCLASSES] = { 0, 0, 0, 0, 0, 0, 1, 2 };
+
+struct slab {
+    slab* next;                         // links in the cache's partial list
+    slab* prev;
+    void* free;                         // first free object
+    uint16_t nfree;                     // number of free objects
+    uint16_t nobjs;                     // number of objects
+    uint8_t cls;                        // size class
+};
+static_assert(sizeof(slab) <= SLAB_HEADER, "slab header too big");
+
+struct slab_cache {
+    slab* partial;                      // slabs with a free object
+    unsigned nslabs;
+    unsigned nused;                     // objects allocated
+    unsigned next_color;                // color of the next new slab
+};
+static slab_cache slab_caches[KMALLOC_NCLASSES];
+
+static void slab_link(slab_cache& c, slab* s) {
+    s->prev = nullptr;
+    s->next = c.partial;
+    if (c.partial) {
+        c.partial->prev = s;
+    }
+    c.partial = s;
+}
+
+static void slab_unlink(slab_cache& c, slab* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        c.partial = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+// slab_create(cls)
+//    Adds a new slab of empty objects to class `cls`'s cache. Returns it,
+//    or `nullptr` if out of memory.
+
+static slab* slab_create(int cls) {
+    size_t size = size_t(16) << cls;
+    size_t bytes = size_t(PAGESIZE) << slab_order[cls];
+    slab* s = reinterpret_cast<slab*>(kalloc(bytes));
+    if (!s) {
+        return nullptr;
+    }
+    for (size_t off = 0; off != bytes; off += PAGESIZE) {
+        physpages[(kptr2pa(s) + off) / PAGESIZE].flags |= PPI_SLAB;
+    }
+
+    slab_cache& c = slab_caches[cls];
+    unsigned nobjs = (bytes - SLAB_HEADER) / size;
+    unsigned ncolors = (bytes - SLAB_HEADER - nobjs * size) / 64 + 1;
+    char* objs = reinterpret_cast<char*>(s) + SLAB_HEADER
+        + (c.next_color++ % ncolors) * 64;
+    s->free = nullptr;
+    for (unsigned i = nobjs; i-- != 0; ) {
+        void** obj = reinterpret_cast<void**>(objs + i * size);
+        *obj = s->free;
+        s->free = obj;
+    }
+    s->nfree = s->nobjs = nobjs;
+    s->cls = cls;
+    ++c.nslabs;
+    slab_link(c, s);
+    return s;
+}
+
+void* kmalloc(size_t sz) {
+    if (sz > KMALLOC_MAXSIZE) {
+        return kalloc(sz);
+    }
+    int cls = sz <= 16 ? 0 : msb(sz - 1) - 4;
+    slab_cache& c = slab_caches[cls];
+    slab* s = c.partial;
+    if (!s && !(s = slab_create(cls))) {
+        return nullptr;
+    }
+    void** obj = reinterpret_cast<void**>(s->free);
+    s->free = *obj;
+    if (--s->nfree == 0) {
+        slab_unlink(c, s);
+    }
+    ++c.nused;
+    return obj;
+}
+
+void kmfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    int pageno = kptr2pa(ptr) / PAGESIZE;
+    if (!(physpages[pageno].flags & PPI_SLAB)) {
+        kfree(ptr);
+        return;
+    }
+    while (block_order[pageno] < 0) {
+        --pageno;
+    }
+    slab* s = pa2kptr<slab*>(pageno * PAGESIZE);
+    slab_cache& c = slab_caches[s->cls];
+    *reinterpret_cast<void**>(ptr) = s->free;
+    s->free = ptr;
+    --c.nused;
+    if (s->nfree++ == 0) {
+        slab_link(c, s);
+    }
+    if (s->nfree == s->nobjs && c.nslabs > 1) {
+        slab_unlink(c, s);
+        --c.nslabs;
+        kfree(s);
+    }
+}
+
+void kmalloc_usage(int cls, unsigned* nused, unsigned* npages) {
+    *nused = slab_caches[cls].nused;
+    *npages = slab_caches[cls].nslabs << slab_order[cls];
+}
+
+
+// user_page(kpage, p)
+//    Marks the newly allocated page `kpage`, if any, as user memory of
+//    process `p`: unpinned, with `p` as its owner. Returns `kpage`.
+
+static void* user_page(void* kpage, proc* p) {
+    if (kpage) {
+        physpageinfo& pi = physpages[kptr2pa(kpage) / PAGESIZE];
+        pi.flags &= ~PPI_PINNED;
+        pi.owner = p->pid;
+    }
+    return kpage;
+}
+
+
+// Memory accounting
+//    Each process's `mem` counters change only where `vmiter` changes its
+//    page table, so they stay exact without walks. A process's top page
+//    table page names the process as its `owner`, which finds the
+//    counters in constant time; `free_pagetable_and_pages` clears them.
+
+proc* pagetable_owner(x86_64_pagetable* pt) {
+    uintptr_t pa = kptr2pa(pt);
+    if (pa >= MEMSIZE_PHYSICAL) {
+        return nullptr;
+    }
+    proc* p = &ptable[physpages[pa / PAGESIZE].owner];
+    return p->pid != 0 && p->pagetable == pt ? p : nullptr;
+}
+
+// meminfo_flags(va, pte)
+//    Returns 0 if `pte` at `va` is not a resident user page, and
+//    otherwise 1, plus 2 if the page is shareable, plus 4 if it is
+//    `zero_page`.
+
+static unsigned meminfo_flags(uintptr_t va, x86_64_pageentry_t pte) {
+    if (va < PROC_START_ADDR || va >= MEMSIZE_VIRTUAL
+        || (pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U)) {
+        return 0;
+    }
+    uintptr_t pa = pte & PTE_PAMASK;
+    if (zero_page && pa == kptr2pa(zero_page)) {
+        return 7;
+    } else if ((pte & PTE_COW) || !(pte & PTE_W)
+        || (pa < MEMSIZE_PHYSICAL
+            && (physpages[pa / PAGESIZE].flags & PPI_SHARED))) {
+        return 3;
+    }
+    return 1;
+}
+
+void meminfo_account(x86_64_pagetable* pt, uintptr_t va,
+                     x86_64_pageentry_t oldpte, x86_64_pageentry_t newpte) {
+    unsigned oldf = meminfo_flags(va, oldpte);
+    unsigned newf = meminfo_flags(va, newpte);
+    if (oldf == newf) {
+        return;
+    }
+    if (proc* p = pagetable_owner(pt)) {
+        p->mem.resident += (newf & 1) - (oldf & 1);
+        p->mem.shared += ((newf >> 1) & 1) - ((oldf >> 1) & 1);
+        p->mem.reserved += (newf >> 2) - (oldf >> 2);
+    }
+}
+
+void meminfo_add_pagetable(x86_64_pagetable* pt) {
+    if (proc* p = pagetable_owner(pt)) {
+        ++p->mem.pagetable;
+    }
+}
+
+// own_pagetable(p)
+//    Records `p` as the owner of its new, empty page table.
+
+static void own_pagetable(proc* p) {
+    physpages[kptr2pa(p->pagetable) / PAGESIZE].owner = p->pid;
+    p->mem = {};
+    p->mem.pagetable = 1;
+}
+
+
+// Swap
+//    When `kalloc` runs out of memory, `reclaim_page` evicts a cold user
+//    page to a slot of the swap area on the boot disk. It picks the page
+//    with the CLOCK algorithm: a hand sweeps the processes' user mappings
+//    in order of pid and address, and a page whose accessed bit (PTE_A)
+//    is set gets a second chance: the bit is cleared and the hand moves
+//    on. The first page found with the bit clear is written out, and its
+//    entry becomes a PTE_SWAP entry holding the slot number. A fault on
+//    that entry reads the page back (`swap_in`).
+//
+//    Only a page that a single mapping holds (refcount 1) and that is not
+//    pinned can be evicted, and not while its process runs on another
+//    CPU, whose TLB could still write it. Forking copies PTE_SWAP entries;
+//    `swap_refs` counts each slot's entries, and each process reads back
+//    its own copy. The disk is written synchronously under `kernel_lock`.
+//    After a disk error, swapping stops.
+static uint8_t swap_refs[SWAP_NSLOTS];  // PTE_SWAP entries per slot; 0 if free
+static unsigned nswap_free = SWAP_NSLOTS;   // slots with `swap_refs` 0
+static int swap_next_slot = 0;          // where to look for a free slot
+static bool swap_failed = false;
+static pid_t clock_pid = 1;             // the CLOCK hand
+static uintptr_t clock_va = PROC_START_ADDR;
+
+static uint32_t swap_sector(int slot) {
+    return SWAP_START_SECTOR + slot * (PAGESIZE / SECTORSIZE);
+}
+
+// swap_release(pte)
+//    Drops the PTE_SWAP entry `pte`'s reference to its slot.
+
+static void swap_release(x86_64_pageentry_t pte) {
+    int slot = pte >> PAGEOFFBITS;
+    assert(slot < SWAP_NSLOTS && swap_refs[slot] > 0);
+    if (--swap_refs[slot] == 0) {
+        ++nswap_free;
+    }
+}
+
+// reclaim_page()
+//    Evicts one user page to swap and frees it. Returns false if no page
+//    could be evicted.
+
+static bool reclaim_page() {
+    if (swap_failed) {
+        return false;
+    }
+    int slot = swap_next_slot;
+    while (swap_refs[slot] != 0) {
+        slot = (slot + 1) % SWAP_NSLOTS;
+        if (slot == swap_next_slot) {
+            return false;               // swap is full
+        }
+    }
+
+    // Two turns of the hand: the first may only clear accessed bits
+    int self = this_cpu()->index;
+    for (int n = 0; n != 2 * MAXNPROC; ++n) {
+        proc* p = &ptable[clock_pid];
+        if (p->state == P_FREE || p->state == P_ZOMBIE || !p->pagetable
+            || (p->cpu >= 0 && p->cpu != self)) {
+            clock_pid = clock_pid % (MAXNPROC - 1) + 1;
+            clock_va = PROC_START_ADDR;
             continue;
         }
-        // Store virtual address, physical address, and mappings
-        uintptr_t kva = kit.va();
-        uintptr_t kpa = kit.pa();
-        int kperm = kit.perm();
+        for (vmiter it(p, clock_va); it.va() < MEMSIZE_VIRTUAL; it.next()) {
+            if (!it.user()) {
+                continue;
+            }
+            physpageinfo& pi = physpages[it.pa() / PAGESIZE];
+            if (pi.refcount != 1 || (pi.flags & (PPI_PINNED | PPI_PAGETABLE))) {
+                continue;
+            }
+            if (it.perm(PTE_A)) {
+                it.map(it.pa(), it.perm() & ~PTE_A);
+                continue;
+            }
+
+            void* kpage = it.kptr<void*>();
+            if (disk_write(kpage, swap_sector(slot), PAGESIZE / SECTORSIZE) != 0) {
+                log_printf("swap: disk error, swapping disabled\n");
+                swap_failed = true;
+                return false;
+            }
+            trace(TRACE_SWAPOUT, it.va() | p->pid);
+            it.map(uintptr_t(slot) << PAGEOFFBITS,
+                   (it.perm() & (PTE_U | PTE_W | PTE_COW)) | PTE_SWAP);
+            swap_refs[slot] = 1;
+            --nswap_free;
+            swap_next_slot = (slot + 1) % SWAP_NSLOTS;
+            clock_va = it.va() + PAGESIZE;
+            kfree(kpage);
+            return true;
+        }
+        clock_pid = clock_pid % (MAXNPROC - 1) + 1;
+        clock_va = PROC_START_ADDR;
+    }
+    return false;
+}
+
+// swap_in(p, it)
+//    Reads `p`'s swapped-out page at `it` back into a new page and maps
+//    it. Returns false if memory ran out or the disk failed.
 
-        // If not the console address, get rid of user permission
-        if (kva != CONSOLE_ADDR) {
-            kperm &= ~PTE_U;
+static bool swap_in(proc* p, vmiter& it) {
+    x86_64_pageentry_t pte = it.pte();
+    void* kpage = user_page(kalloc(PAGESIZE), p);
+    if (!kpage) {
+        return false;
+    }
+    int slot = pte >> PAGEOFFBITS;
+    if (disk_read(kpage, swap_sector(slot), PAGESIZE / SECTORSIZE) != 0) {
+        kfree(kpage);
+        return false;
+    }
+    trace(TRACE_SWAPIN, it.va() | p->pid);
+    it.map(kpage, (pte & (PTE_U | PTE_W | PTE_COW)) | PTE_P);
+    swap_release(pte);
+    return true;
+}
+
+
+// map_kernel_region(pt)
+//    Maps the kernel region in the new page table `pt`. Mapping the
+//    console page allocates the page table pages for the region; then
+//    all its level-1 entries are copied at once. Returns 0 on success and
+//    -1 if a page table page could not be allocated.
+
+static int map_kernel_region(x86_64_pagetable* pt) {
+    vmiter it(pt, CONSOLE_ADDR);
+    if (it.try_map(CONSOLE_ADDR, PTE_P | PTE_W | PTE_U) != 0) {
+        return -1;
+    }
+    x86_64_pagetable* l1 = pt;
+    for (int level = 0; level != 3; ++level) {
+        l1 = pa2kptr<x86_64_pagetable*>(l1->entry[0] & PTE_PAMASK);
+    }
+    memcpy(l1->entry, kernel_region_ptes, sizeof(kernel_region_ptes));
+    return 0;
+}
+
+// map_info_page(p)
+//    Allocates `p`'s kernel info page and maps it read-only at KINFO_ADDR,
+//    over the kernel region's entry there. Returns 0 or -1. The page is
+//    pinned; `free_pagetable_and_pages` frees it.
+
+static int map_info_page(proc* p) {
+    p->info_page = reinterpret_cast<kinfo*>(kalloc_zeroed_page());
+    if (!p->info_page) {
+        return -1;
+    }
+    physpages[kptr2pa(p->info_page) / PAGESIZE].owner = p->pid;
+    p->info_page->pid = p->pid;
+    p->info_page->ncpu = ncpu;
+    p->info_page->tsc_per_usec = tsc_per_usec;
+    p->info_page->tsc_per_tick = tsc_per_tick;
+    p->info_page->clock_start_tsc = clock_start_tsc;
+    return vmiter(p->pagetable, KINFO_ADDR).try_map(p->info_page, PTE_P | PTE_U);
+}
+
+
+// Program page cache
+//    Read-only segment pages (text and constants) loaded for a program
+//    are kept here and mapped into later processes running the same
+//    program, so N instances of a program share one copy. The cache
+//    holds a reference to each page, so it outlives the processes.
+//    Writable segments are still copied per process. If the cache fills,
+//    further pages are simply not cached.
+#define PROGRAM_CACHE_SIZE 64
+struct program_page {
+    int program;                // program number + 1, or 0 if unused
+    uintptr_t va;
+    void* kpage;
+};
+static program_page program_pages[PROGRAM_CACHE_SIZE];
+
+static void* find_program_page(int program, uintptr_t va) {
+    for (auto& pp : program_pages) {
+        if (pp.program == program && pp.va == va) {
+            return pp.kpage;
         }
+    }
+    return nullptr;
+}
 
-        // Copy values into the new table
-        vmiter pit(p->pagetable, kva);
-        pit.map(kpa, kperm);
+static void cache_program_page(int program, uintptr_t va, void* kpage) {
+    for (auto& pp : program_pages) {
+        if (pp.program == 0) {
+            pp = {program, va, kpage};
+            ++physpages[kptr2pa(kpage) / PAGESIZE].refcount;
+            return;
+        }
     }
+}
 
-    program_image pgm(program_name);
 
-    // Iterate over each segment
-    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
-        // Align with page size to ensure we are covering whole pages
-        uintptr_t seg_lo = round_down(seg.va(), PAGESIZE);
-        uintptr_t seg_hi = round_up(seg.va() + seg.size(), PAGESIZE);
+// load_program_page(p, va, write)
+//    Loads the page at page-aligned `va` of `p`'s program segments on
+//    `p`'s first access to it. Program segments are not mapped when a
+//    process starts; a user fault on a missing page in one lands here,
+//    and the page is filled from `p->program`'s image: shared from the
+//    program page cache if read-only, otherwise copied into a new zeroed
+//    page. A read of a page that lies wholly in a writable segment's
+//    zero-initialized part (BSS) maps `zero_page` copy-on-write instead.
+//    Returns false if `va` is in no segment or memory ran out.
 
-        // Calculate permissions for this segment
+static bool load_program_page(proc* p, uintptr_t va, bool write) {
+    if (p->program < 0) {
+        return false;
+    }
+    program_image pgm(p->program);
+    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
+        if (va < round_down(seg.va(), PAGESIZE)
+            || va >= round_up(seg.va() + seg.size(), PAGESIZE)) {
+            continue;
+        }
         int uperm = PTE_P | PTE_U | (seg.writable() ? PTE_W : 0);
+        vmiter it(p->pagetable, va);
+
+        // Share a read-only page another instance already loaded
+        if (!seg.writable()) {
+            if (void* kpage = find_program_page(p->program + 1, va)) {
+                if (it.try_map(kpage, uperm) != 0) {
+                    return false;
+                }
+                ++physpages[kptr2pa(kpage) / PAGESIZE].refcount;
+                return true;
+            }
+        }
+
+        // Find section that actually contains segment data
+        uintptr_t copy_lo = va < seg.va() ? seg.va() : va;
+        uintptr_t copy_hi = (va + PAGESIZE) < (seg.va() + seg.data_size()) ? (va + PAGESIZE) : (seg.va() + seg.data_size());
 
-        // Iterate over each virtual address
-        for (uintptr_t va = seg_lo; va < seg_hi; va += PAGESIZE) {
-            // Allocate a page and zero it
-            void* kpage = kalloc(PAGESIZE);
-            assert(kpage != nullptr);
-            memset(kpage, 0, PAGESIZE);
-
-            // Map the page to this virtual address
-            vmiter pit(p->pagetable, va);
-            pit.map(kpage, uperm);
-
-            // Find section that actually contains segment data
-            uintptr_t copy_lo = va < seg.va() ? seg.va() : va;
-            uintptr_t copy_hi = (va + PAGESIZE) < (seg.va() + seg.data_size()) ? (va + PAGESIZE) : (seg.va() + seg.data_size());
-            // Copy initialized bytes into the process's page
-            if (copy_hi > copy_lo) {
-                char* dst = reinterpret_cast<char*>(kpage) + (copy_lo - va);
-                assert(dst != nullptr);
-                const char* src = seg.data() + (copy_lo - seg.va());
-                memcpy(dst, src, copy_hi - copy_lo);
+        // Read pure BSS through the zero page until it is written
+        if (copy_hi <= copy_lo && seg.writable() && !write) {
+            if (!reserve_zero_page()) {
+                return false;
             }
-        } 
+            if (it.try_map(zero_page, PTE_P | PTE_U | PTE_COW) != 0) {
+                kfree(zero_page);
+                return false;
+            }
+            return true;
+        }
+
+        // Allocate a zeroed page and copy initialized bytes into it
+        void* kpage = user_page(kalloc_zeroed_page(), p);
+        if (!kpage) {
+            return false;
+        }
+        if (copy_hi > copy_lo) {
+            char* dst = reinterpret_cast<char*>(kpage) + (copy_lo - va);
+            const char* src = seg.data() + (copy_lo - seg.va());
+            memcpy(dst, src, copy_hi - copy_lo);
+        }
+        if (it.try_map(kpage, uperm) != 0) {
+            kfree(kpage);
+            return false;
+        }
+        if (!seg.writable()) {
+            cache_program_page(p->program + 1, va, kpage);
+        }
+        return true;
+    }
+    return false;
+}
+
+
+// fault_in_page(p, va, write)
+//    Handles `p`'s fault on the missing page at page-aligned `va`: reads
+//    it back from swap, or loads it from the program image. Returns false
+//    if the page cannot be provided.
+
+static bool fault_in_page(proc* p, uintptr_t va, bool write) {
+    vmiter it(p, va);
+    if (it.pte() & PTE_SWAP) {
+        return swap_in(p, it);
+    }
+    return load_program_page(p, va, write);
+}
+
+
+// process_setup(pid, program_name)
+//    Load application program `program_name` as process number `pid`.
+//    This sets the process's %rip and %rsp, gives it a stack page, and
+//    marks it as runnable. The application's code and data are loaded
+//    one page at a time as the process touches them (see
+//    `load_program_page`), so setup takes the same time for any program.
+//    Returns 0, or -1 if memory runs out, in which case `pid` stays free.
+
+static int process_setup(pid_t pid, const char* program_name) {
+    proc* p = &ptable[pid];
+    init_process(p, 0);
+
+    // initialize process page table
+    p->pagetable = kalloc_pagetable();
+    if (!p->pagetable) {
+        return -1;
     }
+    own_pagetable(p);
+
+    // Map the kernel region and info page
+    if (map_kernel_region(p->pagetable) != 0 || map_info_page(p) != 0) {
+        free_pagetable_and_pages(p);
+        return -1;
+    }
+
+    // Remember the program; its segments are loaded on demand
+    p->program = program_image::program_number(program_name);
+    program_image pgm(p->program);
+
     // Allocate & map one user stack page at the same virtual address
     uintptr_t stack_addr = MEMSIZE_VIRTUAL - PAGESIZE;
     {
-        void* kpage = kalloc(PAGESIZE);
-        assert(kpage != nullptr);
-        memset(kpage, 0, PAGESIZE);
+        void* kpage = user_page(kalloc_zeroed_page(), p);
         vmiter pit(p->pagetable, stack_addr);
-        pit.map(kpage, PTE_P | PTE_W | PTE_U);
+        if (!kpage || pit.try_map(kpage, PTE_P | PTE_W | PTE_U) != 0) {
+            kfree(kpage);
+            free_pagetable_and_pages(p);
+            return -1;
+        }
         p->regs.reg_rsp = stack_addr + PAGESIZE;
     }
 
     // Set entry point and mark runnable
     p->regs.reg_rip = pgm.entry();
-    p->state = P_RUNNABLE;
+    set_state(p, P_RUNNABLE);
+    return 0;
+}
+
+
+// resolve_cow_fault(it)
+//    Handles a user write to the copy-on-write page at `it`: gives the
+//    process its own writable copy if other processes still share the
+//    page (or a new zeroed page for `zero_page`), and otherwise just
+//    makes the page writable. Returns false if no memory is available
+//    for the copy.
+
+static bool resolve_cow_fault(vmiter& it) {
+    uintptr_t pa = it.pa();
+    int perm = (it.perm() & ~PTE_COW) | PTE_W;
+    if (it.kptr<void*>() == zero_page) {
+        // Demand-zero page: allocate it from this mapping's reservation
+        --nreserved_pages;
+        void* kpage = user_page(kalloc_zeroed_page(), current);
+        if (!kpage) {
+            ++nreserved_pages;
+            return false;
+        }
+        it.map(kpage, perm);
+    } else if (physpages[pa / PAGESIZE].refcount > 1) {
+        void* kpage = user_page(kalloc(PAGESIZE), current);
+        if (!kpage) {
+            return false;
+        }
+        copy_page(kpage, it.kptr<void*>());
+        kfree(it.kptr<void*>());    // Drop this process's reference
+        it.map(kpage, perm);
+    } else {
+        physpages[pa / PAGESIZE].flags &= ~PPI_COW;
+        it.map(pa, perm);
+    }
+    return true;
+}
+
+
+// Keyboard input
+//    Only the first CPU gets keyboard interrupts (a soft reboot clears the
+//    other CPUs' stacks). Keys the kernel does not act on itself go to
+//    the oldest process blocked in `sys_getc`, or else into `keybuf`, a
+//    ring of keys not read yet; keys typed while it is full are dropped.
+
+#define KEYBUF_SIZE 64
+static uint8_t keybuf[KEYBUF_SIZE];
+static unsigned keybuf_head;    // next key to read
+static unsigned keybuf_tail;    // next free slot
+static proc* keybuf_waiters;    // processes blocked in `sys_getc`, oldest first
+
+// keyboard_interrupt()
+//    Handle the typed keys: Control-C exits the virtual machine (see
+//    `check_keyboard`), Control-T dumps the kernel trace to `log.txt`,
+//    Control-P the profile, and other keys are delivered to processes.
+
+static void keyboard_interrupt() {
+    int c;
+    while ((c = check_keyboard()) >= 0) {
+        if (c == 0) {
+            continue;
+        } else if (c == 0x14) {     // Control-T
+            trace_dump();
+        } else if (c == 0x10) {     // Control-P
+            profile_report();
+        } else if (proc* w = keybuf_waiters) {
+            keybuf_waiters = w->wait_next;
+            w->wait_next = nullptr;
+            w->regs.reg_rax = c;
+            set_state(w, P_RUNNABLE);
+        } else if (keybuf_tail - keybuf_head < KEYBUF_SIZE) {
+            keybuf[keybuf_tail % KEYBUF_SIZE] = c;
+            ++keybuf_tail;
+        }
+    }
+}
+
+// syscall_getc()
+//    Returns the oldest unread key, blocking until one is typed.
+
+int syscall_getc() {
+    if (keybuf_head != keybuf_tail) {
+        int c = keybuf[keybuf_head % KEYBUF_SIZE];
+        ++keybuf_head;
+        return c;
+    }
+    proc** pp = &keybuf_waiters;
+    while (*pp) {
+        pp = &(*pp)->wait_next;
+    }
+    *pp = current;
+    set_state(current, P_BLOCKED);
+    schedule();                 // does not return
 }
 
 
@@ -275,63 +1324,108 @@ void process_setup(pid_t pid, const char* program_name) {
 //    Exception handler (for interrupts, traps, and faults).
 //
 //    The register values from exception time are stored in `regs`.
-//    The processor responds to an exception by saving application state on
-//    the kernel's stack, then jumping to kernel assembly code (in
-//    k-exception.S). That code saves more registers on the kernel's stack,
-//    then calls exception().
+//    The processor responds to an exception by saving application state,
+//    then jumping to kernel assembly code (in k-exception.S). That code
+//    saves more registers, then calls exception(). From user mode, both
+//    save into `current->regs` (see `run`); from `idle`, `regs` is on the
+//    kernel stack.
 //
-//    Note that hardware interrupts are disabled when the kernel is running.
+//    Note that hardware interrupts are disabled when the kernel is running,
+//    and that the kernel runs holding `kernel_lock`.
 
 void exception(regstate* regs) {
-    // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    // Unless the interrupt woke the kernel from `idle`, `regs` is
+    // `&current->regs`.
+    bool from_idle = (regs->reg_cs & 3) == 0;
+    if (from_idle && regs->reg_intno < INT_IRQ) {
+        // A fault in kernel code is a bug. Report it without waiting for
+        // `kernel_lock`, which this CPU may hold.
+        panic_at(*regs, "Kernel exception %d (rip=%p, cr2=%p)!\n",
+                 regs->reg_intno, regs->reg_rip, rdcr2());
+    }
+    kernel_lock.lock();
+    if (from_idle) {
+        cpustate* c = this_cpu();
+        idle_cycles += rdtsc() - c->run_tsc;
+        idle_cpus &= ~(1U << c->index);
+        woken_cpus &= ~(1U << c->index);
+    }
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: exception %d at rip %p\n",
                 current->pid, regs->reg_intno, regs->reg_rip); */
 
-    // Show the current cursor location and memory state
-    // (unless this is a kernel fault).
-    console_show_cursor();
-    if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
-        memshow();
-    }
-
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
-
-
     // Actually handle the exception.
     switch (regs->reg_intno) {
 
     case INT_IRQ + IRQ_TIMER:
-        ++ticks;
+        // The one-shot timer fired: for the end of `current`'s time
+        // slice, or, on the first CPU, for clock work.
+        this_cpu()->timer_deadline = 0;
+        profile_sample(*regs, from_idle ? nullptr : current);
+        update_clock();
         lapicstate::get().ack();
+        if (!from_idle && sched_timer(current)) {
+            run(current);
+        }
         schedule();
         break;                  /* will not be reached */
 
+    case INT_IRQ + IRQ_WAKEUP:
+        // Another CPU made a process runnable. An idle CPU schedules it
+        // below; a busy one gives way if it outranks `current`, and
+        // otherwise just re-arms its timer on the way back.
+        lapicstate::get().ack();
+        if (!from_idle && sched_preempted(current)) {
+            schedule();
+        }
+        break;
+
+    case INT_IRQ + IRQ_KEYBOARD:
+        keyboard_interrupt();
+        lapicstate::get().ack();
+        break;
+
     case INT_PF: {
         // Analyze faulting address and access type.
         uintptr_t addr = rdcr2();
+        trace(TRACE_PAGEFAULT, addr);
         const char* operation = regs->reg_errcode & PTE_W
                 ? "write" : "read";
         const char* problem = regs->reg_errcode & PTE_P
                 ? "protection problem" : "missing page";
 
-        if (!(regs->reg_errcode & PTE_U)) {
-            proc_panic(current, "Kernel page fault on %p (%s %s, rip=%p)!\n",
-                       addr, operation, problem, regs->reg_rip);
+        // Resolve writes to copy-on-write pages
+        if ((regs->reg_errcode & (PTE_P | PTE_W | PTE_U)) == (PTE_P | PTE_W | PTE_U)) {
+            vmiter it(current->pagetable, round_down(addr, PAGESIZE));
+            if (it.user() && it.perm(PTE_COW) && resolve_cow_fault(it)) {
+                break;
+            }
         }
+
+        // Read swapped-out pages back, and load program pages on first
+        // access
+        if ((regs->reg_errcode & (PTE_P | PTE_U)) == PTE_U
+            && addr >= PROC_START_ADDR
+            && fault_in_page(current, round_down(addr, PAGESIZE),
+                             regs->reg_errcode & PTE_W)) {
+            break;
+        }
+
         error_printf("PAGE FAULT on %p (pid %d, %s %s, rip=%p)!\n",
                      addr, current->pid, operation, problem, regs->reg_rip);
         log_print_backtrace(current);
-        current->state = P_FAULTED;
+        set_state(current, P_FAULTED);
+        wake_waiters(current, -1);
+        log_accounting(current);
         break;
     }
 
     default:
+        if (from_idle) {
+            panic_at(*regs, "Unhandled interrupt %d!\n", regs->reg_intno);
+        }
         proc_panic(current, "Unhandled exception %d (rip=%p)!\n",
                    regs->reg_intno, regs->reg_rip);
 
@@ -339,7 +1433,7 @@ void exception(regstate* regs) {
 
 
     // Return to the current process (or run something else).
-    if (current->state == P_RUNNABLE) {
+    if (!from_idle && current->state == P_RUNNABLE) {
         run(current);
     } else {
         schedule();
@@ -348,10 +1442,40 @@ void exception(regstate* regs) {
 
 
 int syscall_page_alloc(uintptr_t addr);
+int syscall_page_alloc_range(uintptr_t addr, size_t npages, int flags);
+int syscall_sleep(unsigned long nticks);
+int syscall_set_quantum(unsigned long usec);
+int syscall_shm_create(size_t npages);
+int syscall_shm_map(int id, uintptr_t addr);
+int syscall_getc();
+int syscall_log(uintptr_t msg);
+int syscall_waitpid(pid_t pid);
 int syscall_fork();
+int syscall_spawn(uintptr_t name);
+int syscall_meminfo(pid_t pid, uintptr_t addr);
+int syscall_write_console(uintptr_t buf, size_t len);
 void sys_exit();
 
 
+// fault_in_user_string(addr, maxlen)
+//    Loads the pages under the first `maxlen` bytes at `addr`, a string
+//    argument that may be in a program page the process has not touched,
+//    so `strlcpy_from_user` can read it.
+
+static void fault_in_user_string(uintptr_t addr, size_t maxlen) {
+    if (!addr) {
+        return;
+    }
+    for (uintptr_t va = round_down(addr, PAGESIZE);
+         va < addr + maxlen && va < MEMSIZE_VIRTUAL;
+         va += PAGESIZE) {
+        if (va >= PROC_START_ADDR && !vmiter(current, va).present()) {
+            fault_in_page(current, va, false);
+        }
+    }
+}
+
+
 // syscall(regs)
 //    Handle a system call initiated by a `syscall` instruction.
 //    The process’s register values at system call time are accessible in
@@ -366,30 +1490,40 @@ void sys_exit();
 //    It is only valid to return from this function if
 //    `current->state == P_RUNNABLE`.
 //
-//    Note that hardware interrupts are disabled when the kernel is running.
+//    Note that hardware interrupts are disabled when the kernel is running,
+//    and that the kernel runs holding `kernel_lock`.
+
+static uintptr_t syscall_dispatch(regstate* regs);
 
 uintptr_t syscall(regstate* regs) {
-    // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    kernel_lock.lock();
+
+    // `syscall_entry` saved the registers in `current->regs`.
+    assert(regs == &current->regs);
+    ++current->nsyscalls;
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: syscall %d at rip %p\n",
                   current->pid, regs->reg_rax, regs->reg_rip); */
 
-    // Show the current cursor location and memory state.
-    console_show_cursor();
-    memshow();
+    trace_syscall_enter(regs->reg_rax);
+    uintptr_t r = syscall_dispatch(regs);
+    trace_syscall_exit();
+    return r;
+}
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
 
+// syscall_dispatch(regs)
+//    Handle the system call in `regs` for `syscall`. Does not return if
+//    the system call blocks, yields, or ends the process; `run` or `idle`
+//    then ends its trace.
 
-    // Actually handle the exception.
+static uintptr_t syscall_dispatch(regstate* regs) {
     switch (regs->reg_rax) {
 
     case SYSCALL_PANIC:
+        fault_in_user_string(current->regs.reg_rdi, 256);
         user_panic(current);
         break; // will not be reached
 
@@ -402,87 +1536,435 @@ uintptr_t syscall(regstate* regs) {
 
     case SYSCALL_PAGE_ALLOC:
         return syscall_page_alloc(current->regs.reg_rdi);
+
+    case SYSCALL_PAGE_ALLOC_RANGE:
+        return syscall_page_alloc_range(current->regs.reg_rdi,
+                                        current->regs.reg_rsi,
+                                        current->regs.reg_rdx);
     
+    case SYSCALL_SLEEP:
+        return syscall_sleep(current->regs.reg_rdi);
+
+    case SYSCALL_WAITPID:
+        return syscall_waitpid(current->regs.reg_rdi);
+
     case SYSCALL_FORK:
         return syscall_fork();
 
+    case SYSCALL_SPAWN:
+        return syscall_spawn(current->regs.reg_rdi);
+
     case SYSCALL_EXIT:
         sys_exit();
         break;
 
+    case SYSCALL_TRACE_DUMP:
+        trace_dump();
+        return 0;
+
+    case SYSCALL_SET_QUANTUM:
+        return syscall_set_quantum(current->regs.reg_rdi);
+
+    case SYSCALL_SHM_CREATE:
+        return syscall_shm_create(current->regs.reg_rdi);
+
+    case SYSCALL_SHM_MAP:
+        return syscall_shm_map(current->regs.reg_rdi, current->regs.reg_rsi);
+
+    case SYSCALL_GETC:
+        return syscall_getc();
+
+    case SYSCALL_LOG:
+        return syscall_log(current->regs.reg_rdi);
+
+    case SYSCALL_MEMINFO:
+        return syscall_meminfo(current->regs.reg_rdi, current->regs.reg_rsi);
+
+    case SYSCALL_WRITE_CONSOLE:
+        return syscall_write_console(current->regs.reg_rdi, current->regs.reg_rsi);
+
     default:
         proc_panic(current, "Unhandled system call %ld (pid=%d, rip=%p)!\n",
                    regs->reg_rax, current->pid, regs->reg_rip);
 
     }
 
-    panic("Should not get here!\n");
+    panic("Should not get here!\n");
+}
+
+
+// unmap_user_page(it)
+//    If `it` maps a user page (other than the console) or a swapped-out
+//    one, frees it and clears the mapping.
+
+static void unmap_user_page(vmiter& it) {
+    if (it.present() && it.user() && it.va() != CONSOLE_ADDR) {
+        void* kpage = it.kptr<void*>();
+        it.map(it.pa(), 0);
+        kfree(kpage);
+    } else if (it.pte() & PTE_SWAP) {
+        swap_release(it.pte());
+        it.map(uintptr_t(0), 0);
+    }
+}
+
+
+// page_alloc(addr, flags)
+//    Allocates the user page at page-aligned `addr` for `current`,
+//    freeing any page mapped there. Without PAGE_ALLOC_EAGER in `flags`,
+//    the page is a reserved mapping of `zero_page`, allocated on first
+//    write. Returns 0 on success and -1 on failure. An old page (or
+//    zero-page reservation) held only by this mapping is released before
+//    allocating and is not restored on failure, so `addr` is then left
+//    unmapped; any other old mapping is left in place.
+
+static int page_alloc(uintptr_t addr, int flags) {
+    vmiter it(current->pagetable, addr);
+
+    // A page (or zero-page reservation) that only this mapping holds is
+    // freed first: its replacement then cannot run out of memory.
+    // Otherwise, fail at once if no page can be had
+    if (it.present() && it.user() && it.va() != CONSOLE_ADDR
+        && (it.kptr<void*>() == zero_page
+            || physpages[it.pa() / PAGESIZE].refcount == 1)) {
+        unmap_user_page(it);
+    } else if (!can_commit(1)) {
+        return -1;
+    }
+
+    // Get a zeroed page, or reserve one to allocate on first write
+    void* kpage;
+    int perm;
+    if (flags & PAGE_ALLOC_EAGER) {
+        kpage = user_page(kalloc_zeroed_page(), current);
+        perm = PTE_P | PTE_W | PTE_U;
+        if (!kpage) {
+            return -1;
+        }
+    } else {
+        kpage = zero_page;
+        perm = PTE_P | PTE_U | PTE_COW;
+        if (!reserve_zero_page()) {
+            return -1;
+        }
+    }
+
+    unmap_user_page(it);
+
+    // Install the new mapping
+    int r = it.try_map(kpage, perm);
+    if (r != 0) {
+        // If mapping fails, free the page (or release the reservation)
+        kfree(kpage);
+        return -1;
+    }
+    return 0;
+}
+
+
+// syscall_page_alloc(addr)
+//    Handles the SYSCALL_PAGE_ALLOC system call. This function
+//    should implement the specification for `sys_page_alloc`
+//    in `u-lib.hh` (but in the handout code, it does not).
+
+int syscall_page_alloc(uintptr_t addr) {
+    // Check that address is in user region and properly aligned
+    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL || addr % PAGESIZE != 0) {
+        // Return with an error
+        return -1;
+    }
+    return page_alloc(addr, 0);
+}
+
+
+// syscall_page_alloc_range(addr, npages, flags)
+//    Handles the SYSCALL_PAGE_ALLOC_RANGE system call; see
+//    `sys_page_alloc_range` in `u-lib.hh`. Returns the number of pages
+//    allocated, or -1 if none were.
+
+int syscall_page_alloc_range(uintptr_t addr, size_t npages, int flags) {
+    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL || addr % PAGESIZE != 0
+        || npages == 0 || npages > (MEMSIZE_VIRTUAL - addr) / PAGESIZE
+        || (flags & ~PAGE_ALLOC_EAGER)) {
+        return -1;
+    }
+    size_t n = 0;
+    while (n != npages && page_alloc(addr + n * PAGESIZE, flags) == 0) {
+        ++n;
+    }
+    return n > 0 ? int(n) : -1;
+}
+// Shared memory
+//    `syscall_shm_create` allocates a segment of zeroed pages, and
+//    `syscall_shm_map` maps all of a segment, writable, into the calling
+//    process. Segment IDs are global: any process may map any segment.
+//    The segment holds a reference to each of its pages and each mapping
+//    another, so a page outlives both the segment and its last mapping.
+//    Shared pages stay pinned and are flagged PPI_SHARED, which makes
+//    `syscall_fork` map them into the child as they are rather than
+//    copy-on-write. A process that creates or maps a segment, or is
+//    forked from one that did, holds it (a bit in `proc::shm_held`); the
+//    segment is destroyed when its last holder exits.
+
+#define SHM_MAXPAGES            16
+struct shm_segment {
+    size_t npages;
+    int nholders;                       // processes holding it
+    void* pages[SHM_MAXPAGES];
+};
+static shm_segment* shm_segments[MAXNSHM];  // from `kmalloc`
+
+// shm_hold(p, id)
+//    Makes `p` a holder of segment `id`, if it is not already.
+
+static void shm_hold(proc* p, int id) {
+    if (!(p->shm_held & (1U << id))) {
+        p->shm_held |= 1U << id;
+        ++shm_segments[id]->nholders;
+    }
+}
+
+// shm_release(p)
+//    Drops `p`'s hold on each segment it holds, destroying the segments
+//    it held last. Their pages are freed once unmapped too.
+
+static void shm_release(proc* p) {
+    for (int id = 0; id != MAXNSHM; ++id) {
+        shm_segment* seg = shm_segments[id];
+        if (!(p->shm_held & (1U << id)) || --seg->nholders > 0) {
+            continue;
+        }
+        for (size_t i = 0; i != seg->npages; ++i) {
+            kfree(seg->pages[i]);
+        }
+        kmfree(seg);
+        shm_segments[id] = nullptr;
+    }
+    p->shm_held = 0;
+}
+
+
+// syscall_shm_create(npages)
+//    Handles the SYSCALL_SHM_CREATE system call; see `sys_shm_create` in
+//    `u-lib.hh`. Returns the new segment's ID, or -1.
+
+int syscall_shm_create(size_t npages) {
+    if (npages == 0 || npages > SHM_MAXPAGES) {
+        return -1;
+    }
+    int id = 0;
+    while (id != MAXNSHM && shm_segments[id]) {
+        ++id;
+    }
+    shm_segment* seg;
+    if (id == MAXNSHM
+        || !(seg = reinterpret_cast<shm_segment*>(kmalloc(sizeof(shm_segment))))) {
+        return -1;
+    }
+
+    for (size_t i = 0; i != npages; ++i) {
+        seg->pages[i] = kalloc_zeroed_page();
+        if (!seg->pages[i]) {
+            while (i != 0) {
+                --i;
+                kfree(seg->pages[i]);
+            }
+            kmfree(seg);
+            return -1;
+        }
+        physpages[kptr2pa(seg->pages[i]) / PAGESIZE].flags |= PPI_SHARED;
+    }
+    seg->npages = npages;
+    seg->nholders = 0;
+    shm_segments[id] = seg;
+    shm_hold(current, id);
+    return id;
 }
 
 
-// syscall_page_alloc(addr)
-//    Handles the SYSCALL_PAGE_ALLOC system call. This function
-//    should implement the specification for `sys_page_alloc`
-//    in `u-lib.hh` (but in the handout code, it does not).
+// syscall_shm_map(id, addr)
+//    Handles the SYSCALL_SHM_MAP system call; see `sys_shm_map` in
+//    `u-lib.hh`. Returns 0 or -1.
 
-int syscall_page_alloc(uintptr_t addr) {
-    // Check that address is in user region and properly aligned
-    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL || addr % PAGESIZE != 0) {
-        // Return with an error
+int syscall_shm_map(int id, uintptr_t addr) {
+    if (id < 0 || id >= MAXNSHM || !shm_segments[id]) {
+        return -1;
+    }
+    shm_segment* seg = shm_segments[id];
+    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL || addr % PAGESIZE != 0
+        || seg->npages > (MEMSIZE_VIRTUAL - addr) / PAGESIZE) {
         return -1;
     }
-
     vmiter it(current->pagetable, addr);
+    for (size_t i = 0; i != seg->npages; ++i, it += PAGESIZE) {
+        if (it.present() && it.kptr<void*>() == seg->pages[i]) {
+            continue;                   // already mapped here
+        }
+        unmap_user_page(it);
+        if (it.try_map(seg->pages[i], PTE_P | PTE_W | PTE_U) != 0) {
+            return -1;
+        }
+        ++physpages[kptr2pa(seg->pages[i]) / PAGESIZE].refcount;
+    }
+    shm_hold(current, id);
+    return 0;
+}
 
-    // Allocate a physical page
-    void* kpage = kalloc(PAGESIZE);
-    if (kpage == nullptr) {
+
+// syscall_meminfo(pid, addr)
+//    Handles the SYSCALL_MEMINFO system call; see `sys_meminfo` in
+//    `u-lib.hh`. Copies process `pid`'s counters (the caller's if `pid`
+//    is 0) to `addr`, first giving the caller its own copy of any
+//    copy-on-write or unloaded page there. Returns 0 or -1.
+
+int syscall_meminfo(pid_t pid, uintptr_t addr) {
+    if (pid < 0 || pid >= MAXNPROC) {
         return -1;
     }
-    memset(kpage, 0, PAGESIZE);
-
-    // If there was an old mapping, free it and unmap
-    if (it.present() && it.user() && it.va() != CONSOLE_ADDR) {
-        kfree(it.kptr<void*>());       
-        it.map(it.pa(), 0);            
+    proc* p = pid == 0 ? current : &ptable[pid];
+    if (p->state == P_FREE || p->state == P_ZOMBIE || !p->pagetable
+        || addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL
+        || sizeof(meminfo) > MEMSIZE_VIRTUAL - addr) {
+        return -1;
     }
-
-    // Install new mapping
-    int r = it.try_map(kpage, PTE_P | PTE_W | PTE_U);
-    if (r != 0) {
-        // If mapping fails, free the page
-        kfree(kpage);
+    meminfo info = p->mem;
+    for (uintptr_t va = round_down(addr, PAGESIZE);
+         va < addr + sizeof(meminfo);
+         va += PAGESIZE) {
+        vmiter it(current, va);
+        if (!it.present() && !fault_in_page(current, va, true)) {
+            return -1;
+        }
+        it.find(va);
+        if (it.user() && it.perm(PTE_COW) && !resolve_cow_fault(it)) {
+            return -1;
+        }
+    }
+    if (copy_to_user(vmiter(current, addr), &info, sizeof(info)) != sizeof(info)) {
         return -1;
     }
     return 0;
 }
-/// Helper function for handling page frees
-static void free_pagetable_and_pages(proc* free_proc) {
-    // Unmap & free all user pages
-    for (vmiter it(free_proc->pagetable, PROC_START_ADDR); !it.done(); it.next()) {
-        if (it.present() && it.user() && it.va() != CONSOLE_ADDR) {
+
+
+// free_pagetable_and_pages(p)
+//    Frees process `p`'s user pages and page table pages and marks it
+//    free. `vmiter::next` steps over absent page table subtrees in one
+//    move, and the user range ends at MEMSIZE_VIRTUAL, so this costs time
+//    in proportion to the mapped pages. The mappings are not cleared one
+//    by one, since the page table pages holding them are freed too.
+static void free_pagetable_and_pages(proc* p) {
+    for (vmiter it(p->pagetable, PROC_START_ADDR);
+         it.va() < MEMSIZE_VIRTUAL;
+         it.next()) {
+        if (it.user() && it.va() != CONSOLE_ADDR) {
             kfree(it.kptr<void*>());
-            it.map(it.pa(), 0);
+        } else if (it.pte() & PTE_SWAP) {
+            swap_release(it.pte());
         }
     }
-    // Free page table pages
-    for (ptiter pt(free_proc->pagetable); !pt.done(); pt.next()) {
+    for (ptiter pt(p->pagetable); !pt.done(); pt.next()) {
         kfree(pt.kptr());
     }
-    kfree(free_proc->pagetable);
-    free_proc->pagetable = nullptr;
-    free_proc->state = P_FREE;
+    kfree(p->pagetable);
+    p->pagetable = nullptr;
+    p->mem = {};
+    kfree(p->info_page);
+    p->info_page = nullptr;
+    shm_release(p);
+    set_state(p, P_FREE);
 }
 
-int syscall_fork() {
-    // Find a free slot
-    pid_t free_pid = 0;
-    for(pid_t i {1}; i < MAXNPROC; ++i) {
-        if(ptable[i].state == P_FREE) {
-            free_pid = i;
-            break;
+
+// Reaper
+//    `sys_exit` does not free the exiting process's memory, which would
+//    delay the next process by the size of the dying one. The process
+//    becomes a `P_ZOMBIE`, off the run queues, and `reap_some` frees its
+//    user pages later, a batch at a time, clearing each mapping as it
+//    goes so no freed page stays mapped. Once the user range is empty it
+//    frees the page table pages and the process slot. `schedule` reaps
+//    while there is nothing to run, `kalloc` when memory runs short, and
+//    `find_free_pid` when every slot is taken.
+static unsigned nzombies;       // processes in state `P_ZOMBIE`
+
+// reap_some(batch)
+//    Frees up to `batch` user pages of the lowest-numbered zombie, and
+//    the rest of it if that was its last. Returns false if there are no
+//    zombies.
+
+static bool reap_some(unsigned batch) {
+    if (nzombies == 0) {
+        return false;
+    }
+    proc* p = &ptable[1];
+    while (p->state != P_ZOMBIE) {
+        ++p;
+    }
+    vmiter it(p->pagetable, p->reap_va);
+    for (unsigned n = 0; it.va() < MEMSIZE_VIRTUAL && n != batch; it.next()) {
+        if (it.user() || (it.pte() & PTE_SWAP)) {
+            unmap_user_page(it);
+            ++n;
+        }
+    }
+    p->reap_va = it.va();
+    if (p->reap_va >= MEMSIZE_VIRTUAL) {
+        free_pagetable_and_pages(p);
+        --nzombies;
+    }
+    return true;
+}
+
+// can_commit(npages)
+//    Returns false if `kalloc` surely cannot supply `npages` more pages
+//    (or zero-page reservations), so that `syscall_fork` and `page_alloc`
+//    can fail at once instead of allocating until `kalloc` fails and
+//    then undoing their work. Counts the free pages not reserved; if
+//    that is too few, it adds an upper bound on what the reaper and swap
+//    could provide: zombies' pages, and live processes' resident pages
+//    up to the number of free swap slots. Costs O(1) unless memory is
+//    short, and O(MAXNPROC) then.
+
+static bool can_commit(size_t npages) {
+    size_t avail = nfree_pages - nreserved_pages;
+    if (avail >= npages) {
+        return true;
+    }
+    size_t evictable = 0;
+    for (pid_t pid = 1; pid < MAXNPROC; ++pid) {
+        const proc* p = &ptable[pid];
+        if (p->state == P_ZOMBIE) {
+            avail += p->mem.resident + p->mem.pagetable + 1;
+        } else if (p->state != P_FREE) {
+            evictable += p->mem.resident - p->mem.reserved;
+        }
+    }
+    if (!swap_failed) {
+        avail += min(evictable, size_t(nswap_free));
+    }
+    return avail >= npages;
+}
+
+// find_free_pid()
+//    Returns the lowest free process slot, or 0 if there is none. Takes
+//    a zombie's slot, finishing it off, if no other is free.
+
+static pid_t find_free_pid() {
+    while (true) {
+        for (pid_t i = 1; i < MAXNPROC; ++i) {
+            if (ptable[i].state == P_FREE) {
+                return i;
+            }
+        }
+        if (!reap_some(~0U)) {
+            return 0;
         }
     }
+}
+
+int syscall_fork() {
+    // Find a free slot
+    pid_t free_pid = find_free_pid();
     // If no free slot found, return error
     if(free_pid == 0) {
         return -1;
@@ -491,6 +1973,14 @@ int syscall_fork() {
     proc* free_proc = &ptable[free_pid];
     proc* current_proc = current;
 
+    // Fail at once if the child's page table pages, info page, and
+    // zero-page reservations cannot all be had. Pages shared
+    // copy-on-write cost nothing until written.
+    if (!can_commit(current_proc->mem.pagetable + 1
+                    + current_proc->mem.reserved)) {
+        return -1;
+    }
+
     // Initialize the new process
     init_process(free_proc, 0);
 
@@ -500,62 +1990,74 @@ int syscall_fork() {
     if(free_proc->pagetable == nullptr) {
         return -1;
     }
+    own_pagetable(free_proc);
 
-    // Copy kernel region mappings (same as in process_setup)
-    for (vmiter kit(kernel_pagetable, 0); kit.va() < PROC_START_ADDR; kit.next()) {
-        if (!kit.present()) {
+    // Map the kernel region and info page
+    if (map_kernel_region(free_proc->pagetable) != 0
+        || map_info_page(free_proc) != 0) {
+        free_pagetable_and_pages(free_proc);
+        return -1;
+    }
+
+    // Copy user region mappings. Both iterators only move forward, so
+    // neither walks down from the root for each page.
+    vmiter cit(free_proc->pagetable, PROC_START_ADDR);
+    for (vmiter pit(current_proc->pagetable, PROC_START_ADDR);
+         pit.va() < MEMSIZE_VIRTUAL;
+         pit.next()) {
+        // Both processes keep a swapped-out page's slot; each reads back
+        // its own copy
+        if (pit.pte() & PTE_SWAP) {
+            cit.find(pit.va());
+            if (cit.try_map(pit.pte() & PTE_PAMASK, pit.pte() & PAGEOFFMASK) != 0) {
+                free_pagetable_and_pages(free_proc);
+                return -1;
+            }
+            ++swap_refs[pit.pte() >> PAGEOFFBITS];
             continue;
         }
-        
-        uintptr_t kva = kit.va();
-        uintptr_t kpa = kit.pa();
-        int kperm = kit.perm();
-        
-        if (kva != CONSOLE_ADDR) {
-            kperm &= ~PTE_U;
-        }
-        
-        vmiter cit(free_proc->pagetable, kva);
-        int r = cit.try_map(kpa, kperm);
-        if (r != 0) {
-            free_pagetable_and_pages(free_proc);
-            return -1;
-        }
-    }
-    
-    // Copy user region mappings (need separate physical pages)
-    for (vmiter pit(current_proc->pagetable, PROC_START_ADDR); !pit.done(); pit.next()) {
         if (!pit.present() || !pit.user()) {
             continue;
         }
-        
+
         uintptr_t va = pit.va();
+        cit.find(va);
         uintptr_t pa = pit.pa();
         int perm = pit.perm();
 
-        // Copy page if in user region, writable, and not the console
-        if (va >= PROC_START_ADDR && (perm & PTE_U) && pit.writable() && va != CONSOLE_ADDR) {
-            // Allocate new physical page for child
-            void* new_page = kalloc(PAGESIZE);
-            // If allocation fails, clean up and return error
-            if (new_page == nullptr) {
+        // Share writable user pages (other than the console and shared
+        // memory) copy-on-write: both processes map them read-only with
+        // PTE_COW until one writes
+        if (va >= PROC_START_ADDR && (perm & PTE_U) && va != CONSOLE_ADDR
+            && (pit.writable() || (perm & PTE_COW))
+            && !(physpages[pa / PAGESIZE].flags & PPI_SHARED)) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            // Zero-page mappings need a reservation of their own
+            bool zero = pit.kptr<void*>() == zero_page;
+            if (zero && !reserve_zero_page()) {
                 free_pagetable_and_pages(free_proc);
                 return -1;
             }
-                        
-            // Copy data from parent to child
-            memcpy(new_page, reinterpret_cast<void*>(pa), PAGESIZE);
-            
-            // Map new page in child's page table
-            vmiter cit(free_proc->pagetable, va);
-            int r = cit.try_map(new_page, perm);
+            int r = cit.try_map(pa, perm);
             if (r != 0) {
+                if (zero) {
+                    kfree(zero_page);
+                }
                 free_pagetable_and_pages(free_proc);
                 return -1;
             }
+            // The parent loses write access too (`tlb_mark_pagetable`
+            // makes returning to it flush its TLB entries), unless an
+            // earlier fork already took it
+            if (pit.writable()) {
+                pit.map(pa, perm);
+            }
+            if (!zero) {
+                ++physpages[pa / PAGESIZE].refcount;
+                physpages[pa / PAGESIZE].flags |= PPI_COW;
+            }
         } else {
-            // Share read-only/kernel pages
-            vmiter cit(free_proc->pagetable, va);
+            // Share read-only/kernel pages and shared memory
             int r = cit.try_map(pa, perm);
             if (r != 0) {
                 // Cleanup and return error
@@ -570,76 +2072,611 @@ int syscall_fork() {
     // Copy current register's to forked process
     free_proc->regs = current_proc->regs;
     free_proc->regs.reg_rax = 0;
-    free_proc->state = P_RUNNABLE;
+    // Pages the parent has not loaded yet are still pristine, so the
+    // child loads them from the program image too
+    free_proc->program = current_proc->program;
+    set_state(free_proc, P_RUNNABLE);
+    free_proc->quantum = current_proc->quantum;
+    for (int id = 0; id != MAXNSHM; ++id) {
+        if (current_proc->shm_held & (1U << id)) {
+            shm_hold(free_proc, id);
+        }
+    }
     
     return free_pid;
 }
 
+// syscall_spawn(name)
+//    Starts program `name` in a new process, set up from the program
+//    image by `process_setup` rather than copied from the caller, so it
+//    costs the same however large the caller is. Returns the new
+//    process's ID, or -1 if there is no such program, no free slot, or
+//    no memory.
+
+int syscall_spawn(uintptr_t name) {
+    char buf[32];
+    fault_in_user_string(name, sizeof(buf));
+    strlcpy_from_user(buf, vmiter(current, name), sizeof(buf));
+    if (program_image(buf).empty()) {
+        return -1;
+    }
+    pid_t pid = find_free_pid();
+    if (pid == 0 || process_setup(pid, buf) != 0) {
+        return -1;
+    }
+    return pid;
+}
+
 void sys_exit() {
     proc* p = current;
 
-    // Free all user pages
-    for (vmiter it(p->pagetable, PROC_START_ADDR); !it.done(); it.next()) {
-        if (it.present() && it.user() && it.va() != CONSOLE_ADDR) {
-            // free physical page
-            kfree(it.kptr<void*>());
-            // unmap the virtual addresses
-            it.map(it.pa(), 0);
-        }
-    }
-    // Free all page tables
-    for (ptiter pt(p->pagetable); !pt.done(); pt.next()) {
-        kfree(pt.kptr());   
-    }
-    kfree(p->pagetable);     
-    
-    // Mark process as free
-    p->state = P_FREE;
-    p->pagetable = nullptr;
+    // Leave its memory to the reaper and wake processes waiting for it
+    log_accounting(p);
+    set_state(p, P_ZOMBIE);
+    p->reap_va = PROC_START_ADDR;
+    ++nzombies;
+    wake_waiters(p, 0);
     
     // Schedule another process
     schedule();
 }
 
+// Run queues
+//    Each scheduling level has a circular list of its `P_RUNNABLE`
+//    processes, linked through `runq_next` and `runq_prev`. `runq[L]`
+//    is the next process to run from level L; `schedule` advances it
+//    past each process it picks, so each level is round-robin.
+//
+//    The round-robin scheduler uses one level, and switches processes
+//    after every time slice. The multilevel feedback scheduler (`mlfq`)
+//    uses `SCHED_LEVELS`: processes start on level 0, and a process that
+//    uses a whole time slice without blocking or yielding drops a level.
+//    `schedule` always runs the highest level with runnable processes,
+//    so interactive processes are not starved by CPU hogs, and every
+//    `SCHED_BOOST_TICKS` all processes return to level 0 so the hogs are
+//    not starved either.
+//
+//    A slice is SCHED_QUANTUM microseconds, or the process's own
+//    `quantum` (`sys_set_quantum`), doubled for each level below 0. There
+//    is no periodic tick: `run` arms the CPU's one-shot timer for the end
+//    of the slice, and an idle CPU has no timer interrupts at all (except
+//    the first CPU's, for clock work) until `wake_idle_cpu` sends it an
+//    IPI.
+
+static void runq_insert(proc* p) {
+    proc*& head = runq[p->level];
+    if (!head) {
+        p->runq_next = p->runq_prev = p;
+        head = p;
+    } else {
+        // insert just before `head`, so it runs last in this round
+        p->runq_next = head;
+        p->runq_prev = head->runq_prev;
+        head->runq_prev->runq_next = p;
+        head->runq_prev = p;
+    }
+}
+
+static void runq_remove(proc* p) {
+    proc*& head = runq[p->level];
+    if (p->runq_next == p) {
+        head = nullptr;
+    } else {
+        p->runq_prev->runq_next = p->runq_next;
+        p->runq_next->runq_prev = p->runq_prev;
+        if (head == p) {
+            head = p->runq_next;
+        }
+    }
+    p->runq_next = p->runq_prev = nullptr;
+}
+
+// set_state(p, state)
+//    Change `p`'s state, keeping the run queues up to date. A process
+//    slot that starts a new process also starts new accounting.
+
+static void set_state(proc* p, int state) {
+    if (p->state == P_FREE && state != P_FREE) {
+        p->tlb_cpus = 0;                // a new address space for this PCID
+        p->level = 0;
+        p->quantum = 0;
+        p->slice_end = 0;
+        p->cpu_cycles = p->nswitches = p->nsyscalls = p->nchecks = 0;
+    }
+    if (p->state == P_RUNNABLE && state != P_RUNNABLE) {
+        runq_remove(p);
+    } else if (p->state != P_RUNNABLE && state == P_RUNNABLE) {
+        runq_insert(p);
+        wake_idle_cpu(p);
+    }
+    p->state = state;
+}
+
+// wake_cpu(cpu)
+//    Interrupts CPU `cpu` with IRQ_WAKEUP.
+
+static void wake_cpu(int cpu) {
+    lapicstate::get().ipi(cpus[cpu].lapic_id, INT_IRQ + IRQ_WAKEUP);
+}
+
+// wake_idle_cpu(p)
+//    Called when `p` becomes runnable. Wakes one idle CPU to run it, if
+//    any other CPU is idle; otherwise, under `mlfq`, preempts a CPU
+//    running a lower-priority process.
+
+static void wake_idle_cpu(proc* p) {
+    int self = this_cpu()->index;
+    if (unsigned idle = idle_cpus & ~woken_cpus & ~(1U << self)) {
+        int cpu = lsb(idle) - 1;
+        woken_cpus |= 1U << cpu;
+        wake_cpu(cpu);
+        return;
+    }
+    if (sched_levels > 1) {
+        for (auto& q : ptable) {
+            if (q.cpu >= 0 && q.cpu != self && q.level > p->level) {
+                wake_cpu(q.cpu);
+                return;
+            }
+        }
+    }
+}
+
+// set_level(p, level)
+//    Move `p` to scheduling level `level`.
+
+static void set_level(proc* p, int level) {
+    if (p->state == P_RUNNABLE) {
+        runq_remove(p);
+        p->level = level;
+        runq_insert(p);
+    } else {
+        p->level = level;
+    }
+}
+
+// sched_quantum(p)
+//    Returns the length of `p`'s time slices in TSC cycles.
+
+static uint64_t sched_quantum(proc* p) {
+    uint64_t usec = p->quantum ? p->quantum : SCHED_QUANTUM;
+    return (usec << p->level) * tsc_per_usec;
+}
+
+// sched_preempted(p)
+//    Returns true if a higher scheduling level than the running process
+//    `p`'s has work.
+
+static bool sched_preempted(proc* p) {
+    for (int level = 0; level < p->level; ++level) {
+        if (runq[level]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// sched_timer(p)
+//    Called when a timer interrupt finds `p` running. Returns true if `p`
+//    should keep running: its slice is not over, and it is not
+//    preempted. A process that used its whole slice drops a level.
+
+static bool sched_timer(proc* p) {
+    if (p->state != P_RUNNABLE) {
+        return false;
+    }
+    if (rdtsc() < p->slice_end) {
+        return !sched_preempted(p);
+    }
+    p->slice_end = 0;
+    if (p->level + 1 < sched_levels) {
+        set_level(p, p->level + 1);
+    }
+    return false;
+}
+
+// sched_boost()
+//    Returns every process to level 0.
+
+static void sched_boost() {
+    for (int pid = 1; pid < MAXNPROC; ++pid) {
+        if (ptable[pid].state != P_FREE && ptable[pid].level != 0) {
+            set_level(&ptable[pid], 0);
+        }
+    }
+}
+
+// log_accounting(p)
+//    Logs the CPU accounting for process `p`.
+
+static void log_accounting(proc* p) {
+    if (p == current) {
+        cpustate* c = this_cpu();
+        uint64_t now = rdtsc();
+        p->cpu_cycles += now - c->run_tsc;
+        c->run_tsc = now;
+    }
+    log_printf("proc %d: %lu usec, %lu switches, %lu syscalls, %lu checks, "
+               "level %d\n",
+               p->pid, p->cpu_cycles / tsc_per_usec, p->nswitches,
+               p->nsyscalls, p->nchecks, p->level);
+}
+
+// syscall_set_quantum(usec)
+//    Sets the current process's time slice to `usec` microseconds, or
+//    back to the default if `usec == 0`. The new length applies from its
+//    next slice.
+
+int syscall_set_quantum(unsigned long usec) {
+    if (usec != 0 && (usec < SCHED_MIN_QUANTUM || usec > SCHED_MAX_QUANTUM)) {
+        return -1;
+    }
+    current->quantum = usec;
+    return 0;
+}
+
+
+// syscall_log(msg)
+//    Writes the current process's string `msg` to `log.txt` as one line.
+
+int syscall_log(uintptr_t msg) {
+    char buf[128];
+    fault_in_user_string(msg, sizeof(buf));
+    strlcpy_from_user(buf, vmiter(current, msg), sizeof(buf));
+    log_printf("proc %d: %s\n", current->pid, buf);
+    return 0;
+}
+
+
+// syscall_write_console(buf, len)
+//    Writes up to CONSOLE_WRITE_MAX bytes from the current process's
+//    `buf` to the console at the cursor, scrolling as `console_printf`
+//    does. The hardware cursor is left for `update_clock` to move with
+//    the next memory viewer refresh. Returns the number of bytes written,
+//    or -1 if none could be read.
+#define CONSOLE_WRITE_MAX 4096
+
+int syscall_write_console(uintptr_t buf, size_t len) {
+    len = min(len, size_t(CONSOLE_WRITE_MAX));
+    fault_in_user_string(buf, len);
+    console_printer cp(-1, console_printer::scroll_on);
+    char chunk[128];
+    size_t n = 0;
+    while (n != len) {
+        size_t want = min(len - n, sizeof(chunk));
+        size_t got = copy_from_user(chunk, vmiter(current, buf + n), want);
+        for (size_t i = 0; i != got; ++i) {
+            cp.putc(chunk[i]);
+        }
+        n += got;
+        if (got != want) {
+            break;
+        }
+    }
+    cp.move_cursor();
+    return n || !len ? int(n) : -1;
+}
+
+
+// syscall_sleep(nticks)
+//    Blocks the current process for at least `nticks` clock ticks. It
+//    goes on the timer wheel slot for its wake-up tick, which
+//    `update_clock` checks when that tick has passed. If it is due before
+//    the first CPU's timer fires, that CPU is woken to re-arm it.
+
+int syscall_sleep(unsigned long nticks) {
+    if (nticks == 0) {
+        return 0;
+    }
+    update_clock();
+    current->wake_tick = ticks + nticks;
+    proc** slot = &timer_wheel[current->wake_tick % TIMER_WHEEL_SIZE];
+    current->wait_next = *slot;
+    *slot = current;
+    if (current->wake_tick < next_wake_tick) {
+        next_wake_tick = current->wake_tick;
+        uint64_t due = clock_start_tsc + next_wake_tick * tsc_per_tick;
+        if (this_cpu()->index != 0 && due < cpus[0].timer_deadline) {
+            wake_cpu(0);
+        }
+    }
+    current->regs.reg_rax = 0;
+    set_state(current, P_BLOCKED);
+    schedule();                 // does not return
+}
+
+// wake_sleepers(from, to)
+//    Wakes the sleeping processes due in ticks (`from`, `to`]. A slot
+//    also holds processes due whole turns of the wheel later; they stay.
+
+static void wake_sleepers(unsigned long from, unsigned long to) {
+    if (to < next_wake_tick) {
+        return;
+    }
+    unsigned long n = min(to - from, (unsigned long) TIMER_WHEEL_SIZE);
+    for (unsigned long t = to - n + 1; t <= to; ++t) {
+        proc** pp = &timer_wheel[t % TIMER_WHEEL_SIZE];
+        while (proc* p = *pp) {
+            if (p->wake_tick <= to) {
+                *pp = p->wait_next;
+                p->wait_next = nullptr;
+                set_state(p, P_RUNNABLE);
+            } else {
+                pp = &p->wait_next;
+            }
+        }
+    }
+    next_wake_tick = -1;
+    for (proc* head : timer_wheel) {
+        for (proc* p = head; p; p = p->wait_next) {
+            next_wake_tick = min(next_wake_tick, p->wake_tick);
+        }
+    }
+}
+
+// update_clock()
+//    Advances `ticks` to the TSC's time, then does the clock work for the
+//    ticks that passed: waking sleepers, `mlfq` priority boosts, and
+//    refreshing the cursor and memory viewer every MEMSHOW_TICKS. Ticks
+//    are not interrupts, so several may pass at once.
+
+static void update_clock() {
+    unsigned long then = ticks;
+    unsigned long now = (rdtsc() - clock_start_tsc) / tsc_per_tick;
+    if (now <= then) {
+        return;
+    }
+    ticks = now;
+    wake_sleepers(then, now);
+    if (sched_levels > 1 && now / SCHED_BOOST_TICKS != then / SCHED_BOOST_TICKS) {
+        sched_boost();
+    }
+    if (now / WS_SCAN_TICKS != then / WS_SCAN_TICKS) {
+        wss_scan();
+    }
+    if (now / MEMSHOW_TICKS != then / MEMSHOW_TICKS) {
+        console_show_cursor();
+        memshow();
+    }
+}
+
+// wss_scan()
+//    Estimates working sets from the accessed and dirty bits, which it
+//    samples and clears in every live process's user mappings. Stepping
+//    with `vmiter::next` skips absent page table subtrees, so a scan
+//    costs time in proportion to the mapped pages. An accessed bit marks
+//    its page PPI_ACCESSED; then one pass over `physpages` zeroes those
+//    pages' ages and ages the rest, and tells the memory viewer about
+//    pages that turned hot or cold. A process's working set counts
+//    pages accessed now or younger than WS_WINDOW - 1 scans before, so a
+//    page another process keeps hot counts too. A process running on
+//    another CPU may not set cleared bits again until that CPU's TLB is
+//    flushed, at its next return to user mode.
+
+static void wss_scan() {
+    for (pid_t pid = 1; pid < MAXNPROC; ++pid) {
+        proc* p = &ptable[pid];
+        if (p->state == P_FREE || p->state == P_ZOMBIE || !p->pagetable) {
+            continue;
+        }
+        unsigned ws = 0, written = 0;
+        for (vmiter it(p, PROC_START_ADDR); it.va() < MEMSIZE_VIRTUAL; it.next()) {
+            if (!it.user()) {
+                continue;
+            }
+            uint64_t bits = it.take_bits(PTE_A | PTE_D);
+            physpageinfo& pi = physpages[it.pa() / PAGESIZE];
+            if (bits & PTE_A) {
+                pi.flags |= PPI_ACCESSED;
+            }
+            ws += (bits & PTE_A) || pi.age + 1 < WS_WINDOW;
+            written += (bits & PTE_D) != 0;
+        }
+        tlb_mark_pagetable(p->pagetable);
+        p->mem.working_set = ws;
+        p->mem.written = written;
+    }
+
+    for (int pn = 0; pn != NPAGES; ++pn) {
+        physpageinfo& pi = physpages[pn];
+        bool was_hot = pi.age < WS_WINDOW;
+        if (pi.flags & PPI_ACCESSED) {
+            pi.flags &= ~PPI_ACCESSED;
+            pi.age = 0;
+        } else if (pi.used() && pi.age != 255) {
+            ++pi.age;
+        }
+        if (was_hot != (pi.age < WS_WINDOW)) {
+            memviewer_mark_page(pn * PAGESIZE);
+        }
+    }
+}
+
+// arm_timer(p)
+//    Arms this CPU's timer for its next deadline while running `p` (or
+//    idling, if `p == nullptr`): the end of `p`'s slice, and on the first
+//    CPU also the next tick with clock work. Other idle CPUs disarm it.
+//    The LAPIC is only written when the deadline changes, so returning
+//    to a process within its slice costs nothing.
+
+static void arm_timer(proc* p) {
+    cpustate* c = this_cpu();
+    uint64_t deadline = p ? p->slice_end : uint64_t(-1);
+    if (c->index == 0) {
+        unsigned long tick = (ticks / MEMSHOW_TICKS + 1) * MEMSHOW_TICKS;
+        if (sched_levels > 1) {
+            tick = min(tick, (ticks / SCHED_BOOST_TICKS + 1) * SCHED_BOOST_TICKS);
+        }
+        tick = min(tick, next_wake_tick);
+        deadline = min(deadline, clock_start_tsc + tick * tsc_per_tick);
+    }
+    if (deadline == uint64_t(-1)) {
+        deadline = 0;
+    }
+    if (deadline == c->timer_deadline) {
+        return;
+    }
+    c->timer_deadline = deadline;
+    if (deadline == 0) {
+        set_timer(0);
+    } else {
+        uint64_t now = rdtsc();
+        set_timer(deadline > now ? (deadline - now) / tsc_per_usec + 1 : 1);
+    }
+}
+
+// syscall_waitpid(pid)
+//    Blocks the current process until process `pid` exits or faults.
+
+int syscall_waitpid(pid_t pid) {
+    if (pid <= 0 || pid >= MAXNPROC || pid == current->pid) {
+        return -1;
+    }
+    proc* p = &ptable[pid];
+    if (p->state == P_FREE || p->state == P_FAULTED || p->state == P_ZOMBIE) {
+        return -1;
+    }
+    current->wait_next = p->waiters;
+    p->waiters = current;
+    set_state(current, P_BLOCKED);
+    schedule();                 // does not return
+}
+
+// wake_waiters(p, result)
+//    Wakes the processes waiting for `p`, returning `result` from their
+//    `sys_waitpid` calls.
+
+static void wake_waiters(proc* p, int result) {
+    while (proc* w = p->waiters) {
+        p->waiters = w->wait_next;
+        w->wait_next = nullptr;
+        w->regs.reg_rax = result;
+        set_state(w, P_RUNNABLE);
+    }
+}
+
+
 // schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Pick the next process to run and then run it: the next process on
+//    the highest run queue level that has one, skipping processes other
+//    CPUs are running. If there are no runnable processes, waits for one.
 
 void schedule() {
-    pid_t pid = current->pid;
-    for (unsigned spins = 1; true; ++spins) {
-        pid = (pid + 1) % MAXNPROC;
-        if (ptable[pid].state == P_RUNNABLE) {
-            run(&ptable[pid]);
+    int cpu = this_cpu()->index;
+    while (true) {
+        for (int level = 0; level < sched_levels; ++level) {
+            proc* p = runq[level];
+            while (p && p->cpu >= 0 && p->cpu != cpu) {
+                p = p->runq_next;
+                if (p == runq[level]) {
+                    p = nullptr;
+                }
+            }
+            if (p) {
+                runq[level] = p->runq_next;
+                p->slice_end = 0;
+                run(p);
+            }
         }
 
-        // If Control-C was typed, exit the virtual machine.
-        check_keyboard();
-
-        // If spinning forever, show the memviewer.
-        if (spins % (1 << 12) == 0) {
-            memshow();
+        // Use the idle time to free exited processes' memory and clear
+        // pages for later allocations, then sleep until an interrupt.
+        if (!reap_some(REAP_BATCH) && !prezero_page()) {
+            idle();
         }
     }
 }
 
 
+// idle()
+//    Release `kernel_lock` and halt the CPU until the next interrupt. The
+//    kernel stack is reset first: the interrupt's handler never returns
+//    here, so otherwise every interrupt taken while idle would leave a
+//    frame behind. Idle time also drains the kernel log, `LOG_IDLE_BATCH`
+//    bytes at a time, so interrupts are never held off for long. Only
+//    the first CPU's timer stays armed (see `arm_timer`); other work
+//    arrives with IRQ_WAKEUP.
+
+#define LOG_IDLE_BATCH 1024
+
+void idle() {
+    trace_syscall_exit();
+    cpustate* c = this_cpu();
+    uint64_t now = rdtsc();
+    if (current) {
+        current->cpu_cycles += now - c->run_tsc;
+        current->cpu = -1;
+        current = nullptr;
+    }
+    c->run_tsc = now;
+    idle_cpus |= 1U << c->index;
+    arm_timer(nullptr);
+    uintptr_t stack_top = c->stack_top;
+    kernel_lock.unlock();
+    // Write out some buffered log messages while there is nothing to do
+    log_flush(LOG_IDLE_BATCH);
+    asm volatile("movq %0, %%rsp\n\t"
+                 "1: sti\n\t"
+                 "hlt\n\t"
+                 "cli\n\t"
+                 "jmp 1b"
+                 : : "r" (stack_top) : "memory");
+    __builtin_unreachable();
+}
+
+
 // run(p)
-//    Run process `p`. This involves setting `current = p` and calling
-//    `exception_return` to restore its page table and registers.
+//    Run process `p`. This involves setting `current = p`, arming the
+//    timer for the end of its time slice (starting a new slice if
+//    `schedule` picked it), and calling `exception_return` to restore its
+//    page table and registers.
 
 void run(proc* p) {
     assert(p->state == P_RUNNABLE);
+    trace_syscall_exit();
+    cpustate* c = this_cpu();
+    if (p != current) {
+        trace(TRACE_SWITCH, p->pid);
+        uint64_t now = rdtsc();
+        if (current) {
+            current->cpu_cycles += now - c->run_tsc;
+            current->cpu = -1;
+        }
+        c->run_tsc = now;
+        ++p->nswitches;
+    }
+    p->cpu = c->index;
     current = p;
+    if (!p->slice_end) {
+        p->slice_end = rdtsc() + sched_quantum(p);
+    }
+    arm_timer(p);
+
+    // Keep this PCID's TLB entries unless they may be stale.
+    c->user_cr3 = kptr2pa(p->pagetable);
+    if (pcid_enabled) {
+        c->user_cr3 |= p->pid;
+        if (p->tlb_cpus & (1U << c->index)) {
+            c->user_cr3 |= CR3_NOFLUSH;
+        }
+        p->tlb_cpus |= 1U << c->index;
+    }
 
-    // Check the process's current registers.
-    check_process_registers(p);
+    // The next exception from user mode saves its frame in `p->regs`.
+    c->taskstate.ts_rsp[0] = reinterpret_cast<uintptr_t>(&p->regs + 1);
 
-    // Check the process's current pagetable.
-    check_pagetable(p->pagetable);
+    // Check the process's current registers and pagetable, as often as
+    // `check_interval` says.
+    ++run_count;
+    if (check_interval && run_count % check_interval == 0) {
+        check_process_registers(p);
+        check_pagetable(p->pagetable);
+        ++p->nchecks;
+    }
 
     // This function is defined in k-exception.S. It restores the process's
     // registers then jumps back to user mode.
+    kernel_lock.unlock();
     exception_return(p);
 
     // should never get here
@@ -648,9 +2685,29 @@ void run(proc* p) {
 }
 
 
+// tlb_mark_pagetable(pt)
+//    Called when a mapping in `pt` changes. The kernel changes mappings
+//    on the kernel page table, where `invlpg` would not reach the
+//    process's PCID, so instead every CPU flushes that PCID when it next
+//    returns to the process. That includes this CPU, if it is about to
+//    return from a system call.
+
+void tlb_mark_pagetable(x86_64_pagetable* pt) {
+    for (auto& p : ptable) {
+        if (p.pagetable == pt) {
+            p.tlb_cpus = 0;
+        }
+    }
+    if (current && current->pagetable == pt) {
+        this_cpu()->user_cr3 &= ~CR3_NOFLUSH;
+    }
+}
+
+
 // memshow()
 //    Draw a picture of memory (physical and virtual) on the CGA console.
-//    Switches to a new process's virtual memory map every 0.25 sec.
+//    Switches to a new process's virtual memory map every 0.25 sec, and
+//    shows how much of the last second the CPUs spent idle.
 //    Uses `console_memviewer()`, a function defined in `k-memviewer.cc`.
 
 void memshow() {
@@ -675,8 +2732,30 @@ void memshow() {
 
     console_memviewer(p);
     if (!p) {
+        console_printf(CPOS(10, 0), "                    ");
         console_printf(CPOS(10, 26), CS_WHITE "   VIRTUAL ADDRESS SPACE\n"
             "                          [All processes have exited]\n"
             "\n\n\n\n\n\n\n\n\n\n\n");
     }
+
+    // show the share of the CPUs' time spent idle, updated every second;
+    // CPUs idle right now count up to now
+    static uint64_t last_idle_cycles = 0, last_idle_tsc = 0;
+    static unsigned idle_percent = 0;
+    uint64_t now = rdtsc();
+    if (now - last_idle_tsc >= HZ * tsc_per_tick) {
+        uint64_t idle_now = idle_cycles;
+        for (int cpu = 0; cpu != ncpu; ++cpu) {
+            if (idle_cpus & (1U << cpu)) {
+                idle_now += now - cpus[cpu].run_tsc;
+            }
+        }
+        if (last_idle_tsc) {
+            idle_percent = min((idle_now - last_idle_cycles) * 100
+                               / ((now - last_idle_tsc) * ncpu), uint64_t(100));
+        }
+        last_idle_cycles = idle_now;
+        last_idle_tsc = now;
+    }
+    console_printf(CPOS(0, 70), CS_WHITE "idle %3u%%", idle_percent);
 }
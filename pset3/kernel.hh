@@ -2,6 +2,7 @@
 #define WEENSYOS_KERNEL_HH
 #include "x86-64.h"
 #include "lib.hh"
+#include <atomic>
 #if WEENSYOS_PROCESS
 #error "kernel.hh should not be used by process code."
 #endif
@@ -21,20 +22,138 @@ class vmiter;
 #define P_RUNNABLE  1                   // runnable process
 #define P_BLOCKED   2                   // blocked process
 #define P_FAULTED   3                   // faulted process
+#define P_ZOMBIE    4                   // exited; memory not yet freed
 
 // Process descriptor type
-struct proc {
+//    k-exception.S saves user registers directly into `regs`: the CPU's
+//    `ts_rsp[0]` and `syscall_entry` point at its end, which must be
+//    16-byte aligned for exception frames.
+#define PROC_REGS               16      // offsetof(proc, regs)
+#define PROC_REGS_END           208     // PROC_REGS + sizeof(regstate)
+#define REGSTATE_CS             160     // offsetof(regstate, reg_cs)
+#define REGSTATE_RIP            152     // offsetof(regstate, reg_rip)
+
+struct alignas(16) proc {
     x86_64_pagetable* pagetable;        // process's page table
     pid_t pid;                          // process ID
     int state;                          // process state (see above)
     regstate regs;                      // process's current registers
     // The first 4 members of `proc` must not change, but you can add more.
+
+    // Links in the circular run queue of `P_RUNNABLE` processes
+    proc* runq_next = nullptr;
+    proc* runq_prev = nullptr;
+    int level = 0;                      // scheduling level (0 is highest)
+    unsigned quantum = 0;               // time slice in usec, or 0 for default
+    uint64_t slice_end = 0;             // TSC when its slice ends, or 0 if unstarted
+
+    // CPU accounting, logged when the process exits or faults
+    uint64_t cpu_cycles = 0;            // TSC cycles charged while running
+    unsigned long nswitches = 0;        // times switched to
+    unsigned long nsyscalls = 0;        // system calls made
+    unsigned long nchecks = 0;          // times `run` checked its state
+
+    // A `P_BLOCKED` process is on one list: a timer wheel slot, while
+    // sleeping, another process's `waiters`, while waiting for it, or
+    // the keyboard's, in `sys_getc`.
+    proc* wait_next = nullptr;          // next process on that list
+    proc* waiters = nullptr;            // processes waiting for this one
+    unsigned long wake_tick = 0;        // when a sleeping process wakes
+
+    int cpu = -1;                       // CPU running this process, or -1
+    int program = -1;                   // program number of its image
+    unsigned tlb_cpus = 0;              // CPUs whose TLB for it is current
+    unsigned shm_held = 0;              // shared memory segments it holds
+    kinfo* info_page = nullptr;         // page mapped at KINFO_ADDR
+    meminfo mem = {};                   // memory use (see `meminfo_account`)
+    uintptr_t reap_va = 0;              // where the reaper resumes, if zombie
 };
 
+// Shared memory segments (see `syscall_shm_create`)
+#define MAXNSHM                 16
+
 // Process table
 extern proc ptable[MAXNPROC];
 
 
+// Per-CPU state
+//    While a CPU runs kernel code, its `%gs` base points at its `cpustate`,
+//    so `this_cpu()` is a single load; `syscall_entry` and the exception
+//    handlers switch `%gs` with `swapgs` on the way in from user mode.
+//    k-exception.S uses the member offsets below.
+#define MAXNCPU                 8
+#define CPUSTATE_SYSCALL_RSP    8       // offsetof(cpustate, syscall_rsp)
+#define CPUSTATE_STACK_TOP      16      // offsetof(cpustate, stack_top)
+#define CPUSTATE_CURRENT        24      // offsetof(cpustate, current)
+#define CPUSTATE_KERNEL_CR3     32      // offsetof(cpustate, kernel_cr3)
+#define CPUSTATE_USER_CR3       40      // offsetof(cpustate, user_cr3)
+
+struct cpustate {
+    cpustate* self;
+    uintptr_t syscall_rsp;              // user `%rsp` during `syscall_entry`
+    uintptr_t stack_top;                // top of this CPU's kernel stack
+    proc* current;                      // process this CPU is running
+    uint64_t kernel_cr3;                // `%cr3` on kernel entry
+    uint64_t user_cr3;                  // `%cr3` on return to `current`
+    int index;                          // index in `cpus`
+    uint32_t lapic_id;                  // local APIC ID, for IPIs
+    uint64_t timer_deadline;            // TSC its timer is armed for, or 0
+    uint64_t run_tsc;                   // TSC when `current` started, or idle
+    x86_64_taskstate taskstate;
+    uint64_t gdt_segments[7];
+};
+extern cpustate cpus[MAXNCPU];
+extern int ncpu;                        // number of running CPUs
+
+// this_cpu()
+//    Return the running CPU's `cpustate`.
+inline cpustate* this_cpu() {
+    cpustate* c;
+    asm volatile("movq %%gs:0, %0" : "=r" (c));
+    return c;
+}
+
+
+// PCIDs
+//    If the CPU supports process-context identifiers, each process's TLB
+//    entries are tagged with its pid (the kernel page table uses 0), and
+//    `%cr3` switches set CR3_NOFLUSH, so entering and leaving the kernel
+//    keeps every address space's entries.
+#define CR3_NOFLUSH             (1UL << 63)
+extern bool pcid_enabled;
+
+// tlb_mark_pagetable(pt)
+//    Called when a mapping in `pt` changes. Makes the next return to a
+//    process using `pt`, on any CPU, flush its PCID's TLB entries.
+void tlb_mark_pagetable(x86_64_pagetable* pt);
+
+
+// spinlock
+//    A test-and-test-and-set lock. The kernel is not preemptible, and
+//    interrupts are off in the kernel, so holders never sleep.
+struct spinlock {
+    std::atomic<bool> locked_ = false;
+
+    void lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                pause();
+            }
+        }
+    }
+    void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+};
+
+// kernel_lock
+//    Protects all kernel state shared between CPUs (process table, run
+//    queues, `physpages` and the allocator, the console). A CPU takes it
+//    on every kernel entry and drops it on the way back to user mode or
+//    into `idle`; `syscall_entry` releases it in assembly.
+extern spinlock kernel_lock;
+
+
 // Kernel start address
 #define KERNEL_START_ADDR       0x40000
 // Top of the kernel stack
@@ -49,6 +168,9 @@ extern proc ptable[MAXNPROC];
 #define NPAGES                  (MEMSIZE_PHYSICAL / PAGESIZE)
 
 // Virtual memory size
+//    User mappings are all 4 KiB pages. A 2 MiB page would need a 2 MiB-
+//    aligned virtual range inside [PROC_START_ADDR, MEMSIZE_VIRTUAL), and
+//    2 MiB of contiguous free physical memory; neither exists here.
 #define MEMSIZE_VIRTUAL         0x300000
 
 // physpages
@@ -61,22 +183,73 @@ extern proc ptable[MAXNPROC];
 //    In the handout code, `physpages[I].refcount` represents the number of
 //    times physical page `I` is used. Free pages have `refcount == 0`, and
 //    (since handout processes never share memory) allocated pages have
-//    `refcount == 1`.
+//    `refcount == 1`. Here `syscall_fork` shares pages between parent and
+//    child (read-only pages directly, writable pages copy-on-write), and
+//    the program page cache and shared memory segments hold a reference
+//    to each page they keep, so a user page's refcount counts its
+//    mappings plus any cache or segment reference.
+//    That can exceed MAXNPROC, so the count is 32 bits wide.
+//
+//    Each entry also has `PPI_` flags, an owner hint, and an age, and is
+//    packed into 8 bytes, so the whole array spans only a few cache lines per
+//    page of it for the memory viewer's and `kalloc`'s scans. `kalloc`
+//    returns pages pinned and owned by the kernel (`owner == 0`); pages
+//    given to a process as its user memory are unpinned and record that
+//    process's pid. Flags, owner, and age are cleared when a page is freed.
+//
+//    `age` counts the working-set scans (see `wss_scan`) since a user
+//    mapping of the page last had its accessed bit set, up to 255. Pages
+//    younger than WS_WINDOW scans form their processes' working sets.
 //
 //    You can add more information to `physpageinfo` if you need to.
 //    The memory viewer calls `used()` and `valid()` to check for bugs.
+#define PPI_ZEROED      0x1     // free and already cleared (zeroed pool)
+#define PPI_PINNED      0x2     // kernel memory; never reclaim or move it
+#define PPI_PAGETABLE   0x4     // a page table page
+#define PPI_COW         0x8     // shared copy-on-write by `syscall_fork`
+#define PPI_SHARED      0x10    // a shared memory segment's page
+#define PPI_SLAB        0x20    // part of a `kmalloc` slab
+#define PPI_ACCESSED    0x40    // accessed since the last scan's aging pass
+
+#define WS_WINDOW       4       // working-set scans a page stays hot
+
 struct physpageinfo {
-    uint8_t refcount = 0;
+    uint32_t refcount = 0;
+    uint16_t flags = 0;                 // PPI_ flags
+    int8_t owner = 0;                   // pid it was allocated for, or 0
+    uint8_t age = 0;                    // scans since last accessed
 
     bool used() const {
         return this->refcount != 0;
     }
     bool valid() const {
-        return this->refcount <= MAXNPROC;
+        if (this->refcount == 0) {
+            return (this->flags & ~PPI_ZEROED) == 0 && this->owner == 0;
+        }
+        return !(this->flags & PPI_ZEROED)
+            && (!(this->flags & PPI_PAGETABLE) || this->refcount == 1)
+            && this->owner >= 0 && this->owner < MAXNPROC;
     }
 };
+static_assert(sizeof(physpageinfo) == 8, "physpageinfo should stay packed");
+static_assert(MAXNPROC <= 128, "physpageinfo::owner should hold any pid");
 extern physpageinfo physpages[NPAGES];
 
+// PTE_COW
+//    Software page table bit marking a user page that `syscall_fork`
+//    shared copy-on-write. The page is mapped read-only; the first write
+//    to it faults, and `exception` gives the writer its own copy (or, if
+//    no other process still shares it, makes it writable again).
+#define PTE_COW         PTE_OS1
+
+// PTE_SWAP
+//    Software page table bit marking a non-present user entry whose page
+//    `reclaim_page` wrote to swap. The entry's address bits hold the swap
+//    slot number instead of a physical address, and its PTE_U, PTE_W, and
+//    PTE_COW bits are the page's old permissions; a fault on it reads the
+//    page back in.
+#define PTE_SWAP        PTE_OS2
+
 
 // Segment selectors
 #define SEGSEL_BOOT_CODE        0x8             // boot code segment
@@ -92,6 +265,7 @@ extern physpageinfo physpages[NPAGES];
 #define IRQ_TIMER               0
 #define IRQ_KEYBOARD            1
 #define IRQ_ERROR               19
+#define IRQ_WAKEUP              30      // IPI: work for an idle CPU
 #define IRQ_SPURIOUS            31
 
 
@@ -101,15 +275,71 @@ extern physpageinfo physpages[NPAGES];
 //    and writable to both kernel and application code.
 void init_hardware();
 
-// init_timer(rate)
-//    Set the timer interrupt to fire `rate` times a second. Disables the
-//    timer interrupt if `rate <= 0`.
-void init_timer(int rate);
+// init_cpu(index)
+//    Initialize the running CPU as `cpus[index]`: its segments, task
+//    state, `%gs` base, system call entry, and local APIC.
+void init_cpu(int index);
+
+// init_other_cpus()
+//    Start the other CPUs with INIT and startup IPIs, and set `ncpu`. Each
+//    starts in `ap_trampoline` (k-exception.S), which calls `ap_start`.
+//    Copies the trampoline to the page at `AP_TRAMPOLINE_ADDR`, which
+//    `kalloc` never hands out, and allocates the CPUs' kernel stacks.
+#define AP_TRAMPOLINE_ADDR      0x8000
+void init_other_cpus();
+
+// disk_read(buf, sector, nsectors), disk_write(buf, sector, nsectors)
+//    Transfer `nsectors` sectors (1-256) between `buf` and the boot disk,
+//    starting at sector `sector`. Return 0 on success and -1 on a disk
+//    error, including sectors past the end of the disk.
+#define SECTORSIZE              512
+int disk_read(void* buf, uint32_t sector, unsigned nsectors);
+int disk_write(const void* buf, uint32_t sector, unsigned nsectors);
+
+// Swap area
+//    The boot disk image reserves SWAP_NSLOTS pages for swap, starting at
+//    sector SWAP_START_SECTOR, after the kernel (see `weensyos.img` in
+//    GNUmakefile, which must agree).
+#define SWAP_START_SECTOR       4096
+#define SWAP_NSLOTS             1024
+
+// init_timer()
+//    Measure the TSC's rate against the PIT, setting `tsc_per_usec`. Each
+//    CPU's local APIC timer is in one-shot mode, and fires only when
+//    `set_timer` arms it.
+extern uint64_t tsc_per_usec;
+void init_timer();
+
+// set_timer(usec)
+//    Arm this CPU's timer to interrupt once, `usec` microseconds from now
+//    (at most about 4 seconds). Disarms the timer if `usec == 0`.
+void set_timer(uint64_t usec);
 
 
 void* kalloc(size_t sz);
 void kfree(void* ptr);
 
+// kalloc_zeroed_page
+//    Like `kalloc(PAGESIZE)`, but the page is filled with zeros. Uses a
+//    page the idle loop already cleared when one is available.
+void* kalloc_zeroed_page();
+
+// kmalloc(sz), kmfree(ptr)
+//    Allocate and free kernel objects smaller than a page. Requests of up
+//    to KMALLOC_MAXSIZE bytes come from slabs of objects of the next power
+//    of 2 (at least 16 bytes), aligned to at least 16 bytes; larger ones
+//    go to `kalloc`. `kmfree` takes either. Returns `nullptr` if out of
+//    memory. The memory is not cleared.
+#define KMALLOC_NCLASSES        8
+#define KMALLOC_MAXSIZE         (16 << (KMALLOC_NCLASSES - 1))
+void* kmalloc(size_t sz);
+void kmfree(void* ptr);
+
+// kmalloc_usage(cls, nused, npages)
+//    Sets `*nused` to the number of allocated objects of size class `cls`
+//    (objects of 16 << `cls` bytes) and `*npages` to its slabs' pages.
+void kmalloc_usage(int cls, unsigned* nused, unsigned* npages);
+
 
 // kernel page table (used for virtual memory)
 extern x86_64_pagetable kernel_pagetable[];
@@ -170,6 +400,27 @@ void console_show_cursor();
 //    space for `vmp`.
 void console_memviewer(proc* vmp);
 
+// memviewer_mark_pagetable(pt), memviewer_mark_page(pa)
+//    Tell the memory viewer that a mapping in page table `pt`, or whether
+//    physical page `pa` is allocated, changed. The viewer redraws only
+//    what these marks (and processes starting or exiting) touch.
+void memviewer_mark_pagetable(x86_64_pagetable* pt);
+void memviewer_mark_page(uintptr_t pa);
+
+// pagetable_owner(pt)
+//    Return the process whose level-4 page table is `pt`, or `nullptr`
+//    (for `kernel_pagetable`, say). A process's top page table page
+//    records its pid as the page's `owner`.
+proc* pagetable_owner(x86_64_pagetable* pt);
+
+// meminfo_account(pt, va, oldpte, newpte), meminfo_add_pagetable(pt)
+//    Called by `vmiter` when it changes the level-1 entry for `va` in
+//    `pt` from `oldpte` to `newpte`, or allocates a page table page under
+//    `pt`. Update the `mem` counters of the process owning `pt`, if any.
+void meminfo_account(x86_64_pagetable* pt, uintptr_t va,
+                     x86_64_pageentry_t oldpte, x86_64_pageentry_t newpte);
+void meminfo_add_pagetable(x86_64_pagetable* pt);
+
 
 // keyboard_readc
 //    Read a character from the keyboard. Returns -1 if there is no character
@@ -273,6 +524,10 @@ struct program_image_segment {
 //    Reboot the virtual machine.
 [[noreturn]] void reboot();
 
+// panic_at(regs, fmt, ...)
+//    Report a panic that happened in kernel code with registers `regs`.
+[[noreturn]] void panic_at(const regstate& regs, const char* fmt, ...);
+
 // proc_panic(p, fmt, ...)
 //    Report a panic that happened due to a process & its registers.
 [[noreturn]] void proc_panic(const proc* p, const char* fmt, ...);
@@ -287,6 +542,12 @@ void error_print_backtrace(const regstate& regs, x86_64_pagetable* pagetable,
                            bool exclude_rip = false);
 
 
+// copy_from_user, copy_to_user
+//    Copy bytes between kernel memory and the user-accessible mappings
+//    at a `vmiter`, a page at a time; return the number copied.
+size_t copy_from_user(void* dst, vmiter it, size_t sz);
+size_t copy_to_user(vmiter it, const void* src, size_t sz);
+
 // strlcpy_from_user
 //    Copy a C string from a `vmiter` into `buf`, only considering
 //    user-accessible mappings.
@@ -299,6 +560,48 @@ void strlcpy_from_user(char* buf, vmiter it, size_t maxlen);
 __noinline void log_printf(const char* format, ...);
 __noinline void log_vprintf(const char* format, va_list val);
 
+// log_flush(max)
+//    Write up to `max` bytes of buffered log messages to `log.txt`.
+void log_flush(size_t max = -1);
+
+// init_log_ring(), init_trace()
+//    Allocate the log ring and the trace rings once `kalloc` works.
+//    Until then, log messages are written directly and tracepoints
+//    record nothing.
+void init_log_ring();
+void init_trace();
+
+// trace(type, arg), trace_syscall_enter(sysno), trace_syscall_exit()
+//    Record a timestamped event in this CPU's trace ring (k-trace.cc).
+//    `trace_syscall_exit` also counts the running system call's latency
+//    in its histogram; it does nothing if no system call is running.
+enum trace_type {
+    TRACE_SYSCALL, TRACE_SYSRET, TRACE_PAGEFAULT, TRACE_SWITCH,
+    TRACE_KALLOC, TRACE_KFREE, TRACE_SWAPOUT, TRACE_SWAPIN
+};
+void trace(int type, uint64_t arg);
+void trace_syscall_enter(int sysno);
+void trace_syscall_exit();
+
+// trace_dump()
+//    Write the system call latency histograms, recent trace events, and
+//    profile to `log.txt`.
+void trace_dump();
+
+// profile_sample(regs, p), profile_report()
+//    The timer interrupt samples the interrupted `regs` of process `p`
+//    (`nullptr` if the CPU was idle). `profile_report` writes the flat
+//    and call-stack profiles to `log.txt`.
+void profile_sample(const regstate& regs, const proc* p);
+void profile_report();
+
+// backtrace_collect(regs, pt, frames, max)
+//    Store up to `max` return addresses from the stack described by
+//    `regs` and `pt` in `frames`, innermost first. Returns the number
+//    stored.
+int backtrace_collect(const regstate& regs, x86_64_pagetable* pt,
+                      uintptr_t* frames, int max);
+
 // log_print_backtrace
 //    Print a backtrace to the host's `log.txt` file, either for the current
 //    stack or for the stack active in `p`.
@@ -17,9 +17,42 @@ extern "C" {
 // strtoul, strtol
 //    We must provide our own implementations.
 
+// The memory functions move 8 bytes at a time through these types,
+// which may alias anything and need no alignment. Large moves and fills
+// use `rep movsb`/`rep stosb`, which CPUs with ERMS (enhanced `rep
+// movsb`, CPUID leaf 7 %ebx bit 9) run a cache line at a time; on older
+// CPUs, `rep movsq`/`rep stosq` do the bulk instead. Below
+// `REP_THRESHOLD` bytes, the string instructions' startup cost exceeds
+// the word loops' run time.
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+#define REP_THRESHOLD 256
+
+static bool have_erms() {
+    static int erms = -1;
+    if (erms < 0) {
+        erms = (cpuid(7, 0).ebx >> 9) & 1;
+    }
+    return erms;
+}
+
 void* memcpy(void* dst, const void* src, size_t n) {
     const char* s = reinterpret_cast<const char*>(src);
     char* d = reinterpret_cast<char*>(dst);
+    if (n >= REP_THRESHOLD) {
+        if (!have_erms()) {
+            size_t nw = n / 8;
+            asm volatile("rep movsq" : "+D" (d), "+S" (s), "+c" (nw)
+                         : : "memory");
+            n %= 8;
+        }
+        asm volatile("rep movsb" : "+D" (d), "+S" (s), "+c" (n)
+                     : : "memory");
+        return dst;
+    }
+    for (; n >= 8; n -= 8, s += 8, d += 8) {
+        *reinterpret_cast<unaligned_u64*>(d) =
+            *reinterpret_cast<const unaligned_u64*>(s);
+    }
     for (; n > 0; --n, ++s, ++d) {
         *d = *s;
     }
@@ -29,21 +62,46 @@ void* memcpy(void* dst, const void* src, size_t n) {
 void* memmove(void* dst, const void* src, size_t n) {
     const char* s = reinterpret_cast<const char*>(src);
     char* d = reinterpret_cast<char*>(dst);
-    if (s < d && s + n > d) {
-        s += n, d += n;
-        while (n-- > 0) {
-            *--d = *--s;
-        }
-    } else {
-        while (n-- > 0) {
-            *d++ = *s++;
-        }
+    if (!(s < d && s + n > d)) {
+        // A forward copy reads each byte before overwriting it
+        return memcpy(dst, src, n);
+    }
+    if (n >= REP_THRESHOLD) {
+        // Copy backward with the direction flag set
+        s += n - 1, d += n - 1;
+        asm volatile("std; rep movsb; cld" : "+D" (d), "+S" (s), "+c" (n)
+                     : : "memory");
+        return dst;
+    }
+    s += n, d += n;
+    for (; n >= 8; n -= 8) {
+        s -= 8, d -= 8;
+        *reinterpret_cast<unaligned_u64*>(d) =
+            *reinterpret_cast<const unaligned_u64*>(s);
+    }
+    while (n-- > 0) {
+        *--d = *--s;
     }
     return dst;
 }
 
 void* memset(void* v, int c, size_t n) {
     char* p = reinterpret_cast<char*>(v);
+    uint64_t w = uint64_t(uint8_t(c)) * 0x0101010101010101UL;
+    if (n >= REP_THRESHOLD) {
+        if (!have_erms()) {
+            size_t nw = n / 8;
+            asm volatile("rep stosq" : "+D" (p), "+c" (nw) : "a" (w)
+                         : "memory");
+            n %= 8;
+        }
+        asm volatile("rep stosb" : "+D" (p), "+c" (n) : "a" (w)
+                     : "memory");
+        return v;
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        *reinterpret_cast<unaligned_u64*>(p) = w;
+    }
     for (; n > 0; ++p, --n) {
         *p = c;
     }
@@ -53,6 +111,13 @@ void* memset(void* v, int c, size_t n) {
 int memcmp(const void* a, const void* b, size_t n) {
     const uint8_t* sa = reinterpret_cast<const uint8_t*>(a);
     const uint8_t* sb = reinterpret_cast<const uint8_t*>(b);
+    // Skip equal words; the byte loop finds the first difference
+    for (; n >= 8; sa += 8, sb += 8, n -= 8) {
+        if (*reinterpret_cast<const unaligned_u64*>(sa)
+            != *reinterpret_cast<const unaligned_u64*>(sb)) {
+            break;
+        }
+    }
     for (; n > 0; ++sa, ++sb, --n) {
         if (*sa != *sb) {
             return (*sa > *sb) - (*sa < *sb);
@@ -61,8 +126,46 @@ int memcmp(const void* a, const void* b, size_t n) {
     return 0;
 }
 
+// copy_page(dst, src), clear_page(dst)
+//    Copy or zero one page-aligned page: `PAGESIZE / 8` quadwords with
+//    no size checks or tails.
+
+void copy_page(void* dst, const void* src) {
+    size_t n = PAGESIZE / 8;
+    asm volatile("rep movsq" : "+D" (dst), "+S" (src), "+c" (n)
+                 : : "memory");
+}
+
+void clear_page(void* dst) {
+    size_t n = PAGESIZE / 8;
+    asm volatile("rep stosq" : "+D" (dst), "+c" (n) : "a" (0UL)
+                 : "memory");
+}
+
+// memchr and strlen test 8 bytes at a time: `haszero(w)` is nonzero iff
+// some byte of `w` is zero, and its lowest set bit marks the first such
+// byte. They read whole aligned words, which never cross a page, so they
+// may read (but ignore) bytes past the end of the string or buffer.
+#define ONES 0x0101010101010101UL
+#define HIGHS 0x8080808080808080UL
+static inline uint64_t haszero(uint64_t w) {
+    return (w - ONES) & ~w & HIGHS;
+}
+
+__no_asan
 void* memchr(const void* s, int c, size_t n) {
     const unsigned char* ss = reinterpret_cast<const unsigned char*>(s);
+    for (; n != 0 && (reinterpret_cast<uintptr_t>(ss) & 7) != 0; ++ss, --n) {
+        if (*ss == (unsigned char) c) {
+            return (void*) ss;
+        }
+    }
+    uint64_t cs = uint64_t((unsigned char) c) * ONES;
+    for (; n >= 8; ss += 8, n -= 8) {
+        if (uint64_t z = haszero(*reinterpret_cast<const uint64_t*>(ss) ^ cs)) {
+            return (void*) (ss + (lsb(z) - 1) / 8);
+        }
+    }
     for (; n != 0; ++ss, --n) {
         if (*ss == (unsigned char) c) {
             return (void*) ss;
@@ -71,12 +174,20 @@ void* memchr(const void* s, int c, size_t n) {
     return nullptr;
 }
 
+__no_asan
 size_t strlen(const char* s) {
-    size_t n;
-    for (n = 0; *s != '\0'; ++s) {
-        ++n;
+    const char* p = s;
+    for (; (reinterpret_cast<uintptr_t>(p) & 7) != 0; ++p) {
+        if (*p == '\0') {
+            return p - s;
+        }
+    }
+    while (true) {
+        if (uint64_t z = haszero(*reinterpret_cast<const uint64_t*>(p))) {
+            return p - s + (lsb(z) - 1) / 8;
+        }
+        p += 8;
     }
-    return n;
 }
 
 size_t strnlen(const char* s, size_t maxlen) {
@@ -349,6 +460,58 @@ to_chars_result to_chars(char* first, char* last,
 }
 
 
+// crc32c(crc, buf, sz)
+//    CRC-32C (Castagnoli), continuing from `crc`, the checksum of the
+//    preceding bytes (0 for none). CPUs with SSE4.2 (CPUID leaf 1 %ecx bit
+//    20) have a `crc32` instruction for this polynomial, which checksums
+//    8 bytes per instruction; others use a table computed at compile time.
+
+static constexpr uint32_t CRC32C_POLY = 0x82F63B78;   // bit-reversed
+
+struct crc32c_table {
+    uint32_t t[256];
+    constexpr crc32c_table() : t() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+            }
+            t[i] = c;
+        }
+    }
+};
+static constexpr crc32c_table crc32c_sw;
+
+static bool have_sse42() {
+    static int sse42 = -1;
+    if (sse42 < 0) {
+        sse42 = (cpuid(1).ecx >> 20) & 1;
+    }
+    return sse42;
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t sz) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+    uint64_t c = ~crc;
+    if (have_sse42()) {
+        for (; sz >= 8; p += 8, sz -= 8) {
+            asm("crc32q %1, %0" : "+r" (c)
+                : "rm" (*reinterpret_cast<const unaligned_u64*>(p)));
+        }
+        for (; sz != 0; ++p, --sz) {
+            asm("crc32b %1, %k0" : "+r" (c) : "rm" (*p));
+        }
+    } else {
+        for (; sz != 0; ++p, --sz) {
+            c = crc32c_sw.t[(c ^ *p) & 0xFF] ^ (c >> 8);
+        }
+    }
+    return ~uint32_t(c);
+}
+
+static_assert(crc32c_sw.t[1] == 0xF26B8303, "crc32c table failure");
+
+
 // pseudorandom number generators
 
 static std::atomic<int> rand_seed_set;
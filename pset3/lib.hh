@@ -16,6 +16,8 @@ void* memcpy(void* dst, const void* src, size_t n);
 void* memmove(void* dst, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
 int memcmp(const void* a, const void* b, size_t n);
+void copy_page(void* dst, const void* src);
+void clear_page(void* dst);
 void* memchr(const void* s, int c, size_t n);
 size_t strlen(const char* s);
 size_t strnlen(const char* s, size_t maxlen);
@@ -256,6 +258,21 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_PAGE_ALLOC      4
 #define SYSCALL_FORK            5
 #define SYSCALL_EXIT            6
+#define SYSCALL_PAGE_ALLOC_RANGE 7
+#define SYSCALL_SLEEP           8
+#define SYSCALL_WAITPID         9
+#define SYSCALL_TRACE_DUMP      10
+#define SYSCALL_SET_QUANTUM     11
+#define SYSCALL_SHM_CREATE      12
+#define SYSCALL_SHM_MAP         13
+#define SYSCALL_GETC            14
+#define SYSCALL_LOG             15
+#define SYSCALL_SPAWN           16
+#define SYSCALL_MEMINFO         17
+#define SYSCALL_WRITE_CONSOLE   18
+
+// Flags for `sys_page_alloc_range`
+#define PAGE_ALLOC_EAGER        1   // Allocate pages now, not on first write
 
 
 // System call error return values
@@ -280,6 +297,45 @@ inline bool is_error(uintptr_t r) {
 #endif
 
 
+// Kernel info page
+//    The kernel maps a read-only page at KINFO_ADDR, just below the first
+//    user address, into each process, so user code can read these values
+//    without a system call. The clock fields let it compute the kernel's
+//    tick count from the TSC, as the kernel does (see `clock_ticks`).
+
+#define KINFO_ADDR          0xFF000
+
+struct kinfo {
+    pid_t pid;                          // this process's ID
+    int ncpu;                           // number of running CPUs
+    uint64_t tsc_per_usec;              // TSC cycles per microsecond
+    uint64_t tsc_per_tick;              // TSC cycles per clock tick
+    uint64_t clock_start_tsc;           // TSC at tick 0
+};
+
+
+// Memory use
+//    The kernel counts each process's pages as its mappings change, so
+//    `sys_meminfo` reports them without walking page tables. `resident`
+//    counts user pages in memory (not swapped out); `shared` counts those
+//    other processes may map too: copy-on-write, read-only, and shared
+//    memory pages. `reserved` counts those that are demand-zero pages not
+//    yet written, which hold a reservation rather than memory.
+//    `pagetable` counts the process's page table pages. A periodic scan
+//    of accessed and dirty bits sets `working_set`, the resident pages
+//    used in the last few scans (about 2 seconds), and `written`, the
+//    pages written since the scan before.
+
+struct meminfo {
+    unsigned resident;                  // user pages mapped
+    unsigned shared;                    // of those, shareable pages
+    unsigned reserved;                  // of those, unwritten demand-zero pages
+    unsigned pagetable;                 // page table pages
+    unsigned working_set;               // recently used resident pages
+    unsigned written;                   // pages written in the last period
+};
+
+
 // CGA console printing
 
 #define CONSOLE_COLUMNS     80
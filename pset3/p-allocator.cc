@@ -2,6 +2,10 @@
 #ifndef ALLOC_SLOWDOWN
 #define ALLOC_SLOWDOWN 100
 #endif
+// Heap pages allocated per system call
+#ifndef ALLOC_BATCH
+#define ALLOC_BATCH 4
+#endif
 
 extern uint8_t end[];
 
@@ -51,19 +55,23 @@ void process_main() {
     // or (2) allocation fails (out of physical memory).
     while (heap_top != stack_bottom) {
         if (rand(0, ALLOC_SLOWDOWN - 1) < p) {
-            if (sys_page_alloc(reinterpret_cast<void*>(heap_top)) < 0) {
+            size_t want = min<size_t>(ALLOC_BATCH, (stack_bottom - heap_top) / PAGESIZE);
+            int n = sys_page_alloc_range(reinterpret_cast<void*>(heap_top), want);
+            if (n < 0) {
                 break;
             }
-            auto new_page = heap_top;
-            heap_top += PAGESIZE;
-            // check that the page starts out all zero
-            for (auto l = heap_long_ptr(new_page);
-                 l != heap_long_ptr(new_page + PAGESIZE);
-                 ++l) {
-                assert(*l == 0);
+            for (int i = 0; i != n; ++i) {
+                auto new_page = heap_top;
+                heap_top += PAGESIZE;
+                // check that the page starts out all zero
+                for (auto l = heap_long_ptr(new_page);
+                     l != heap_long_ptr(new_page + PAGESIZE);
+                     ++l) {
+                    assert(*l == 0);
+                }
+                // check we can write to new page
+                *heap_byte_ptr(new_page) = p;
             }
-            // check we can write to new page
-            *heap_byte_ptr(new_page) = p;
             // check we can write to console
             console[CPOS(24, 79)] = p;
         }
@@ -72,6 +80,6 @@ void process_main() {
 
     // After running out of memory, do nothing forever
     while (true) {
-        sys_yield();
+        sys_sleep(1000);
     }
 }
@@ -0,0 +1,203 @@
+#include "u-lib.hh"
+#ifndef KBENCH_ROUNDS
+#define KBENCH_ROUNDS 20
+#endif
+#ifndef KBENCH_PAGES
+#define KBENCH_PAGES 128
+#endif
+
+// p-kbench
+//    Kernel benchmarks, in TSC cycles. Run it with `make run-kbench`.
+//    Each of KBENCH_ROUNDS rounds:
+//
+//    - Forks children until `sys_fork` fails (the process table is full)
+//      and times each fork. The children block in `sys_waitpid` on a
+//      gate process; once the parent releases the gate, the time from
+//      its exit until the parent has waited for every child is counted
+//      per exit.
+//    - Forks a child that allocates KBENCH_PAGES pages with one
+//      `sys_page_alloc` each, writes every word of them twice (the first
+//      pass takes any page faults), and reads them back. The parent then
+//      times the child's exit, which frees the pages.
+//
+//    Each round's results are written to `log.txt` with `log_printf` and
+//    the latest round is printed on the bottom line of the console; the
+//    best of each is logged at the end. p-syscallbench and p-switchbench
+//    measure system calls and context switches.
+
+extern uint8_t end[];
+
+struct kbench_shared {
+    volatile bool release;              // the gate process may exit
+    volatile uint64_t exit_tsc;         // when the gate or page child exited
+    size_t npages;                      // results from the page child
+    uint64_t alloc_cycles;              // per `sys_page_alloc`
+    uint64_t fault_bw, write_bw, read_bw;   // bytes per 1000 cycles
+};
+static kbench_shared* shared;
+static uintptr_t pages_addr;
+
+struct kbench_result {
+    int nforks;
+    uint64_t fork_cycles, exit_cycles;
+    size_t npages;
+    uint64_t alloc_cycles, free_cycles;
+    uint64_t fault_bw, write_bw, read_bw;
+};
+
+static uint64_t bandwidth(size_t bytes, uint64_t cycles) {
+    return bytes * 1000 / max(cycles, uint64_t(1));
+}
+
+
+// fork_bench(r)
+//    Fork to the process limit, then release the children.
+
+static void fork_bench(kbench_result& r) {
+    shared->release = false;
+    pid_t gate = sys_fork();
+    assert(gate >= 0);
+    if (gate == 0) {
+        while (!shared->release) {
+            sys_sleep(1);
+        }
+        shared->exit_tsc = rdtsc();
+        sys_exit();
+    }
+
+    pid_t children[MAXNPROC];
+    int n = 0;
+    uint64_t start = rdtsc();
+    while (n != MAXNPROC) {
+        pid_t child = sys_fork();
+        if (child == 0) {
+            sys_waitpid(gate);
+            sys_exit();
+        } else if (child < 0) {
+            break;
+        }
+        children[n] = child;
+        ++n;
+    }
+    r.nforks = n;
+    r.fork_cycles = (rdtsc() - start) / max(n, 1);
+
+    shared->release = true;
+    sys_waitpid(gate);
+    for (int i = 0; i != n; ++i) {
+        sys_waitpid(children[i]);       // fails if it already exited
+    }
+    r.exit_cycles = (rdtsc() - shared->exit_tsc) / max(n + 1, 1);
+}
+
+
+// page_child()
+//    Allocate, write, and read pages, leaving the results in `shared`.
+
+[[noreturn]] static void page_child() {
+    size_t npages = 0;
+    uint64_t start = rdtsc();
+    while (npages != KBENCH_PAGES
+           && sys_page_alloc(reinterpret_cast<void*>(pages_addr + npages * PAGESIZE)) == 0) {
+        ++npages;
+    }
+    uint64_t t1 = rdtsc();
+    shared->npages = npages;
+    shared->alloc_cycles = (t1 - start) / max(npages, size_t(1));
+
+    uint64_t* words = reinterpret_cast<uint64_t*>(pages_addr);
+    size_t nwords = npages * PAGESIZE / sizeof(uint64_t);
+    for (size_t i = 0; i != nwords; ++i) {
+        words[i] = i;
+    }
+    uint64_t t2 = rdtsc();
+    for (size_t i = 0; i != nwords; ++i) {
+        words[i] = ~i;
+    }
+    uint64_t t3 = rdtsc();
+    clobber_memory(words);
+    uint64_t sum = 0;
+    for (size_t i = 0; i != nwords; ++i) {
+        sum += words[i];
+    }
+    uint64_t t4 = rdtsc();
+    assert(sum == nwords * ~uint64_t(0) - nwords * (nwords - 1) / 2);
+
+    size_t bytes = nwords * sizeof(uint64_t);
+    shared->fault_bw = bandwidth(bytes, t2 - t1);
+    shared->write_bw = bandwidth(bytes, t3 - t2);
+    shared->read_bw = bandwidth(bytes, t4 - t3);
+    shared->exit_tsc = rdtsc();
+    sys_exit();
+}
+
+static void page_bench(kbench_result& r) {
+    pid_t child = sys_fork();
+    assert(child >= 0);
+    if (child == 0) {
+        page_child();
+    }
+    sys_waitpid(child);
+    r.npages = shared->npages;
+    r.alloc_cycles = shared->alloc_cycles;
+    r.free_cycles = (rdtsc() - shared->exit_tsc) / max(r.npages, size_t(1));
+    r.fault_bw = shared->fault_bw;
+    r.write_bw = shared->write_bw;
+    r.read_bw = shared->read_bw;
+}
+
+
+static void log_result(const char* what, const kbench_result& r) {
+    log_printf("kbench %s: fork %lu cycles (%d forks), exit %lu",
+               what, r.fork_cycles, r.nforks, r.exit_cycles);
+    log_printf("kbench %s: page_alloc %lu cycles, free %lu/page (%zu pages)",
+               what, r.alloc_cycles, r.free_cycles, r.npages);
+    log_printf("kbench %s: B/kcycle first write %lu, write %lu, read %lu",
+               what, r.fault_bw, r.write_bw, r.read_bw);
+}
+
+void process_main() {
+    // The shared page comes first; the page child's pages follow it
+    uintptr_t addr = round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE);
+    int id = sys_shm_create(1);
+    assert(id >= 0);
+    int mapped = sys_shm_map(id, reinterpret_cast<void*>(addr));
+    assert(mapped == 0);
+    shared = reinterpret_cast<kbench_shared*>(addr);
+    pages_addr = addr + PAGESIZE;
+    assert(pages_addr + KBENCH_PAGES * PAGESIZE
+           <= round_down(rdrsp(), PAGESIZE) - PAGESIZE);
+
+    kbench_result best = {};
+    best.fork_cycles = best.exit_cycles = ~uint64_t(0);
+    best.alloc_cycles = best.free_cycles = ~uint64_t(0);
+    for (unsigned round = 1; round <= KBENCH_ROUNDS; ++round) {
+        kbench_result r;
+        fork_bench(r);
+        page_bench(r);
+
+        char what[16];
+        snprintf(what, sizeof(what), "round %u", round);
+        log_result(what, r);
+        console_printf(CPOS(24, 0), CS_YELLOW
+                       "kbench %u: fork %lu, exit %lu, alloc %lu, free %lu, write %lu B/kc  ",
+                       round, r.fork_cycles, r.exit_cycles, r.alloc_cycles,
+                       r.free_cycles, r.write_bw);
+
+        best.nforks = max(best.nforks, r.nforks);
+        best.fork_cycles = min(best.fork_cycles, r.fork_cycles);
+        best.exit_cycles = min(best.exit_cycles, r.exit_cycles);
+        best.npages = max(best.npages, r.npages);
+        best.alloc_cycles = min(best.alloc_cycles, r.alloc_cycles);
+        best.free_cycles = min(best.free_cycles, r.free_cycles);
+        best.fault_bw = max(best.fault_bw, r.fault_bw);
+        best.write_bw = max(best.write_bw, r.write_bw);
+        best.read_bw = max(best.read_bw, r.read_bw);
+    }
+    log_result("best", best);
+    console_printf(CPOS(24, 0), CS_YELLOW
+                   "kbench done: fork %lu, exit %lu, alloc %lu, free %lu, write %lu B/kc  ",
+                   best.fork_cycles, best.exit_cycles, best.alloc_cycles,
+                   best.free_cycles, best.write_bw);
+    sys_exit();
+}
@@ -0,0 +1,82 @@
+#include "u-lib.hh"
+#ifndef MALLOCBENCH_OPS
+#define MALLOCBENCH_OPS 100000
+#endif
+
+// p-mallocbench
+//    Exercises and times the u-lib heap allocator. Run it with
+//    `make run-mallocbench`. The process keeps up to MALLOCBENCH_SLOTS
+//    live allocations; each operation picks a random slot and frees its
+//    block (first checking its contents), grows or shrinks it with
+//    `realloc`, or fills an empty slot with a new block. Sizes are mostly
+//    small, sometimes up to 2 KiB, and rarely up to 16 KiB. Each round's
+//    cost per operation is printed on the bottom line of the console.
+
+#define MALLOCBENCH_SLOTS 256
+
+static unsigned char* blocks[MALLOCBENCH_SLOTS];
+static size_t sizes[MALLOCBENCH_SLOTS];
+
+static size_t random_size() {
+    int r = rand(0, 99);
+    if (r < 75) {
+        return rand(1, 128);
+    } else if (r < 97) {
+        return rand(129, 2048);
+    } else {
+        return rand(2049, 16384);
+    }
+}
+
+static void fill(int slot, size_t from) {
+    for (size_t i = from; i < sizes[slot]; ++i) {
+        blocks[slot][i] = slot + i;
+    }
+}
+
+static void check(int slot, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        assert(blocks[slot][i] == (unsigned char) (slot + i));
+    }
+}
+
+void process_main() {
+    srand(getpid());
+    uint64_t best = ~uint64_t(0);
+
+    for (unsigned round = 1; true; ++round) {
+        size_t live = 0;
+        uint64_t start = rdtsc();
+        for (unsigned op = 0; op != MALLOCBENCH_OPS; ++op) {
+            int slot = rand(0, MALLOCBENCH_SLOTS - 1);
+            if (!blocks[slot]) {
+                sizes[slot] = random_size();
+                blocks[slot] = reinterpret_cast<unsigned char*>(malloc(sizes[slot]));
+                assert(blocks[slot]);
+                assert(reinterpret_cast<uintptr_t>(blocks[slot]) % 16 == 0);
+                fill(slot, 0);
+            } else if (rand(0, 3) == 0) {
+                size_t old_size = sizes[slot];
+                sizes[slot] = random_size();
+                blocks[slot] = reinterpret_cast<unsigned char*>(
+                    realloc(blocks[slot], sizes[slot]));
+                assert(blocks[slot]);
+                check(slot, min(old_size, sizes[slot]));
+                fill(slot, old_size);
+            } else {
+                check(slot, sizes[slot]);
+                free(blocks[slot]);
+                blocks[slot] = nullptr;
+            }
+        }
+        uint64_t cycles = (rdtsc() - start) / MALLOCBENCH_OPS;
+        best = min(best, cycles);
+        for (int slot = 0; slot != MALLOCBENCH_SLOTS; ++slot) {
+            live += blocks[slot] ? sizes[slot] : 0;
+        }
+        console_printf(CPOS(24, 0), CS_YELLOW
+                       "mallocbench round %u: %lu cycles/op (best %lu), %lu bytes live   ",
+                       round, cycles, best, live);
+        sys_yield();
+    }
+}
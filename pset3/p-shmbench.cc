@@ -0,0 +1,124 @@
+#include "u-lib.hh"
+#ifndef SHMBENCH_PINGS
+#define SHMBENCH_PINGS 20000
+#endif
+#ifndef SHMBENCH_BYTES
+#define SHMBENCH_BYTES (16UL << 20)
+#endif
+
+// p-shmbench
+//    Measures shared-memory IPC. Run it with `make run-shmbench`, on one
+//    CPU or (with `NCPU=2`) on two. The process maps a shared memory
+//    segment holding two `spsc_ring`s and forks a child that echoes
+//    everything from the first ring into the second. Each round then
+//    times SHMBENCH_PINGS round trips of a small message, and streams
+//    SHMBENCH_BYTES through the child and back for throughput. No data
+//    passes through the kernel; a side that finds its ring empty or full
+//    yields, so the benchmark also works on one CPU. Each round's result
+//    is printed on the bottom line of the console.
+
+#define SHMBENCH_PAGES  8               // 4 pages per ring
+#define SHMBENCH_MSG    64              // bytes per round trip
+#define SHMBENCH_CHUNK  1024            // bytes per streaming write
+
+extern uint8_t end[];
+
+static spsc_ring* ping;                 // parent to child
+static spsc_ring* pong;                 // child to parent
+
+static void echo() {
+    char buf[SHMBENCH_CHUNK];
+    while (true) {
+        size_t n = spsc_read(ping, buf, sizeof(buf));
+        if (n == 0) {
+            sys_yield();
+        }
+        for (size_t off = 0; off != n; ) {
+            size_t w = spsc_write(pong, buf + off, n - off);
+            if (w == 0) {
+                sys_yield();
+            }
+            off += w;
+        }
+    }
+}
+
+// shm_write_all, shm_read_all
+//    Transfer exactly `n` bytes, yielding while the ring is full (empty).
+
+static void shm_write_all(spsc_ring* r, const char* buf, size_t n) {
+    while (n != 0) {
+        size_t w = spsc_write(r, buf, n);
+        if (w == 0) {
+            sys_yield();
+        }
+        buf += w;
+        n -= w;
+    }
+}
+
+static void shm_read_all(spsc_ring* r, char* buf, size_t n) {
+    while (n != 0) {
+        size_t m = spsc_read(r, buf, n);
+        if (m == 0) {
+            sys_yield();
+        }
+        buf += m;
+        n -= m;
+    }
+}
+
+void process_main() {
+    uintptr_t addr = round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE);
+    int id = sys_shm_create(SHMBENCH_PAGES);
+    assert(id >= 0);
+    int r = sys_shm_map(id, reinterpret_cast<void*>(addr));
+    assert(r == 0);
+    size_t ring_size = SHMBENCH_PAGES / 2 * PAGESIZE;
+    ping = spsc_init(reinterpret_cast<void*>(addr), ring_size);
+    pong = spsc_init(reinterpret_cast<void*>(addr + ring_size), ring_size);
+
+    pid_t child = sys_fork();
+    assert(child >= 0);
+    if (child == 0) {
+        echo();
+    }
+
+    static char out[SHMBENCH_CHUNK], in[SHMBENCH_CHUNK];
+    for (size_t i = 0; i != sizeof(out); ++i) {
+        out[i] = i;
+    }
+    uint64_t best_ping = ~uint64_t(0), best_bw = 0;
+    for (unsigned round = 1; true; ++round) {
+        uint64_t start = rdtsc();
+        for (unsigned i = 0; i != SHMBENCH_PINGS; ++i) {
+            shm_write_all(ping, out, SHMBENCH_MSG);
+            shm_read_all(pong, in, SHMBENCH_MSG);
+        }
+        uint64_t ping_cycles = (rdtsc() - start) / SHMBENCH_PINGS;
+        assert(memcmp(in, out, SHMBENCH_MSG) == 0);
+
+        // Keep the rings full: write what fits, then drain what came back
+        start = rdtsc();
+        size_t sent = 0, received = 0;
+        while (received != SHMBENCH_BYTES) {
+            size_t w = 0;
+            if (sent != SHMBENCH_BYTES) {
+                w = spsc_write(ping, out, min(sizeof(out), SHMBENCH_BYTES - sent));
+                sent += w;
+            }
+            size_t m = spsc_read(pong, in, sizeof(in));
+            received += m;
+            if (w == 0 && m == 0) {
+                sys_yield();
+            }
+        }
+        uint64_t bw = SHMBENCH_BYTES * 1000 / max(rdtsc() - start, uint64_t(1));
+
+        best_ping = min(best_ping, ping_cycles);
+        best_bw = max(best_bw, bw);
+        console_printf(CPOS(24, 0), CS_YELLOW
+                       "shmbench %u: %lu cycles/ping (best %lu), %lu B/kcycle (best %lu)  ",
+                       round, ping_cycles, best_ping, bw, best_bw);
+    }
+}
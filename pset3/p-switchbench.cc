@@ -0,0 +1,39 @@
+#include "u-lib.hh"
+#ifndef SWITCHBENCH_YIELDS
+#define SWITCHBENCH_YIELDS 20000
+#endif
+
+// p-switchbench
+//    Measures the cost of a context switch in TSC cycles. Run it with
+//    `make run-switchbench` (on one CPU, so the two processes alternate).
+//    The process forks a child that only yields; each `sys_yield` then
+//    switches to the other process and back, so a round of
+//    SWITCHBENCH_YIELDS yields makes twice as many switches. Each round's
+//    result is printed on the bottom line of the console, and each new
+//    best is logged to `log.txt`.
+
+void process_main() {
+    pid_t child = sys_fork();
+    assert(child >= 0);
+    if (child == 0) {
+        while (true) {
+            sys_yield();
+        }
+    }
+
+    uint64_t best = ~uint64_t(0);
+    for (unsigned round = 1; true; ++round) {
+        uint64_t start = rdtsc();
+        for (unsigned i = 0; i != SWITCHBENCH_YIELDS; ++i) {
+            sys_yield();
+        }
+        uint64_t cycles = (rdtsc() - start) / (2 * SWITCHBENCH_YIELDS);
+        if (cycles < best) {
+            best = cycles;
+            log_printf("switchbench round %u: %lu cycles/switch", round, cycles);
+        }
+        console_printf(CPOS(24, 0), CS_YELLOW
+                       "switchbench round %u: %lu cycles/switch (best %lu)   ",
+                       round, cycles, best);
+    }
+}
@@ -0,0 +1,46 @@
+#include "u-lib.hh"
+#ifndef SYSCALLBENCH_CALLS
+#define SYSCALLBENCH_CALLS 100000
+#endif
+
+// p-syscallbench
+//    Measures the round-trip cost of a trivial system call, `sys_getpid`,
+//    in TSC cycles, next to `getpid`, which reads the kernel info page
+//    instead. Run it with `make run-syscallbench`. Each round's result
+//    is printed on the bottom line of the console, below the memory
+//    viewer, and each new best is logged to `log.txt`.
+
+void process_main() {
+    pid_t pid = sys_getpid();
+    assert(getpid() == pid);
+    uint64_t best = ~uint64_t(0), best_fast = ~uint64_t(0);
+
+    for (unsigned round = 1; true; ++round) {
+        uint64_t start = rdtsc();
+        for (unsigned i = 0; i != SYSCALLBENCH_CALLS; ++i) {
+            assert(sys_getpid() == pid);
+        }
+        uint64_t cycles = (rdtsc() - start) / SYSCALLBENCH_CALLS;
+        if (cycles < best) {
+            log_printf("syscallbench round %u: %lu cycles/sys_getpid", round, cycles);
+        }
+        best = min(best, cycles);
+
+        start = rdtsc();
+        for (unsigned i = 0; i != SYSCALLBENCH_CALLS; ++i) {
+            // keep the compiler from hoisting the load out of the loop
+            clobber_memory(const_cast<kinfo*>(kernel_info()));
+            assert(getpid() == pid);
+        }
+        uint64_t fast_cycles = (rdtsc() - start) / SYSCALLBENCH_CALLS;
+        if (fast_cycles < best_fast) {
+            log_printf("syscallbench round %u: %lu cycles/getpid", round, fast_cycles);
+        }
+        best_fast = min(best_fast, fast_cycles);
+
+        console_printf(CPOS(24, 0), CS_YELLOW
+                       "syscallbench %u: %lu cycles/sys_getpid (best %lu), %lu/getpid (best %lu)  ",
+                       round, cycles, best, fast_cycles, best_fast);
+        sys_yield();
+    }
+}
@@ -40,3 +40,320 @@ void assert_fail(const char* file, int line, const char* msg,
     }
     sys_panic(buf);
 }
+
+
+// log_printf
+//     Format into a stack buffer and write it with `sys_log`.
+
+void log_printf(const char* format, ...) {
+    va_list val;
+    va_start(val, format);
+    char buf[128];
+    vsnprintf(buf, sizeof(buf), format, val);
+    va_end(val);
+    sys_log(buf);
+}
+
+
+// printf, vprintf, console_flush
+//    Collect output in `console_buf` and write it with one
+//    `sys_write_console` per line.
+
+static char console_buf[256];
+static size_t console_len;
+
+struct buffered_console_printer : public printer {
+    void putc(unsigned char c) override {
+        console_buf[console_len] = c;
+        ++console_len;
+        if (c == '\n' || console_len == sizeof(console_buf)) {
+            console_flush();
+        }
+    }
+};
+
+void console_flush() {
+    if (console_len != 0) {
+        sys_write_console(console_buf, console_len);
+        console_len = 0;
+    }
+}
+
+void vprintf(const char* format, va_list val) {
+    buffered_console_printer pr;
+    pr.vprintf(format, val);
+}
+
+void printf(const char* format, ...) {
+    va_list val;
+    va_start(val, format);
+    vprintf(format, val);
+    va_end(val);
+}
+
+
+// spsc_init, spsc_write, spsc_read
+//    See `spsc_ring` in u-lib.hh. The indices only grow; a byte's slot is
+//    its index modulo the capacity.
+
+spsc_ring* spsc_init(void* mem, size_t size) {
+    assert(size > sizeof(spsc_ring));
+    spsc_ring* r = new (mem) spsc_ring;
+    r->capacity = size_t(1) << msb(size - sizeof(spsc_ring)) >> 1;
+    r->cached_tail = r->cached_head = 0;
+    r->tail.store(0, std::memory_order_relaxed);
+    r->head.store(0, std::memory_order_release);
+    return r;
+}
+
+size_t spsc_write(spsc_ring* r, const void* buf, size_t n) {
+    size_t head = r->head.load(std::memory_order_relaxed);
+    if (r->capacity - (head - r->cached_tail) < n) {
+        r->cached_tail = r->tail.load(std::memory_order_acquire);
+    }
+    n = min(n, r->capacity - (head - r->cached_tail));
+    size_t off = head & (r->capacity - 1);
+    size_t first = min(n, r->capacity - off);
+    memcpy(r->data() + off, buf, first);
+    memcpy(r->data(), reinterpret_cast<const char*>(buf) + first, n - first);
+    r->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+size_t spsc_read(spsc_ring* r, void* buf, size_t n) {
+    size_t tail = r->tail.load(std::memory_order_relaxed);
+    if (r->cached_head - tail < n) {
+        r->cached_head = r->head.load(std::memory_order_acquire);
+    }
+    n = min(n, r->cached_head - tail);
+    size_t off = tail & (r->capacity - 1);
+    size_t first = min(n, r->capacity - off);
+    memcpy(buf, r->data() + off, first);
+    memcpy(reinterpret_cast<char*>(buf) + first, r->data(), n - first);
+    r->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+
+// malloc, free, calloc, realloc
+//    A boundary-tag allocator on the design of pset1's m61. The heap is
+//    one run of pages from the first page past the program's `end`,
+//    grown with `sys_page_alloc_range`, whose pages cost nothing until
+//    written. Each block starts with a tag holding its size (a multiple
+//    of 16) and an in-use bit, and ends with a copy of that tag, so `free`
+//    coalesces with both neighbors in constant time. Blocks start 8 bytes
+//    past a 16-byte boundary, so payloads are 16-byte aligned. A footer tag
+//    at the heap's start and a header tag at its end, both in use and of
+//    size 0, stop coalescing there.
+//
+//    Free blocks hold the links of a free list. Free list `c` holds blocks
+//    whose sizes are in [2^c, 2^(c+1)), and bit `c` of `malloc_nonempty`
+//    is set iff it is nonempty. `malloc` takes the first block that fits
+//    from its own size's list, else the first block of the next nonempty
+//    larger list, and splits off what it does not need.
+
+extern uint8_t end[];
+
+struct malloc_block {
+    size_t tag;                         // size | MALLOC_INUSE
+    malloc_block* next;                 // free list links (free blocks)
+    malloc_block* prev;
+};
+
+#define MALLOC_INUSE            1UL
+#define MALLOC_MINBLOCK         32UL    // tag, links, footer tag
+#define MALLOC_NLISTS           32
+#define MALLOC_GROWPAGES        16      // least growth, in pages
+
+static malloc_block* malloc_lists[MALLOC_NLISTS];
+static uint32_t malloc_nonempty;
+static malloc_block* malloc_end;        // heap end tag; nullptr until used
+
+static inline size_t block_size(const malloc_block* b) {
+    return b->tag & ~MALLOC_INUSE;
+}
+static inline size_t* block_footer(malloc_block* b) {
+    return reinterpret_cast<size_t*>(reinterpret_cast<char*>(b) + block_size(b)) - 1;
+}
+static inline malloc_block* block_after(malloc_block* b) {
+    return reinterpret_cast<malloc_block*>(reinterpret_cast<char*>(b) + block_size(b));
+}
+static inline void set_block(malloc_block* b, size_t size, size_t inuse) {
+    b->tag = size | inuse;
+    *block_footer(b) = size | inuse;
+}
+
+static void free_list_push(malloc_block* b) {
+    int c = msb(block_size(b)) - 1;
+    b->prev = nullptr;
+    b->next = malloc_lists[c];
+    if (b->next) {
+        b->next->prev = b;
+    }
+    malloc_lists[c] = b;
+    malloc_nonempty |= 1U << c;
+}
+
+static void free_list_remove(malloc_block* b) {
+    int c = msb(block_size(b)) - 1;
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else if (!(malloc_lists[c] = b->next)) {
+        malloc_nonempty &= ~(1U << c);
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+}
+
+// free_block(b, size)
+//    Makes the `size` bytes at `b` a free block, merged with any free
+//    neighbors, and puts it on its free list.
+
+static void free_block(malloc_block* b, size_t size) {
+    b->tag = size;
+    malloc_block* next = block_after(b);
+    if (!(next->tag & MALLOC_INUSE)) {
+        free_list_remove(next);
+        size += block_size(next);
+    }
+    size_t prev_tag = reinterpret_cast<size_t*>(b)[-1];
+    if (!(prev_tag & MALLOC_INUSE)) {
+        b = reinterpret_cast<malloc_block*>(reinterpret_cast<char*>(b) - prev_tag);
+        free_list_remove(b);
+        size += prev_tag;
+    }
+    set_block(b, size, 0);
+    free_list_push(b);
+}
+
+// malloc_grow(size)
+//    Extends the heap by at least `size` bytes, leaving a page free below
+//    the stack. Returns false if no pages could be added.
+
+static bool malloc_grow(size_t size) {
+    uintptr_t top = malloc_end ? reinterpret_cast<uintptr_t>(malloc_end) + 8
+        : round_up(reinterpret_cast<uintptr_t>(end), PAGESIZE);
+    uintptr_t limit = round_down(rdrsp(), PAGESIZE) - PAGESIZE;
+    size_t npages = max(round_up(size + 16, PAGESIZE) / PAGESIZE,
+                        size_t(MALLOC_GROWPAGES));
+    npages = min(npages, top < limit ? (limit - top) / PAGESIZE : 0);
+    int n = npages ? sys_page_alloc_range(reinterpret_cast<void*>(top), npages) : -1;
+    if (n <= 0) {
+        return false;
+    }
+
+    // The new pages become a free block, starting at the old end tag or,
+    // for the first pages, after the start tag
+    malloc_block* b = malloc_end;
+    size_t size_added = n * PAGESIZE;
+    if (!b) {
+        *reinterpret_cast<size_t*>(top) = MALLOC_INUSE;
+        b = reinterpret_cast<malloc_block*>(top + 8);
+        size_added -= 16;
+    }
+    malloc_end = reinterpret_cast<malloc_block*>(top + n * PAGESIZE - 8);
+    malloc_end->tag = MALLOC_INUSE;
+    free_block(b, size_added);
+    return true;
+}
+
+// malloc_find(size)
+//    Removes a free block of at least `size` bytes from the free lists
+//    and returns it, or returns nullptr.
+
+static malloc_block* malloc_find(size_t size) {
+    int c = msb(size) - 1;
+    for (malloc_block* b = malloc_lists[c]; b; b = b->next) {
+        if (block_size(b) >= size) {
+            free_list_remove(b);
+            return b;
+        }
+    }
+    uint32_t larger = malloc_nonempty & ~((2U << c) - 1);
+    if (!larger) {
+        return nullptr;
+    }
+    malloc_block* b = malloc_lists[lsb(larger) - 1];
+    free_list_remove(b);
+    return b;
+}
+
+// use_block(b, have, size)
+//    Marks `b`, a `have`-byte block off the free lists, in use with
+//    `size` bytes, freeing the rest if it is big enough to be a block.
+
+static void use_block(malloc_block* b, size_t have, size_t size) {
+    if (have - size >= MALLOC_MINBLOCK) {
+        set_block(b, size, MALLOC_INUSE);
+        free_block(block_after(b), have - size);
+    } else {
+        set_block(b, have, MALLOC_INUSE);
+    }
+}
+
+static inline size_t malloc_block_size(size_t sz) {
+    return max(round_up(sz + 16, 16), MALLOC_MINBLOCK);
+}
+
+void* malloc(size_t sz) {
+    if (sz > (1UL << 30)) {
+        return nullptr;
+    }
+    size_t size = malloc_block_size(sz);
+    malloc_block* b = malloc_find(size);
+    if (!b) {
+        if (!malloc_grow(size) || !(b = malloc_find(size))) {
+            return nullptr;
+        }
+    }
+    use_block(b, block_size(b), size);
+    return &b->next;
+}
+
+void free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    malloc_block* b = reinterpret_cast<malloc_block*>(reinterpret_cast<size_t*>(ptr) - 1);
+    assert(b->tag & MALLOC_INUSE);
+    free_block(b, block_size(b));
+}
+
+void* calloc(size_t n, size_t sz) {
+    if (sz != 0 && n > (1UL << 30) / sz) {
+        return nullptr;
+    }
+    void* ptr = malloc(n * sz);
+    if (ptr) {
+        memset(ptr, 0, n * sz);
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t sz) {
+    if (!ptr) {
+        return malloc(sz);
+    } else if (sz > (1UL << 30)) {
+        return nullptr;
+    }
+    malloc_block* b = reinterpret_cast<malloc_block*>(reinterpret_cast<size_t*>(ptr) - 1);
+    size_t have = block_size(b), size = malloc_block_size(sz);
+    // Grow in place into a free next block
+    malloc_block* next = block_after(b);
+    if (have < size && !(next->tag & MALLOC_INUSE)
+        && have + block_size(next) >= size) {
+        free_list_remove(next);
+        have += block_size(next);
+    }
+    if (have >= size) {
+        use_block(b, have, size);
+        return ptr;
+    }
+    void* nptr = malloc(sz);
+    if (nptr) {
+        memcpy(nptr, ptr, block_size(b) - 16);
+        free(ptr);
+    }
+    return nptr;
+}
@@ -2,6 +2,7 @@
 #define WEENSYOS_U_LIB_HH
 #include "lib.hh"
 #include "x86-64.h"
+#include <atomic>
 #if WEENSYOS_KERNEL
 #error "u-lib.hh should not be used by kernel code."
 #endif
@@ -81,6 +82,27 @@ inline pid_t sys_getpid() {
     return make_syscall(SYSCALL_GETPID);
 }
 
+// kernel_info()
+//    Return this process's read-only kernel info page.
+inline const kinfo* kernel_info() {
+    return reinterpret_cast<const kinfo*>(KINFO_ADDR);
+}
+
+// getpid()
+//    Return current process ID, like `sys_getpid`, but with a load from
+//    the kernel info page rather than a system call.
+inline pid_t getpid() {
+    return kernel_info()->pid;
+}
+
+// clock_ticks()
+//    Return the kernel's clock ticks so far (100 a second, as for
+//    `sys_sleep`), computed from the TSC without a system call.
+inline unsigned long clock_ticks() {
+    const kinfo* ki = kernel_info();
+    return (rdtsc() - ki->clock_start_tsc) / ki->tsc_per_tick;
+}
+
 // sys_yield
 //    Yield control of the CPU to the kernel. The kernel will pick another
 //    process to run, if possible; if there is no other process, it will
@@ -103,17 +125,45 @@ inline int sys_page_alloc(void* addr) {
     return make_syscall(SYSCALL_PAGE_ALLOC, reinterpret_cast<uintptr_t>(addr));
 }
 
+// sys_page_alloc_range(addr, npages, flags)
+//    Like `sys_page_alloc` on each of the `npages` pages starting at
+//    `addr`, in order, but with one system call. Stops at the first page
+//    that cannot be allocated. Returns the number of pages allocated, or
+//    a negative error code if it allocated none (or if `addr`, `npages`,
+//    or `flags` is invalid). `flags` is 0 or PAGE_ALLOC_EAGER, which asks
+//    the kernel to allocate the pages now rather than on first write.
+inline int sys_page_alloc_range(void* addr, size_t npages, int flags = 0) {
+    return make_syscall(SYSCALL_PAGE_ALLOC_RANGE, reinterpret_cast<uintptr_t>(addr),
+                        npages, flags);
+}
+
+// sys_spawn(program_name)
+//    Start program `program_name` (such as "allocator") in a new process,
+//    from scratch: nothing is copied from this process, so unlike
+//    `sys_fork` the cost does not grow with its size. Returns the new
+//    process ID, or a negative error code if there is no such program or
+//    no free process or memory.
+inline pid_t sys_spawn(const char* program_name) {
+    return make_syscall(SYSCALL_SPAWN, reinterpret_cast<uintptr_t>(program_name));
+}
+
+void console_flush();
+
 // sys_fork()
 //    Fork the current process. On success, returns the child's process ID to
 //    the parent, and returns 0 to the child. On failure, returns a negative
-//    error code without creating a new process.
+//    error code without creating a new process. Buffered `printf` output
+//    is written first, so the child does not print it again.
 inline pid_t sys_fork() {
+    console_flush();
     return make_syscall(SYSCALL_FORK);
 }
 
 // sys_exit()
-//    Exit this process. Does not return.
+//    Exit this process, after writing any buffered `printf` output. Does
+//    not return.
 [[noreturn]] inline void sys_exit() {
+    console_flush();
     make_syscall(SYSCALL_EXIT);
     make_syscall(SYSCALL_PANIC, reinterpret_cast<uintptr_t>("sys_exit should not return!"));
 
@@ -122,6 +172,102 @@ inline pid_t sys_fork() {
     }
 }
 
+// sys_sleep(nticks)
+//    Block this process for at least `nticks` clock ticks (the clock
+//    ticks 100 times a second), using no CPU meanwhile. Returns 0.
+inline int sys_sleep(unsigned long nticks) {
+    return make_syscall(SYSCALL_SLEEP, nticks);
+}
+
+// sys_waitpid(pid)
+//    Block until process `pid` exits, using no CPU meanwhile. Returns 0
+//    once it has exited. Returns a negative error code if `pid` is not
+//    another live process, or if that process faults instead.
+inline int sys_waitpid(pid_t pid) {
+    return make_syscall(SYSCALL_WAITPID, pid);
+}
+
+// sys_trace_dump()
+//    Write the kernel's system call latency histograms and recent trace
+//    events to `log.txt`. Returns 0.
+inline int sys_trace_dump() {
+    return make_syscall(SYSCALL_TRACE_DUMP);
+}
+
+// sys_set_quantum(usec)
+//    Set this process's time slice to `usec` microseconds (doubled for
+//    each `mlfq` level it drops), or to the scheduler's default, 10000,
+//    if `usec == 0`. Returns 0, or -1 if `usec` is outside [100, 1000000].
+//    Forked children inherit it.
+inline int sys_set_quantum(unsigned long usec) {
+    return make_syscall(SYSCALL_SET_QUANTUM, usec);
+}
+
+// sys_shm_create(npages)
+//    Create a shared memory segment of `npages` zeroed pages, at most 16.
+//    Returns its ID, a small nonnegative integer, or a negative error code
+//    if `npages` is invalid or memory or segment IDs ran out. The segment
+//    lasts while any process that created or mapped it, or was forked from
+//    one, is alive; forked children see the parent's mappings of it shared,
+//    not copied.
+inline int sys_shm_create(size_t npages) {
+    return make_syscall(SYSCALL_SHM_CREATE, npages);
+}
+
+// sys_shm_map(id, addr)
+//    Map all of shared memory segment `id`, writable, starting at `addr`,
+//    freeing any pages mapped there before. Every process that maps the
+//    segment sees the same memory. `addr` has the same requirements as in
+//    `sys_page_alloc`. Returns 0 on success or a negative error code.
+inline int sys_shm_map(int id, void* addr) {
+    return make_syscall(SYSCALL_SHM_MAP, id, reinterpret_cast<uintptr_t>(addr));
+}
+
+// sys_getc()
+//    Return the next key typed, blocking until there is one, using no
+//    CPU meanwhile. Keys the kernel handles itself (Control-C, `q`, `a`,
+//    `f`, `e`, `t`, and `p`) are not returned.
+inline int sys_getc() {
+    return make_syscall(SYSCALL_GETC);
+}
+
+// sys_log(msg)
+//    Write `msg`, up to 127 characters, as a line of `log.txt`. Returns 0.
+inline int sys_log(const char* msg) {
+    return make_syscall(SYSCALL_LOG, reinterpret_cast<uintptr_t>(msg));
+}
+
+// sys_meminfo(pid, info)
+//    Copy process `pid`'s memory use (this process's if `pid == 0`) into
+//    `*info`; see `struct meminfo` in `lib.hh`. Takes constant time, so
+//    it can be called often. Returns 0, or a negative error code if
+//    `pid` is not a live process or `info` is not in user memory.
+inline int sys_meminfo(pid_t pid, meminfo* info) {
+    return make_syscall(SYSCALL_MEMINFO, pid, reinterpret_cast<uintptr_t>(info));
+}
+
+// sys_write_console(buf, len)
+//    Write `len` bytes from `buf`, at most 4096, to the console at the
+//    cursor, scrolling as needed. ANSI color escapes work as in
+//    `console_printf`. Returns the number of bytes written, or a negative
+//    error code if `buf` is not readable.
+inline ssize_t sys_write_console(const char* buf, size_t len) {
+    return make_syscall(SYSCALL_WRITE_CONSOLE, reinterpret_cast<uintptr_t>(buf), len);
+}
+
+// printf(format, ...), vprintf(format, val), console_flush()
+//    Print to the console at the cursor, like `console_printf(-1, ...)`,
+//    but through a buffer that `sys_write_console` writes a line at a
+//    time: at each newline, when the buffer fills, and on `console_flush`
+//    (which `sys_fork` and `sys_exit` call).
+void printf(const char* format, ...);
+void vprintf(const char* format, va_list val);
+
+// log_printf(format, ...)
+//    Format a line for `log.txt`, without the trailing newline, and
+//    write it with `sys_log`.
+void log_printf(const char* format, ...);
+
 // sys_panic(msg)
 //    Panic.
 [[noreturn]] inline void sys_panic(const char* msg) {
@@ -132,4 +278,51 @@ inline pid_t sys_fork() {
     }
 }
 
+
+// malloc(sz), free(ptr), calloc(n, sz), realloc(ptr, sz)
+//    Heap allocation, as in the C library (see u-lib.cc). The heap takes
+//    the pages after the program's data and grows toward the stack with
+//    `sys_page_alloc_range`, so a program that uses it must not allocate
+//    those pages itself. Payloads are 16-byte aligned. Returns `nullptr`
+//    when the heap cannot grow.
+void* malloc(size_t sz);
+void free(void* ptr);
+void* calloc(size_t n, size_t sz);
+void* realloc(void* ptr, size_t sz);
+
+// spsc_ring
+//    A lock-free byte queue between one producer and one consumer, for
+//    memory that both map with `sys_shm_map`. Only the producer writes
+//    `head` and only the consumer writes `tail`; each sits on its own
+//    cache line next to its writer's copy of the other index, which is
+//    reread only when the ring looks full (or empty), so the two sides
+//    rarely pull each other's cache lines. The data follows the header.
+
+struct spsc_ring {
+    alignas(64) std::atomic<size_t> head;   // bytes ever written
+    size_t cached_tail;                     // producer's copy of `tail`
+    alignas(64) std::atomic<size_t> tail;   // bytes ever read
+    size_t cached_head;                     // consumer's copy of `head`
+    alignas(64) size_t capacity;            // data bytes, a power of 2
+
+    char* data() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+// spsc_init(mem, size)
+//    Set up an empty ring in the `size` bytes at `mem`, which should be
+//    64-byte aligned, and return it. Only one side should call this.
+spsc_ring* spsc_init(void* mem, size_t size);
+
+// spsc_write(r, buf, n)
+//    Copy up to `n` bytes from `buf` into `r` without blocking. Returns
+//    the number of bytes copied, which is 0 if `r` is full.
+size_t spsc_write(spsc_ring* r, const void* buf, size_t n);
+
+// spsc_read(r, buf, n)
+//    Copy up to `n` bytes from `r` into `buf` without blocking. Returns
+//    the number of bytes copied, which is 0 if `r` is empty.
+size_t spsc_read(spsc_ring* r, void* buf, size_t n);
+
 #endif
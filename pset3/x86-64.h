@@ -179,6 +179,7 @@ typedef struct x86_64_msr_t {
 #define CR4_PCE                 0x00000100      // Perfmonitor Counter Enable
 #define CR4_OSFXSR              0x00000200      // OS FXSAVE/FXRSTOR support
 #define CR4_VMXE                0x00004000      // VMX Enable
+#define CR4_PCIDE               0x00020000      // PCID Enable
 
 // eflags bits (useful for rdeflags() and wreflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
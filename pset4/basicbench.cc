@@ -0,0 +1,151 @@
+#include "io61.hh"
+#include "io61_basic.hh"
+#include <cinttypes>
+#include <type_traits>
+
+// basicbench.cc
+//    Times byte-at-a-time copies and random reads through io61_file and
+//    through the compile-time specialized io61::basic_file, using the same
+//    C-style calls for both. `-s SIZE` (default 64m) sets the size of the
+//    temporary input. Outputs are compared, so the benchmark doubles as a
+//    test of basic_file.
+
+using basic_reader = io61::basic_file<O_RDONLY, 65536, true>;
+using basic_writer = io61::basic_file<O_WRONLY, 65536, true>;
+// Random reads fetch whole blocks, so they use small ones
+using basic_random_reader = io61::basic_file<O_RDONLY, 4096, true>;
+
+static bool failed = false;
+
+// open_file<F>(filename, mode)
+//    Opens `filename` as an `F`, either io61_file or a basic_file.
+template <typename F>
+static F* open_file(const char* filename, int mode) {
+    if constexpr (std::is_same_v<F, io61_file>) {
+        return io61_open_check(filename, mode);
+    } else {
+        return io61::open_check<F>(filename, mode);
+    }
+}
+
+// copy_bytewise<R, W>(in, out)
+//    Copies `in` to `out` a byte at a time; returns the seconds taken.
+template <typename R, typename W>
+static double copy_bytewise(const char* in, const char* out) {
+    double start = monotonic_timestamp();
+    R* inf = open_file<R>(in, O_RDONLY);
+    W* outf = open_file<W>(out, O_WRONLY | O_CREAT | O_TRUNC);
+    int ch;
+    while ((ch = io61_readc(inf)) != EOF) {
+        io61_writec(outf, ch);
+    }
+    io61_close(inf);
+    io61_close(outf);
+    return monotonic_timestamp() - start;
+}
+
+// random_reads(f, size, n, sum)
+//    Reads 16 bytes at each of `n` pseudorandom offsets of `f`, adding
+//    them into `*sum`; returns the seconds taken.
+template <typename F>
+static double random_reads(F* f, size_t size, size_t n, uint64_t* sum) {
+    std::mt19937_64 rng(61);
+    off_t off = 0;
+    double start = monotonic_timestamp();
+    for (size_t i = 0; i != n; ++i) {
+        // Mostly near the last offset, sometimes anywhere
+        off = rng() % 8 ? (off + rng() % 4096) % size : rng() % size;
+        unsigned char buf[16];
+        io61_seek(f, off);
+        ssize_t r = io61_read(f, buf, sizeof(buf));
+        for (ssize_t j = 0; j < r; ++j) {
+            *sum = *sum * 31 + buf[j];
+        }
+    }
+    return monotonic_timestamp() - start;
+}
+
+static bool same_file(const char* a, const char* b) {
+    FILE* fa = fopen(a, "r");
+    FILE* fb = fopen(b, "r");
+    bool same = fa && fb;
+    while (same) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        same = ca == cb;
+        if (ca == EOF) {
+            break;
+        }
+    }
+    if (fa) {
+        fclose(fa);
+    }
+    if (fb) {
+        fclose(fb);
+    }
+    return same;
+}
+
+static void report(const char* name, double elapsed, size_t n) {
+    printf("%-24s %8.1f ms %8.2f ns/op\n", name, elapsed * 1e3,
+           elapsed * 1e9 / (double) n);
+}
+
+int main(int argc, char** argv) {
+    size_t size = 64 << 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's' && io61_args::parse_size(optarg)) {
+            size = *io61_args::parse_size(optarg);
+        } else {
+            fprintf(stderr, "Usage: ./basicbench [-s SIZE]\n");
+            exit(1);
+        }
+    }
+    size = std::max(size, size_t(1));
+
+    char in[] = "/tmp/basicbench.in.XXXXXX";
+    char out1[] = "/tmp/basicbench.out1.XXXXXX";
+    char out2[] = "/tmp/basicbench.out2.XXXXXX";
+    int fds[] = {mkstemp(in), mkstemp(out1), mkstemp(out2)};
+    for (int fd : fds) {
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(1);
+        }
+        close(fd);
+    }
+    {
+        std::mt19937_64 rng(61);
+        io61_file* f = io61_open_check(in, O_WRONLY | O_TRUNC);
+        for (size_t i = 0; i != size; ++i) {
+            io61_writec(f, "0123456789abcdef\n"[rng() % 17]);
+        }
+        io61_close(f);
+    }
+
+    report("io61_file copy", copy_bytewise<io61_file, io61_file>(in, out1), size);
+    report("basic_file copy", copy_bytewise<basic_reader, basic_writer>(in, out2), size);
+    if (!same_file(in, out1) || !same_file(in, out2)) {
+        fprintf(stderr, "basicbench: copies differ from input\n");
+        failed = true;
+    }
+
+    size_t n = 4000000;
+    uint64_t sum1 = 0, sum2 = 0;
+    io61_file* f1 = open_file<io61_file>(in, O_RDONLY);
+    report("io61_file random reads", random_reads(f1, size, n, &sum1), n);
+    io61_close(f1);
+    basic_random_reader* f2 = open_file<basic_random_reader>(in, O_RDONLY);
+    report("basic_file random reads", random_reads(f2, size, n, &sum2), n);
+    io61_close(f2);
+    if (sum1 != sum2) {
+        fprintf(stderr, "basicbench: random reads differ (%" PRIx64 " vs %" PRIx64 ")\n",
+                sum1, sum2);
+        failed = true;
+    }
+
+    unlink(in);
+    unlink(out1);
+    unlink(out2);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+#! /usr/bin/perl -w
+
+# bench.pl
+#    This program counts the system calls made by the tests under each
+#    io61 implementation (io61, stdio-io61, syscall-io61, slow-io61),
+#    using `./syscount`, and reports them with the bytes moved.
+#
+#    `BASELINE=1 make bench` records the io61 counts in
+#    .deps/syscounts.txt. Later runs compare against that record and
+#    fail if a test's io61 system calls or bytes grow by more than
+#    RATIO (default 2) times.
+#
+#    To add benchmarks of your own, scroll down to the bottom.
+
+my (@benches, %baseline, @regressions);
+my ($BASELINEFILE) = ".deps/syscounts.txt";
+my ($SLACK) = 32;
+my (@VARIANTS) = (["io61", ""], ["stdio", "stdio-"],
+                  ["syscall", "syscall-"], ["slow", "slow-"]);
+
+sub nonemptyenv ($) {
+    my ($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+
+sub boolenv ($) {
+    my ($e) = @_;
+    return nonemptyenv($e) && $ENV{$e} ne "0" ? 1 : 0;
+}
+
+my ($RECORD) = boolenv("BASELINE");
+my ($RATIO) = nonemptyenv("RATIO") ? $ENV{"RATIO"} + 0 : 2;
+
+my ($Red, $Green, $Cyan, $Off) = ("\x1b[01;31m", "\x1b[01;32m", "\x1b[01;36m", "\x1b[0m");
+if (!(-t STDERR && -t STDOUT)) {
+    $Red = $Green = $Cyan = $Off = "";
+}
+
+# make_datafile(filename, size)
+#    Creates a deterministic input file: numbered lines for `.txt`,
+#    pseudorandom bytes for `.bin`.
+sub make_datafile ($$) {
+    my ($filename, $size) = @_;
+    return if -r $filename && -s $filename == $size;
+    mkdir "inputs";
+    open(DATA, ">", $filename) or die "$filename: $!\n";
+    my ($data, $n) = ("", 0);
+    srand(61);
+    while (length($data) < $size) {
+        if ($filename =~ /\.txt\z/) {
+            $data .= sprintf("%d: the quick brown fox jumps over the lazy dog\n", ++$n);
+        } else {
+            $data .= pack("N*", map { int(rand(4294967296)) } 1..1024);
+        }
+    }
+    print DATA substr($data, 0, $size);
+    close(DATA);
+}
+
+sub bench ($$) {
+    my ($id, $command) = @_;
+    push @benches, [$id, $command];
+}
+
+# run_bench(command, prefix)
+#    Runs `command` with each `./*61` program replaced by its `prefix`
+#    variant. Returns a hash of counts, or undef if a program is missing
+#    or the command fails.
+sub run_bench ($$) {
+    my ($command, $prefix) = @_;
+    $command =~ s{\./([-a-z]*61)\b}{./$prefix$1}g;
+    while ($command =~ m{\./([-a-z]*61)\b}g) {
+        return undef if !-x $1;
+    }
+    my ($outfile) = ".deps/syscount.json";
+    unlink($outfile);
+    system("./syscount", "-o", $outfile, "sh", "-c", $command);
+    return undef if $? != 0 || !open(RESULT, "<", $outfile);
+    my ($buf) = join("", <RESULT>);
+    close(RESULT);
+    my (%t);
+    while ($buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
+        $t{$1} = $2;
+    }
+    return exists($t{"syscalls"}) ? \%t : undef;
+}
+
+sub read_baseline () {
+    return if $RECORD || !open(BASELINE, "<", $BASELINEFILE);
+    while (defined($_ = <BASELINE>)) {
+        my ($id, $syscalls, $bytes) = split;
+        $baseline{$id} = [$syscalls, $bytes] if defined($bytes);
+    }
+    close(BASELINE);
+}
+
+sub grew ($$) {
+    my ($now, $before) = @_;
+    return $now > $RATIO * $before && $now > $before + $SLACK;
+}
+
+sub run () {
+    mkdir ".deps";
+    mkdir "outputs";
+    read_baseline();
+    my (@record);
+    printf "%-5s %10s %10s %10s %10s %12s %9s\n", "",
+        (map { $_->[0] } @VARIANTS), "io61 bytes", "vs stdio";
+    foreach my $b (@benches) {
+        my ($id, $command) = @$b;
+        my (@t) = map { run_bench($command, $_->[1]) } @VARIANTS;
+        my ($io61, $stdio) = @t;
+        my ($ratio) = $io61 && $stdio && $stdio->{"syscalls"} > 0
+            ? sprintf("%.2fx", $io61->{"syscalls"} / $stdio->{"syscalls"}) : "-";
+        my ($line) = sprintf("%-5s %10s %10s %10s %10s %12s %9s", $id,
+            (map { $_ ? $_->{"syscalls"} : "-" } @t),
+            $io61 ? $io61->{"bytes_read"} + $io61->{"bytes_written"} : "-",
+            $ratio);
+
+        if (!$io61) {
+            print "$Red$line$Off\n";
+            push @regressions, "$id: io61 run failed";
+            next;
+        }
+        my ($bytes) = $io61->{"bytes_read"} + $io61->{"bytes_written"};
+        push @record, "$id $io61->{syscalls} $bytes\n";
+        my ($base) = $baseline{$id};
+        if ($base && grew($io61->{"syscalls"}, $base->[0])) {
+            print "$Red$line$Off\n";
+            push @regressions, "$id: $io61->{syscalls} system calls, baseline $base->[0]";
+        } elsif ($base && grew($bytes, $base->[1])) {
+            print "$Red$line$Off\n";
+            push @regressions, "$id: $bytes bytes, baseline $base->[1]";
+        } else {
+            print "$line\n";
+        }
+        print "$Cyan      $command$Off\n" if boolenv("V");
+    }
+
+    if ($RECORD) {
+        open(BASELINE, ">", $BASELINEFILE) or die "$BASELINEFILE: $!\n";
+        print BASELINE @record;
+        close(BASELINE);
+        print "${Green}Baseline recorded in $BASELINEFILE.$Off\n";
+    } elsif (@regressions) {
+        print STDERR "${Red}*** System call regressions (more than ${RATIO}x baseline):$Off\n";
+        print STDERR map { "    $_\n" } @regressions;
+        exit(1);
+    } elsif (!%baseline) {
+        print "No baseline yet; run `BASELINE=1 make bench` to record one.\n";
+    } else {
+        print "${Green}No regressions against $BASELINEFILE.$Off\n";
+    }
+}
+
+
+# BENCHMARKS
+#    Inputs are small so the byte-at-a-time variants finish quickly.
+my ($text) = "inputs/bench128k.txt";
+my ($bin) = "inputs/bench128k.bin";
+make_datafile($text, 128 << 10);
+make_datafile($bin, 128 << 10);
+
+bench("S1", "./cat61 -o outputs/out.txt $text");
+bench("S2", "./blockcat61 -b 1024 -o outputs/out.txt $text");
+bench("S3", "./blockcat61 -b 509 -o outputs/out.bin $bin");
+bench("S4", "cat $text | ./blockcat61 -b 1024 | cat > outputs/out.txt");
+bench("S5", "./varblockcat61 -o outputs/out.txt $text");
+bench("S6", "./reverse61 -o outputs/out.txt $text");
+bench("S7", "./wreverse61 $text > outputs/out.txt");
+bench("S8", "./cat61 -s 131072 -o outputs/out.txt /dev/zero");
+bench("S9", "./shufflecat61 -o outputs/out.bin $bin");
+bench("S10", "./endorder61 -RW -B 4096 -o outputs/out.txt $text");
+bench("S11", "./scattergather61 -b 512 -o outputs/sga.txt -o outputs/sgb.txt < $text");
+
+run();
@@ -3,11 +3,12 @@
 // Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks.
 //    With `-R`, reads bytewise; with `-W`, writes bytewise.
+//    With `-Z`, compresses the output; with `-z`, decompresses the input.
 //    Default BLOCKSIZE is 4096.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:o:i:D:FRWy", 4096).parse(argc, argv);
+    io61_args args = io61_args("b:o:i:D:FRWyzZ", 4096).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
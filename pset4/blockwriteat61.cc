@@ -1,4 +1,5 @@
 #include "io61.hh"
+#include <sys/stat.h>
 
 // Usage: ./blockwriteat61 [-b BLOCKSIZE] [-p POS] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks,
@@ -16,6 +17,12 @@ int main(int argc, char* argv[]) {
     io61_file* outf = io61_open_check(args.output_file, O_WRONLY | O_CREAT);
     args.after_open(inf, O_RDONLY);
 
+    // The output will end where the input does
+    struct stat s;
+    if (fstat(fileno(inf), &s) == 0 && S_ISREG(s.st_mode)) {
+        io61_expect_size(outf, args.initial_offset + s.st_size);
+    }
+
     int r = io61_seek(outf, args.initial_offset);
     assert(r == 0);
 
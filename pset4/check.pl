@@ -45,6 +45,9 @@ eval { require "syscall.ph" };
 
 my $ROOT = "";
 my %param;
+my $CACHESTATE = "cold";
+# Inputs differ by generator, so cached results record which made them
+my $INPUTGEN = -x "./datagen" ? "datagen" : "dict";
 my $SEQTEST = 1;
 my $VERBOSE = boolenv("V");
 my $FILECHECKSUM = 0;
@@ -74,16 +77,27 @@ sub decache ($) {
     }
 }
 
+# make_datafile(filename)
+#    Creates input `filename`. Uses `./datagen`, which is deterministic
+#    and fast and can share files through an `IO61_DATACACHE` directory,
+#    if it is built; otherwise concatenates a dictionary or a binary.
 sub make_datafile ($) {
     my ($filename) = @_;
     my ($size) = $fileinfo{$filename}->[2];
+    my ($rootfn) = "${ROOT}$filename";
+    my ($seed) = $fileinfo{$filename}->[3];
+    if (-x "./datagen" && (!-r $rootfn || -s $rootfn != $size)) {
+        my ($kind) = $filename =~ /\.bin$/ ? "binary" : "text";
+        my ($rev) = $filename =~ /-rev/ ? " -R" : "";
+        unlink($rootfn);
+        system("./datagen -t $kind -s $size -r " . ($seed || 0) . "$rev $rootfn");
+    }
     my ($cmd) = $filename =~ /-rev/ ? "rev" : "cat";
     my ($src) = $filename =~ /\.bin$/ ? "/bin/sh" : "/usr/share/dict/words";
     die if $ROOT ne "" && $filename =~ /\A${ROOT}/;
-    my ($rootfn) = "${ROOT}$filename";
     my ($first_offset) = "";
-    if (defined($fileinfo{$filename}->[3]) && $fileinfo{$filename}->[3]) {
-        $first_offset = " | tail -c +" . $fileinfo{$filename}->[3];
+    if ($seed) {
+        $first_offset = " | tail -c +" . $seed;
     }
     if (!-r $rootfn || !defined(-s $rootfn) || -s $rootfn != $size) {
         while (!defined(-s $rootfn) || -s $rootfn < $size) {
@@ -92,7 +106,7 @@ sub make_datafile ($) {
         }
         truncate($rootfn, $size);
     }
-    $fileinfo{$filename} = [-M $rootfn, -C $rootfn, $size];
+    $fileinfo{$filename} = [-M $rootfn, -C $rootfn, $size, $seed];
 }
 
 sub verify_file ($) {
@@ -101,7 +115,8 @@ sub verify_file ($) {
         && (!-r "${ROOT}$filename"
             || $fileinfo{$filename}->[0] != -M "${ROOT}$filename"
             || $fileinfo{$filename}->[1] != -C "${ROOT}$filename")) {
-        truncate("${ROOT}$filename", 0);
+        # Unlink, not truncate: the file may be shared with a data cache
+        unlink("${ROOT}$filename");
         make_datafile($filename);
     }
     return -s "${ROOT}$filename";
@@ -436,7 +451,7 @@ sub read_triallog ($) {
         $buf =~ s/^\x1e//;
         eval {
             $t = decode_json($buf);
-            if (keys(%$t)) {
+            if (keys(%$t) && ($t->{"type"} // "") ne "stats") {
                 $t->{"cached"} = 1;
                 push @cachedtests, $t;
             }
@@ -455,7 +470,7 @@ sub add_make_targets ($) {
         push @t, $1;
     }
     foreach my $t (@t) {
-        next if $command !~ m/(?:\A|[|&;]\s*|'\|'\s*|\.\/socketpipe\s*(?:-B\s*\d+\s*|))$t/;
+        next if $command !~ m/(?:\A|[|&;]\s*|'\|'\s*|\.\/socketpipe\s*(?:-[BmP]\s*\w+\s*)*)$t/;
         $t = substr($t, 2);
         if (!exists($MAKE_TARGETS{$t})) {
             push @MAKE_TARGETS, $t;
@@ -611,7 +626,9 @@ sub run_qitem ($) {
         my $t = $cachedtests[$i];
         if ($t->{"id"} eq $qitem->{"id"}
             && $t->{"type"} eq $qitem->{"type"}
-            && $t->{"qcommand"} eq $qitem->{"command"}) {
+            && $t->{"qcommand"} eq $qitem->{"command"}
+            && ($t->{"cache"} // "cold") eq $CACHESTATE
+            && ($t->{"inputs"} // "dict") eq $INPUTGEN) {
             splice @cachedtests, $i, 1;
             $result = $t;
             last;
@@ -646,8 +663,12 @@ sub run_qitem ($) {
     map { s/\b(inputs|outputs|stdoutputs)\//${ROOT}$1\// } @size_limit_files;
 
     if (!$result) {
-        foreach my $f (@{$qitem->{"infiles"}}) {
-            decache($ROOT . $f);
+        # Cold trials evict the inputs from the page cache first; warm
+        # trials (`WARM=1`) find them where the last trial left them
+        if ($CACHESTATE eq "cold") {
+            foreach my $f (@{$qitem->{"infiles"}}) {
+                decache($ROOT . $f);
+            }
         }
         Time::HiRes::usleep(100000);
 
@@ -661,6 +682,8 @@ sub run_qitem ($) {
                            "compare" => $qitem->{"compare"});
         $result->{"qcommand"} = $qitem->{"command"};
         $result->{"perf"} = $qitem->{"perf"};
+        $result->{"cache"} = $CACHESTATE;
+        $result->{"inputs"} = $INPUTGEN;
         $result->{"strace"} = 1 if $qitem->{"strace"};
     }
 
@@ -765,6 +788,102 @@ sub first_trial ($$$) {
     @tests ? $tests[0] : undef;
 }
 
+# t_critical(df)
+#    Returns the two-sided 95% critical value of Student's t distribution
+#    with `df` degrees of freedom.
+my (@T95) = (undef, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+             2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+             2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+             2.052, 2.048, 2.045, 2.042);
+sub t_critical ($) {
+    my ($df) = @_;
+    return $df < @T95 ? $T95[$df] : 1.96;
+}
+
+# trial_stats(times...)
+#    Summarizes trial times: drops outliers outside Tukey's fences (1.5
+#    interquartile ranges beyond the quartiles), then returns the median,
+#    mean, standard deviation, and 95% confidence interval of the mean of
+#    the rest, plus the mean and variance of their logarithms (when all are
+#    positive) for ratio intervals. Returns undef for no times.
+sub trial_stats (@) {
+    my (@t) = sort { $a <=> $b } @_;
+    return undef if !@t;
+    my ($quantile) = sub {
+        my ($q) = @_;
+        my ($pos) = $q * (@t - 1);
+        my ($lo) = int($pos);
+        return $lo + 1 < @t ? $t[$lo] + ($pos - $lo) * ($t[$lo + 1] - $t[$lo]) : $t[$lo];
+    };
+    my (@kept) = @t;
+    if (@t >= 4) {
+        my ($q1, $q3) = ($quantile->(0.25), $quantile->(0.75));
+        my ($iqr) = $q3 - $q1;
+        @kept = grep { $_ >= $q1 - 1.5 * $iqr && $_ <= $q3 + 1.5 * $iqr } @t;
+    }
+    my ($n) = scalar(@kept);
+    my ($mean) = 0;
+    $mean += $_ foreach @kept;
+    $mean /= $n;
+    my ($var) = 0;
+    $var += ($_ - $mean) ** 2 foreach @kept;
+    $var = $n > 1 ? $var / ($n - 1) : 0;
+    my ($half) = $n > 1 ? t_critical($n - 1) * sqrt($var / $n) : 0;
+    my ($logmean, $logvar);
+    if ($n > 1 && $kept[0] > 0) {
+        $logmean = 0;
+        $logmean += log($_) foreach @kept;
+        $logmean /= $n;
+        $logvar = 0;
+        $logvar += (log($_) - $logmean) ** 2 foreach @kept;
+        $logvar /= $n - 1;
+    }
+    return {
+        "n" => scalar(@t), "kept" => $n, "outliers" => @t - $n,
+        "median" => $kept[int($n / 2)], "mean" => $mean,
+        "stddev" => sqrt($var), "ci95" => [$mean - $half, $mean + $half],
+        "relci" => $mean > 0 ? $half / $mean : 0,
+        "logmean" => $logmean, "logvar" => $logvar
+    };
+}
+
+# needs_more_trials(qitem)
+#    Returns true if `qitem`'s timing is still too noisy: its 95%
+#    confidence interval is wider than `CI` (relative to the mean) and it
+#    has trials and time left under `MAXTRIALS` and the trial time limit.
+sub needs_more_trials ($) {
+    my ($qitem) = @_;
+    return 0 if !$qitem->{"perf"} || $param{"CI"} <= 0 || $qitem->{"errors"}
+        || $qitem->{"count"} >= $param{"MAXTRIALS"};
+    my ($trialtime) = $qitem->{"type"} eq "stdio" ? $param{"STDIOTRIALTIME"} : $param{"TRIALTIME"};
+    return 0 if $trialtime > 0 && $qitem->{"elapsed"} >= $trialtime;
+    my (@times) = map { $_->{"time"} } grep { !exists($_->{"killed"}) }
+        find_tests($qitem->{"id"}, $qitem->{"type"}, $qitem->{"command"});
+    return 0 if @times < 3;
+    my ($st) = trial_stats(@times);
+    return $st->{"relci"} > $param{"CI"};
+}
+
+# format_outliers(tt)
+#    Returns a note about the outlier trials a median trial's statistics
+#    dropped, if any.
+sub format_outliers ($) {
+    my ($tt) = @_;
+    my ($n) = $tt->{"stats"} ? $tt->{"stats"}->{"outliers"} : 0;
+    return $n ? ", $n outlier" . ($n == 1 ? "" : "s") . " dropped" : "";
+}
+
+# format_ci(tt)
+#    Returns a `±` suffix for a median trial's time, if it has statistics.
+sub format_ci ($) {
+    my ($tt) = @_;
+    my ($st) = $tt->{"stats"};
+    return "" if !$st || $st->{"kept"} < 2;
+    return sprintf(" ±%.1f%%", 100 * $st->{"relci"});
+}
+
+my (@trialstats);
+
 sub median_trial ($$$) {
     my ($id, $type, $qitem) = @_;
     my $command = $qitem->{$type eq "stdio" ? "stdiocommand" : "maincommand"};
@@ -808,6 +927,14 @@ sub median_trial ($$$) {
     }
 
     # decorate it
+    my ($st) = trial_stats(map { $_->{"time"} } grep { !exists($_->{"killed"}) } @tests);
+    if ($st) {
+        $tt->{"stats"} = $st;
+        if (!grep { $_->{"id"} eq $id && $_->{"of"} eq $type && $_->{"qcommand"} eq $command } @trialstats) {
+            push @trialstats, {"type" => "stats", "id" => $id, "of" => $type,
+                               "qcommand" => $command, "cache" => $CACHESTATE, %$st};
+        }
+    }
     $tt->{"medianof"} = scalar(@tests);
     $tt->{"ncached"} = $ncached;
     $tt->{"stderr"} = $stderr;
@@ -824,11 +951,12 @@ sub print_stdio ($) {
     my ($t) = @_;
     my $maxrss = defined($t->{"maxrss"}) ? $t->{"maxrss"} : 0;
     if (exists($t->{"utime"})) {
-        printf("%.5fs (%.5fs user, %.5fs system, %.0fMiB memory, %d %strial%s)\n",
-               $t->{"time"}, $t->{"utime"}, $t->{"stime"}, $maxrss / 1024.0,
+        printf("%.5fs%s (%.5fs user, %.5fs system, %.0fMiB memory, %d %strial%s%s)\n",
+               $t->{"time"}, format_ci($t),
+               $t->{"utime"}, $t->{"stime"}, $maxrss / 1024.0,
                $t->{"medianof"},
                $t->{"ncached"} ? "cached " : "",
-               $t->{"medianof"} == 1 ? "" : "s");
+               $t->{"medianof"} == 1 ? "" : "s", format_outliers($t));
     } else {
         printf("${Red}KILLED${Redctx} after %.5fs (%d %strial%s)${Off}\n",
                $t->{"time"},
@@ -918,6 +1046,13 @@ sub run () {
         # run it
         my ($t) = run_qitem($qitem);
 
+        # add a trial if the timing is still too noisy
+        if ($qitem->{"nleft"} == 0 && $t && needs_more_trials($qitem)) {
+            splice(@workq, $qpos + 1, 0, $qitem);
+            $qitem->{"nleft"} += 1;
+            $command_trials{$qitem->{"maincommand"}} += 1;
+        }
+
         # compare results
         if (!exists($t->{"killed"})
             && $qitem->{"type"} eq "yourcode") {
@@ -961,9 +1096,11 @@ sub run () {
             printf "${Red}KILLED${Redctx} (%s)${Off}\n", $tt->{"killed"};
             ++$nkilled;
         } elsif ($tt) {
-            printf("%.5fs (%.5fs user, %.5fs system, %.0fMiB memory, %d trial%s)\n",
-               $tt->{"time"}, $tt->{"utime"}, $tt->{"stime"}, $tt->{"maxrss"} / 1024.0,
-               $tt->{"medianof"}, $tt->{"medianof"} == 1 ? "" : "s");
+            printf("%.5fs%s (%.5fs user, %.5fs system, %.0fMiB memory, %d trial%s%s)\n",
+               $tt->{"time"}, format_ci($tt),
+               $tt->{"utime"}, $tt->{"stime"}, $tt->{"maxrss"} / 1024.0,
+               $tt->{"medianof"}, $tt->{"medianof"} == 1 ? "" : "s",
+               format_outliers($tt));
             push @runtimes, $tt->{"time"};
         }
 
@@ -984,7 +1121,21 @@ sub run () {
             } else {
                 $color = $Green;
             }
-            printf("RATIO:     ${color}%.2fx stdio${Off}\n", $ratio);
+            my ($ss, $ys) = ($stdiot->{"stats"}, $tt->{"stats"});
+            my ($range) = "";
+            if ($ss && $ys && defined($ss->{"logmean"})
+                && defined($ys->{"logmean"})) {
+                # Interval on the difference of mean log times, which
+                # exponentiates to an always-positive ratio interval
+                my ($diff) = $ss->{"logmean"} - $ys->{"logmean"};
+                my ($df) = min($ss->{"kept"}, $ys->{"kept"}) - 1;
+                my ($half) = t_critical($df)
+                    * sqrt($ss->{"logvar"} / $ss->{"kept"}
+                           + $ys->{"logvar"} / $ys->{"kept"});
+                $range = sprintf(" (95%% CI %.2fx-%.2fx)",
+                                 exp($diff - $half), exp($diff + $half));
+            }
+            printf("RATIO:     ${color}%.2fx stdio${Off}%s\n", $ratio, $range);
             push @ratios, $ratio;
             push @basetimes, $stdiot->{"time"};
         }
@@ -1053,6 +1204,10 @@ sub summary () {
             next if $skip_my && $t->{"type"} ne "stdio";
             push @testjsons, ((encode_json $t) . "\n");
         }
+        foreach my $t (@trialstats) {
+            next if $skip_my && $t->{"of"} ne "stdio";
+            push @testjsons, ((encode_json $t) . "\n");
+        }
         print "\n", @testjsons if $VERBOSE;
         if (($param{"MAKETRIALLOG"} || $param{"CACHE"}) && @testjsons) {
             my $outfile;
@@ -1082,6 +1237,9 @@ sub summary () {
     "STDIOTRIALTIME" => nonemptyenv("STDIOTRIALTIME") ? $ENV{"STDIOTRIALTIME"} + 0 : undef,
     "TRIALS" => nonemptyenv("TRIALS") ? int($ENV{"TRIALS"}) : 5,
     "STDIOTRIALS" => nonemptyenv("STDIOTRIALS") ? int($ENV{"STDIOTRIALS"}) : undef,
+    "MAXTRIALS" => nonemptyenv("MAXTRIALS") ? int($ENV{"MAXTRIALS"}) : undef,
+    "CI" => nonemptyenv("CI") ? $ENV{"CI"} + 0 : 0.025,
+    "WARM" => boolenv("WARM"),
     "MAXTIME" => nonemptyenv("MAXTIME") ? $ENV{"MAXTIME"} + 0 : 20,
     "DEFS" => nonemptyenv("DEFS") ? $ENV{"DEFS"} : undef,
     "O" => nonemptyenv("O") ? $ENV{"O"} : undef,
@@ -1115,6 +1273,9 @@ while (@ARGV) {
 $param{"TRIALS"} = 5 if $param{"TRIALS"} <= 0;
 $param{"STDIOTRIALS"} = $param{"TRIALS"} if !defined($param{"STDIOTRIALS"});
 $param{"STDIOTRIALS"} = 5 if $param{"STDIOTRIALS"} <= 0;
+$param{"MAXTRIALS"} = 4 * max($param{"TRIALS"}, $param{"STDIOTRIALS"})
+    if !defined($param{"MAXTRIALS"}) || $param{"MAXTRIALS"} <= 0;
+$CACHESTATE = $param{"WARM"} ? "warm" : "cold";
 $param{"STDIOTRIALTIME"} = $param{"TRIALTIME"} if !defined($param{"STDIOTRIALTIME"});
 $param{"MAXTIME"} = 20 if $param{"MAXTIME"} <= 0;
 $param{"NOSTDIO"} = 1 if $param{"STRACE"};
@@ -1320,6 +1481,91 @@ enqueue("C20",
     "magic random file, byte I/O, sequential",
     "perf" => 0, "compare" => -1, "insize" => 400000, "check_random" => 1);
 
+enqueue("C21",
+    "./tee61 -b 1000 -o outputs/c23a.txt -o outputs/c23b.txt -o /dev/stdout $textsm | cat > outputs/c23c.txt",
+    "tee to 3 files, 1000B block I/O, sequential",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C22",
+    "./tail61 -s 150 -o outputs/c24.txt $textsm",
+    "last 150 lines, line index, block I/O",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C23",
+    "./sharewrite61 -j 4 -o outputs/c27.txt $textsm",
+    "shared output file, 4 threads, whole records",
+    "perf" => 0, "compare" => -1);
+
+enqueue("C24",
+    "./sharewrite61 -j 4 $textsm | sort > outputs/c28.txt",
+    "shared output pipe, 4 threads, sorted records",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C25",
+    "./iovcat61 -b 1000 -o outputs/c31.txt $textsm",
+    "scatter/gather vectors, up to 8 1000B buffers, sequential",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C26",
+    "cat $textsm | ./iovcat61 -b 70000 | cat > outputs/c32.txt",
+    "scatter/gather vectors, up to 8 70000B buffers, piped",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C27",
+    "./carefulcat61 -a 0.001 $textsm | ./trycat61 -K | ./syscall-carefulblockcat61 -D 0.002 -b 117 -y > outputs/out.txt",
+    "nonblocking try I/O, short-piped input, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C28",
+    "./trycat61 -K -P 4096 -b 65536 $textsm | ./syscall-carefulblockcat61 -D 0.05 -b 117 > outputs/out.txt",
+    "nonblocking try I/O, short writes to a full pipe, sequential correctness",
+    "perf" => 0, "expect" => $textsm);
+
+enqueue("C29",
+    "cat $textsm | ./loopcat61 -K -b 1000 -i /dev/stdin -o outputs/c35a.txt -i $revtextsm -o /dev/stdout | cat > outputs/c35b.txt",
+    "event loop, 2 pipes and files at once, 1000B block I/O",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C30",
+    "cat $textsm | ./loopcat61 -K -s 50000 -i /dev/stdin -o /dev/stdout | cat > outputs/c36.txt",
+    "event loop, stopped after 50000 bytes",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C31",
+    "./copycat61 -o outputs/c37.txt $textsm $revtextsm",
+    "io61_copy, 2 files",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C32",
+    "cat $textsm | ./copycat61 -b 1000 -s 300000 | cat > outputs/c38.txt",
+    "io61_copy, 1000B blocks, piped, first 300000 bytes",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C33",
+    "./linecat61 -o outputs/c39.txt $textsm",
+    "numbered lines read in place",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C34",
+    "cat $binmd | ./linecat61 -b 100 | cat > outputs/c40.bin",
+    "numbered lines, long binary lines in pieces, piped",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C35",
+    "./sumcat61 -o outputs/c41.txt $textsm",
+    "checksummed copy, mixed character, block, and in-kernel copies",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C36",
+    "cat $binmd | ./sumcat61 -b 70000 -r 5 | cat > outputs/c42.bin",
+    "checksummed copy, piped, up to 70000B blocks",
+    "perf" => 0, "compare" => 1);
+
+enqueue("C37",
+    "./scattergather61 -b 509 -M 64k -o outputs/c43a.txt -o outputs/c43b.txt -o outputs/c43c.txt -i $textsm -i $revtextsm -i $textsm -i $revtextsm",
+    "scatter/gather 3/4 files, 509B block I/O, 64KiB memory limit",
+    "perf" => 0, "compare" => 1);
+
 
 # NONSEQUENTIAL CORRECTNESS
 enqueue("CN1",
@@ -1357,6 +1603,31 @@ enqueue("CN7",
     "magic random file, byte I/O, reverse order",
     "perf" => 0, "compare" => -1, "insize" => 500000, "check_random" => 1);
 
+enqueue("CN8",
+    "./reverse61 -l -o outputs/c25.txt $textsm",
+    "line I/O, correctness for reverse lines",
+    "perf" => 0, "compare" => 1);
+
+enqueue("CN9",
+    ": > outputs/c26in.txt; ./reverse61 -l -s 5 -o outputs/c26.txt outputs/c26in.txt",
+    "line I/O, reverse lines from past the end of an empty file",
+    "perf" => 0, "compare" => 1);
+
+enqueue("CN10",
+    "cp $textsm outputs/c29.txt; ./rwpatch61 -s 2000 -o outputs/c29log.txt outputs/c29.txt",
+    "read/write file, mixed reads, seeks, and writes",
+    "perf" => 0, "compare" => 1);
+
+enqueue("CN11",
+    "cp $textsm outputs/c30.txt; ./rwpatch61 -b 100 -s 5000 -r 7 -o outputs/c30log.txt outputs/c30.txt",
+    "read/write file, small mixed reads, seeks, and writes",
+    "perf" => 0, "compare" => 1);
+
+enqueue("CN12",
+    "cp $textsm outputs/c44.txt; ./rwpatch61 -b 3000 -s 3000 -M 16k -o outputs/c44log.txt outputs/c44.txt",
+    "read/write file, mixed reads, seeks, and writes, 16KiB memory limit",
+    "perf" => 0, "compare" => 1);
+
 
 # REGULAR FILES, SEQUENTIAL I/O
 enqueue("MP1",
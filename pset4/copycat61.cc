@@ -0,0 +1,39 @@
+#include "io61.hh"
+
+// Usage: ./copycat61 [-b BLOCKSIZE] [-s SIZE] [-o OUTFILE] [FILE]...
+//    Copies the input FILEs in order to OUTFILE with io61_copy, which
+//    can move the bytes inside the kernel. Before each io61_copy of up to
+//    BLOCKSIZE bytes, copies one byte with io61_readc and io61_writec,
+//    so the copy also starts after bytes the library has cached. Stops
+//    after SIZE bytes in all.
+//    Default BLOCKSIZE is 65536.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:s:o:i:#", 65536).parse(argc, argv);
+
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Copy file data
+    for (auto filename : args.input_files) {
+        io61_file* inf = io61_open_check(filename, O_RDONLY);
+        while (args.file_size != 0) {
+            int ch = io61_readc(inf);
+            if (ch == EOF) {
+                break;
+            }
+            int r = io61_writec(outf, ch);
+            assert(r == 0);
+            --args.file_size;
+
+            size_t n = std::min(args.block_size, args.file_size);
+            ssize_t nc = io61_copy(inf, outf, n);
+            assert(nc >= 0 && size_t(nc) <= n);
+            args.file_size -= nc;
+        }
+        io61_close(inf);
+    }
+
+    io61_close(outf);
+}
@@ -0,0 +1,306 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <string>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// datagen.cc
+//    Writes deterministic test inputs quickly: the same options always
+//    produce the same bytes, on any machine. Kinds are `text` (lines of
+//    a few words), `lines` (words in lines of wildly varying length,
+//    from empty to 64 KiB), and `binary` (pseudorandom bytes). `-R`
+//    reverses the characters of each line, like `rev`.
+//
+//    With a cache directory (`-c DIR`, or `IO61_DATACACHE` in the
+//    environment), each generated file is kept there under a name that
+//    hashes the generator version and every option that determines its
+//    contents, and later requests for the same contents hard-link it
+//    instead of generating it again. Cached files are shared, so callers
+//    should replace an input by unlinking it, not by truncating it.
+//    check.pl uses this to build its `inputs/` files.
+
+static constexpr const char* version = "datagen 1";
+
+// Words for the text kinds.
+static const char* const words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+    "file", "buffer", "cache", "block", "read", "write", "seek", "flush",
+    "kernel", "system", "call", "byte", "page", "disk", "pipe", "socket",
+    "stream", "offset", "stride", "reverse", "shuffle", "random", "order",
+    "memory", "latency", "bandwidth", "throughput", "descriptor",
+    "a", "an", "of", "to", "in", "is", "it", "and", "or", "not", "on",
+    "performance", "engineering", "sequential", "prefetch", "eviction",
+    "Cambridge", "Massachusetts", "Harvard", "computer", "science",
+    "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"
+};
+static constexpr unsigned nwords = sizeof(words) / sizeof(words[0]);
+static constexpr size_t maxline = (1 << 16) + 64;   // Longest line + newline
+
+// wyrand
+//    A small, fast, statistically good 64-bit generator.
+struct wyrand {
+    uint64_t state;
+
+    uint64_t next() {
+        this->state += 0xa0761d6478bd642fULL;
+        __uint128_t m = (__uint128_t) this->state
+            * (this->state ^ 0xe7037ed1a0b428dbULL);
+        return (uint64_t) (m >> 64) ^ (uint64_t) m;
+    }
+    // below(n): Returns a number in [0, n).
+    uint64_t below(uint64_t n) {
+        return (uint64_t) (((__uint128_t) this->next() * n) >> 64);
+    }
+};
+
+enum datagen_kind { dg_text, dg_lines, dg_binary };
+
+struct options {
+    datagen_kind kind = dg_text;
+    unsigned long long size = 1 << 20;
+    unsigned long long seed = 61;
+    bool reverse = false;
+};
+
+// output
+//    Collects generated bytes in a large buffer and writes it in big
+//    chunks.
+struct output {
+    static constexpr size_t cap = 4 << 20;
+    int fd;
+    unsigned long long left;        // Bytes still to generate
+    char* buf;
+    size_t len = 0;
+
+    output(int fd_, unsigned long long size)
+        : fd(fd_), left(size), buf(new char[cap]) {
+    }
+    ~output() {
+        delete[] this->buf;
+    }
+    // room(): Returns how many more bytes fit before a flush.
+    size_t room() const {
+        return cap - this->len;
+    }
+    // put(s, n): Appends up to `n` bytes, stopping at the requested size.
+    void put(const char* s, size_t n) {
+        if (n > this->left) {
+            n = this->left;
+        }
+        memcpy(this->buf + this->len, s, n);
+        this->len += n;
+        this->left -= n;
+    }
+    void flush() {
+        size_t done = 0;
+        while (done < this->len) {
+            ssize_t w = write(this->fd, this->buf + done, this->len - done);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            } else if (w <= 0) {
+                perror("datagen: write");
+                exit(1);
+            }
+            done += w;
+        }
+        this->len = 0;
+    }
+};
+
+// make_line(o, rng, line)
+//    Writes one line of the text kinds, including its newline, into
+//    `line`, which has room for any line. Returns the line's length.
+static size_t make_line(const options& o, wyrand& rng, char* line) {
+    static size_t lengths[nwords];
+    if (!lengths[0]) {
+        for (unsigned i = 0; i != nwords; ++i) {
+            lengths[i] = strlen(words[i]);
+        }
+    }
+    size_t len = 0, target;
+    if (o.kind == dg_text) {
+        target = 1 + rng.below(60);
+    } else {
+        // Log-uniform up to 64 KiB, plus some empty lines
+        unsigned bits = rng.below(17);
+        target = rng.below(1 << bits);
+    }
+    while (len < target) {
+        if (len != 0) {
+            line[len++] = ' ';
+        }
+        unsigned w = rng.below(nwords);
+        memcpy(line + len, words[w], lengths[w]);
+        len += lengths[w];
+    }
+    if (o.reverse) {
+        std::reverse(line, line + len);
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+// generate(o, fd)
+//    Writes the file described by `o` to `fd`.
+static void generate(const options& o, int fd) {
+    wyrand rng = {o.seed};
+    output out(fd, o.size);
+    static char line[maxline];
+    while (out.left > 0) {
+        if (o.kind == dg_binary) {
+            uint64_t x = rng.next();
+            if (out.room() < sizeof(x)) {
+                out.flush();
+            }
+            out.put(reinterpret_cast<const char*>(&x), sizeof(x));
+        } else {
+            size_t len = make_line(o, rng, line);
+            if (out.room() < len) {
+                out.flush();
+            }
+            out.put(line, len);
+        }
+    }
+    out.flush();
+}
+
+// cache_name(o)
+//    Returns the cache file name for the contents `o` describes: a hash
+//    of the generator version and the content-determining options.
+static std::string cache_name(const options& o) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s kind=%d size=%llu seed=%llu rev=%d",
+             version, (int) o.kind, o.size, o.seed, (int) o.reverse);
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    for (const char* p = key; *p; ++p) {
+        h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".dat", h);
+    return name;
+}
+
+// copy_file(from, to)
+//    Copies file `from` to a new file `to`, in the kernel if possible.
+static void copy_file(const char* from, const char* to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (in < 0 || out < 0) {
+        fprintf(stderr, "datagen: %s: %s\n", in < 0 ? from : to, strerror(errno));
+        exit(1);
+    }
+    ssize_t n;
+    while ((n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0) {
+    }
+    if (n < 0) {
+        static char buf[1 << 20];
+        if (lseek(in, 0, SEEK_SET) != 0 || lseek(out, 0, SEEK_SET) != 0
+            || ftruncate(out, 0) != 0) {
+            perror("datagen: copy");
+            exit(1);
+        }
+        while ((n = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, n) != n) {
+                perror("datagen: write");
+                exit(1);
+            }
+        }
+    }
+    close(in);
+    close(out);
+}
+
+// generate_cached(o, dir, filename)
+//    Makes `filename` a link to the cached file for `o` in `dir`,
+//    generating that first if it is missing.
+static void generate_cached(const options& o, const char* dir, const char* filename) {
+    mkdir(dir, 0777);
+    std::string cached = std::string(dir) + "/" + cache_name(o);
+    struct stat s;
+    if (stat(cached.c_str(), &s) != 0 || (unsigned long long) s.st_size != o.size) {
+        // Generate under a temporary name, so a concurrent or interrupted
+        // run never leaves a partial file under the final one
+        std::string tmp = cached + "." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0444);
+        if (fd < 0) {
+            fprintf(stderr, "datagen: %s: %s\n", tmp.c_str(), strerror(errno));
+            exit(1);
+        }
+        generate(o, fd);
+        close(fd);
+        if (rename(tmp.c_str(), cached.c_str()) != 0) {
+            fprintf(stderr, "datagen: %s: %s\n", cached.c_str(), strerror(errno));
+            exit(1);
+        }
+    }
+    unlink(filename);
+    if (link(cached.c_str(), filename) != 0) {
+        copy_file(cached.c_str(), filename);   // Different file system
+    }
+}
+
+[[noreturn]] static void usage() {
+    fprintf(stderr, "Usage: ./datagen [-t text|lines|binary] [-s SIZE] [-r SEED] [-R] [-c CACHEDIR] [FILE]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    options o;
+    const char* cachedir = getenv("IO61_DATACACHE");
+    int opt;
+    char* end;
+    while ((opt = getopt(argc, argv, "t:s:r:Rc:")) != -1) {
+        if (opt == 't' && strcmp(optarg, "text") == 0) {
+            o.kind = dg_text;
+        } else if (opt == 't' && strcmp(optarg, "lines") == 0) {
+            o.kind = dg_lines;
+        } else if (opt == 't' && strcmp(optarg, "binary") == 0) {
+            o.kind = dg_binary;
+        } else if (opt == 's' || opt == 'r') {
+            unsigned long long x = strtoull(optarg, &end, 0);
+            if (end == optarg) {
+                usage();
+            }
+            if (*end == 'k' || *end == 'K') {
+                x <<= 10, ++end;
+            } else if (*end == 'm' || *end == 'M') {
+                x <<= 20, ++end;
+            } else if (*end == 'g' || *end == 'G') {
+                x <<= 30, ++end;
+            }
+            if (*end) {
+                usage();
+            }
+            (opt == 's' ? o.size : o.seed) = x;
+        } else if (opt == 'R') {
+            o.reverse = true;
+        } else if (opt == 'c') {
+            cachedir = optarg;
+        } else {
+            usage();
+        }
+    }
+    if (optind + 1 < argc) {
+        usage();
+    }
+
+    const char* filename = optind < argc ? argv[optind] : nullptr;
+    if (filename && cachedir && *cachedir) {
+        generate_cached(o, cachedir, filename);
+    } else if (filename) {
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "datagen: %s: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+        generate(o, fd);
+        close(fd);
+    } else {
+        generate(o, STDOUT_FILENO);
+    }
+}
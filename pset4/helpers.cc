@@ -3,6 +3,9 @@
 #include <csignal>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
+#include <memory>
+#include <cstdarg>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -67,37 +70,271 @@ double monotonic_timestamp() {
 
 
 // io61_read_bytewise(f, buf, sz)
-//    Read a block of `sz` bytes into `buf`, but using `io61_readc` calls.
+//    Read a block of `sz` bytes into `buf`, but a byte at a time, the way
+//    a parser would: each byte comes straight from the window
+//    io61_read_window exposes, with one io61_consume per window rather
+//    than a call per byte.
 
 ssize_t io61_read_bytewise(io61_file* f, unsigned char* buf, size_t sz) {
     size_t nr = 0;
     while (nr != sz) {
-        int ch = io61_readc(f);
-        if (ch < 0) {
+        const unsigned char* p;
+        size_t len;
+        if (io61_read_window(f, &p, &len) <= 0) {
             break;
         }
-        buf[nr] = ch;
-        ++nr;
+        len = std::min(len, sz - nr);
+        for (size_t i = 0; i != len; ++i) {
+            buf[nr + i] = p[i];
+        }
+        io61_consume(f, len);
+        nr += len;
     }
     return nr;
 }
 
 
 // io61_write_bytewise(f, buf, sz)
-//    Write a block of `sz` bytes from `buf`, but using `io61_writec` calls.
+//    Write a block of `sz` bytes from `buf`, but a byte at a time, the way
+//    a formatter would: each byte goes straight into the window
+//    io61_write_window exposes, with one io61_commit per window.
 
 ssize_t io61_write_bytewise(io61_file* f, const unsigned char* buf, size_t sz) {
     size_t nw = 0;
     while (nw != sz) {
-        if (io61_writec(f, buf[nw]) < 0) {
+        unsigned char* p;
+        size_t len;
+        if (io61_write_window(f, &p, &len) <= 0) {
+            break;
+        }
+        len = std::min(len, sz - nw);
+        for (size_t i = 0; i != len; ++i) {
+            p[i] = buf[nw + i];
+        }
+        if (io61_commit(f, len) < 0) {
             break;
         }
-        ++nw;
+        nw += len;
     }
     return nw;
 }
 
 
+// io61_printf(f, format, ...), io61_vprintf(f, format, val)
+//    Format like `printf` straight into the window io61_write_window
+//    exposes, then commit it, so the text is built in the write cache
+//    rather than in a buffer of its own. Only a record that does not fit
+//    (as near the end of the cache) is formatted again into a temporary
+//    buffer and written with io61_write. Returns the number of bytes
+//    written, or -1 on error.
+
+ssize_t io61_vprintf(io61_file* f, const char* format, va_list val) {
+    unsigned char* p;
+    size_t len;
+    if (io61_write_window(f, &p, &len) < 0) {
+        return -1;
+    }
+    va_list val2;
+    va_copy(val2, val);
+    int n = vsnprintf(reinterpret_cast<char*>(p), len, format, val2);
+    va_end(val2);
+    if (n < 0) {
+        return -1;
+    } else if (size_t(n) < len) {
+        // `vsnprintf` wants room for a null terminator past the text
+        return io61_commit(f, n) < 0 ? -1 : n;
+    }
+
+    char small[256];
+    std::unique_ptr<char[]> large;
+    char* buf = small;
+    if (size_t(n) >= sizeof(small)) {
+        large.reset(new char[size_t(n) + 1]);
+        buf = large.get();
+    }
+    vsnprintf(buf, size_t(n) + 1, format, val);
+    return io61_write(f, reinterpret_cast<unsigned char*>(buf), n);
+}
+
+ssize_t io61_printf(io61_file* f, const char* format, ...) {
+    va_list val;
+    va_start(val, format);
+    ssize_t r = io61_vprintf(f, format, val);
+    va_end(val);
+    return r;
+}
+
+
+// io61_write_uint(f, v), io61_write_int(f, v), io61_write_hex(f, v, width)
+//    Write `v` in decimal, or in lowercase hexadecimal zero-padded to at
+//    least `width` (at most 32) digits, without `printf`'s parsing. The
+//    length is computed first and the digits rendered backward in place,
+//    two decimal digits per step, straight into the write window when it
+//    has room, and through a small buffer and io61_write when it does
+//    not. Returns the number of bytes written, or -1 on error.
+
+static const char io61_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static size_t io61_decimal_length(unsigned long long v) {
+    size_t n = 1;
+    while (true) {
+        if (v < 10) {
+            return n;
+        } else if (v < 100) {
+            return n + 1;
+        } else if (v < 1000) {
+            return n + 2;
+        } else if (v < 10000) {
+            return n + 3;
+        }
+        v /= 10000;
+        n += 4;
+    }
+}
+
+// io61_write_rendered(f, n, render)
+//    Write the `n` bytes that `render(p)` puts at `p`, for n <= 64.
+
+template <typename R>
+static ssize_t io61_write_rendered(io61_file* f, size_t n, R render) {
+    unsigned char* p;
+    size_t len;
+    if (io61_write_window(f, &p, &len) < 0) {
+        return -1;
+    } else if (len >= n) {
+        render(p);
+        return io61_commit(f, n) < 0 ? -1 : ssize_t(n);
+    }
+    unsigned char buf[64];
+    render(buf);
+    return io61_write(f, buf, n);
+}
+
+ssize_t io61_write_uint(io61_file* f, unsigned long long v) {
+    size_t n = io61_decimal_length(v);
+    return io61_write_rendered(f, n, [=] (unsigned char* p) {
+        unsigned long long x = v;
+        p += n;
+        while (x >= 100) {
+            unsigned d = unsigned(x % 100) * 2;
+            x /= 100;
+            *--p = io61_digit_pairs[d + 1];
+            *--p = io61_digit_pairs[d];
+        }
+        if (x >= 10) {
+            *--p = io61_digit_pairs[x * 2 + 1];
+            *--p = io61_digit_pairs[x * 2];
+        } else {
+            *--p = '0' + x;
+        }
+    });
+}
+
+ssize_t io61_write_int(io61_file* f, long long v) {
+    if (v >= 0) {
+        return io61_write_uint(f, v);
+    }
+    // Negate as unsigned so LLONG_MIN works
+    unsigned long long mag = 0ULL - static_cast<unsigned long long>(v);
+    if (io61_writec(f, '-') < 0) {
+        return -1;
+    }
+    ssize_t n = io61_write_uint(f, mag);
+    return n < 0 ? -1 : n + 1;
+}
+
+ssize_t io61_write_hex(io61_file* f, unsigned long long v, int width) {
+    size_t n = v ? (67 - __builtin_clzll(v)) / 4 : 1;
+    n = std::max(n, size_t(std::clamp(width, 0, 32)));
+    return io61_write_rendered(f, n, [=] (unsigned char* p) {
+        unsigned long long x = v;
+        for (size_t i = n; i != 0; --i) {
+            p[i - 1] = "0123456789abcdef"[x & 15];
+            x >>= 4;
+        }
+    });
+}
+
+
+// crc32c(crc, buf, sz)
+//    Returns the CRC-32C (Castagnoli) checksum of the `sz` bytes at `buf`,
+//    continuing from `crc`, the checksum of the bytes before them (0 for
+//    none). This matches WeensyOS's `crc32c` in pset3's lib.hh. Uses the
+//    SSE4.2 or ARMv8 CRC instructions when the CPU has them, and a
+//    byte-at-a-time table otherwise.
+
+struct crc32c_table_type {
+    uint32_t t[256];
+    constexpr crc32c_table_type()
+        : t() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t x = i;
+            for (int k = 0; k != 8; ++k) {
+                x = (x >> 1) ^ (0x82F63B78U & -(x & 1));
+            }
+            t[i] = x;
+        }
+    }
+};
+static constexpr crc32c_table_type crc32c_bytes;
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t sz) {
+    for (size_t i = 0; i != sz; ++i) {
+        crc = crc32c_bytes.t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t sz) {
+    uint64_t c = crc;
+    for (; sz >= 8; p += 8, sz -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    crc = c;
+    for (; sz != 0; ++p, --sz) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+static const bool crc32c_has_hw = [] () {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+}();
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t sz) {
+    for (; sz >= 8; p += 8, sz -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; sz != 0; ++p, --sz) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+static const bool crc32c_has_hw = true;
+#else
+static const bool crc32c_has_hw = false;
+#define crc32c_hw crc32c_table
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t sz) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+    crc = ~crc;
+    crc = crc32c_has_hw ? crc32c_hw(crc, p, sz) : crc32c_table(crc, p, sz);
+    return ~crc;
+}
+
+
 // io61_args functions
 
 io61_args::io61_args(const char* opts_, size_t bs)
@@ -112,6 +349,9 @@ io61_args& io61_args::set_block_size(size_t bs) {
 io61_args& io61_args::set_seed(unsigned seed_) {
     this->engine.seed(seed_);
     this->seed = seed_;
+    if (io61_seed_hook) {
+        io61_seed_hook(seed_);
+    }
     return *this;
 }
 
@@ -236,6 +476,12 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'K':
             this->nonblocking = true;
             break;
+        case 'z':
+            this->decompress = true;
+            break;
+        case 'Z':
+            this->compress = true;
+            break;
         case 'q':
             this->quiet = true;
             break;
@@ -254,7 +500,7 @@ io61_args& io61_args::parse(int argc, char** argv) {
             break;
         case 'r':
             if (auto sz = parse_size(optarg)) {
-                this->engine.seed(*sz);
+                this->set_seed(*sz);
             } else {
                 goto usage;
             }
@@ -271,6 +517,25 @@ io61_args& io61_args::parse(int argc, char** argv) {
                 goto usage;
             }
             break;
+        case 'g': {
+            auto sz = parse_size(optarg);
+            if (!sz || *sz == 0) {
+                goto usage;
+            }
+            this->batch = *sz;
+            break;
+        }
+        case 'j': {
+            auto sz = parse_size(optarg);
+            if (!sz || *sz == 0) {
+                goto usage;
+            }
+            this->threads = *sz;
+            break;
+        }
+        case 'v':
+            this->verbose = true;
+            break;
         case 'P':
             if (auto sz = parse_size(optarg)) {
                 this->pipebuf_size = *sz;
@@ -285,6 +550,13 @@ io61_args& io61_args::parse(int argc, char** argv) {
                 goto usage;
             }
             break;
+        case 'M':
+            if (auto sz = parse_size(optarg)) {
+                this->memory_limit = *sz;
+            } else {
+                goto usage;
+            }
+            break;
         case '#':
         default:
             goto usage;
@@ -342,6 +614,10 @@ io61_args& io61_args::parse(int argc, char** argv) {
 #endif
     }
 
+    if (this->memory_limit > 0) {
+        io61_set_memory_limit(this->memory_limit);
+    }
+
     return *this;
 
  usage:
@@ -402,6 +678,21 @@ void io61_args::usage() {
     if (strchr(this->opts, 'H')) {
         fprintf(stderr, "    -H            Supply hints to library\n");
     }
+    if (strchr(this->opts, 'g')) {
+        fprintf(stderr, "    -g COUNT      Read COUNT blocks per batch\n");
+    }
+    if (strchr(this->opts, 'z')) {
+        fprintf(stderr, "    -z            Decompress input (LZ4 frames)\n");
+    }
+    if (strchr(this->opts, 'Z')) {
+        fprintf(stderr, "    -Z            Compress output (LZ4 frames)\n");
+    }
+    if (strchr(this->opts, 'j')) {
+        fprintf(stderr, "    -j THREADS    Copy with THREADS worker threads\n");
+    }
+    if (strchr(this->opts, 'v')) {
+        fprintf(stderr, "    -v            Report throughput on stderr\n");
+    }
     if (strchr(this->opts, 'X')) {
         fprintf(stderr, "    -X            Use powers of two for block sizes\n");
     }
@@ -411,6 +702,9 @@ void io61_args::usage() {
     if (strchr(this->opts, 'A')) {
         fprintf(stderr, "    -A ASLIMIT    Set address space limit on Linux\n");
     }
+    if (strchr(this->opts, 'M')) {
+        fprintf(stderr, "    -M MEMLIMIT   Limit io61 cache memory\n");
+    }
     if (strchr(this->opts, 'r')) {
         fprintf(stderr, "    -r            Set random seed (default %u)\n", this->seed);
     }
@@ -450,6 +744,13 @@ void io61_args::after_open(int fd, int mode) {
 }
 
 void io61_args::after_open(io61_file* f, int mode) {
+    bool filter = (mode & O_ACCMODE) == O_RDONLY ? this->decompress
+        : this->compress;
+    if (filter && io61_push_filter(f, io61_filter_lz4) != 0) {
+        fprintf(stderr, "%s: compression filter: %s\n",
+                this->program_name, strerror(errno));
+        exit(1);
+    }
     this->after_open(io61_fileno(f), mode);
 }
 
@@ -485,6 +786,9 @@ void io61_args::after_write(FILE* f) {
 }
 
 
+int (*io61_profile_hook)(char* buf, size_t sz);
+void (*io61_seed_hook)(unsigned seed);
+
 namespace {
 
 struct io61_profiler {
@@ -531,6 +835,12 @@ io61_profiler::~io61_profiler() {
         usage.ru_majflt + cusage.ru_majflt,
         usage.ru_inblock + cusage.ru_inblock,
         usage.ru_oublock + cusage.ru_oublock);
+    if (io61_profile_hook) {
+        // Replace the closing brace with io61's counters
+        len -= 2;
+        len += io61_profile_hook(buf + len, sizeof(buf) - len - 2);
+        len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+    }
 
     off_t off = lseek(100, 0, SEEK_CUR);
     int fd = (off != (off_t) -1 || errno == ESPIPE ? 100 : STDERR_FILENO);
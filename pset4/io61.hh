@@ -1,14 +1,17 @@
 #ifndef IO61_HH
 #define IO61_HH
 #include <cstdio>
+#include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <vector>
 #include <random>
 #include <optional>
+#include <functional>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <sched.h>
 
 struct io61_file;
@@ -22,16 +25,161 @@ off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t off);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int c);
+enum io61_hint_pattern {
+    io61_hint_willneed,     // [off, off + len) will be read soon
+    io61_hint_dontneed,     // [off, off + len) will not be read again
+    io61_hint_sequential,   // Later reads are sequential
+    io61_hint_random        // Later reads jump around
+};
+int io61_hint(io61_file* f, off_t off, off_t len, int pattern);
+int io61_expect_size(io61_file* f, off_t size);
+
+// io61_fastbuf
+//    Buffer windows at the start of every io61_file, so the inline
+//    io61_readc and io61_writec below can move a byte without a call.
+//    An implementation keeps them empty except between its own calls;
+//    empty windows send every byte to the out-of-line `_slow` versions.
+struct io61_fastbuf {
+    const unsigned char* rpos = nullptr;    // Next byte for io61_readc
+    const unsigned char* rend = nullptr;    // End of io61_readc's window
+    unsigned char* wpos = nullptr;          // Next byte for io61_writec
+    unsigned char* wend = nullptr;          // End of io61_writec's window
+};
+
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int c);
+
+inline int io61_readc(io61_file* f) {
+    io61_fastbuf* fb = reinterpret_cast<io61_fastbuf*>(f);
+    if (fb->rpos != fb->rend) {
+        return *fb->rpos++;
+    }
+    return io61_readc_slow(f);
+}
+
+inline int io61_writec(io61_file* f, int c) {
+    io61_fastbuf* fb = reinterpret_cast<io61_fastbuf*>(f);
+    if (fb->wpos != fb->wend) {
+        *fb->wpos++ = static_cast<unsigned char>(c);
+        return 0;
+    }
+    return io61_writec_slow(f, c);
+}
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz);
+ssize_t io61_read_backward(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz);
 
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz);
+ssize_t io61_peekline(io61_file* f, const unsigned char** start, size_t* len);
+
+int io61_index_lines(io61_file* f);
+off_t io61_seek_line(io61_file* f, long long n);
+ssize_t io61_readline_backward(io61_file* f, unsigned char* buf, size_t sz);
+
+ssize_t io61_read_window(io61_file* f, const unsigned char** start, size_t* len);
+int io61_consume(io61_file* f, size_t n);
+ssize_t io61_write_window(io61_file* f, unsigned char** start, size_t* len);
+int io61_commit(io61_file* f, size_t n);
+
+ssize_t io61_printf(io61_file* f, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+ssize_t io61_vprintf(io61_file* f, const char* format, va_list val);
+ssize_t io61_write_uint(io61_file* f, unsigned long long v);
+ssize_t io61_write_int(io61_file* f, long long v);
+ssize_t io61_write_hex(io61_file* f, unsigned long long v, int width = 0);
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n);
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+
+struct io61_request {
+    off_t off;              // File offset to read from
+    size_t len;             // Number of bytes to read
+    unsigned char* buf;     // Destination for the bytes
+    ssize_t result;         // Set to # bytes read, or -1 on error
+    int err;                // Set to the error if `result` is -1
+};
+int io61_read_batch(io61_file* f, io61_request* reqs, size_t n);
+
 int io61_flush(io61_file* f);
 
+ssize_t io61_try_read(io61_file* f, unsigned char* buf, size_t sz);
+ssize_t io61_try_write(io61_file* f, const unsigned char* buf, size_t sz);
+int io61_try_flush(io61_file* f);
+
+enum io61_events {
+    io61_readable = 1,
+    io61_writable = 2
+};
+struct io61_loop;
+using io61_callback = std::function<void(io61_file* f, int events)>;
+io61_loop* io61_loop_new();
+void io61_loop_free(io61_loop* l);
+int io61_loop_add(io61_loop* l, io61_file* f, int events, io61_callback callback);
+int io61_loop_modify(io61_loop* l, io61_file* f, int events);
+int io61_loop_remove(io61_loop* l, io61_file* f);
+int io61_loop_run(io61_loop* l);
+void io61_loop_stop(io61_loop* l);
+
+struct io61_cache_stats {
+    unsigned long long hits;            // # seeks served from the read cache
+    unsigned long long misses;          // # blocks read from the file
+    unsigned long long readahead_waits; // # reads that waited for read-ahead
+    unsigned long long writebehind_waits; // # writes that waited for write-behind
+};
+io61_cache_stats io61_get_cache_stats(io61_file* f);
+
+struct io61_file_stats {
+    unsigned long long read_calls;      // # read, pread, readv, preadv calls
+    unsigned long long write_calls;     // # write, pwrite, writev, pwritev calls
+    unsigned long long copy_calls;      // # copy_file_range, sendfile, splice calls
+    unsigned long long other_calls;     // # poll, fstat, fcntl, madvise, ... calls
+    unsigned long long bytes_read;      // # bytes read by system calls
+    unsigned long long bytes_written;   // # bytes written by system calls
+    unsigned long long hits;            // # seeks served from the read cache
+    unsigned long long misses;          // # blocks read from the file
+    unsigned long long seeks;           // # io61_seek calls
+    unsigned long long refills;         // # read cache refills
+    unsigned long long short_reads;     // # reads returning less than asked
+    unsigned long long short_writes;    // # writes accepting less than asked
+    unsigned long long more_sends;      // # socket sends with MSG_MORE
+    unsigned long long retries;         // # EINTR and EAGAIN retries
+    double blocked;                     // seconds spent in system calls
+};
+io61_file_stats io61_stats(io61_file* f);
+
+// Set by io61.cc to append process-wide io61 counters to the profiler's
+// JSON report; other implementations leave it null.
+extern int (*io61_profile_hook)(char* buf, size_t sz);
+
+// Set by fault-injecting builds of io61.cc (see io61_fault.hh) to reseed
+// their faults from `-r`; other implementations leave it null.
+extern void (*io61_seed_hook)(unsigned seed);
+
+void io61_set_memory_limit(size_t limit);
+
+void io61_checksum_start(io61_file* f);
+uint32_t io61_checksum(io61_file* f);
+
+enum io61_filter_kind {
+    io61_filter_lz4 = 1     // LZ4 block compression
+};
+int io61_push_filter(io61_file* f, int filter);
+
+int io61_share(io61_file* f);
+
+io61_file* io61_tee(io61_file* const* outs, size_t n);
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t sz);
+inline uint32_t crc32c(const void* buf, size_t sz) {
+    return crc32c(0, buf, sz);
+}
+
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
+double monotonic_timestamp();
 
 
 struct io61_args {
@@ -48,7 +196,11 @@ struct io61_args {
     bool exponential = false;           // `-X`: exponential distribution
     unsigned yield = 0;                 // `-y`: yield after output
     bool hint = false;                  // `-H`: make hints
+    size_t batch = 0;                   // `-g`: blocks per read batch
+    size_t threads = 0;                 // `-j`: worker threads
+    bool verbose = false;               // `-v`: report throughput
     size_t as_limit = 0;                // `-A`: address space limit
+    size_t memory_limit = 0;            // `-M`: io61 cache memory limit
     const char* output_file = nullptr;  // `-o`: output file
     const char* input_file = nullptr;   // input file
     std::vector<const char*> input_files;   // all input files
@@ -60,6 +212,8 @@ struct io61_args {
     double delay = 0.0;                 // `-D`: delay
     size_t pipebuf_size = 0;            // `-P`: pipe buffer size
     bool nonblocking = false;           // `-K`: nonblocking
+    bool decompress = false;            // `-z`: decompress input
+    bool compress = false;              // `-Z`: compress output
 
     explicit io61_args(const char* opts, size_t block_size = 0);
 
@@ -0,0 +1,295 @@
+#ifndef IO61_BASIC_HH
+#define IO61_BASIC_HH
+#include "io61.hh"
+#include <cerrno>
+#include <algorithm>
+#include <memory>
+
+// io61::basic_file<Mode, BufSize, Seekable>
+//    A single-buffer io61 file whose open mode (O_RDONLY or O_WRONLY),
+//    cache size (a power of two), and seekability are template arguments
+//    rather than fields of io61_file. Each instantiation compiles only
+//    its own paths: a read-only file has no write members, a stream has
+//    no `seek`, and the buffer arithmetic uses constant sizes and masks.
+//    Seekable files cache `BufSize`-aligned blocks read with pread, so
+//    seeks inside the current block keep it, and write with pwrite at
+//    their own offset; streams read and write at the kernel's position.
+//    `Seekable` must match the file: pread on a pipe fails with ESPIPE.
+//
+//    It does none of io61_file's adaptive work (read slots, mapping,
+//    helper threads, write-back extents); it is for programs that know
+//    their file's shape at compile time. The io61_readc, io61_read, ...
+//    overloads below wrap the members, so code written against the C-style
+//    API compiles with either kind of file.
+
+namespace io61 {
+
+template <int Mode, size_t BufSize = 65536, bool Seekable = true>
+class basic_file {
+    static_assert(Mode == O_RDONLY || Mode == O_WRONLY,
+                  "Mode must be O_RDONLY or O_WRONLY");
+    static_assert(BufSize >= 512 && (BufSize & (BufSize - 1)) == 0,
+                  "BufSize must be a power of two, at least 512");
+
+public:
+    static constexpr bool reading = Mode == O_RDONLY;
+    static constexpr bool seekable = Seekable;
+    static constexpr size_t bufsize = BufSize;
+
+    // basic_file(fd)
+    //    Takes ownership of `fd`, starting at its current position.
+    explicit basic_file(int fd)
+        : fd_(fd), buf_(new unsigned char[BufSize]) {
+        if constexpr (Seekable) {
+            off_t pos = std::max(lseek(fd, 0, SEEK_CUR), off_t(0));
+            if constexpr (reading) {
+                this->seek_to(pos);
+            } else {
+                this->tag_ = pos;
+            }
+        }
+    }
+    basic_file(const basic_file&) = delete;
+    basic_file& operator=(const basic_file&) = delete;
+    ~basic_file() {
+        this->close();
+    }
+
+    int fileno() const {
+        return this->fd_;
+    }
+
+    // readc()
+    //    Returns the next byte, or -1 at end of file or on error.
+    int readc() requires reading {
+        if (this->pos_ < this->end_) {
+            return this->buf_[this->pos_++];
+        }
+        return this->fill() > 0 ? this->buf_[this->pos_++] : -1;
+    }
+
+    // read(buf, sz)
+    //    Reads up to `sz` bytes, fewer only at end of file or on error.
+    //    Returns the number read, or -1 if an error came first.
+    ssize_t read(unsigned char* buf, size_t sz) requires reading {
+        size_t total = 0;
+        while (total != sz) {
+            if (this->pos_ >= this->end_) {
+                ssize_t n = this->fill();
+                if (n <= 0) {
+                    return total > 0 || n == 0 ? (ssize_t) total : -1;
+                }
+            }
+            size_t n = std::min(sz - total, this->end_ - this->pos_);
+            memcpy(buf + total, this->buf_.get() + this->pos_, n);
+            this->pos_ += n;
+            total += n;
+        }
+        return total;
+    }
+
+    // writec(c)
+    //    Writes byte `c`. Returns 0, or -1 on error.
+    int writec(int c) requires (!reading) {
+        if (this->pos_ == BufSize && this->flush() < 0) {
+            return -1;
+        }
+        this->buf_[this->pos_++] = static_cast<unsigned char>(c);
+        return 0;
+    }
+
+    // write(buf, sz)
+    //    Writes `sz` bytes. Returns `sz`, or the number written before an
+    //    error (-1 if none). Writes of a whole buffer or more skip it.
+    ssize_t write(const unsigned char* buf, size_t sz) requires (!reading) {
+        size_t total = 0;
+        while (total != sz) {
+            if (this->pos_ == BufSize
+                || (this->pos_ > 0 && sz - total >= BufSize)) {
+                if (this->flush() < 0) {
+                    return total > 0 ? (ssize_t) total : -1;
+                }
+            }
+            if (sz - total >= BufSize) {
+                ssize_t n = this->write_out(buf + total, sz - total);
+                if (n < 0) {
+                    return total > 0 ? (ssize_t) total : -1;
+                }
+                return total + n;
+            }
+            size_t n = std::min(sz - total, BufSize - this->pos_);
+            memcpy(this->buf_.get() + this->pos_, buf + total, n);
+            this->pos_ += n;
+            total += n;
+        }
+        return total;
+    }
+
+    // flush()
+    //    Writes any buffered bytes. Returns 0, or -1 on error.
+    int flush() {
+        if constexpr (!reading) {
+            size_t n = this->pos_;
+            this->pos_ = 0;
+            if (n > 0 && this->write_out(this->buf_.get(), n) != (ssize_t) n) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // seek(off)
+    //    Moves to offset `off`. Returns 0, or -1 on error.
+    int seek(off_t off) requires Seekable {
+        if (off < 0) {
+            errno = EINVAL;
+            return -1;
+        } else if constexpr (reading) {
+            this->seek_to(off);
+            return 0;
+        } else {
+            int r = this->flush();
+            this->tag_ = off;
+            return r;
+        }
+    }
+
+    // close()
+    //    Flushes and closes the file. Returns 0, or -1 on error.
+    int close() {
+        if (this->fd_ < 0) {
+            return 0;
+        }
+        int r = this->flush();
+        if (::close(this->fd_) < 0) {
+            r = -1;
+        }
+        this->fd_ = -1;
+        return r;
+    }
+
+private:
+    int fd_;
+    std::unique_ptr<unsigned char[]> buf_;
+    // Seekable files: file offset of `buf_[0]`. Reads keep it
+    // `BufSize`-aligned; writes start it at their position.
+    off_t tag_ = 0;
+    size_t pos_ = 0;                // Next byte of `buf_`
+    size_t end_ = 0;                // Read: end of the cached bytes
+
+    // seek_to(off)
+    //    Reading: moves to `off`, keeping the block if it holds `off`.
+    void seek_to(off_t off) {
+        off_t block = off & ~(off_t) (BufSize - 1);
+        if (block != this->tag_ || this->end_ == 0) {
+            this->tag_ = block;
+            this->end_ = 0;
+        }
+        this->pos_ = off - block;
+    }
+
+    // fill()
+    //    Reading: refills `buf_` so `pos_` is on a cached byte. Returns the
+    //    number of bytes cached past `pos_`, 0 at end of file, or -1. A
+    //    short block is the file's last, so it is not read again.
+    ssize_t fill() {
+        if constexpr (Seekable) {
+            if (this->pos_ >= BufSize) {
+                this->tag_ += this->pos_ & ~(BufSize - 1);
+                this->pos_ &= BufSize - 1;
+                this->end_ = 0;
+            } else if (this->end_ > 0 && this->end_ < BufSize) {
+                return 0;
+            }
+        } else {
+            this->pos_ = 0;
+        }
+        ssize_t n;
+        do {
+            if constexpr (Seekable) {
+                n = pread(this->fd_, this->buf_.get(), BufSize, this->tag_);
+            } else {
+                n = ::read(this->fd_, this->buf_.get(), BufSize);
+            }
+        } while (n < 0 && (errno == EINTR || errno == EAGAIN));
+        this->end_ = n > 0 ? n : 0;
+        if (n < 0) {
+            return -1;
+        }
+        return this->pos_ < this->end_ ? this->end_ - this->pos_ : 0;
+    }
+
+    // write_out(buf, sz)
+    //    Writing: writes `sz` bytes at the file position. Returns the
+    //    number written, or -1 if none could be.
+    ssize_t write_out(const unsigned char* buf, size_t sz) {
+        size_t done = 0;
+        while (done != sz) {
+            ssize_t n;
+            if constexpr (Seekable) {
+                n = pwrite(this->fd_, buf + done, sz - done, this->tag_);
+            } else {
+                n = ::write(this->fd_, buf + done, sz - done);
+            }
+            if (n > 0) {
+                done += n;
+                this->tag_ += n;
+            } else if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            } else {
+                break;
+            }
+        }
+        return done > 0 || sz == 0 ? (ssize_t) done : -1;
+    }
+};
+
+// open_check<F>(filename, mode)
+//    Like io61_open_check, but returns a new `F`, a basic_file.
+template <typename F>
+F* open_check(const char* filename, int mode = F::reading ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC) {
+    int fd = fd_open_check(filename, mode);
+    return new F(fd);
+}
+
+}
+
+
+// C-style wrappers, so io61_readc(f) and friends work on basic_files.
+
+template <int M, size_t B, bool S>
+inline int io61_readc(io61::basic_file<M, B, S>* f) {
+    return f->readc();
+}
+template <int M, size_t B, bool S>
+inline ssize_t io61_read(io61::basic_file<M, B, S>* f, unsigned char* buf, size_t sz) {
+    return f->read(buf, sz);
+}
+template <int M, size_t B, bool S>
+inline int io61_writec(io61::basic_file<M, B, S>* f, int c) {
+    return f->writec(c);
+}
+template <int M, size_t B, bool S>
+inline ssize_t io61_write(io61::basic_file<M, B, S>* f, const unsigned char* buf, size_t sz) {
+    return f->write(buf, sz);
+}
+template <int M, size_t B, bool S>
+inline int io61_flush(io61::basic_file<M, B, S>* f) {
+    return f->flush();
+}
+template <int M, size_t B, bool S>
+inline int io61_seek(io61::basic_file<M, B, S>* f, off_t off) {
+    return f->seek(off);
+}
+template <int M, size_t B, bool S>
+inline int io61_fileno(io61::basic_file<M, B, S>* f) {
+    return f->fileno();
+}
+template <int M, size_t B, bool S>
+inline int io61_close(io61::basic_file<M, B, S>* f) {
+    int r = f->close();
+    delete f;
+    return r;
+}
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef IO61_FAULT_HH
+#define IO61_FAULT_HH
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <climits>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// io61_fault.hh
+//    Fault and latency injection for the system calls io61.cc makes to
+//    move data. `fault-*` programs are built from io61.cc with
+//    `-DIO61_FAULTS`, which routes its read, write, pread, pwrite,
+//    readv, writev, preadv, pwritev, and send calls through the
+//    wrappers below. They behave like a slow or flaky device according
+//    to `IO61_FAULTS`, a comma-separated list of settings:
+//
+//        short=P     Shorten a transfer of more than one byte with
+//                    probability P
+//        eintr=P     Fail with EINTR, moving nothing, with probability P
+//        eagain=P    Fail with EAGAIN with probability P (nonblocking
+//                    file descriptors only)
+//        delay=T     Sleep T seconds before every call (`100us`, `2ms`)
+//        bw=N        Also sleep as if moving N bytes per second (`50m`)
+//        seed=S      Seed the decisions (default 61)
+//
+//    For example, `IO61_FAULTS=short=0.3,eintr=0.05,delay=50us`.
+//    Decisions come from one pseudorandom sequence, so a single-threaded
+//    program sees the same faults on every run. `-r SEED` in programs
+//    that take it reseeds the sequence through `io61_seed_hook`. With
+//    `IO61_STATS` set, the injected faults are counted on exit.
+
+struct io61_fault_config {
+    double short_rate = 0;
+    double eintr_rate = 0;
+    double eagain_rate = 0;
+    double delay = 0;               // Seconds per call
+    double bandwidth = 0;           // Bytes per second, or 0
+    std::atomic<uint64_t> state;    // splitmix64 state
+    std::atomic<unsigned long long> calls, shorts, eintrs, eagains;
+    std::atomic<double> slept = 0;
+    bool enabled = false;
+
+    io61_fault_config();
+    ~io61_fault_config();
+
+    // next(): Returns a uniform number in [0, 1).
+    double next() {
+        uint64_t z = this->state.fetch_add(0x9e3779b97f4a7c15ULL,
+                                           std::memory_order_relaxed)
+            + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return (double)(z >> 11) * 0x1.0p-53;
+    }
+};
+
+// io61_fault_parse_time(s, end)
+//    Parses a duration like `2ms`, `100us`, or `0.5` (seconds).
+static double io61_fault_parse_time(const char* s, char** end) {
+    double t = strtod(s, end);
+    if (strncmp(*end, "ns", 2) == 0) {
+        t *= 1e-9, *end += 2;
+    } else if (strncmp(*end, "us", 2) == 0) {
+        t *= 1e-6, *end += 2;
+    } else if (strncmp(*end, "ms", 2) == 0) {
+        t *= 1e-3, *end += 2;
+    } else if (**end == 's') {
+        ++*end;
+    }
+    return t;
+}
+
+inline io61_fault_config::io61_fault_config()
+    : state(61), calls(0), shorts(0), eintrs(0), eagains(0) {
+    const char* s = getenv("IO61_FAULTS");
+    if (!s) {
+        return;
+    }
+    this->enabled = true;
+    while (*s) {
+        const char* eq = strchr(s, '=');
+        if (!eq) {
+            break;
+        }
+        size_t klen = eq - s;
+        char* end;
+        if (klen == 5 && memcmp(s, "short", 5) == 0) {
+            this->short_rate = strtod(eq + 1, &end);
+        } else if (klen == 5 && memcmp(s, "eintr", 5) == 0) {
+            this->eintr_rate = strtod(eq + 1, &end);
+        } else if (klen == 6 && memcmp(s, "eagain", 6) == 0) {
+            this->eagain_rate = strtod(eq + 1, &end);
+        } else if (klen == 5 && memcmp(s, "delay", 5) == 0) {
+            this->delay = io61_fault_parse_time(eq + 1, &end);
+        } else if (klen == 2 && memcmp(s, "bw", 2) == 0) {
+            auto bw = io61_args::parse_size(std::string(eq + 1, strcspn(eq + 1, ",")).c_str());
+            this->bandwidth = bw ? (double)*bw : 0;
+            end = (char*)eq + 1 + strcspn(eq + 1, ",");
+        } else if (klen == 4 && memcmp(s, "seed", 4) == 0) {
+            this->state = strtoull(eq + 1, &end, 0);
+        } else {
+            fprintf(stderr, "IO61_FAULTS: unknown setting `%.*s`\n", (int)klen, s);
+            exit(1);
+        }
+        s = end + (*end == ',');
+    }
+}
+
+inline io61_fault_config::~io61_fault_config() {
+    if (this->enabled && getenv("IO61_STATS")) {
+        fprintf(stderr, "io61: faults: %llu calls, %llu shortened, %llu EINTR, "
+                "%llu EAGAIN; %.6fs injected delay\n",
+                this->calls.load(), this->shorts.load(), this->eintrs.load(),
+                this->eagains.load(), this->slept.load());
+    }
+}
+
+static io61_fault_config io61_faults;
+
+static struct io61_fault_install {
+    io61_fault_install() {
+        io61_seed_hook = [] (unsigned seed) {
+            io61_faults.state = seed;
+        };
+    }
+} io61_fault_installer;
+
+// io61_fault_sleep(t)
+//    Sleeps for `t` seconds.
+static void io61_fault_sleep(double t) {
+    if (t <= 0) {
+        return;
+    }
+    struct timespec ts = {(time_t)t, (long)((t - (time_t)t) * 1e9)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    io61_faults.slept.fetch_add(t, std::memory_order_relaxed);
+}
+
+// io61_fault_begin(fd, sz)
+//    Decides the fate of a call to move `sz` bytes on `fd`. Returns -1
+//    with `errno` set if the call should fail, and otherwise the number
+//    of bytes it should move (`sz` unless shortened).
+static ssize_t io61_fault_begin(int fd, size_t sz) {
+    io61_fault_config& c = io61_faults;
+    if (!c.enabled) {
+        return (ssize_t)sz;
+    }
+    ++c.calls;
+    io61_fault_sleep(c.delay);
+    if (c.eintr_rate > 0 && c.next() < c.eintr_rate) {
+        ++c.eintrs;
+        errno = EINTR;
+        return -1;
+    }
+    if (c.eagain_rate > 0 && c.next() < c.eagain_rate
+        && (fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+        ++c.eagains;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (c.short_rate > 0 && sz > 1 && c.next() < c.short_rate) {
+        ++c.shorts;
+        sz = 1 + (size_t)(c.next() * (double)(sz - 1));
+    }
+    if (c.bandwidth > 0) {
+        io61_fault_sleep((double)sz / c.bandwidth);
+    }
+    return (ssize_t)sz;
+}
+
+// io61_fault_iov(iov, iovcnt, sz, copy)
+//    Fills `copy` with the prefix of the `iovcnt` buffers of `iov` that
+//    holds `sz` bytes (at most all of them) and returns it, setting
+//    `iovcnt` to its length.
+static const struct iovec* io61_fault_iov(const struct iovec* iov, int& iovcnt,
+                                          size_t sz, struct iovec* copy) {
+    int i = 0;
+    for (; i != iovcnt && sz > 0; ++i) {
+        copy[i] = iov[i];
+        if (copy[i].iov_len > sz) {
+            copy[i].iov_len = sz;
+        }
+        sz -= copy[i].iov_len;
+    }
+    iovcnt = i;
+    return copy;
+}
+
+static size_t io61_fault_iov_size(const struct iovec* iov, int iovcnt) {
+    size_t sz = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        sz += iov[i].iov_len;
+    }
+    return sz;
+}
+
+static ssize_t io61_fault_read(int fd, void* buf, size_t sz) {
+    ssize_t n = io61_fault_begin(fd, sz);
+    return n < 0 ? n : read(fd, buf, n);
+}
+
+static ssize_t io61_fault_write(int fd, const void* buf, size_t sz) {
+    ssize_t n = io61_fault_begin(fd, sz);
+    return n < 0 ? n : write(fd, buf, n);
+}
+
+static ssize_t io61_fault_pread(int fd, void* buf, size_t sz, off_t off) {
+    ssize_t n = io61_fault_begin(fd, sz);
+    return n < 0 ? n : pread(fd, buf, n, off);
+}
+
+static ssize_t io61_fault_pwrite(int fd, const void* buf, size_t sz, off_t off) {
+    ssize_t n = io61_fault_begin(fd, sz);
+    return n < 0 ? n : pwrite(fd, buf, n, off);
+}
+
+static ssize_t io61_fault_send(int fd, const void* buf, size_t sz, int flags) {
+    ssize_t n = io61_fault_begin(fd, sz);
+    return n < 0 ? n : send(fd, buf, n, flags);
+}
+
+static ssize_t io61_fault_readv(int fd, const struct iovec* iov, int iovcnt) {
+    struct iovec copy[IOV_MAX];
+    ssize_t n = io61_fault_begin(fd, io61_fault_iov_size(iov, iovcnt));
+    if (n < 0) {
+        return n;
+    }
+    iov = io61_fault_iov(iov, iovcnt, n, copy);
+    return readv(fd, iov, iovcnt);
+}
+
+static ssize_t io61_fault_writev(int fd, const struct iovec* iov, int iovcnt) {
+    struct iovec copy[IOV_MAX];
+    ssize_t n = io61_fault_begin(fd, io61_fault_iov_size(iov, iovcnt));
+    if (n < 0) {
+        return n;
+    }
+    iov = io61_fault_iov(iov, iovcnt, n, copy);
+    return writev(fd, iov, iovcnt);
+}
+
+static ssize_t io61_fault_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+    struct iovec copy[IOV_MAX];
+    ssize_t n = io61_fault_begin(fd, io61_fault_iov_size(iov, iovcnt));
+    if (n < 0) {
+        return n;
+    }
+    iov = io61_fault_iov(iov, iovcnt, n, copy);
+    return preadv(fd, iov, iovcnt, off);
+}
+
+static ssize_t io61_fault_pwritev(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+    struct iovec copy[IOV_MAX];
+    ssize_t n = io61_fault_begin(fd, io61_fault_iov_size(iov, iovcnt));
+    if (n < 0) {
+        return n;
+    }
+    iov = io61_fault_iov(iov, iovcnt, n, copy);
+    return pwritev(fd, iov, iovcnt, off);
+}
+
+#define read(fd, buf, sz) io61_fault_read(fd, buf, sz)
+#define write(fd, buf, sz) io61_fault_write(fd, buf, sz)
+#define pread(fd, buf, sz, off) io61_fault_pread(fd, buf, sz, off)
+#define pwrite(fd, buf, sz, off) io61_fault_pwrite(fd, buf, sz, off)
+#define send(fd, buf, sz, flags) io61_fault_send(fd, buf, sz, flags)
+#define readv(fd, iov, iovcnt) io61_fault_readv(fd, iov, iovcnt)
+#define writev(fd, iov, iovcnt) io61_fault_writev(fd, iov, iovcnt)
+#define preadv(fd, iov, iovcnt, off) io61_fault_preadv(fd, iov, iovcnt, off)
+#define pwritev(fd, iov, iovcnt, off) io61_fault_pwritev(fd, iov, iovcnt, off)
+
+#endif
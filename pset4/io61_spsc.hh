@@ -0,0 +1,138 @@
+#ifndef IO61_SPSC_HH
+#define IO61_SPSC_HH
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+// io61_spsc_ring<T, N>
+//    A bounded single-producer, single-consumer queue of up to `N` items
+//    (a power of two). One thread may push and one other thread may pop,
+//    with no locks: the producer owns `tail` and the consumer owns
+//    `head`, and each side keeps a cached copy of the other's index so it
+//    touches the shared cache line only when its copy says the ring is
+//    full (or empty). The indices sit on separate cache lines so the two
+//    sides do not false-share, and the rarely written sleep flags on a
+//    third.
+//
+//    `push` and `pop` spin briefly when they cannot proceed, then sleep
+//    on the other side's index with std::atomic::wait (a futex on Linux),
+//    so a stalled partner costs no CPU.
+
+template <typename T, size_t N>
+class io61_spsc_ring {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+    // try_push(x)
+    //    Producer: Appends `x` and returns true, or returns false if the
+    //    ring is full.
+    bool try_push(const T& x) {
+        uint32_t t = this->tail.load(std::memory_order_relaxed);
+        if (t - this->head_cache == N) {
+            this->head_cache = this->head.load(std::memory_order_acquire);
+            if (t - this->head_cache == N) {
+                return false;
+            }
+        }
+        this->slots[t % N] = x;
+        // seq_cst orders this store before the `consumer_waiting` check,
+        // pairing with the waiter's store and load in wait_for
+        this->tail.store(t + 1, std::memory_order_seq_cst);
+        if (this->consumer_waiting.load(std::memory_order_seq_cst)) {
+            this->tail.notify_one();
+        }
+        return true;
+    }
+
+    // try_pop(x)
+    //    Consumer: Removes the oldest item into `x` and returns true, or
+    //    returns false if the ring is empty.
+    bool try_pop(T& x) {
+        uint32_t h = this->head.load(std::memory_order_relaxed);
+        if (h == this->tail_cache) {
+            this->tail_cache = this->tail.load(std::memory_order_acquire);
+            if (h == this->tail_cache) {
+                return false;
+            }
+        }
+        x = this->slots[h % N];
+        this->head.store(h + 1, std::memory_order_seq_cst);
+        if (this->producer_waiting.load(std::memory_order_seq_cst)) {
+            this->head.notify_one();
+        }
+        return true;
+    }
+
+    // push(x)
+    //    Producer: Appends `x`, waiting while the ring is full.
+    void push(const T& x) {
+        while (!this->try_push(x)) {
+            uint32_t t = this->tail.load(std::memory_order_relaxed);
+            wait_for(this->head, this->producer_waiting,
+                     [&] (uint32_t h) { return t - h != N; });
+        }
+    }
+
+    // pop()
+    //    Consumer: Removes and returns the oldest item, waiting while the
+    //    ring is empty.
+    T pop() {
+        T x;
+        while (!this->try_pop(x)) {
+            uint32_t h = this->head.load(std::memory_order_relaxed);
+            wait_for(this->tail, this->consumer_waiting,
+                     [&] (uint32_t t) { return t != h; });
+        }
+        return x;
+    }
+
+    // empty()
+    //    Consumer: Returns true if there is nothing to pop.
+    bool empty() const {
+        return this->head.load(std::memory_order_relaxed)
+            == this->tail.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr size_t line = 64;
+
+    // wait_for(index, waiting, ready)
+    //    Waits until `ready(index)`: spins, then announces itself in
+    //    `waiting` and sleeps until the other side moves `index`. With one
+    //    CPU the other side cannot run while this one spins, so it sleeps
+    //    at once.
+    template <typename F>
+    static void wait_for(std::atomic<uint32_t>& index,
+                         std::atomic<bool>& waiting, F ready) {
+        static const int spins = std::thread::hardware_concurrency() > 1 ? 128 : 0;
+        for (int i = 0; i != spins; ++i) {
+            if (ready(index.load(std::memory_order_acquire))) {
+                return;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        waiting.store(true, std::memory_order_seq_cst);
+        uint32_t v = index.load(std::memory_order_seq_cst);
+        while (!ready(v)) {
+            index.wait(v, std::memory_order_acquire);
+            v = index.load(std::memory_order_acquire);
+        }
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+    // Consumer side
+    alignas(line) std::atomic<uint32_t> head = 0;
+    uint32_t tail_cache = 0;
+    // Producer side
+    alignas(line) std::atomic<uint32_t> tail = 0;
+    uint32_t head_cache = 0;
+    // Set while a side sleeps in wait_for, so the other knows to notify
+    alignas(line) std::atomic<bool> consumer_waiting = false;
+    std::atomic<bool> producer_waiting = false;
+    alignas(line) T slots[N];
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "io61.hh"
+
+// Usage: ./iovcat61 [-b MAXBLOCKSIZE] [-r RANDOMSEED] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE with io61_readv and io61_writev.
+//    Each call transfers between 1 and 8 buffers, each of a random size
+//    between 1 and MAXBLOCKSIZE, placed apart in memory; a short read is
+//    written back out from the buffers it filled.
+//    Default MAXBLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:r:o:i:", 4096).set_seed(83419)
+        .parse(argc, argv);
+
+    // Allocate buffers, open files
+    constexpr int maxiov = 8;
+    unsigned char* buf = new unsigned char[maxiov * args.block_size];
+    std::uniform_int_distribution<int> cntdistrib(1, maxiov);
+    std::uniform_int_distribution<size_t> szdistrib(1, args.block_size);
+
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Copy file data
+    while (true) {
+        struct iovec iov[maxiov];
+        int iovcnt = cntdistrib(args.engine);
+        for (int i = 0; i != iovcnt; ++i) {
+            iov[i].iov_base = buf + i * args.block_size;
+            iov[i].iov_len = szdistrib(args.engine);
+        }
+
+        ssize_t nr = io61_readv(inf, iov, iovcnt);
+        if (nr <= 0) {
+            break;
+        }
+
+        // Trim the buffers to the bytes read
+        size_t left = nr;
+        for (int i = 0; i != iovcnt; ++i) {
+            iov[i].iov_len = std::min(iov[i].iov_len, left);
+            left -= iov[i].iov_len;
+        }
+
+        ssize_t nw = io61_writev(outf, iov, iovcnt);
+        assert(nw == nr);
+
+        args.after_write(outf);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
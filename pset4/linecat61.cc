@@ -0,0 +1,59 @@
+#include "io61.hh"
+
+// Usage: ./linecat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE a line at a time, like `cat -n`:
+//    each line is preceded by its number, right-aligned in six columns,
+//    and a tab. Reads lines in place with io61_peekline, or where that
+//    is unsupported, copies them into a BLOCKSIZE buffer with
+//    io61_readline. Either may return a long line in pieces; only the
+//    first piece is numbered.
+//    Default BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:i:", 4096).parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Copy lines
+    bool peek = true;
+    bool at_line_start = true;
+    size_t nlines = 0;
+    while (true) {
+        const unsigned char* line;
+        size_t len;
+        ssize_t nr = -1;
+        if (peek) {
+            nr = io61_peekline(inf, &line, &len);
+            if (nr == -1 && errno == EOPNOTSUPP) {
+                peek = false;
+            }
+        }
+        if (!peek) {
+            nr = io61_readline(inf, buf, args.block_size);
+            line = buf;
+            len = nr;
+        }
+        assert(nr >= 0);
+        if (nr == 0) {
+            break;
+        }
+        assert(size_t(nr) == len && memchr(line, '\n', len - 1) == nullptr);
+
+        if (at_line_start) {
+            ++nlines;
+            io61_printf(outf, "%6zu\t", nlines);
+        }
+        ssize_t nw = io61_write(outf, line, len);
+        assert(nw == nr);
+        at_line_start = line[len - 1] == '\n';
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
@@ -0,0 +1,154 @@
+#include "io61.hh"
+#include <string>
+#include <vector>
+
+// Usage: ./loopcat61 [-b BLOCKSIZE] [-s SIZE] [-K] [-i IFILE | -o OFILE]...
+//    Copies each input IFILE to the matching output OFILE, all at once,
+//    from the callbacks of one io61_loop. An input's callback reads a
+//    block with io61_try_read and offers it to its output with
+//    io61_try_write; bytes the output does not accept wait while the
+//    input is paused (io61_loop_modify) and the output is watched for
+//    writability instead. Each input removes itself from the loop, and
+//    is closed, at end of file. After SIZE bytes in all, the copy stops
+//    early with io61_loop_stop. With `-K`, the files are nonblocking.
+//    Implementations without event loops copy each pair in turn.
+//    Default BLOCKSIZE is 4096.
+
+struct copy_pair {
+    io61_file* inf;
+    io61_file* outf;
+    std::string pending;        // bytes read but not yet written
+};
+
+static io61_loop* loop;
+static std::vector<copy_pair> pairs;
+static unsigned char* buf;
+static size_t block_size;
+static size_t left;             // bytes to copy before stopping
+
+// offer(p, data, sz)
+//    Writes what `p.outf` accepts of the `sz` bytes at `data`. If some
+//    are left, keeps them and waits for `p.outf` rather than `p.inf`.
+
+static void offer(copy_pair& p, const unsigned char* data, size_t sz) {
+    size_t pos = 0;
+    while (pos != sz) {
+        ssize_t nw = io61_try_write(p.outf, data + pos, sz - pos);
+        if (nw < 0) {
+            assert(errno == EAGAIN);
+            break;
+        }
+        assert(nw > 0 && size_t(nw) <= sz - pos);
+        pos += nw;
+    }
+    p.pending.assign(reinterpret_cast<const char*>(data) + pos, sz - pos);
+    if (!p.pending.empty()) {
+        if (p.inf) {
+            io61_loop_modify(loop, p.inf, 0);
+        }
+        io61_loop_modify(loop, p.outf, io61_writable);
+    }
+}
+
+// on_readable(p)
+//    Copies a block from `p.inf`, if one is ready.
+
+static void on_readable(copy_pair& p) {
+    ssize_t nr = io61_try_read(p.inf, buf, std::min(block_size, left));
+    if (nr < 0) {
+        assert(errno == EAGAIN || errno == EINTR);
+        return;
+    } else if (nr == 0) {
+        io61_loop_remove(loop, p.inf);
+        io61_close(p.inf);
+        p.inf = nullptr;
+        return;
+    }
+    left -= nr;
+    offer(p, buf, nr);
+    if (left == 0) {
+        io61_loop_stop(loop);
+    }
+}
+
+// on_writable(p)
+//    Writes `p`'s pending bytes, and resumes reading once they are out.
+
+static void on_writable(copy_pair& p) {
+    std::string data = std::move(p.pending);
+    offer(p, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    if (p.pending.empty()) {
+        io61_loop_modify(loop, p.outf, 0);
+        if (p.inf) {
+            io61_loop_modify(loop, p.inf, io61_readable);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:s:i:o:K##", 4096).parse(argc, argv);
+    if (args.input_files.size() != args.output_files.size()) {
+        args.usage();
+        exit(1);
+    }
+    block_size = args.block_size;
+    left = args.file_size;
+    buf = new unsigned char[block_size];
+
+    // Open files
+    for (size_t i = 0; i != args.input_files.size(); ++i) {
+        copy_pair p;
+        p.inf = io61_open_check(args.input_files[i], O_RDONLY);
+        p.outf = io61_open_check(args.output_files[i],
+                                 O_WRONLY | O_CREAT | O_TRUNC);
+        pairs.push_back(p);
+    }
+
+    loop = io61_loop_new();
+    if (loop) {
+        for (size_t i = 0; i != pairs.size(); ++i) {
+            args.after_open(pairs[i].inf, O_RDONLY);
+            args.after_open(pairs[i].outf, O_WRONLY);
+            int r = io61_loop_add(loop, pairs[i].inf, io61_readable,
+                                  [i] (io61_file*, int) {
+                                      on_readable(pairs[i]);
+                                  });
+            assert(r == 0);
+            r = io61_loop_add(loop, pairs[i].outf, 0,
+                              [i] (io61_file*, int) {
+                                  on_writable(pairs[i]);
+                              });
+            assert(r == 0);
+        }
+        if (left != 0) {
+            int r = io61_loop_run(loop);
+            assert(r == 0);
+        }
+        io61_loop_free(loop);
+    } else {
+        assert(errno == EOPNOTSUPP);
+        for (auto& p : pairs) {
+            ssize_t nr;
+            while (left != 0
+                   && (nr = io61_read(p.inf, buf, std::min(block_size, left))) > 0) {
+                ssize_t nw = io61_write(p.outf, buf, nr);
+                assert(nw == nr);
+                left -= nr;
+            }
+        }
+    }
+
+    // Pending bytes are written even after a stop
+    for (auto& p : pairs) {
+        if (!p.pending.empty()) {
+            ssize_t nw = io61_write(p.outf, reinterpret_cast<const unsigned char*>(p.pending.data()), p.pending.size());
+            assert(nw == ssize_t(p.pending.size()));
+        }
+        if (p.inf) {
+            io61_close(p.inf);
+        }
+        io61_close(p.outf);
+    }
+    delete[] buf;
+}
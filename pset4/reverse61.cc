@@ -1,12 +1,64 @@
 #include "io61.hh"
+#include <vector>
 
-// Usage: ./reverse61 [-s SIZE] [-o OUTFILE] [FILE]
+// Usage: ./reverse61 [-b BLOCKSIZE] [-s SIZE] [-l] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time,
-//    reversing the order of characters in the input.
+//    reversing the order of characters in the input. With `-b`, reads
+//    the input backward BLOCKSIZE bytes at a time instead. With `-l`,
+//    reverses the order of lines, keeping each line's characters in
+//    order, using io61_readline_backward where it is supported.
+
+// read_line_backward(f, pos, line)
+//    Reads into `line` the line of `f` that ends at offset `pos`, which
+//    must be `f`'s position, and returns the line's offset. A `pos` past
+//    `end`, the end of file, reads the last line.
+static off_t read_line_backward(io61_file* f, off_t pos, off_t end,
+                                std::vector<unsigned char>& line) {
+    line.clear();
+    unsigned char buf[4096];
+    while (pos > 0) {
+        ssize_t nr = io61_readline_backward(f, buf, sizeof(buf));
+        if (nr < 0 && errno == EOPNOTSUPP) {
+            // Unsupported: read back a character at a time
+            int r = io61_seek(f, pos - 1);
+            assert(r == 0);
+            int ch = io61_readc(f);
+            if (ch == '\n' && !line.empty()) {
+                break;
+            }
+            if (ch != EOF) {
+                line.insert(line.begin(), ch);
+            }
+            --pos;
+            continue;
+        }
+        assert(nr >= 0);
+        if (nr == 0) {
+            // At the start of the file, perhaps after a position past
+            // its end
+            pos = 0;
+            break;
+        }
+        line.insert(line.begin(), buf, buf + nr);
+        pos = std::min(pos, end) - nr;
+        if (pos == 0 || size_t(nr) < sizeof(buf)) {
+            break;
+        }
+        // A full buffer may have stopped short of the line's start
+        int r = io61_seek(f, pos - 1);
+        int ch = io61_readc(f);
+        r = r == 0 ? io61_seek(f, pos) : r;
+        assert(r == 0 && ch != EOF);
+        if (ch == '\n') {
+            break;
+        }
+    }
+    return pos;
+}
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("s:o:i:qFyA:").parse(argc, argv);
+    io61_args args = io61_args("b:s:o:i:lqFyA:").parse(argc, argv);
 
     // Open files, measure file sizes
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
@@ -25,6 +77,37 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    if (args.read_lines) {
+        std::vector<unsigned char> line;
+        off_t pos = args.file_size;
+        off_t end = io61_filesize(inf);
+        int r = io61_seek(inf, pos);
+        assert(r == 0 || args.quiet);
+        while (pos > 0) {
+            pos = read_line_backward(inf, pos, end < 0 ? pos : end, line);
+            ssize_t nw = io61_write(outf, line.data(), line.size());
+            assert(nw == ssize_t(line.size()));
+            args.after_write(outf);
+        }
+        args.file_size = 0;
+    }
+
+    if (args.block_size != 0) {
+        unsigned char* buf = new unsigned char[args.block_size];
+        int r = io61_seek(inf, args.file_size);
+        assert(r == 0 || args.quiet);
+        while (args.file_size != 0) {
+            ssize_t nr = io61_read_backward(inf, buf,
+                                            std::min(args.block_size, args.file_size));
+            assert(nr > 0);
+            ssize_t nw = io61_write(outf, buf, nr);
+            assert(nw == nr);
+            args.file_size -= nr;
+            args.after_write(outf);
+        }
+        delete[] buf;
+    }
+
     while (args.file_size != 0) {
         --args.file_size;
         int r = io61_seek(inf, args.file_size);
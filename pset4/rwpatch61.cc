@@ -0,0 +1,60 @@
+#include "io61.hh"
+
+// Usage: ./rwpatch61 [-b BLOCKSIZE] [-s COUNT] [-r RANDOMSEED] [-M MEMLIMIT]
+//                    [-o LOGFILE] FILE
+//    Opens FILE, which must be seekable, for reading and writing and
+//    makes COUNT random operations on that one io61_file: seeks to
+//    offsets up to a block past the original end of file, reads of up to
+//    BLOCKSIZE bytes, and writes of up to BLOCKSIZE bytes. Reads and
+//    writes often follow each other without a seek, so reads must see
+//    the bytes just written. Each operation and the bytes each read
+//    returns are logged to LOGFILE; FILE is left patched. `-M` caps the
+//    memory io61 may use, so written data must go out early.
+//    Default BLOCKSIZE is 4096; default COUNT is 1000.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:s:r:o:M:", 4096).set_seed(61045)
+        .parse(argc, argv);
+    size_t count = args.file_size == SIZE_MAX ? 1000 : args.file_size;
+
+    io61_file* f = io61_open_check(args.input_file, O_RDWR);
+    off_t size = io61_filesize(f);
+    if (size < 0 || io61_seek(f, 0) < 0) {
+        fprintf(stderr, "rwpatch61: file is not seekable\n");
+        exit(1);
+    }
+    io61_file* logf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    unsigned char* buf = new unsigned char[args.block_size];
+    std::uniform_int_distribution<int> opdistrib(0, 4);
+    std::uniform_int_distribution<off_t> posdistrib(0, size + args.block_size);
+    std::uniform_int_distribution<size_t> szdistrib(1, args.block_size);
+    for (size_t i = 0; i != count; ++i) {
+        int op = opdistrib(args.engine);
+        if (op == 0) {
+            off_t pos = posdistrib(args.engine);
+            int r = io61_seek(f, pos);
+            assert(r == 0);
+            io61_printf(logf, "seek %lld\n", (long long) pos);
+        } else if (op <= 2) {
+            size_t sz = szdistrib(args.engine);
+            ssize_t nr = io61_read(f, buf, sz);
+            assert(nr >= 0);
+            io61_printf(logf, "read %zu: %zd\n", sz, nr);
+            io61_write(logf, buf, nr);
+        } else {
+            size_t sz = szdistrib(args.engine);
+            memset(buf, 'A' + i % 26, sz);
+            buf[sz - 1] = '\n';
+            ssize_t nw = io61_write(f, buf, sz);
+            assert(nw == ssize_t(sz));
+            io61_printf(logf, "write %zu\n", sz);
+        }
+    }
+
+    io61_close(f);
+    io61_close(logf);
+    delete[] buf;
+}
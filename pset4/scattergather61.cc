@@ -1,29 +1,21 @@
 #include "io61.hh"
 #include <vector>
 
-// Usage: ./scattergather61 [-b BLOCKSIZE] [-i IFILE | -o OFILE]...
+// Usage: ./scattergather61 [-b BLOCKSIZE] [-l] [-M MEMLIMIT]
+//                           [-i IFILE | -o OFILE]...
 //    Copies the input IFILEs to the output OFILEs, alternating
 //    with every block. (I.e., read from IFILE1 and write to OFILE1,
 //    then read from IFILE2 and write to OFILE2, etc. There may be
 //    different numbers of IFILEs and OFILEs.) This is a
 //    "scatter/gather" I/O pattern: input is "gathered" from many
-//    input files and "scattered" to many output files.
+//    input files and "scattered" to many output files. With `-l`, copies
+//    a line at a time (up to BLOCKSIZE bytes). `-M` caps the memory all
+//    the files' caches may use together.
 //    Default BLOCKSIZE is 1.
 
 ssize_t read_line(io61_file* f, unsigned char* buf, size_t sz) {
-    size_t i = 0;
-    while (i != sz) {
-        int ch = io61_readc(f);
-        if (ch == EOF) {
-            break;
-        }
-        buf[i] = ch;
-        ++i;
-        if (ch == '\n') {
-            break;
-        }
-    }
-    return i;
+    ssize_t nr = io61_readline(f, buf, sz);
+    return nr < 0 ? 0 : nr;
 }
 
 ssize_t read_block(io61_file* f, unsigned char* buf, size_t sz) {
@@ -43,7 +35,7 @@ ssize_t read_block(io61_file* f, unsigned char* buf, size_t sz) {
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:i:o:l##", 1).parse(argc, argv);
+    io61_args args = io61_args("b:i:o:lM:##", 1).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
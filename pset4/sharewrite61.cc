@@ -0,0 +1,103 @@
+#include "io61.hh"
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: ./sharewrite61 [-j THREADS] [-o OUTFILE] [FILE]
+//    Copies the lines of the input FILE to OUTFILE from THREADS threads
+//    writing to one io61_file made shared with io61_share. Thread `t`
+//    writes lines `t`, `t + THREADS`, ..., each as one record prefixed
+//    with its line number, so every line appears once but the order of
+//    the threads' records varies from run to run (sort the output to
+//    compare it). A regular OUTFILE is then read back to check that each
+//    record arrived whole and that each thread's records kept their
+//    order. Implementations without shared files serialize the writes
+//    with a mutex.
+//    Default THREADS is 4.
+
+// read_lines(f)
+//    Returns the lines of `f`, each with a newline at its end.
+static std::vector<std::string> read_lines(io61_file* f) {
+    std::string data;
+    unsigned char buf[BUFSIZ];
+    ssize_t nr;
+    while ((nr = io61_read(f, buf, sizeof(buf))) > 0) {
+        data.append(reinterpret_cast<char*>(buf), nr);
+    }
+    assert(nr == 0);
+    std::vector<std::string> lines;
+    for (size_t pos = 0; pos != data.size(); ) {
+        size_t nl = data.find('\n', pos);
+        nl = nl == std::string::npos ? data.size() : nl;
+        lines.push_back(data.substr(pos, nl - pos) + "\n");
+        pos = std::min(nl + 1, data.size());
+    }
+    return lines;
+}
+
+// record(lines, i)
+//    Returns the record for line `i`: its number, a space, and the line.
+static std::string record(const std::vector<std::string>& lines, size_t i) {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%08zu ", i);
+    return prefix + lines[i];
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("j:o:").parse(argc, argv);
+    size_t nthreads = args.threads ? args.threads : 4;
+
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    std::vector<std::string> lines = read_lines(inf);
+    io61_close(inf);
+
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    bool regular = args.output_file && io61_filesize(outf) >= 0;
+    bool shared = io61_share(outf) == 0;
+    if (!shared && errno != EOPNOTSUPP) {
+        perror("sharewrite61: io61_share");
+        exit(1);
+    }
+
+    // Each thread writes its own lines
+    std::mutex write_lock;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t != nthreads; ++t) {
+        workers.emplace_back([&, t] {
+            for (size_t i = t; i < lines.size(); i += nthreads) {
+                std::string r = record(lines, i);
+                std::unique_lock<std::mutex> guard(write_lock, std::defer_lock);
+                if (!shared) {
+                    guard.lock();
+                }
+                ssize_t nw = io61_write(outf, reinterpret_cast<const unsigned char*>(r.data()), r.size());
+                assert(nw == ssize_t(r.size()));
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    io61_close(outf);
+
+    // Read the records back: each must be whole, and each thread's
+    // records must be in order
+    if (regular) {
+        io61_file* checkf = io61_open_check(args.output_file, O_RDONLY);
+        std::vector<std::string> got = read_lines(checkf);
+        io61_close(checkf);
+        assert(got.size() == lines.size());
+        std::vector<bool> seen(lines.size(), false);
+        std::vector<size_t> next(nthreads, 0);
+        for (auto& r : got) {
+            size_t i = strtoul(r.c_str(), nullptr, 10);
+            assert(i < lines.size() && !seen[i] && r == record(lines, i));
+            assert(i >= next[i % nthreads]);
+            seen[i] = true;
+            next[i % nthreads] = i + 1;
+        }
+    }
+}
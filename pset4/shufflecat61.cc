@@ -1,15 +1,18 @@
 #include "io61.hh"
+#include <deque>
 
-// Usage: ./shufflecat61 [-b BLOCKSIZE] [-r RANDOMSEED] [-s SIZE]
-//                       [-o OUTFILE] [FILE]
+// Usage: ./shufflecat61 [-b BLOCKSIZE] [-r RANDOMSEED] [-s SIZE] [-H]
+//                       [-g COUNT] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE in blocks. The blocks are
 //    read in random order, and written in the same order, but
 //    the resulting output file should be the same as the input.
-//    Default BLOCKSIZE is 4096.
+//    Default BLOCKSIZE is 4096. With `-H`, tells the library the
+//    block order ahead of time with io61_hint. With `-g`, reads COUNT
+//    blocks at a time with io61_read_batch, which may reorder them.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:r:s:o:i:A:", 4096).set_seed(83419)
+    io61_args args = io61_args("b:r:s:o:i:A:Hg:", 4096).set_seed(83419)
         .parse(argc, argv);
 
     // Allocate buffer, open files, measure file sizes
@@ -50,13 +53,58 @@ int main(int argc, char* argv[]) {
         blockpos[i] = i;
     }
 
-    // Copy file data
-    while (nblocks != 0) {
-        // Choose block to read
+    // Choose blocks to read, `lookahead` blocks before reading them
+    size_t lookahead = args.hint ? 4 : 1;
+    std::deque<size_t> order;
+    auto choose = [&] () {
         size_t index = blkdistrib(args.engine);
         size_t pos = blockpos[index] * args.block_size;
         blockpos[index] = blockpos[nblocks - 1];
         --nblocks;
+        order.push_back(pos);
+        if (args.hint) {
+            io61_hint(inf, pos, args.block_size, io61_hint_willneed);
+        }
+    };
+    if (args.hint) {
+        io61_hint(inf, 0, 0, io61_hint_random);
+    }
+
+    // Copy file data, in batches if requested
+    if (args.batch != 0) {
+        unsigned char* batchbuf = new unsigned char[args.batch * args.block_size];
+        std::vector<io61_request> reqs;
+        while (nblocks != 0) {
+            reqs.clear();
+            while (nblocks != 0 && reqs.size() < args.batch) {
+                choose();
+                reqs.push_back({off_t(order.back()), args.block_size,
+                                batchbuf + reqs.size() * args.block_size, 0, 0});
+            }
+            order.clear();
+
+            int r = io61_read_batch(inf, reqs.data(), reqs.size());
+            assert(r == 0);
+
+            for (auto& req : reqs) {
+                r = io61_seek(outf, req.off);
+                assert(r == 0);
+
+                ssize_t nw = io61_write(outf, req.buf, req.result);
+                assert(nw == req.result);
+
+                args.after_write(outf);
+            }
+        }
+        delete[] batchbuf;
+    }
+
+    while (nblocks != 0 || !order.empty()) {
+        while (nblocks != 0 && order.size() < lookahead) {
+            choose();
+        }
+        size_t pos = order.front();
+        order.pop_front();
 
         // Transfer that block
         int r = io61_seek(inf, pos);
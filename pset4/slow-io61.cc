@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
 
 // slow-io61.cc
 //    This is a copy of the handout version of io61.cc.
@@ -11,9 +12,11 @@
 // io61_file
 //    Data structure for io61 file wrappers.
 
-struct io61_file {
+struct io61_file : io61_fastbuf {
     int fd = -1;     // file descriptor
     int mode;        // open mode (O_RDONLY or O_WRONLY)
+    unsigned char peek;     // Byte io61_read_window read ahead
+    unsigned char wpeek;    // Byte io61_write_window exposes
 };
 
 
@@ -42,11 +45,13 @@ int io61_close(io61_file* f) {
 }
 
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
-//    which equals -1, on end of file or error.
+//    which equals -1, on end of file or error. This version opens the
+//    io61_fastbuf read window only over a byte io61_read_window read
+//    ahead, so io61_readc calls it for almost every byte.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     unsigned char ch;
     ssize_t nr = read(f->fd, &ch, 1);
     if (nr != 1) {
@@ -60,6 +65,17 @@ int io61_readc(io61_file* f) {
 }
 
 
+// io61_unpeek(f)
+//    Gives back the byte io61_read_window read ahead, if nothing consumed
+//    it, by moving the file position back over it.
+
+static void io61_unpeek(io61_file* f) {
+    if (f->rpos != f->rend) {
+        lseek(f->fd, -1, SEEK_CUR);
+    }
+    f->rpos = f->rend = nullptr;
+}
+
 // io61_read(f, buf, sz)
 //    Reads up to `sz` bytes from `f` into `buf`. Returns the number of
 //    bytes read on success. Returns 0 if end-of-file is encountered before
@@ -86,12 +102,164 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
     return nread;
 }
 
+// io61_read_backward(f, buf, sz)
+//    Reads up to `sz` of the bytes just before `f`'s file position into
+//    `buf` in reverse order and moves the position back past them.
+//    Returns the number of bytes read, 0 at the start of the file, or -1
+//    on error.
+
+ssize_t io61_read_backward(io61_file* f, unsigned char* buf, size_t sz) {
+    io61_unpeek(f);
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    off_t size = io61_filesize(f);
+    if (pos < 0 || size < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    pos = std::min(pos, size);
+    size_t nread = 0;
+    while (nread != sz && pos != 0) {
+        --pos;
+        int ch;
+        if (io61_seek(f, pos) < 0 || (ch = io61_readc(f)) == EOF) {
+            ++pos;
+            break;
+        }
+        buf[nread] = ch;
+        ++nread;
+    }
+    if (io61_seek(f, pos) < 0 || (nread == 0 && pos != 0)) {
+        return -1;
+    }
+    return nread;
+}
+
+// io61_readline(f, buf, sz)
+//    Reads one line from `f` into `buf`, up to and including its newline,
+//    but at most `sz` bytes. Returns the number of bytes read, 0 at end of
+//    file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t i = 0;
+    while (i != sz) {
+        int ch = io61_readc(f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[i] = ch;
+        ++i;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+// io61_peekline(f, start, len)
+//    Reads one line from `f` without copying it; see io61.cc. This
+//    version has no cache to expose: it returns -1 with
+//    `errno == EOPNOTSUPP`.
+
+ssize_t io61_peekline(io61_file* f, const unsigned char** start, size_t* len) {
+    (void) f, (void) start, (void) len;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+// io61_index_lines(f), io61_seek_line(f, n), io61_readline_backward(f, buf, sz)
+//    Line-indexed access; see io61.cc. This version has no line index:
+//    each returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_index_lines(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+off_t io61_seek_line(io61_file* f, long long n) {
+    (void) f, (void) n;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t io61_readline_backward(io61_file* f, unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+// io61_read_window(f, start, len)
+//    Exposes the next byte of `f` at `*start` without consuming it; see
+//    io61.cc. This version reads the byte ahead and opens io61_readc's
+//    window over it, so its windows hold one byte. Returns 1, 0 at end
+//    of file, or -1 on error.
+
+ssize_t io61_read_window(io61_file* f, const unsigned char** start, size_t* len) {
+    if (f->rpos == f->rend) {
+        int ch = io61_readc_slow(f);
+        if (ch == EOF) {
+            return errno != 0 ? -1 : 0;
+        }
+        f->peek = ch;
+        f->rpos = &f->peek;
+        f->rend = &f->peek + 1;
+    }
+    *start = f->rpos;
+    *len = 1;
+    return 1;
+}
+
+// io61_consume(f, n)
+//    Advances past the `n` bytes (0 or 1) of io61_read_window's window.
+
+int io61_consume(io61_file* f, size_t n) {
+    f->rpos += n;
+    return 0;
+}
+
+
+// io61_read_batch(f, reqs, n)
+//    Reads each of the `n` requests in `reqs`, setting its `result` and
+//    `err`; see io61.hh. This version seeks to and reads each request in
+//    offset order. Returns 0 if every request succeeded, and otherwise
+//    -1 with `errno` from the first failed request.
+
+int io61_read_batch(io61_file* f, io61_request* reqs, size_t n) {
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i != n; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+        return reqs[a].off < reqs[b].off;
+    });
+    int first_err = 0;
+    for (size_t i : order) {
+        io61_request& r = reqs[i];
+        r.result = -1;
+        if (io61_seek(f, r.off) == 0) {
+            r.result = io61_read(f, r.buf, r.len);
+        }
+        r.err = (r.result < 0 ? errno : 0);
+        if (r.result < 0 && first_err == 0) {
+            first_err = errno;
+        }
+    }
+    if (first_err != 0) {
+        errno = first_err;
+        return -1;
+    }
+    return 0;
+}
+
 
-// io61_writec(f)
+// io61_writec_slow(f)
 //    Write a single character `c` to `f` (converted to unsigned char).
-//    Returns 0 on success and -1 on error.
+//    Returns 0 on success and -1 on error. Like io61_readc_slow, this
+//    handles every io61_writec call.
 
-int io61_writec(io61_file* f, int c) {
+int io61_writec_slow(io61_file* f, int c) {
     unsigned char ch = c;
     ssize_t nw = write(f->fd, &ch, 1);
     if (nw != 1) {
@@ -124,6 +292,84 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_write_window(f, start, len)
+//    Exposes one byte of space for the next byte of `f`; see io61.cc.
+//    Returns 1.
+
+ssize_t io61_write_window(io61_file* f, unsigned char** start, size_t* len) {
+    *start = &f->wpeek;
+    *len = 1;
+    return 1;
+}
+
+// io61_commit(f, n)
+//    Writes the `n` bytes (0 or 1) of io61_write_window's window.
+//    Returns 0 on success and -1 on error.
+
+int io61_commit(io61_file* f, size_t n) {
+    return n != 0 ? io61_writec_slow(f, f->wpeek) : 0;
+}
+
+// io61_copy(in, out, n)
+//    Copies up to `n` bytes from `in` to `out`; see io61.cc. This version
+//    copies through a buffer with io61_read and io61_write. Returns the
+//    number of bytes copied, or -1 if an error occurred before any were.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    unsigned char buf[BUFSIZ];
+    size_t done = 0;
+    while (done != n) {
+        ssize_t nr = io61_read(in, buf, std::min(sizeof(buf), n - done));
+        if (nr <= 0) {
+            if (nr < 0 && done == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t nw = io61_write(out, buf, nr);
+        if (nw != nr) {
+            return nw > 0 ? ssize_t(done + nw) : (done != 0 ? ssize_t(done) : -1);
+        }
+        done += nr;
+    }
+    return done;
+}
+
+// io61_readv(f, iov, iovcnt), io61_writev(f, iov, iovcnt)
+//    Read into, or write from, the `iovcnt` buffers of `iov` in order; see
+//    io61.cc. This version calls io61_read or io61_write on each buffer,
+//    stopping at the first short transfer.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t n = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nr = io61_read(f, (unsigned char*) iov[i].iov_base, iov[i].iov_len);
+        if (nr < 0) {
+            return n != 0 ? ssize_t(n) : -1;
+        }
+        n += nr;
+        if (size_t(nr) != iov[i].iov_len) {
+            break;
+        }
+    }
+    return n;
+}
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t n = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nw = io61_write(f, (const unsigned char*) iov[i].iov_base, iov[i].iov_len);
+        if (nw < 0) {
+            return n != 0 ? ssize_t(n) : -1;
+        }
+        n += nw;
+        if (size_t(nw) != iov[i].iov_len) {
+            break;
+        }
+    }
+    return n;
+}
+
 // io61_flush(f)
 //    If `f` was opened write-only, `io61_flush(f)` forces a write of any
 //    cached data written to `f`. Returns 0 on success; returns -1 if an error
@@ -138,11 +384,80 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_try_read(f, buf, sz), io61_try_write(f, buf, sz), io61_try_flush(f)
+//    Nonblocking transfers; see io61.cc. This version does not support
+//    them: each returns -1 with `errno == EOPNOTSUPP`.
+
+ssize_t io61_try_read(io61_file* f, unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t io61_try_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_try_flush(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+// io61_loop_new(), io61_loop_free(l), io61_loop_add(l, f, events, callback),
+// io61_loop_modify(l, f, events), io61_loop_remove(l, f), io61_loop_run(l),
+// io61_loop_stop(l)
+//    Event loops; see io61.cc. This version does not support them:
+//    io61_loop_new returns nullptr with `errno == EOPNOTSUPP`, so no loop
+//    reaches the others.
+
+io61_loop* io61_loop_new() {
+    errno = EOPNOTSUPP;
+    return nullptr;
+}
+
+void io61_loop_free(io61_loop* l) {
+    (void) l;
+}
+
+int io61_loop_add(io61_loop* l, io61_file* f, int events, io61_callback callback) {
+    (void) l, (void) f, (void) events, (void) callback;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_modify(io61_loop* l, io61_file* f, int events) {
+    (void) l, (void) f, (void) events;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_remove(io61_loop* l, io61_file* f) {
+    (void) l, (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_run(io61_loop* l) {
+    (void) l;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+void io61_loop_stop(io61_loop* l) {
+    (void) l;
+}
+
+
 // io61_seek(f, off)
 //    Changes the file pointer for file `f` to `off` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t off) {
+    f->rpos = f->rend = nullptr;
     off_t r = lseek(f->fd, (off_t) off, SEEK_SET);
     // Ignore the returned offset unless it’s an error.
     if (r == -1) {
@@ -152,6 +467,80 @@ int io61_seek(io61_file* f, off_t off) {
 }
 
 
+// io61_hint(f, off, len, pattern)
+//    Tells the library how `f` will be read; see io61.hh. This version
+//    ignores hints and returns 0.
+
+int io61_hint(io61_file* f, off_t off, off_t len, int pattern) {
+    (void) f, (void) off, (void) len, (void) pattern;
+    return 0;
+}
+
+// io61_expect_size(f, size)
+//    Tells the library how long write-only file `f` will be; see io61.cc.
+//    This version ignores the hint and returns 0.
+
+int io61_expect_size(io61_file* f, off_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+// io61_set_memory_limit(limit)
+//    Caps io61's cache memory across all files; see io61.cc. This
+//    version has no shared cache pool and ignores the limit.
+
+void io61_set_memory_limit(size_t limit) {
+    (void) limit;
+}
+
+// io61_checksum_start(f), io61_checksum(f)
+//    Checksum the bytes moved through `f`; see io61.cc. This version
+//    keeps no checksum: io61_checksum_start does nothing, and
+//    io61_checksum returns 0 with `errno == EOPNOTSUPP`.
+
+void io61_checksum_start(io61_file* f) {
+    (void) f;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return 0;
+}
+
+// io61_push_filter(f, filter)
+//    Makes `f` a compressed stream; see io61.cc. This version does not
+//    support filters: it returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_push_filter(io61_file* f, int filter) {
+    (void) f, (void) filter;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// io61_share(f)
+//    Lets several threads write to `f`; see io61.cc. This version does
+//    not support sharing: it returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_share(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// io61_tee(outs, n)
+//    Returns a file that writes to each file in `outs`; see io61.cc. This
+//    version does not support tee files: it returns nullptr with
+//    `errno == EOPNOTSUPP`.
+
+io61_file* io61_tee(io61_file* const* outs, size_t n) {
+    (void) outs, (void) n;
+    errno = EOPNOTSUPP;
+    return nullptr;
+}
+
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -8,86 +8,130 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+// socketpipe
+//    Runs a pipeline whose stages are connected by a chosen transport:
+//    loopback TCP connections (`-m tcp`, the default), AF_UNIX stream
+//    socketpairs (`-m unix`), or ordinary pipes (`-m pipe`). `-P SIZE`
+//    sets the socket buffer sizes, or the pipe capacity with
+//    F_SETPIPE_SZ; sockets with a set size also get 1ms send and receive
+//    timeouts, so programs see short reads and writes and EAGAIN.
+
+enum transport { tr_tcp, tr_unix, tr_pipe };
+static transport mode = tr_tcp;
 static int sockbuf = 0;
 
 [[noreturn]] static void usage() {
-    fprintf(stderr, "Usage: ./socketpipe CMD1 ARG... \"|\" CMD2 ARG...\n");
+    fprintf(stderr, "Usage: ./socketpipe [-m tcp|unix|pipe] [-P SIZE] CMD1 ARG... \"|\" CMD2 ARG...\n");
     exit(1);
 }
 
-static void make_child(int& last_sfdr, std::vector<const char*>& args,
-                       bool last) {
-    if (args.empty()) {
-        usage();
+// make_tcp_channel(sfdr, sfdw)
+//    Connects a pair of loopback TCP sockets; data written to `sfdw` can
+//    be read from `sfdr`.
+static void make_tcp_channel(int& sfdr, int& sfdw) {
+    int sfd = socket(AF_INET, SOCK_STREAM, 0), r;
+    if (sfd < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        exit(1);
     }
-    args.push_back(nullptr);
 
-    int sfdr = -1, sfdw = -1, r;
-    if (!last) {
-        int sfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sfd < 0) {
-            fprintf(stderr, "socketpair: %s\n", strerror(errno));
-            exit(1);
-        }
+    sockaddr_in addr_in;
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_port = 0;
+    addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-        sockaddr_in addr_in;
-        addr_in.sin_family = AF_INET;
-        addr_in.sin_port = 0;
-        addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr_in);
 
-        socklen_t addrlen = sizeof(addr_in);
+    r = bind(sfd, (const sockaddr*) &addr_in, addrlen);
+    assert(r == 0);
 
-        r = bind(sfd, (const sockaddr*) &addr_in, addrlen);
-        assert(r == 0);
+    r = listen(sfd, 2);
+    assert(r == 0);
 
-        r = listen(sfd, 2);
-        assert(r == 0);
+    addrlen = sizeof(addr_in);
+    r = getsockname(sfd, (sockaddr*) &addr_in, &addrlen);
+    assert(r == 0);
+    assert(addrlen == sizeof(addr_in));
+    assert(addr_in.sin_family == AF_INET);
+    assert(addr_in.sin_port != 0);
+    assert(addr_in.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
 
-        addrlen = sizeof(addr_in);
-        r = getsockname(sfd, (sockaddr*) &addr_in, &addrlen);
-        assert(r == 0);
-        assert(addrlen == sizeof(addr_in));
-        assert(addr_in.sin_family == AF_INET);
-        assert(addr_in.sin_port != 0);
-        assert(addr_in.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
-
-        sfdr = socket(AF_INET, SOCK_STREAM, 0);
-        assert(sfdr >= 0);
-        r = connect(sfdr, (const sockaddr*) &addr_in, addrlen);
-        assert(r == 0);
+    sfdr = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sfdr >= 0);
+    r = connect(sfdr, (const sockaddr*) &addr_in, addrlen);
+    assert(r == 0);
+
+    sfdw = accept(sfd, nullptr, nullptr);
+    assert(sfdw >= 0);
 
-        sfdw = accept(sfd, nullptr, nullptr);
-        assert(sfdw >= 0);
+    r = close(sfd);
+    assert(r == 0);
+}
+
+// make_channel(sfdr, sfdw)
+//    Creates the transport between two stages in the selected mode.
+static void make_channel(int& sfdr, int& sfdw) {
+    int r;
+    if (mode == tr_pipe) {
+        int pfd[2];
+        if (pipe(pfd) < 0) {
+            fprintf(stderr, "pipe: %s\n", strerror(errno));
+            exit(1);
+        }
+        sfdr = pfd[0];
+        sfdw = pfd[1];
+        if (sockbuf != 0 && fcntl(sfdw, F_SETPIPE_SZ, sockbuf) < 0) {
+            fprintf(stderr, "F_SETPIPE_SZ: %s\n", strerror(errno));
+            exit(1);
+        }
+        return;
+    }
 
-        r = shutdown(sfdr, SHUT_WR);
+    if (mode == tr_tcp) {
+        make_tcp_channel(sfdr, sfdw);
+    } else {
+        int sfd[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sfd) < 0) {
+            fprintf(stderr, "socketpair: %s\n", strerror(errno));
+            exit(1);
+        }
+        sfdr = sfd[0];
+        sfdw = sfd[1];
+    }
+    r = shutdown(sfdr, SHUT_WR);
+    assert(r == 0);
+    r = shutdown(sfdw, SHUT_RD);
+    assert(r == 0);
+
+    if (sockbuf != 0) {
+        int optval = sockbuf;
+        r = setsockopt(sfdw, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
         assert(r == 0);
-        r = shutdown(sfdw, SHUT_RD);
+        optval = sockbuf;
+        r = setsockopt(sfdr, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
         assert(r == 0);
-        r = close(sfd);
+        timeval tv = { 0, 1000 };
+        r = setsockopt(sfdw, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
         assert(r == 0);
+        tv = { 0, 1000 };
+        r = setsockopt(sfdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        assert(r == 0);
+    }
+}
 
-        #if 0
-        r = socketpair(AF_UNIX, SOCK_STREAM, 0, sfd);
-        shutdown(sfd[0], SHUT_WR);
-        shutdown(sfd[1], SHUT_RD);
-        #endif
+static void make_child(int& last_sfdr, std::vector<const char*>& args,
+                       bool last) {
+    if (args.empty()) {
+        usage();
+    }
+    args.push_back(nullptr);
 
-        if (sockbuf != 0) {
-            int optval = sockbuf;
-            r = setsockopt(sfdw, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
-            assert(r == 0);
-            optval = sockbuf;
-            r = setsockopt(sfdr, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
-            assert(r == 0);
-            timeval tv = { 0, 1000 };
-            r = setsockopt(sfdw, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-            assert(r == 0);
-            tv = { 0, 1000 };
-            r = setsockopt(sfdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-            assert(r == 0);
-        }
+    int sfdr = -1, sfdw = -1, r;
+    if (!last) {
+        make_channel(sfdr, sfdw);
     }
 
     pid_t p;
@@ -131,24 +175,38 @@ static void make_child(int& last_sfdr, std::vector<const char*>& args,
 }
 
 int main(int argc, char* argv[]) {
-    // parse `-P` option: socket buffer size
-    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'P') {
-        const char* bufarg;
+    // parse `-m` and `-P` options: transport and buffer size
+    while (argc > 1 && argv[1][0] == '-'
+           && (argv[1][1] == 'm' || argv[1][1] == 'P')) {
+        char opt = argv[1][1];
+        const char* arg;
         if (argv[1][2] != '\0') {
-            bufarg = argv[1] + 2;
+            arg = argv[1] + 2;
             --argc;
             ++argv;
         } else {
-            bufarg = argv[2];
+            arg = argv[2];
             argc -= 2;
             argv += 2;
         }
-        if (!bufarg) {
+        if (!arg) {
             usage();
         }
+        if (opt == 'm') {
+            if (strcmp(arg, "tcp") == 0) {
+                mode = tr_tcp;
+            } else if (strcmp(arg, "unix") == 0) {
+                mode = tr_unix;
+            } else if (strcmp(arg, "pipe") == 0) {
+                mode = tr_pipe;
+            } else {
+                usage();
+            }
+            continue;
+        }
         char* endptr;
-        unsigned long l = strtoul(bufarg, &endptr, 0);
-        if (l > INT_MAX || endptr == bufarg || *endptr) {
+        unsigned long l = strtoul(arg, &endptr, 0);
+        if (l > INT_MAX || endptr == arg || *endptr) {
             usage();
         }
         sockbuf = (int) l;
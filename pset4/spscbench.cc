@@ -0,0 +1,117 @@
+#include "io61.hh"
+#include "io61_spsc.hh"
+#include <cinttypes>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// spscbench.cc
+//    Measures handoff latency through io61_spsc_ring, the queue between
+//    io61 streams and their read-ahead and write-behind threads, against
+//    a mutex and condition variable handoff like the one it replaced.
+//    `ping-pong` bounces one item between two threads through a pair of
+//    queues, so each handoff waits for the last; `stream` pushes items
+//    as fast as the consumer takes them. Every item is checked, so the
+//    benchmark doubles as a test of the ring's ordering.
+
+static bool failed = false;
+
+static void check(uint64_t got, uint64_t expected) {
+    if (got != expected) {
+        fprintf(stderr, "spscbench: got %" PRIu64 ", expected %" PRIu64 "\n",
+                got, expected);
+        failed = true;
+    }
+}
+
+// mutex_queue
+//    A one-item handoff protected by a mutex and condition variable.
+struct mutex_queue {
+    std::mutex m;
+    std::condition_variable cv;
+    uint64_t value;
+    bool full = false;
+
+    void push(uint64_t x) {
+        std::unique_lock<std::mutex> guard(this->m);
+        this->cv.wait(guard, [&] { return !this->full; });
+        this->value = x;
+        this->full = true;
+        this->cv.notify_all();
+    }
+    uint64_t pop() {
+        std::unique_lock<std::mutex> guard(this->m);
+        this->cv.wait(guard, [&] { return this->full; });
+        this->full = false;
+        this->cv.notify_all();
+        return this->value;
+    }
+};
+
+// ping_pong<Q>(n)
+//    Returns the seconds taken to bounce `n` items through two `Q`s.
+template <typename Q>
+static double ping_pong(uint64_t n) {
+    Q* there = new Q;
+    Q* back = new Q;
+    std::thread echo([&] {
+        for (uint64_t i = 0; i != n; ++i) {
+            back->push(there->pop() + 1);
+        }
+    });
+    double start = monotonic_timestamp();
+    for (uint64_t i = 0; i != n; ++i) {
+        there->push(2 * i);
+        check(back->pop(), 2 * i + 1);
+    }
+    double elapsed = monotonic_timestamp() - start;
+    echo.join();
+    delete there;
+    delete back;
+    return elapsed;
+}
+
+// stream<Q>(n)
+//    Returns the seconds taken to pass `n` items through one `Q`.
+template <typename Q>
+static double stream(uint64_t n) {
+    Q* q = new Q;
+    double start = monotonic_timestamp();
+    std::thread consumer([&] {
+        for (uint64_t i = 0; i != n; ++i) {
+            check(q->pop(), i);
+        }
+    });
+    for (uint64_t i = 0; i != n; ++i) {
+        q->push(i);
+    }
+    consumer.join();
+    double elapsed = monotonic_timestamp() - start;
+    delete q;
+    return elapsed;
+}
+
+static void report(const char* name, uint64_t n, unsigned handoffs, double elapsed) {
+    printf("%-18s %10" PRIu64 " items %9.1f ns/handoff\n",
+           name, n, elapsed * 1e9 / ((double)n * handoffs));
+}
+
+int main(int argc, char** argv) {
+    uint64_t n = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n' && io61_args::parse_size(optarg)) {
+            n = *io61_args::parse_size(optarg);
+        } else {
+            fprintf(stderr, "Usage: ./spscbench [-n COUNT]\n");
+            exit(1);
+        }
+    }
+
+    using spsc = io61_spsc_ring<uint64_t, 64>;
+    report("spsc ping-pong", n, 2, ping_pong<spsc>(n));
+    report("mutex ping-pong", n, 2, ping_pong<mutex_queue>(n));
+    report("spsc stream", 10 * n, 1, stream<spsc>(10 * n));
+    report("mutex stream", n, 1, stream<mutex_queue>(n));
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#include "io61.hh"
+
+// Usage: ./sumcat61 [-b MAXBLOCKSIZE] [-r RANDOMSEED] [-v] [-o OUTFILE]
+//                   [FILE]
+//    Copies the input FILE to OUTFILE with checksums started on both
+//    files by io61_checksum_start. Each step copies a random number of
+//    bytes, between 1 and MAXBLOCKSIZE, with io61_readc and io61_writec,
+//    io61_read and io61_write, or, for a regular FILE, io61_copy. Computes its own CRC-32C of
+//    the bytes copied and checks that io61_checksum reports it for both
+//    files; with `-v`, prints it on stderr. Implementations without
+//    checksums skip the check.
+//    Default MAXBLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:r:o:i:v", 4096).set_seed(50050)
+        .parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    bool regular = io61_filesize(inf) >= 0;
+    std::uniform_int_distribution<int> howdistrib(0, regular ? 2 : 1);
+    std::uniform_int_distribution<size_t> szdistrib(1, args.block_size);
+    io61_checksum_start(inf);
+    io61_checksum_start(outf);
+
+    // Copy file data
+    uint32_t crc = 0;
+    off_t pos = 0;
+    bool eof = false;
+    while (!eof) {
+        int how = howdistrib(args.engine);
+        size_t sz = szdistrib(args.engine);
+        if (how == 0) {
+            for (size_t i = 0; i != sz; ++i) {
+                int ch = io61_readc(inf);
+                if (ch == EOF) {
+                    eof = true;
+                    break;
+                }
+                unsigned char c = ch;
+                crc = crc32c(crc, &c, 1);
+                ++pos;
+                int r = io61_writec(outf, ch);
+                assert(r == 0);
+            }
+        } else if (how == 1) {
+            ssize_t nr = io61_read(inf, buf, sz);
+            assert(nr >= 0);
+            eof = nr == 0;
+            crc = crc32c(crc, buf, nr);
+            pos += nr;
+            ssize_t nw = io61_write(outf, buf, nr);
+            assert(nw == nr);
+        } else {
+            // io61_copy's bytes do not pass through `buf`, so read them
+            // back from the input to checksum them
+            ssize_t nc = io61_copy(inf, outf, sz);
+            assert(nc >= 0);
+            eof = nc == 0;
+            ssize_t nr = pread(io61_fileno(inf), buf, nc, pos);
+            assert(nr == nc);
+            crc = crc32c(crc, buf, nr);
+            pos += nr;
+        }
+    }
+
+    // Check the library's checksums
+    errno = 0;
+    uint32_t incrc = io61_checksum(inf);
+    if (incrc != 0 || errno != EOPNOTSUPP) {
+        uint32_t outcrc = io61_checksum(outf);
+        assert(incrc == crc && outcrc == crc);
+    }
+    if (args.verbose) {
+        fprintf(stderr, "sumcat61: crc32c %08x\n", crc);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
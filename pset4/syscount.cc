@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <map>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// syscount.cc
+//    Runs a command under ptrace and counts the system calls made by its
+//    `*61` test programs, plus the bytes they move through read- and
+//    write-type calls. Other processes the command starts (the shell,
+//    `cat` in a pipeline) are traced but not counted. `make bench` uses
+//    this to compare io61 implementations by system call count.
+
+enum syscount_kind {
+    sc_read, sc_write, sc_copy, sc_seek, sc_mem, sc_other, sc_nkinds
+};
+static const char* const kind_names[sc_nkinds] = {
+    "read_calls", "write_calls", "copy_calls", "seek_calls", "mem_calls",
+    "other_calls"
+};
+
+static syscount_kind classify(long nr) {
+    switch (nr) {
+    case SYS_read:
+    case SYS_pread64:
+    case SYS_readv:
+    case SYS_preadv:
+    case SYS_preadv2:
+        return sc_read;
+    case SYS_write:
+    case SYS_pwrite64:
+    case SYS_writev:
+    case SYS_pwritev:
+    case SYS_pwritev2:
+        return sc_write;
+    case SYS_copy_file_range:
+    case SYS_sendfile:
+    case SYS_splice:
+        return sc_copy;
+    case SYS_lseek:
+        return sc_seek;
+    case SYS_mmap:
+    case SYS_munmap:
+    case SYS_mremap:
+    case SYS_madvise:
+    case SYS_brk:
+        return sc_mem;
+    default:
+        return sc_other;
+    }
+}
+
+struct tracee {
+    bool counting = false;      // Running a `*61` program
+    bool seen = false;          // Has stopped at least once
+    syscount_kind kind = sc_other;  // Kind of the current system call
+};
+
+static std::map<pid_t, tracee> tracees;
+static unsigned long long counts[sc_nkinds];
+static unsigned long long bytes_read, bytes_written;
+
+// is_test_program(pid)
+//    Returns true if `pid` is running a program whose name ends in `61`.
+static bool is_test_program(pid_t pid) {
+    char path[64], exe[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/exe", (int) pid);
+    ssize_t n = readlink(path, exe, sizeof(exe) - 1);
+    return n >= 2 && exe[n - 2] == '6' && exe[n - 1] == '1';
+}
+
+// syscall_stop(pid, t)
+//    Handles a system call entry or exit stop of tracee `pid`.
+static void syscall_stop(pid_t pid, tracee& t) {
+    struct __ptrace_syscall_info info;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0) {
+        return;
+    }
+    if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        t.kind = classify((long) info.entry.nr);
+        counts[t.kind] += t.counting;
+    } else if (info.op == PTRACE_SYSCALL_INFO_EXIT
+               && t.counting && !info.exit.is_error && info.exit.rval > 0) {
+        if (t.kind == sc_read || t.kind == sc_copy) {
+            bytes_read += info.exit.rval;
+        }
+        if (t.kind == sc_write || t.kind == sc_copy) {
+            bytes_written += info.exit.rval;
+        }
+    }
+}
+
+[[noreturn]] static void usage() {
+    fprintf(stderr, "Usage: ./syscount [-o FILE] COMMAND [ARG...]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* outfile = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "+o:")) != -1) {
+        if (opt == 'o') {
+            outfile = optarg;
+        } else {
+            usage();
+        }
+    }
+    if (optind == argc) {
+        usage();
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        raise(SIGSTOP);
+        execvp(argv[optind], argv + optind);
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        _exit(127);
+    } else if (child < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+        fprintf(stderr, "syscount: child did not stop\n");
+        exit(1);
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC
+        | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE
+        | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, child, nullptr, options) < 0) {
+        fprintf(stderr, "ptrace: %s\n", strerror(errno));
+        exit(1);
+    }
+    tracees[child].seen = true;
+    ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+
+    int exit_status = 1;
+    while (!tracees.empty()) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child) {
+                exit_status = WIFEXITED(status) ? WEXITSTATUS(status)
+                    : 128 + WTERMSIG(status);
+            }
+            tracees.erase(pid);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        tracee& t = tracees[pid];
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        int deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            syscall_stop(pid, t);
+        } else if (event == PTRACE_EVENT_EXEC) {
+            t.counting = is_test_program(pid);
+        } else if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK
+                   || event == PTRACE_EVENT_CLONE) {
+            // New processes and threads inherit their parent's counting
+            unsigned long newpid;
+            ptrace(PTRACE_GETEVENTMSG, pid, nullptr, &newpid);
+            tracees[(pid_t) newpid].counting = t.counting;
+        } else if (event != 0) {
+            // Other ptrace events need no handling
+        } else if (sig == SIGSTOP && !t.seen) {
+            // A new tracee's initial stop
+        } else {
+            deliver = sig;
+        }
+        t.seen = true;
+        ptrace(PTRACE_SYSCALL, pid, nullptr, (void*) (long) deliver);
+    }
+
+    unsigned long long total = 0;
+    for (int k = 0; k != sc_nkinds; ++k) {
+        total += counts[k];
+    }
+    FILE* out = stderr;
+    if (outfile && !(out = fopen(outfile, "w"))) {
+        fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+        exit(1);
+    }
+    fprintf(out, "{\"syscalls\":%llu", total);
+    for (int k = 0; k != sc_nkinds; ++k) {
+        fprintf(out, ", \"%s\":%llu", kind_names[k], counts[k]);
+    }
+    fprintf(out, ", \"bytes_read\":%llu, \"bytes_written\":%llu}\n",
+            bytes_read, bytes_written);
+    if (out != stderr) {
+        fclose(out);
+    }
+    return exit_status;
+}
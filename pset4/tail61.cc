@@ -0,0 +1,67 @@
+#include "io61.hh"
+
+// Usage: ./tail61 [-s NLINES] [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+//    Copies the last NLINES lines of the input FILE, which must be
+//    seekable, to OUTFILE in blocks. Finds them with io61_seek_line, or
+//    where that is unsupported, by counting lines a character at a time.
+//    Default NLINES is 10; default BLOCKSIZE is 4096.
+
+// seek_line_slow(f, n)
+//    Moves `f` to the start of its `n`th line from the end, like
+//    io61_seek_line(f, -n), reading it twice a character at a time.
+static void seek_line_slow(io61_file* f, size_t n) {
+    size_t nlines = 0;
+    int ch, last = '\n';
+    while ((ch = io61_readc(f)) != EOF) {
+        nlines += ch == '\n';
+        last = ch;
+    }
+    nlines += last != '\n';
+    int r = io61_seek(f, 0);
+    assert(r == 0);
+    for (size_t skip = nlines > n ? nlines - n : 0; skip != 0; ) {
+        ch = io61_readc(f);
+        assert(ch != EOF);
+        skip -= ch == '\n';
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("s:b:o:i:Fy", 4096).parse(argc, argv);
+    size_t nlines = args.file_size == SIZE_MAX ? 10 : args.file_size;
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    if (io61_seek(inf, 0) < 0) {
+        fprintf(stderr, "tail61: input file is not seekable\n");
+        exit(1);
+    }
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    args.after_open();
+
+    // Find the first line to copy
+    if (nlines == 0) {
+        io61_seek(inf, io61_filesize(inf));
+    } else if (io61_seek_line(inf, -(long long) nlines) < 0) {
+        assert(errno == EOPNOTSUPP);
+        seek_line_slow(inf, nlines);
+    }
+
+    // Copy file data
+    while (true) {
+        ssize_t nr = io61_read(inf, buf, args.block_size);
+        if (nr <= 0) {
+            break;
+        }
+        ssize_t nw = io61_write(outf, buf, nr);
+        assert(nw == nr);
+        args.after_write(outf);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
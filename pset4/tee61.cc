@@ -0,0 +1,56 @@
+#include "io61.hh"
+#include <vector>
+
+// Usage: ./tee61 [-b BLOCKSIZE] [-o OFILE]... [FILE]...
+//    Copies the input FILEs in order, in blocks, to every OFILE (or to
+//    standard output if there are none) through one io61_tee file, so
+//    each block is copied once however many outputs there are.
+//    Implementations without tee files write each block to every output
+//    in turn.
+//    Default BLOCKSIZE is 4096.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:i:D:Fy##", 4096).parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    std::vector<io61_file*> outfs;
+    for (auto filename : args.output_files) {
+        outfs.push_back(io61_open_check(filename, O_WRONLY | O_CREAT | O_TRUNC));
+    }
+    io61_file* teef = io61_tee(outfs.data(), outfs.size());
+    args.after_open();
+
+    // Copy file data
+    for (auto filename : args.input_files) {
+        io61_file* inf = io61_open_check(filename, O_RDONLY);
+        while (true) {
+            ssize_t nr = io61_read(inf, buf, args.block_size);
+            if (nr <= 0) {
+                break;
+            }
+
+            if (teef) {
+                ssize_t nw = io61_write(teef, buf, nr);
+                assert(nw == nr);
+                args.after_write(teef);
+            } else {
+                for (auto f : outfs) {
+                    ssize_t nw = io61_write(f, buf, nr);
+                    assert(nw == nr);
+                    args.after_write(f);
+                }
+            }
+        }
+        io61_close(inf);
+    }
+
+    if (teef) {
+        io61_close(teef);
+    }
+    for (auto f : outfs) {
+        io61_close(f);
+    }
+    delete[] buf;
+}
@@ -0,0 +1,88 @@
+#include "io61.hh"
+#include <poll.h>
+
+// Usage: ./trycat61 [-b BLOCKSIZE] [-K] [-P BUFSIZ] [-v] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE in blocks with io61_try_read,
+//    io61_try_write, and io61_try_flush, which never wait for a
+//    nonblocking stream. When one reports EAGAIN, polls the file's
+//    descriptor and tries again. Checks that no call transfers more than
+//    it was asked to and that every byte read is written; with `-v`,
+//    reports how many calls were short or got EAGAIN on stderr.
+//    Implementations without these calls copy with io61_read and
+//    io61_write, leaving the files blocking.
+//    Default BLOCKSIZE is 4096.
+
+// wait_for(f, events)
+//    Waits until `f`'s file descriptor is ready for `events`.
+static void wait_for(io61_file* f, short events) {
+    struct pollfd pfd = {io61_fileno(f), events, 0};
+    int r = poll(&pfd, 1, -1);
+    assert(r == 1 || (r == -1 && errno == EINTR));
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:i:P:Kv", 4096).parse(argc, argv);
+
+    // Allocate buffer, open files
+    unsigned char* buf = new unsigned char[args.block_size];
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    bool supported = io61_try_flush(outf) == 0 || errno != EOPNOTSUPP;
+    if (supported) {
+        args.after_open(inf, O_RDONLY);
+        args.after_open(outf, O_WRONLY);
+    }
+
+    // Copy file data
+    size_t nread = 0, nwritten = 0;
+    size_t nshort_read = 0, nagain_read = 0, nshort_write = 0, nagain_write = 0;
+    while (true) {
+        ssize_t nr = supported ? io61_try_read(inf, buf, args.block_size)
+            : io61_read(inf, buf, args.block_size);
+        if (nr == -1 && errno == EAGAIN) {
+            ++nagain_read;
+            wait_for(inf, POLLIN);
+            continue;
+        }
+        assert(nr >= 0 && size_t(nr) <= args.block_size);
+        if (nr == 0) {
+            break;
+        }
+        nread += nr;
+        nshort_read += size_t(nr) < args.block_size;
+
+        ssize_t pos = 0;
+        while (pos != nr) {
+            ssize_t nw = supported ? io61_try_write(outf, buf + pos, nr - pos)
+                : io61_write(outf, buf + pos, nr - pos);
+            if (nw == -1 && errno == EAGAIN) {
+                ++nagain_write;
+                wait_for(outf, POLLOUT);
+                continue;
+            }
+            assert(nw > 0 && nw <= nr - pos);
+            nshort_write += nw < nr - pos;
+            pos += nw;
+        }
+        nwritten += pos;
+    }
+    assert(nwritten == nread);
+
+    while (supported && io61_try_flush(outf) != 0) {
+        assert(errno == EAGAIN);
+        ++nagain_write;
+        wait_for(outf, POLLOUT);
+    }
+
+    if (args.verbose) {
+        fprintf(stderr, "trycat61: %zu bytes, reads %zu short %zu EAGAIN, "
+                "writes %zu short %zu EAGAIN\n", nread, nshort_read,
+                nagain_read, nshort_write, nagain_write);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    delete[] buf;
+}
@@ -0,0 +1,1251 @@
+#include "io61.hh"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <climits>
+#include <algorithm>
+#include <cerrno>
+
+// uring-io61.cc
+//    This version of io61.cc does its I/O through io_uring. Each file
+//    keeps a pool of block buffers registered with its ring. Reads fetch
+//    aligned blocks and queue read-ahead for the blocks that follow;
+//    writes fill a block and queue it without waiting, so many block
+//    requests can be in flight. Queued requests are submitted together,
+//    with one io_uring_enter, when the file has to wait for one of them.
+//    If the kernel refuses io_uring, requests run synchronously instead.
+//
+//    Regular files opened with O_DIRECT in io61_open_check's mode, or any
+//    regular file when the `IO61_DIRECT` environment variable is set, are
+//    read and written around the page cache (see io61_direct_start).
+
+
+// io61_ring
+//    An io_uring instance and its mapped submission and completion queues.
+
+struct io61_ring {
+    int fd = -1;                    // Ring file descriptor (-1 if none)
+    unsigned entries = 0;           // # submission queue entries
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    void* sq_ptr = nullptr;         // Mapped rings
+    size_t sq_len = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_len = 0;
+    size_t sqes_len = 0;
+    unsigned queued = 0;            // # entries not yet submitted
+};
+
+// io61_block_state
+//    States of a block buffer.
+enum io61_block_state {
+    io61_free,          // Holds nothing
+    io61_reading,       // Read in flight
+    io61_ready,         // Holds file data (read mode)
+    io61_filling,       // Collecting written bytes (write mode)
+    io61_writing        // Write in flight
+};
+
+// io61_block
+//    One registered buffer. In read mode, a ready block holds `len` bytes
+//    of the file starting at `off`; `len < bufsize` means end of file.
+//    In write mode, it holds `len` bytes to be written at `off`, of which
+//    `done` have been written.
+struct io61_block {
+    int state = io61_free;
+    off_t off = 0;
+    size_t len = 0;
+    size_t done = 0;
+    int err = 0;                    // Read error, if any
+    unsigned long long used = 0;    // Last use, for LRU replacement
+};
+
+// io61_file
+//    Data structure for io61 file wrappers.
+
+struct io61_file : io61_fastbuf {
+    int fd = -1;        // File descriptor
+    int mode;           // Open mode (O_RDONLY or O_WRONLY)
+    bool seekable = false;
+    off_t size = -1;    // Size of a regular read-only file, or -1
+    bool direct = false;        // `fd` is in O_DIRECT mode
+
+    static constexpr size_t bufsize = 65536;
+    static constexpr int nblocks = 16;
+    static constexpr int readahead = 4;     // # blocks read ahead
+    static constexpr unsigned batch = 8;    // Writes queued before submitting
+    static constexpr size_t direct_align = 4096;    // O_DIRECT alignment
+
+    io61_ring ring;
+    bool registered = false;    // `mem` is registered with the ring
+    unsigned char* mem;         // `nblocks` buffers of `bufsize` bytes
+    io61_block blocks[nblocks];
+    int inflight = 0;           // # block requests in flight
+    unsigned long long clock = 0;
+
+    off_t pos = 0;              // File position
+    int cur = -1;               // Block holding `pos` (read), or filling (write)
+    off_t last_block = -1;      // Offset of the previous block read
+    off_t stream_end = 0;       // Stream offset of the next read's data
+    bool stream_eof = false;    // Stream reached end of file
+    int err = 0;                // First failed write's error
+};
+
+static constexpr __u64 io61_cancel_tag = ~(__u64) 0;
+
+
+// io61_ring_setup(r, entries)
+//    Creates an io_uring with `entries` submission slots and maps its
+//    queues. Returns 0 on success and -1 on failure.
+
+static int io61_ring_setup(io61_ring* r, unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        r->sq_len = r->cq_len = std::max(r->sq_len, r->cq_len);
+    }
+    r->sq_ptr = mmap(nullptr, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    r->cq_ptr = r->sq_ptr;
+    if (!single) {
+        r->cq_ptr = mmap(nullptr, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, r->sqes_len);
+        }
+        if (r->cq_ptr != MAP_FAILED && !single) {
+            munmap(r->cq_ptr, r->cq_len);
+        }
+        munmap(r->sq_ptr, r->sq_len);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = (char*) r->sq_ptr;
+    char* cq = (char*) r->cq_ptr;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->sqes = (io_uring_sqe*) sqes;
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    r->fd = fd;
+    return 0;
+}
+
+// io61_ring_teardown(r)
+//    Unmaps and closes ring `r`.
+
+static void io61_ring_teardown(io61_ring* r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+// io61_ring_enter(r, wait)
+//    Submits `r`'s queued entries and, if `wait`, waits for at least one
+//    completion. Returns 0 on success and -1 on error.
+
+static int io61_ring_enter(io61_ring* r, bool wait) {
+    while (r->queued > 0 || wait) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            return -1;
+        }
+        r->queued -= (unsigned) n;
+        wait = false;
+    }
+    return 0;
+}
+
+// io61_ring_sqe(r)
+//    Returns a cleared submission queue entry of `r`, to be queued by
+//    io61_ring_push.
+
+static io_uring_sqe* io61_ring_sqe(io61_ring* r) {
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries) {
+        io61_ring_enter(r, false);
+    }
+    io_uring_sqe* sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// io61_ring_push(r, sqe)
+//    Queues `sqe`, obtained from io61_ring_sqe, for submission.
+
+static void io61_ring_push(io61_ring* r, io_uring_sqe* sqe) {
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    assert(sqe == &r->sqes[i]);
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+}
+
+
+static void io61_complete(io61_file* f, int i, ssize_t res);
+
+// io61_direct_unaligned_write(f, buf, sz, off)
+//    Writes `sz` bytes from `buf` at `off` with O_DIRECT briefly turned off,
+//    for the unaligned edges of an O_DIRECT file. Returns a byte count or
+//    negative error code, like a completion.
+
+static ssize_t io61_direct_unaligned_write(io61_file* f, const unsigned char* buf,
+                                           size_t sz, off_t off) {
+    int flags = fcntl(f->fd, F_GETFL);
+    if (flags < 0 || fcntl(f->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+        return -errno;
+    }
+    ssize_t n = pwrite(f->fd, buf, sz, off);
+    int err = errno;
+    fcntl(f->fd, F_SETFL, flags);
+    return n < 0 ? -err : n;
+}
+
+// io61_submit(f, i)
+//    Queues the read or write for block `i` of `f`, which must be in state
+//    io61_reading or io61_writing. Writes continue after their `done`
+//    bytes. Without a ring, the request runs synchronously.
+
+static void io61_submit(io61_file* f, int i) {
+    io61_block& b = f->blocks[i];
+    unsigned char* buf = f->mem + i * io61_file::bufsize;
+    bool rd = b.state == io61_reading;
+    size_t sz = rd ? io61_file::bufsize : b.len - b.done;
+    off_t off = rd ? b.off : b.off + (off_t) b.done;
+    if (!rd) {
+        buf += b.done;
+    }
+    ++f->inflight;
+
+    if (f->direct && !rd) {
+        // O_DIRECT needs aligned offsets, addresses, and lengths. Write
+        // the aligned part of the block directly; its completion submits
+        // the rest, which, like a block starting at an unaligned offset
+        // (after a seek), is written now through the page cache.
+        size_t mask = io61_file::direct_align - 1;
+        if ((off & mask) != 0 || (b.done & mask) != 0 || sz <= mask) {
+            io61_complete(f, i, io61_direct_unaligned_write(f, buf, sz, off));
+            return;
+        }
+        sz &= ~mask;
+    }
+
+    if (f->ring.fd < 0) {
+        ssize_t n;
+        if (f->seekable) {
+            n = rd ? pread(f->fd, buf, sz, off) : pwrite(f->fd, buf, sz, off);
+        } else {
+            n = rd ? read(f->fd, buf, sz) : write(f->fd, buf, sz);
+        }
+        io61_complete(f, i, n < 0 ? -errno : n);
+        return;
+    }
+
+    io_uring_sqe* sqe = io61_ring_sqe(&f->ring);
+    if (f->registered) {
+        sqe->opcode = rd ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = i;
+    } else {
+        sqe->opcode = rd ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = f->fd;
+    sqe->addr = (__u64) (uintptr_t) buf;
+    sqe->len = sz;
+    sqe->off = f->seekable ? (__u64) off : (__u64) -1;
+    sqe->user_data = i;
+    io61_ring_push(&f->ring, sqe);
+}
+
+// io61_complete(f, i, res)
+//    Handles the completion of block `i`'s request with result `res`
+//    (a byte count or negative error code).
+
+static void io61_complete(io61_file* f, int i, ssize_t res) {
+    io61_block& b = f->blocks[i];
+    --f->inflight;
+    if (res == -EINTR || res == -EAGAIN) {
+        io61_submit(f, i);
+    } else if (b.state == io61_reading) {
+        if (res == -ECANCELED) {
+            b.state = io61_free;
+            return;
+        }
+        b.state = io61_ready;
+        b.len = res > 0 ? (size_t) res : 0;
+        b.err = res < 0 ? (int) -res : 0;
+        if (!f->seekable) {
+            // Stream blocks get offsets in the order they arrive
+            b.off = f->stream_end;
+            f->stream_end += b.len;
+            f->stream_eof = res <= 0;
+        }
+    } else if (res > 0) {
+        b.done += res;
+        if (b.done < b.len) {
+            io61_submit(f, i);
+        } else {
+            b.state = io61_free;
+        }
+    } else {
+        if (f->err == 0) {
+            f->err = res < 0 ? (int) -res : EIO;
+        }
+        b.state = io61_free;
+    }
+}
+
+// io61_wait(f)
+//    Submits queued requests, waits for at least one request to finish,
+//    and handles all available completions.
+
+static void io61_wait(io61_file* f) {
+    if (f->inflight == 0 || f->ring.fd < 0) {
+        return;
+    }
+    io61_ring* r = &f->ring;
+    if (io61_ring_enter(r, true) < 0) {
+        perror("io_uring_enter");
+        abort();
+    }
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        __u64 tag = cqe->user_data;
+        int res = cqe->res;
+        ++head;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (tag != io61_cancel_tag) {
+            io61_complete(f, (int) tag, res);
+        }
+    }
+}
+
+// io61_get_block(f, wait, keep)
+//    Returns a block of `f` that can be reused: a free block, or else the
+//    least recently used ready block other than `keep`. If none is
+//    available, waits for one if `wait` is true, and otherwise returns -1.
+
+static int io61_get_block(io61_file* f, bool wait, int keep) {
+    while (true) {
+        int victim = -1;
+        for (int i = 0; i != io61_file::nblocks; ++i) {
+            io61_block& b = f->blocks[i];
+            if (b.state == io61_free) {
+                return i;
+            } else if (b.state == io61_ready && i != keep
+                       && (victim < 0 || b.used < f->blocks[victim].used)) {
+                victim = i;
+            }
+        }
+        if (victim >= 0 || !wait) {
+            return victim;
+        }
+        io61_wait(f);
+    }
+}
+
+// io61_find_block(f, off)
+//    Returns the read-mode block caching or reading the aligned block at
+//    `off`, or -1 if none.
+
+static int io61_find_block(io61_file* f, off_t off) {
+    for (int i = 0; i != io61_file::nblocks; ++i) {
+        io61_block& b = f->blocks[i];
+        if ((b.state == io61_reading || b.state == io61_ready) && b.off == off) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// io61_start_read(f, i, off)
+//    Queues a read of the block at `off` into block `i`.
+
+static void io61_start_read(io61_file* f, int i, off_t off) {
+    io61_block& b = f->blocks[i];
+    b.state = io61_reading;
+    b.off = off;
+    b.len = 0;
+    b.err = 0;
+    b.used = ++f->clock;
+    io61_submit(f, i);
+}
+
+// io61_read_block(f)
+//    Returns the index of a ready block holding `f->pos`. For seekable
+//    files, reading the block also queues read-ahead for the next blocks
+//    in the direction of travel. Returns -1 on error. At end of file,
+//    the returned block ends at or before `f->pos`.
+
+static int io61_read_block(io61_file* f) {
+    if (f->cur >= 0) {
+        io61_block& b = f->blocks[f->cur];
+        if (b.state == io61_ready && b.off <= f->pos
+            && f->pos < b.off + (off_t) b.len) {
+            return f->cur;
+        }
+    }
+
+    int i;
+    if (!f->seekable) {
+        // Streams keep one read in flight, which becomes the next block
+        if (f->cur >= 0 && f->blocks[f->cur].state == io61_ready) {
+            if (f->blocks[f->cur].len == 0) {
+                return f->cur;
+            }
+            f->blocks[f->cur].state = io61_free;
+        }
+        i = -1;
+        for (int j = 0; j != io61_file::nblocks; ++j) {
+            if (f->blocks[j].state == io61_reading
+                || (f->blocks[j].state == io61_ready && j != f->cur)) {
+                i = j;
+            }
+        }
+        if (i < 0) {
+            i = io61_get_block(f, true, -1);
+            io61_start_read(f, i, 0);
+        }
+        while (f->blocks[i].state == io61_reading) {
+            io61_wait(f);
+        }
+        f->cur = i;
+        if (!f->stream_eof) {
+            io61_start_read(f, io61_get_block(f, true, i), 0);
+        }
+    } else {
+        off_t off = f->pos & ~(off_t) (io61_file::bufsize - 1);
+        i = io61_find_block(f, off);
+        if (i < 0) {
+            i = io61_get_block(f, true, -1);
+            io61_start_read(f, i, off);
+        }
+        f->blocks[i].used = ++f->clock;
+
+        // Read ahead when moving block by block
+        off_t step = off - f->last_block;
+        if (f->last_block >= 0 && (step == io61_file::bufsize
+                                   || step == -(off_t) io61_file::bufsize)) {
+            for (int k = 1; k <= io61_file::readahead; ++k) {
+                off_t next = off + k * step;
+                if (next < 0 || (f->size >= 0 && next >= f->size)) {
+                    break;
+                }
+                if (io61_find_block(f, next) < 0) {
+                    int j = io61_get_block(f, false, i);
+                    if (j < 0) {
+                        break;
+                    }
+                    io61_start_read(f, j, next);
+                }
+            }
+        }
+        f->last_block = off;
+
+        while (f->blocks[i].state == io61_reading) {
+            io61_wait(f);
+        }
+        f->cur = i;
+    }
+
+    io61_block& b = f->blocks[i];
+    if (b.err != 0) {
+        errno = b.err;
+        b.state = io61_free;
+        f->cur = -1;
+        return -1;
+    }
+    return i;
+}
+
+// io61_queue_write(f)
+//    Queues the filling block of `f` to be written. Waits first for any
+//    earlier write it overlaps, so later bytes land last; streams wait
+//    for all earlier writes. Submits once enough writes are queued.
+
+static void io61_queue_write(io61_file* f) {
+    int i = f->cur;
+    f->cur = -1;
+    io61_block& b = f->blocks[i];
+    if (b.len == 0) {
+        b.state = io61_free;
+        return;
+    }
+    bool overlap = true;
+    while (overlap) {
+        overlap = false;
+        for (int j = 0; j != io61_file::nblocks; ++j) {
+            io61_block& o = f->blocks[j];
+            if (o.state == io61_writing
+                && (!f->seekable
+                    || (o.off < b.off + (off_t) b.len && b.off < o.off + (off_t) o.len))) {
+                overlap = true;
+            }
+        }
+        if (overlap) {
+            io61_wait(f);
+        }
+    }
+    b.state = io61_writing;
+    b.done = 0;
+    io61_submit(f, i);
+    if (f->ring.fd >= 0 && f->ring.queued >= io61_file::batch) {
+        io61_ring_enter(&f->ring, false);
+    }
+}
+
+
+// io61_direct_start(f)
+//    Decides whether seekable file `f` uses O_DIRECT: it does if `fd` was
+//    opened with O_DIRECT, or if `IO61_DIRECT` is set and `fd` is a
+//    regular file that accepts the flag. Bulk copies then skip the page
+//    cache, which would otherwise fill with data read or written once;
+//    read-ahead and queued writes keep several block requests in flight
+//    in its place. Blocks are `bufsize`-aligned in memory (the buffers
+//    are mapped) and, for reads, in the file, so only write blocks at
+//    unaligned offsets and the file's unaligned tail go through the page
+//    cache. Files with no O_DIRECT support (e.g., on some tmpfs kernels)
+//    are left alone.
+
+static void io61_direct_start(io61_file* f) {
+    int flags = fcntl(f->fd, F_GETFL);
+    struct stat s;
+    if (flags >= 0 && !(flags & O_DIRECT) && getenv("IO61_DIRECT")
+        && fstat(f->fd, &s) == 0 && S_ISREG(s.st_mode)
+        && fcntl(f->fd, F_SETFL, flags | O_DIRECT) == 0) {
+        flags |= O_DIRECT;
+    }
+    f->direct = flags >= 0 && (flags & O_DIRECT);
+}
+
+
+// io61_fdopen(fd, mode)
+//    Returns a new io61_file for file descriptor `fd`. `mode` is either
+//    O_RDONLY for a read-only file or O_WRONLY for a write-only file.
+//    You need not support read/write files.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    io61_file* f = new io61_file;
+    f->fd = fd;
+    f->mode = mode;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0) {
+        f->seekable = true;
+        f->pos = pos;
+    }
+    struct stat s;
+    if ((mode & O_ACCMODE) == O_RDONLY && fstat(fd, &s) == 0
+        && S_ISREG(s.st_mode)) {
+        f->size = s.st_size;
+    }
+    if (f->seekable) {
+        io61_direct_start(f);
+    }
+
+    void* mem = mmap(nullptr, io61_file::nblocks * io61_file::bufsize,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    f->mem = (unsigned char*) mem;
+    if (io61_ring_setup(&f->ring, 2 * io61_file::nblocks) == 0) {
+        struct iovec iov[io61_file::nblocks];
+        for (int i = 0; i != io61_file::nblocks; ++i) {
+            iov[i] = {f->mem + i * io61_file::bufsize, io61_file::bufsize};
+        }
+        // Registration can fail under a small RLIMIT_MEMLOCK; plain
+        // reads and writes still work then
+        f->registered = syscall(__NR_io_uring_register, f->ring.fd,
+                                IORING_REGISTER_BUFFERS, iov,
+                                io61_file::nblocks) == 0;
+    }
+    return f;
+}
+
+
+// io61_close(f)
+//    Closes the io61_file `f` and releases all its resources.
+
+int io61_close(io61_file* f) {
+    io61_flush(f);
+    if (f->ring.fd >= 0) {
+        // Cancel reads in flight (a stream read might never finish), and
+        // wait for every request before the buffers go away
+        for (int i = 0; i != io61_file::nblocks; ++i) {
+            if (f->blocks[i].state == io61_reading) {
+                io_uring_sqe* sqe = io61_ring_sqe(&f->ring);
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = i;
+                sqe->user_data = io61_cancel_tag;
+                io61_ring_push(&f->ring, sqe);
+            }
+        }
+        while (f->inflight > 0) {
+            io61_wait(f);
+        }
+        io61_ring_teardown(&f->ring);
+    }
+    munmap(f->mem, io61_file::nblocks * io61_file::bufsize);
+    int r = close(f->fd);
+    delete f;
+    return r;
+}
+
+
+// io61_readc_slow(f)
+//    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
+//    which equals -1, on end of file or error. This version never opens
+//    the io61_fastbuf windows, so io61_readc calls it for every byte.
+
+int io61_readc_slow(io61_file* f) {
+    if (f->cur >= 0) {
+        io61_block& b = f->blocks[f->cur];
+        if (b.state == io61_ready && b.off <= f->pos
+            && f->pos < b.off + (off_t) b.len) {
+            unsigned char* buf = f->mem + f->cur * io61_file::bufsize;
+            return buf[f->pos++ - b.off];
+        }
+    }
+    unsigned char ch;
+    if (io61_read(f, &ch, 1) != 1) {
+        return -1;
+    }
+    return ch;
+}
+
+
+// io61_read(f, buf, sz)
+//    Reads up to `sz` bytes from `f` into `buf`. Returns the number of
+//    bytes read on success. Returns 0 if end-of-file is encountered before
+//    any bytes are read, and -1 if an error is encountered before any
+//    bytes are read.
+//
+//    Note that the return value might be positive, but less than `sz`,
+//    if end-of-file or error is encountered before all `sz` bytes are read.
+//    This is called a “short read.”
+
+ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t copied = 0;
+    while (copied < sz) {
+        int i = io61_read_block(f);
+        if (i < 0) {
+            return (copied > 0) ? (ssize_t) copied : -1;
+        }
+        io61_block& b = f->blocks[i];
+        off_t end = b.off + (off_t) b.len;
+        if (f->pos >= end) {
+            // End of file
+            errno = 0;
+            break;
+        }
+        size_t avail = (size_t) (end - f->pos);
+        size_t copy = (avail < sz - copied ? avail : sz - copied);
+        memcpy(buf + copied, f->mem + i * io61_file::bufsize + (f->pos - b.off), copy);
+        f->pos += copy;
+        copied += copy;
+    }
+    return (ssize_t) copied;
+}
+
+// io61_read_backward(f, buf, sz)
+//    Reads up to `sz` of the bytes just before `f`'s file position into
+//    `buf` in reverse order and moves the position back past them.
+//    Returns the number of bytes read, 0 at the start of the file, or -1
+//    on error.
+
+ssize_t io61_read_backward(io61_file* f, unsigned char* buf, size_t sz) {
+    off_t size = io61_filesize(f);
+    if (!f->seekable || size < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    // Reading backward block by block reads ahead downward
+    off_t pos = std::min(f->pos, size);
+    size_t n = std::min((size_t) pos, sz);
+    f->pos = pos - n;
+    ssize_t nr = io61_read(f, buf, n);
+    f->pos = pos - n;
+    if (nr != (ssize_t) n) {
+        return -1;
+    }
+    std::reverse(buf, buf + n);
+    return n;
+}
+
+// io61_readline(f, buf, sz)
+//    Reads one line from `f` into `buf`, up to and including its newline,
+//    but at most `sz` bytes. Returns the number of bytes read, 0 at end of
+//    file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t i = 0;
+    while (i != sz) {
+        int ch = io61_readc(f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[i] = ch;
+        ++i;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+// io61_peekline(f, start, len)
+//    Reads one line from `f` without copying it; see io61.cc. This
+//    version has no cache to expose: it returns -1 with
+//    `errno == EOPNOTSUPP`.
+
+ssize_t io61_peekline(io61_file* f, const unsigned char** start, size_t* len) {
+    (void) f, (void) start, (void) len;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+// io61_index_lines(f), io61_seek_line(f, n), io61_readline_backward(f, buf, sz)
+//    Line-indexed access; see io61.cc. This version has no line index:
+//    each returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_index_lines(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+off_t io61_seek_line(io61_file* f, long long n) {
+    (void) f, (void) n;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t io61_readline_backward(io61_file* f, unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// io61_read_window(f, start, len)
+//    Exposes the bytes of `f`'s current block from its position onward
+//    at `*start` without consuming them; see io61.cc. Returns `*len`, 0
+//    at end of file, or -1 on error.
+
+ssize_t io61_read_window(io61_file* f, const unsigned char** start, size_t* len) {
+    int i = io61_read_block(f);
+    if (i < 0) {
+        return -1;
+    }
+    io61_block& b = f->blocks[i];
+    off_t end = b.off + (off_t) b.len;
+    if (f->pos >= end) {
+        return 0;
+    }
+    *start = f->mem + i * io61_file::bufsize + (f->pos - b.off);
+    *len = (size_t) (end - f->pos);
+    return (ssize_t) *len;
+}
+
+// io61_consume(f, n)
+//    Advances past the first `n` bytes of io61_read_window's window.
+
+int io61_consume(io61_file* f, size_t n) {
+    f->pos += n;
+    return 0;
+}
+
+
+// io61_read_batch(f, reqs, n)
+//    Reads each of the `n` requests in `reqs`, setting its `result` and
+//    `err`; see io61.hh. This version seeks to and reads each request in
+//    offset order. Returns 0 if every request succeeded, and otherwise
+//    -1 with `errno` from the first failed request.
+
+int io61_read_batch(io61_file* f, io61_request* reqs, size_t n) {
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i != n; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+        return reqs[a].off < reqs[b].off;
+    });
+    int first_err = 0;
+    for (size_t i : order) {
+        io61_request& r = reqs[i];
+        r.result = -1;
+        if (io61_seek(f, r.off) == 0) {
+            r.result = io61_read(f, r.buf, r.len);
+        }
+        r.err = (r.result < 0 ? errno : 0);
+        if (r.result < 0 && first_err == 0) {
+            first_err = errno;
+        }
+    }
+    if (first_err != 0) {
+        errno = first_err;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_writec_slow(f)
+//    Write a single character `c` to `f` (converted to unsigned char).
+//    Returns 0 on success and -1 on error. Like io61_readc_slow, this
+//    handles every io61_writec call.
+
+int io61_writec_slow(io61_file* f, int c) {
+    unsigned char ch = c;
+    return io61_write(f, &ch, 1) == 1 ? 0 : -1;
+}
+
+
+// io61_fill_block(f)
+//    Returns the index of the block filling at `f->pos` with room for at
+//    least one more byte, queueing the filling block and starting
+//    another if needed.
+
+static int io61_fill_block(io61_file* f) {
+    if (f->cur >= 0) {
+        io61_block& b = f->blocks[f->cur];
+        if (b.off + (off_t) b.len != f->pos || b.len == io61_file::bufsize) {
+            io61_queue_write(f);
+        }
+    }
+    if (f->cur < 0) {
+        f->cur = io61_get_block(f, true, -1);
+        io61_block& b = f->blocks[f->cur];
+        b.state = io61_filling;
+        b.off = f->pos;
+        b.len = 0;
+    }
+    return f->cur;
+}
+
+
+// io61_write(f, buf, sz)
+//    Writes `sz` characters from `buf` to `f`. Returns `sz` on success.
+//    Can write fewer than `sz` characters when there is an error, such as
+//    a drive running out of space. In this case io61_write returns the
+//    number of characters written, or -1 if no characters were written
+//    before the error occurred.
+//
+//    Bytes are written asynchronously, so errors in earlier writes are
+//    reported by later calls and by io61_flush.
+
+ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    size_t total = 0;
+    while (total < sz) {
+        if (f->err != 0) {
+            errno = f->err;
+            return (total > 0) ? (ssize_t) total : -1;
+        }
+        io61_block& b = f->blocks[io61_fill_block(f)];
+        size_t space = io61_file::bufsize - b.len;
+        size_t copy = (space < sz - total ? space : sz - total);
+        memcpy(f->mem + f->cur * io61_file::bufsize + b.len, buf + total, copy);
+        b.len += copy;
+        f->pos += copy;
+        total += copy;
+    }
+    return (ssize_t) total;
+}
+
+
+// io61_write_window(f, start, len)
+//    Exposes the free space of the block filling at `f`'s position; see
+//    io61.cc. Returns `*len`, or -1 if an earlier write failed.
+
+ssize_t io61_write_window(io61_file* f, unsigned char** start, size_t* len) {
+    if (f->err != 0) {
+        errno = f->err;
+        return -1;
+    }
+    int i = io61_fill_block(f);
+    io61_block& b = f->blocks[i];
+    *start = f->mem + i * io61_file::bufsize + b.len;
+    *len = io61_file::bufsize - b.len;
+    return (ssize_t) *len;
+}
+
+// io61_commit(f, n)
+//    Appends the first `n` bytes of io61_write_window's window to `f`.
+
+int io61_commit(io61_file* f, size_t n) {
+    f->blocks[f->cur].len += n;
+    f->pos += n;
+    return 0;
+}
+
+// io61_copy(in, out, n)
+//    Copies up to `n` bytes from `in` to `out`; see io61.cc. This version
+//    copies through a buffer with io61_read and io61_write. Returns the
+//    number of bytes copied, or -1 if an error occurred before any were.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    unsigned char buf[BUFSIZ];
+    size_t done = 0;
+    while (done != n) {
+        ssize_t nr = io61_read(in, buf, std::min(sizeof(buf), n - done));
+        if (nr <= 0) {
+            if (nr < 0 && done == 0) {
+                return -1;
+            }
+            break;
+        }
+        ssize_t nw = io61_write(out, buf, nr);
+        if (nw != nr) {
+            return nw > 0 ? ssize_t(done + nw) : (done != 0 ? ssize_t(done) : -1);
+        }
+        done += nr;
+    }
+    return done;
+}
+
+// io61_readv(f, iov, iovcnt), io61_writev(f, iov, iovcnt)
+//    Read into, or write from, the `iovcnt` buffers of `iov` in order; see
+//    io61.cc. This version calls io61_read or io61_write on each buffer,
+//    stopping at the first short transfer.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t n = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nr = io61_read(f, (unsigned char*) iov[i].iov_base, iov[i].iov_len);
+        if (nr < 0) {
+            return n != 0 ? ssize_t(n) : -1;
+        }
+        n += nr;
+        if (size_t(nr) != iov[i].iov_len) {
+            break;
+        }
+    }
+    return n;
+}
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t n = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t nw = io61_write(f, (const unsigned char*) iov[i].iov_base, iov[i].iov_len);
+        if (nw < 0) {
+            return n != 0 ? ssize_t(n) : -1;
+        }
+        n += nw;
+        if (size_t(nw) != iov[i].iov_len) {
+            break;
+        }
+    }
+    return n;
+}
+
+// io61_flush(f)
+//    If `f` was opened write-only, `io61_flush(f)` forces a write of any
+//    cached data written to `f`. Returns 0 on success; returns -1 if an error
+//    is encountered before all cached data was written.
+//
+//    If `f` was opened read-only, `io61_flush(f)` returns 0. It may also
+//    drop any data cached for reading.
+
+int io61_flush(io61_file* f) {
+    if ((f->mode & O_ACCMODE) == O_RDONLY) {
+        return 0;
+    }
+    if (f->cur >= 0) {
+        io61_queue_write(f);
+    }
+    while (f->inflight > 0) {
+        io61_wait(f);
+    }
+    if (f->err != 0) {
+        errno = f->err;
+        f->err = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_try_read(f, buf, sz), io61_try_write(f, buf, sz), io61_try_flush(f)
+//    Nonblocking transfers; see io61.cc. This version does not support
+//    them: each returns -1 with `errno == EOPNOTSUPP`.
+
+ssize_t io61_try_read(io61_file* f, unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t io61_try_write(io61_file* f, const unsigned char* buf, size_t sz) {
+    (void) f, (void) buf, (void) sz;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_try_flush(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+
+// io61_loop_new(), io61_loop_free(l), io61_loop_add(l, f, events, callback),
+// io61_loop_modify(l, f, events), io61_loop_remove(l, f), io61_loop_run(l),
+// io61_loop_stop(l)
+//    Event loops; see io61.cc. This version does not support them:
+//    io61_loop_new returns nullptr with `errno == EOPNOTSUPP`, so no loop
+//    reaches the others.
+
+io61_loop* io61_loop_new() {
+    errno = EOPNOTSUPP;
+    return nullptr;
+}
+
+void io61_loop_free(io61_loop* l) {
+    (void) l;
+}
+
+int io61_loop_add(io61_loop* l, io61_file* f, int events, io61_callback callback) {
+    (void) l, (void) f, (void) events, (void) callback;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_modify(io61_loop* l, io61_file* f, int events) {
+    (void) l, (void) f, (void) events;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_remove(io61_loop* l, io61_file* f) {
+    (void) l, (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int io61_loop_run(io61_loop* l) {
+    (void) l;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+void io61_loop_stop(io61_loop* l) {
+    (void) l;
+}
+
+
+// io61_seek(f, off)
+//    Changes the file pointer for file `f` to `off` bytes into the file.
+//    Returns 0 on success and -1 on failure.
+
+int io61_seek(io61_file* f, off_t off) {
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
+    } else if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Blocks are found or started by the next read or write
+    f->pos = off;
+    return 0;
+}
+
+
+// io61_hint(f, off, len, pattern)
+//    Tells the library how `f` will be read; see io61.hh. This version
+//    starts reads of up to `readahead` uncached blocks of a
+//    `io61_hint_willneed` range, and ignores other hints.
+//    Returns 0 on success and -1 on error.
+
+int io61_hint(io61_file* f, off_t off, off_t len, int pattern) {
+    if (!f->seekable) {
+        errno = ESPIPE;
+        return -1;
+    } else if (off < 0 || len < 0) {
+        errno = EINVAL;
+        return -1;
+    } else if (pattern != io61_hint_willneed || f->mode != O_RDONLY) {
+        return 0;
+    }
+    off_t end = off + len;
+    if (f->size >= 0 && end > f->size) {
+        end = f->size;
+    }
+    int started = 0;
+    for (off_t b = off & ~(off_t) (io61_file::bufsize - 1);
+         b < end && started != io61_file::readahead;
+         b += io61_file::bufsize) {
+        if (io61_find_block(f, b) < 0) {
+            int j = io61_get_block(f, false, f->cur);
+            if (j < 0) {
+                break;
+            }
+            io61_start_read(f, j, b);
+            ++started;
+        }
+    }
+    if (started != 0 && f->ring.fd >= 0) {
+        io61_ring_enter(&f->ring, false);
+    }
+    return 0;
+}
+
+// io61_expect_size(f, size)
+//    Tells the library how long write-only file `f` will be; see io61.cc.
+//    This version ignores the hint and returns 0.
+
+int io61_expect_size(io61_file* f, off_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+// io61_set_memory_limit(limit)
+//    Caps io61's cache memory across all files; see io61.cc. This
+//    version has no shared cache pool and ignores the limit.
+
+void io61_set_memory_limit(size_t limit) {
+    (void) limit;
+}
+
+// io61_checksum_start(f), io61_checksum(f)
+//    Checksum the bytes moved through `f`; see io61.cc. This version
+//    keeps no checksum: io61_checksum_start does nothing, and
+//    io61_checksum returns 0 with `errno == EOPNOTSUPP`.
+
+void io61_checksum_start(io61_file* f) {
+    (void) f;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return 0;
+}
+
+// io61_push_filter(f, filter)
+//    Makes `f` a compressed stream; see io61.cc. This version does not
+//    support filters: it returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_push_filter(io61_file* f, int filter) {
+    (void) f, (void) filter;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// io61_share(f)
+//    Lets several threads write to `f`; see io61.cc. This version does
+//    not support sharing: it returns -1 with `errno == EOPNOTSUPP`.
+
+int io61_share(io61_file* f) {
+    (void) f;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// io61_tee(outs, n)
+//    Returns a file that writes to each file in `outs`; see io61.cc. This
+//    version does not support tee files: it returns nullptr with
+//    `errno == EOPNOTSUPP`.
+
+io61_file* io61_tee(io61_file* const* outs, size_t n) {
+    (void) outs, (void) n;
+    errno = EOPNOTSUPP;
+    return nullptr;
+}
+
+
+
+// You shouldn't need to change these functions.
+
+// io61_open_check(filename, mode)
+//    Opens the file corresponding to `filename` and returns its io61_file.
+//    If `!filename`, returns either the standard input or the
+//    standard output, depending on `mode`. Exits with an error message if
+//    `filename != nullptr` and the named file cannot be opened, or if
+//    `mode` asks for a read/write file, which this version does not
+//    support.
+
+io61_file* io61_open_check(const char* filename, int mode) {
+    if ((mode & O_ACCMODE) == O_RDWR) {
+        fprintf(stderr, "%s: %s\n", filename ? filename : "-", strerror(EOPNOTSUPP));
+        exit(1);
+    }
+    int fd;
+    if (filename) {
+        fd = open(filename, mode, 0666);
+    } else if ((mode & O_ACCMODE) == O_RDONLY) {
+        fd = STDIN_FILENO;
+    } else {
+        fd = STDOUT_FILENO;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return io61_fdopen(fd, mode & O_ACCMODE);
+}
+
+
+// io61_fileno(f)
+//    Returns the file descriptor associated with `f`.
+
+int io61_fileno(io61_file* f) {
+    return f->fd;
+}
+
+
+// io61_filesize(f)
+//    Returns the size of `f` in bytes. Returns -1 if `f` does not have a
+//    well-defined size (for instance, if it is a pipe).
+
+off_t io61_filesize(io61_file* f) {
+    struct stat s;
+    int r = fstat(f->fd, &s);
+    if (r < 0 || !S_ISREG(s.st_mode)) {
+        return -1;
+    }
+    return s.st_size;
+}
@@ -28,6 +28,7 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "wstridecat61: need `-s SIZE` argument\n");
         exit(1);
     }
+    io61_expect_size(outf, args.file_size);
 
     // Copy file data
     size_t pos = args.initial_offset;
@@ -39,8 +40,8 @@ int main(int argc, char* argv[]) {
 
         // Determine block size
         size_t block_size = args.block_size;
-        if (pos + block_size > args.stride) {
-            block_size = args.stride - pos;
+        if (pos % args.stride + block_size > args.stride) {
+            block_size = args.stride - pos % args.stride;
         }
 
         // Copy a block